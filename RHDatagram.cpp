@@ -5,11 +5,15 @@
 
 #include <RHDatagram.h>
 
-RHDatagram::RHDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHDatagram::RHDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     :
     _driver(driver),
     _thisAddress(thisAddress)
 {
+#ifdef RH_EXTENDED_ADDRESSING
+    memset(_txAddressHigh, 0, sizeof(_txAddressHigh));
+    memset(_rxAddressHigh, 0, sizeof(_rxAddressHigh));
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -22,7 +26,7 @@ bool RHDatagram::init()
     return ret;
 }
 
-void RHDatagram::setThisAddress(uint8_t thisAddress)
+void RHDatagram::setThisAddress(RHAddress thisAddress)
 {
     _driver.setThisAddress(thisAddress);
     // Use this address in the transmitted FROM header
@@ -30,23 +34,92 @@ void RHDatagram::setThisAddress(uint8_t thisAddress)
     _thisAddress = thisAddress;
 }
 
-bool RHDatagram::sendto(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHDatagram::sendto(uint8_t* buf, uint8_t len, RHAddress address)
 {
     setHeaderTo(address);
+#ifdef RH_EXTENDED_ADDRESSING
+    RHGenericDriver::Segment segments[2] = { { _txAddressHigh, sizeof(_txAddressHigh) }, { buf, len } };
+    return _driver.sendv(segments, 2);
+#else
     return _driver.send(buf, len);
+#endif
 }
 
-bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHDatagram::sendAck(const uint8_t* data, uint8_t len)
 {
-    if (_driver.recv(buf, len))
+#ifdef RH_EXTENDED_ADDRESSING
+    uint8_t ack[RH_MAX_MESSAGE_LEN];
+    if (len > sizeof(ack) - sizeof(_txAddressHigh))
+	return false;
+    memcpy(ack, _txAddressHigh, sizeof(_txAddressHigh));
+    memcpy(ack + sizeof(_txAddressHigh), data, len);
+    return _driver.sendAck(ack, len + sizeof(_txAddressHigh));
+#else
+    return _driver.sendAck(data, len);
+#endif
+}
+
+#ifdef RH_EXTENDED_ADDRESSING
+bool RHDatagram::acceptExtended(const uint8_t* buf, uint8_t len)
+{
+    if (len < sizeof(_rxAddressHigh))
+	return false; // Not from an extended addressing node
+    memcpy(_rxAddressHigh, buf, sizeof(_rxAddressHigh));
+    // The driver only checked the low 8 bits of the TO address
+    RHAddress to = headerTo();
+    return _driver.promiscuous() || to == _thisAddress || to == RH_BROADCAST_ADDRESS;
+}
+#endif
+
+bool RHDatagram::recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
+{
+#ifdef RH_EXTENDED_ADDRESSING
+    // Receive into our own buffer, so the extension octets do not take space from the caller's
+    uint8_t rxBuf[RH_MAX_MESSAGE_LEN];
+    uint8_t rxLen = sizeof(rxBuf);
+    if (!_driver.recv(rxBuf, &rxLen) || !acceptExtended(rxBuf, rxLen))
+	return false;
+    rxLen -= sizeof(_rxAddressHigh);
+    if (buf && len)
+    {
+	if (*len > rxLen)
+	    *len = rxLen;
+	memcpy(buf, rxBuf + sizeof(_rxAddressHigh), *len);
+    }
+#else
+    if (!_driver.recv(buf, len))
+	return false;
+#endif
+    if (from)  *from =  headerFrom();
+    if (to)    *to =    headerTo();
+    if (id)    *id =    headerId();
+    if (flags) *flags = headerFlags();
+    return true;
+}
+
+bool RHDatagram::recvfromLease(RHGenericDriver::RxLease* lease)
+{
+#ifdef RH_EXTENDED_ADDRESSING
+    if (!_driver.recvLease(lease))
+	return false;
+    if (!acceptExtended(lease->data, lease->len))
     {
-	if (from)  *from =  headerFrom();
-	if (to)    *to =    headerTo();
-	if (id)    *id =    headerId();
-	if (flags) *flags = headerFlags();
-	return true;
+	_driver.releaseLease();
+	return false;
     }
-    return false;
+    lease->headerTo = headerTo();
+    lease->headerFrom = headerFrom();
+    lease->data += sizeof(_rxAddressHigh);
+    lease->len -= sizeof(_rxAddressHigh);
+    return true;
+#else
+    return _driver.recvLease(lease);
+#endif
+}
+
+void RHDatagram::releaseLease()
+{
+    _driver.releaseLease();
 }
 
 bool RHDatagram::available()
@@ -74,19 +147,30 @@ bool RHDatagram::waitAvailableTimeout(uint16_t timeout)
     return _driver.waitAvailableTimeout(timeout);
 }
 
-uint8_t RHDatagram::thisAddress()
+RHAddress RHDatagram::thisAddress()
 {
     return _thisAddress;
 }
 
-void RHDatagram::setHeaderTo(uint8_t to)
+uint8_t RHDatagram::maxMessageLength()
+{
+    return _driver.maxMessageLength() - RH_DATAGRAM_HEADER_LEN;
+}
+
+void RHDatagram::setHeaderTo(RHAddress to)
 {
     _driver.setHeaderTo(to);
+#ifdef RH_EXTENDED_ADDRESSING
+    _txAddressHigh[0] = to >> 8;
+#endif
 }
 
-void RHDatagram::setHeaderFrom(uint8_t from)
+void RHDatagram::setHeaderFrom(RHAddress from)
 {
     _driver.setHeaderFrom(from);
+#ifdef RH_EXTENDED_ADDRESSING
+    _txAddressHigh[1] = from >> 8;
+#endif
 }
 
 void RHDatagram::setHeaderId(uint8_t id)
@@ -99,14 +183,22 @@ void RHDatagram::setHeaderFlags(uint8_t set, uint8_t clear)
     _driver.setHeaderFlags(set, clear);
 }
 
-uint8_t RHDatagram::headerTo()
+RHAddress RHDatagram::headerTo()
 {
+#ifdef RH_EXTENDED_ADDRESSING
+    return _driver.headerTo() | ((RHAddress)_rxAddressHigh[0] << 8);
+#else
     return _driver.headerTo();
+#endif
 }
 
-uint8_t RHDatagram::headerFrom()
+RHAddress RHDatagram::headerFrom()
 {
+#ifdef RH_EXTENDED_ADDRESSING
+    return _driver.headerFrom() | ((RHAddress)_rxAddressHigh[1] << 8);
+#else
     return _driver.headerFrom();
+#endif
 }
 
 uint8_t RHDatagram::headerId()
@@ -12,6 +12,14 @@
 // Not all radios support this length, and many are much smaller
 #define RH_MAX_MESSAGE_LEN 255
 
+// The number of octets RHDatagram adds to the start of every message: the high 8 bits of the TO and FROM
+// addresses with RH_EXTENDED_ADDRESSING, otherwise none
+#ifdef RH_EXTENDED_ADDRESSING
+#define RH_DATAGRAM_HEADER_LEN 2
+#else
+#define RH_DATAGRAM_HEADER_LEN 0
+#endif
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHDatagram RHDatagram.h <RHDatagram.h>
 /// \brief Manager class for addressed, unreliable messages
@@ -42,13 +50,22 @@
 /// \b FLAGS A bitmask of flags. The most significant 4 bits are reserved for use by RadioHead. The least
 /// significant 4 bits are reserved for applications.<br>
 ///
+/// \par Extended Addressing
+///
+/// With RH_EXTENDED_ADDRESSING defined (see RadioHead.h), addresses are 16 bit RHAddress values. The 
+/// TO and FROM headers carry the low 8 bits, and every message starts with 2 more octets: the high 8 
+/// bits of TO, then the high 8 bits of FROM. RHDatagram adds and removes them, so they are not 
+/// visible to the application, but they reduce the maximum message length by 2. 
+/// RHDatagram drops messages whose full TO address is neither this node nor RH_BROADCAST_ADDRESS 
+/// (0x00ff), unless the driver is promiscuous. All nodes in a network must use the same addressing mode.
+///
 class RHDatagram
 {
 public:
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialise this instance and the 
     /// driver connected to it.
@@ -59,7 +76,7 @@ public:
     /// In a conventional multinode system, all nodes will have a unique address 
     /// (which you could store in EEPROM).
     /// \param[in] thisAddress The address of this node
-    void setThisAddress(uint8_t thisAddress);
+    void setThisAddress(RHAddress thisAddress);
 
     /// Sends a message to the node(s) with the given address
     /// RH_BROADCAST_ADDRESS is a valid address which will cause the message
@@ -68,7 +85,7 @@ public:
     /// \param[in] len Number of octets to send (> 0)
     /// \param[in] address The address to send the message to.
     /// \return true if the message not too loing fot eh driver, and the message was transmitted.
-    bool sendto(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendto(uint8_t* buf, uint8_t len, RHAddress address);
 
     /// Turns the receiver on if it not already on.
     /// If there is a valid message available for this node, copy it to buf and return true
@@ -79,13 +96,22 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the FROM address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the TO address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the FROM address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the TO address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfrom(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfrom(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Like recvfrom(), but if the driver supports it, lends the message where it lies in the driver 
+    /// instead of copying it. See RHGenericDriver::recvLease(). 
+    /// \param[out] lease Set to describe the lent message and its headers
+    /// \return true if a message was lent. Call releaseLease() when finished with it
+    bool recvfromLease(RHGenericDriver::RxLease* lease);
+
+    /// Ends the loan of a message by recvfromLease()
+    void releaseLease();
 
     /// Tests whether a new message is available
     /// from the Driver.
@@ -116,11 +142,11 @@ public:
 
     /// Sets the TO header to be sent in all subsequent messages
     /// \param[in] to The new TO header value
-    void           setHeaderTo(uint8_t to);
+    void           setHeaderTo(RHAddress to);
 
     /// Sets the FROM header to be sent in all subsequent messages
     /// \param[in] from The new FROM header value
-    void           setHeaderFrom(uint8_t from);
+    void           setHeaderFrom(RHAddress from);
 
     /// Sets the ID header to be sent in all subsequent messages
     /// \param[in] id The new ID header value
@@ -133,11 +159,11 @@ public:
 
     /// Returns the TO header of the last received message
     /// \return The TO header of the most recently received message.
-    uint8_t        headerTo();
+    RHAddress      headerTo();
 
     /// Returns the FROM header of the last received message
     /// \return The FROM header of the most recently received message.
-    uint8_t        headerFrom();
+    RHAddress      headerFrom();
 
     /// Returns the ID header of the last received message
     /// \return The ID header of the most recently received message.
@@ -149,14 +175,41 @@ public:
 
     /// Returns the address of this node.
     /// \return The address of this node
-    uint8_t         thisAddress();
+    RHAddress       thisAddress();
+
+    /// Returns the maximum message length that can be sent with sendto(). This is the driver's 
+    /// maxMessageLength(), less RH_DATAGRAM_HEADER_LEN
+    /// \return The maximum message length in octets
+    uint8_t         maxMessageLength();
 
 protected:
+    /// Sends an acknowledgement through the driver's sendAck(), with the TO and FROM headers 
+    /// previously set, as used by RHReliableDatagram and RHFragmentedDatagram
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message was transmitted
+    bool            sendAck(const uint8_t* data, uint8_t len);
+
     /// The Driver we are to use
     RHGenericDriver&        _driver;
 
     /// The address of this node
-    uint8_t         _thisAddress;
+    RHAddress       _thisAddress;
+
+#ifdef RH_EXTENDED_ADDRESSING
+    /// Tells whether a received message is addressed to this node, and records the high 8 bits of its 
+    /// TO and FROM addresses from the first 2 octets of the message
+    /// \param[in] buf The received message, including the 2 octets
+    /// \param[in] len Length of the received message
+    /// \return true if the message should be passed to the caller
+    bool            acceptExtended(const uint8_t* buf, uint8_t len);
+
+    /// The high 8 bits of the TO and FROM addresses to send
+    uint8_t         _txAddressHigh[RH_DATAGRAM_HEADER_LEN];
+
+    /// The high 8 bits of the TO and FROM addresses of the last received message
+    uint8_t         _rxAddressHigh[RH_DATAGRAM_HEADER_LEN];
+#endif
 };
 
 #endif
@@ -0,0 +1,452 @@
+// RHFragmentedDatagram.cpp
+//
+// Fragmentation and reassembly of large messages over RHReliableDatagram
+//
+// Copyright (C) 2026 Pi-Gate (contact@pi-gate.net)
+// $Id: RHFragmentedDatagram.cpp,v 1.0 2026/10/19 $
+
+#include <RHFragmentedDatagram.h>
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHFragmentedDatagram::RHFragmentedDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
+    : RHReliableDatagram(driver, thisAddress)
+{
+    _lastFragmentedId = 0;
+    _reassemblyTimeout = RH_FRAGMENT_REASSEMBLY_TIMEOUT;
+    uint8_t i;
+    for (i = 0; i < RH_FRAGMENT_REASSEMBLY_SLOTS; i++)
+	_slots[i].state = Free;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+void RHFragmentedDatagram::setReassemblyTimeout(uint16_t timeout)
+{
+    _reassemblyTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::sendtoWaitFragmented(const uint8_t* buf, uint16_t len, RHAddress address)
+{
+    if (len > RH_FRAGMENT_MAX_MESSAGE_LEN || !beginFragmented(address, len))
+	return false; // Too long to be reassembled
+    // Its all here already, so send it all in one burst, straight from buf
+    _txWritten = len;
+    _txFirst = _txCount;
+    bool ret = sendBurst(buf, 0, _txCount);
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_FRAGMENT);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::beginFragmented(RHAddress address, uint16_t len)
+{
+    uint8_t maxLen = maxMessageLength();
+    if (maxLen <= sizeof(FragmentHeader))
+	return false;
+    uint8_t size = maxLen - sizeof(FragmentHeader);
+    uint16_t count = (len + size - 1) / size;
+    if (count == 0)
+	count = 1; // 0 length messages are sent as one empty fragment
+    if (count > RH_FRAGMENT_MAX_FRAGMENTS)
+	return false;
+
+    _txAddress = address;
+    _txLen = len;
+    _txWritten = 0;
+    _txId = ++_lastFragmentedId;
+    _txCount = count;
+    _txSize = size;
+    _txFirst = 0;
+    _txFailed = false;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::writeFragmented(const uint8_t* data, uint16_t len)
+{
+    if (_txFailed || len > _txLen - _txWritten)
+	return false;
+    while (len)
+    {
+	// Fill the window, and send it when it is full
+	uint16_t windowOffset = _txWritten - _txFirst * _txSize;
+	uint16_t room = RH_FRAGMENT_SEND_WINDOW * _txSize - windowOffset;
+	uint16_t n = len < room ? len : room;
+	memcpy(_txWindow + windowOffset, data, n);
+	data += n;
+	len -= n;
+	_txWritten += n;
+	if (n == room)
+	{
+	    uint8_t end = _txFirst + RH_FRAGMENT_SEND_WINDOW;
+	    if (!sendBurst(_txWindow, _txFirst, end))
+		_txFailed = true;
+	    _txFirst = end;
+	    if (_txFailed)
+		break;
+	}
+    }
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_FRAGMENT);
+    return !_txFailed;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::finishFragmented()
+{
+    if (_txFailed || _txWritten != _txLen)
+	return false;
+    if (_txFirst < _txCount && !sendBurst(_txWindow, _txFirst, _txCount))
+	_txFailed = true;
+    _txFirst = _txCount;
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_FRAGMENT);
+    return !_txFailed;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::sendBurst(const uint8_t* data, uint8_t first, uint8_t end)
+{
+    // Initially every fragment is missing
+    uint8_t missing[RH_FRAGMENT_BITMAP_LEN];
+    uint8_t numMissing = end - first;
+    uint8_t i;
+    memset(missing, 0, sizeof(missing));
+    for (i = first; i < end; i++)
+	missing[i / 8] |= (1 << (i % 8));
+
+    uint8_t retries = 0;
+    while (retries++ <= _retries)
+    {
+	// Send all the missing fragments back-to-back. The last one asks for a bitmap ACK
+	uint8_t last = first;
+	for (i = first; i < end; i++)
+	    if (missing[i / 8] & (1 << (i % 8)))
+		last = i;
+	waitSendInterval();
+	uint16_t cadBusy = _driver.cadBusy();
+	for (i = first; i < end; i++)
+	    if (missing[i / 8] & (1 << (i % 8)))
+		sendFragment(data + (i - first) * _txSize, i, i == last);
+	_lastSendTime = millis();
+	if (_driver.cadBusy() != cadBusy)
+	    congestionDetected(); // Had to back off for a busy channel
+
+	// Never wait for ACKS to broadcasts:
+	if (_txAddress == RH_BROADCAST_ADDRESS)
+	    return true;
+
+	if (retries > 1)
+	    _retransmissions++;
+	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
+
+	// Compute a new timeout, random between _timeout and _timeout plus the backoff window
+	uint16_t timeout = retransmitTimeout();
+	int32_t timeLeft;
+	bool gotAck = false;
+	while (!gotAck && (timeLeft = timeout - (millis() - thisSendTime)) > 0)
+	{
+	    if (waitAvailableTimeout(timeLeft))
+	    {
+		uint8_t ack[1 + RH_FRAGMENT_BITMAP_LEN];
+		uint8_t ackLen = sizeof(ack);
+		RHAddress from, to;
+		uint8_t rxId, flags;
+		if (   recvfrom(ack, &ackLen, &from, &to, &rxId, &flags)
+		    && from == _txAddress
+		    && to == _thisAddress
+		    && (flags & RH_FLAGS_ACK)
+		    && (flags & RH_FLAGS_FRAGMENT)
+		    && rxId == _txId
+		    && ackLen >= 1
+		    && ack[0] == _txCount)
+		{
+		    // Its the bitmap ACK we are waiting for. Only the listed fragments of this burst are
+		    // still missing: the later ones have not been sent yet
+		    uint8_t stillMissing = 0;
+		    uint8_t bitmap[RH_FRAGMENT_BITMAP_LEN];
+		    memset(bitmap, 0, sizeof(bitmap));
+		    memcpy(bitmap, ack + 1, ackLen - 1);
+		    memset(missing, 0, sizeof(missing));
+		    for (i = first; i < end; i++)
+			if (bitmap[i / 8] & (1 << (i % 8)))
+			{
+			    missing[i / 8] |= (1 << (i % 8));
+			    stillMissing++;
+			}
+		    if (stillMissing < numMissing)
+			retries = 0; // Progress, so this round does not count as a retry
+		    numMissing = stillMissing;
+		    gotAck = true;
+		    congestionRelieved();
+		}
+		// Else discard it
+	    }
+	    YIELD;
+	}
+	if (gotAck && numMissing == 0)
+	    return true;
+	if (!gotAck)
+	    congestionDetected();
+	// Timeout exhausted or some fragments missing, maybe retry
+	YIELD;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::recvfromAckFragmented(uint8_t* buf, uint16_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
+{
+    RHAddress _from;
+    RHAddress _to;
+    uint8_t _id;
+    uint8_t _flags;
+    uint8_t frame[RH_MAX_MESSAGE_LEN];
+    uint8_t frameLen = sizeof(frame);
+    ReassemblySlot* slot;
+
+    uint8_t received = receiveFrame(frame, &frameLen, &_from, &_to, &_id, &_flags, true, &slot);
+    if (received == Message)
+    {
+	if (*len > frameLen)
+	    *len = frameLen;
+	memcpy(buf, frame, *len);
+    }
+    else if (received == NewFragment && isComplete(slot))
+    {
+	if (*len > slot->len)
+	    *len = slot->len;
+	memcpy(buf, slot->data, *len);
+	slot->state = Delivered;
+    }
+    else
+	return false;
+    if (from)  *from =  _from;
+    if (to)    *to =    _to;
+    if (id)    *id =    _id;
+    if (flags) *flags = _flags & ~RH_FLAGS_FRAGMENT;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::recvfromAckFragmentedTimeout(uint8_t* buf, uint16_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
+{
+    unsigned long starttime = millis();
+    int32_t timeLeft;
+    while ((timeLeft = timeout - (millis() - starttime)) > 0)
+    {
+	if (waitAvailableTimeout(timeLeft))
+	{
+	    if (recvfromAckFragmented(buf, len, from, to, id, flags))
+		return true;
+	}
+	YIELD;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::recvfromAckFragment(uint8_t* buf, uint8_t* len, uint16_t* offset, bool* complete, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
+{
+    RHAddress _from;
+    RHAddress _to;
+    uint8_t _id;
+    uint8_t _flags;
+    uint8_t frame[RH_MAX_MESSAGE_LEN];
+    uint8_t frameLen = sizeof(frame);
+    ReassemblySlot* slot;
+    const uint8_t* data = frame;
+
+    uint8_t received = receiveFrame(frame, &frameLen, &_from, &_to, &_id, &_flags, false, &slot);
+    if (received == Message)
+    {
+	*offset = 0;
+	*complete = true;
+    }
+    else if (received == NewFragment)
+    {
+	FragmentHeader* h = (FragmentHeader*)frame;
+	data = frame + sizeof(FragmentHeader);
+	frameLen -= sizeof(FragmentHeader);
+	*offset = (uint16_t)(h->index & ~RH_FRAGMENT_POLL) * h->size;
+	*complete = isComplete(slot);
+	if (*complete)
+	    slot->state = Delivered;
+    }
+    else
+	return false;
+    if (*len > frameLen)
+	*len = frameLen;
+    memcpy(buf, data, *len);
+    if (from)  *from =  _from;
+    if (to)    *to =    _to;
+    if (id)    *id =    _id;
+    if (flags) *flags = _flags & ~RH_FLAGS_FRAGMENT;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHFragmentedDatagram::receiveFrame(uint8_t* frame, uint8_t* frameLen, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags,
+					   bool reassemble, ReassemblySlot** slot)
+{
+    expireSlots();
+    checkAckAggregation();
+    if (!(available() && recvfrom(frame, frameLen, from, to, id, flags)))
+	return Nothing;
+
+    // Never ACK an ACK
+    if (*flags & RH_FLAGS_ACK)
+	return Nothing;
+
+    if (!(*flags & RH_FLAGS_FRAGMENT))
+    {
+	// An ordinary message, handled as by RHReliableDatagram::recvfromAck()
+	if (*to != RH_BROADCAST_ADDRESS)
+	{
+	    if (_ackAggregationWindow && (*flags & RH_FLAGS_AGGREGATE))
+		acknowledgeAggregated(*id, *from);
+	    else
+		acknowledge(*id, *from);
+	}
+	if (isDuplicate(*from, *id))
+	    return Nothing; // Seen it before: just re-ack it
+	setSeenId(*from, *id);
+	return Message;
+    }
+
+    if (*frameLen < sizeof(FragmentHeader))
+	return Nothing;
+    FragmentHeader* h = (FragmentHeader*)frame;
+    uint8_t index = h->index & ~RH_FRAGMENT_POLL;
+    uint8_t dataLen = *frameLen - sizeof(FragmentHeader);
+    if (   h->count == 0 
+	|| h->count > RH_FRAGMENT_MAX_FRAGMENTS
+	|| index >= h->count
+	|| (index < h->count - 1 && dataLen != h->size)
+	|| dataLen > h->size
+	|| (reassemble && (uint32_t)index * h->size + dataLen > RH_FRAGMENT_MAX_MESSAGE_LEN))
+	return Nothing; // Bogus or too big for us
+
+    *slot = getSlot(*from, *id, h->count, h->size);
+    uint8_t received = Nothing;
+    // A delivered slot keeps the time of its last fragment, so that it is freed by expireSlots()
+    // even if the sender keeps polling it, or reuses the same ID after it wraps
+    if ((*slot)->state == Receiving)
+	(*slot)->lastRx = millis();
+    if ((*slot)->state == Receiving && !((*slot)->received[index / 8] & (1 << (index % 8))))
+    {
+	if (reassemble)
+	    memcpy((*slot)->data + index * h->size, frame + sizeof(FragmentHeader), dataLen);
+	(*slot)->received[index / 8] |= (1 << (index % 8));
+	if (index == h->count - 1)
+	    (*slot)->len = index * h->size + dataLen;
+	received = NewFragment;
+    }
+
+    // Answer a poll with the list of fragments we still need
+    if ((h->index & RH_FRAGMENT_POLL) && *to != RH_BROADCAST_ADDRESS)
+	acknowledgeFragments(*slot);
+    return received;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::isComplete(ReassemblySlot* slot)
+{
+    uint8_t i;
+    for (i = 0; i < slot->count; i++)
+	if (!(slot->received[i / 8] & (1 << (i % 8))))
+	    return false;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHFragmentedDatagram::sendFragment(const uint8_t* data, uint8_t index, bool poll)
+{
+    uint8_t frame[RH_MAX_MESSAGE_LEN];
+    FragmentHeader* h = (FragmentHeader*)frame;
+    uint8_t dataLen = index == _txCount - 1 ? _txLen - index * _txSize : _txSize;
+
+    h->index = index | (poll ? RH_FRAGMENT_POLL : 0);
+    h->count = _txCount;
+    h->size = _txSize;
+    memcpy(frame + sizeof(FragmentHeader), data, dataLen);
+
+    setHeaderId(_txId);
+    setHeaderFlags(RH_FLAGS_FRAGMENT, RH_FLAGS_ACK | RH_FLAGS_AGGREGATE);
+    bool ret = sendto(frame, sizeof(FragmentHeader) + dataLen, _txAddress);
+    waitPacketSent();
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragmentedDatagram::acknowledgeFragments(ReassemblySlot* slot)
+{
+    uint8_t ack[1 + RH_FRAGMENT_BITMAP_LEN];
+    uint8_t bitmapLen = (slot->count + 7) / 8;
+    uint8_t i;
+
+    ack[0] = slot->count;
+    memset(ack + 1, 0, bitmapLen);
+    if (slot->state == Receiving)
+    {
+	for (i = 0; i < slot->count; i++)
+	    if (!(slot->received[i / 8] & (1 << (i % 8))))
+		ack[1 + i / 8] |= (1 << (i % 8));
+    }
+    setHeaderId(slot->id);
+    setHeaderFlags(RH_FLAGS_ACK | RH_FLAGS_FRAGMENT, RH_FLAGS_AGGREGATE);
+    setHeaderTo(slot->from);
+    sendAck(ack, 1 + bitmapLen);
+    waitPacketSent();
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_FRAGMENT);
+}
+
+////////////////////////////////////////////////////////////////////
+RHFragmentedDatagram::ReassemblySlot* RHFragmentedDatagram::getSlot(RHAddress from, uint8_t id, uint8_t count, uint8_t size)
+{
+    uint8_t i;
+    ReassemblySlot* slot = NULL;
+    unsigned long now = millis();
+
+    // First look for the message we are already reassembling
+    for (i = 0; i < RH_FRAGMENT_REASSEMBLY_SLOTS; i++)
+	if (   _slots[i].state != Free
+	    && _slots[i].from == from
+	    && _slots[i].id == id
+	    && _slots[i].count == count
+	    && _slots[i].size == size)
+	    return &_slots[i];
+
+    // Prefer a free slot, then a delivered one, then the oldest partial message
+    for (i = 0; i < RH_FRAGMENT_REASSEMBLY_SLOTS; i++)
+    {
+	if (_slots[i].state == Free)
+	{
+	    slot = &_slots[i];
+	    break;
+	}
+	if (   !slot
+	    || (_slots[i].state == Delivered && slot->state != Delivered)
+	    || (_slots[i].state == slot->state && now - _slots[i].lastRx > now - slot->lastRx))
+	    slot = &_slots[i];
+    }
+
+    slot->state = Receiving;
+    slot->from = from;
+    slot->id = id;
+    slot->count = count;
+    slot->size = size;
+    slot->len = 0;
+    memset(slot->received, 0, sizeof(slot->received));
+    return slot;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHFragmentedDatagram::expireSlots()
+{
+    uint8_t i;
+    unsigned long now = millis();
+    for (i = 0; i < RH_FRAGMENT_REASSEMBLY_SLOTS; i++)
+	if (_slots[i].state != Free && now - _slots[i].lastRx > _reassemblyTimeout)
+	    _slots[i].state = Free;
+}
@@ -0,0 +1,298 @@
+// RHFragmentedDatagram.h
+//
+// Copyright (C) 2026 Pi-Gate (contact@pi-gate.net)
+// $Id: RHFragmentedDatagram.h,v 1.0 2026/10/19 $
+
+#ifndef RHFragmentedDatagram_h
+#define RHFragmentedDatagram_h
+
+#include <RHReliableDatagram.h>
+
+// The fragment bit in the FLAGS
+// Set in every fragment and in the bitmap acknowledgements of fragmented messages
+#define RH_FLAGS_FRAGMENT 0x40
+
+// Set in the index of the last fragment of a burst, to ask the receiver for a bitmap ACK
+#define RH_FRAGMENT_POLL 0x80
+
+// The maximum number of fragments in a message. The index is 7 bits
+#define RH_FRAGMENT_MAX_FRAGMENTS 128
+
+// Number of octets in a bitmap of fragments
+#define RH_FRAGMENT_BITMAP_LEN (RH_FRAGMENT_MAX_FRAGMENTS / 8)
+
+// This is the maximum size of a reassembled message.
+// On Linux and compatible systems it defaults to 4096, otherwise to 512 so that small targets
+// do not run out of SRAM. Can be pre-defined to another size prior to including this header.
+// Messages received a fragment at a time with recvfromAckFragment() are not limited by it
+#ifndef RH_FRAGMENT_MAX_MESSAGE_LEN
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_FRAGMENT_MAX_MESSAGE_LEN 4096
+#else
+#define RH_FRAGMENT_MAX_MESSAGE_LEN 512
+#endif
+#endif
+
+// The number of messages that can be reassembled at the same time.
+// Defaults to 2 on Linux and compatible systems, otherwise 1.
+// Can be pre-defined to another number prior to including this header
+#ifndef RH_FRAGMENT_REASSEMBLY_SLOTS
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_FRAGMENT_REASSEMBLY_SLOTS 2
+#else
+#define RH_FRAGMENT_REASSEMBLY_SLOTS 1
+#endif
+#endif
+
+// The number of fragments beginFragmented() and writeFragmented() buffer before sending them
+// as a burst and waiting for the bitmap ACK. Each one costs RH_MAX_MESSAGE_LEN octets of SRAM.
+// Defaults to 8 on Linux and compatible systems, otherwise 2.
+// Can be pre-defined to another number (at least 1) prior to including this header
+#ifndef RH_FRAGMENT_SEND_WINDOW
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_FRAGMENT_SEND_WINDOW 8
+#else
+#define RH_FRAGMENT_SEND_WINDOW 2
+#endif
+#endif
+
+// The default time in milliseconds a partially received message is kept without new fragments
+#define RH_FRAGMENT_REASSEMBLY_TIMEOUT 5000
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHFragmentedDatagram RHFragmentedDatagram.h <RHFragmentedDatagram.h>
+/// \brief RHReliableDatagram subclass for sending messages larger than the driver's maximum message length.
+///
+/// Manager class that extends RHReliableDatagram to split large messages (up to 
+/// RH_FRAGMENT_MAX_MESSAGE_LEN octets, and at most RH_FRAGMENT_MAX_FRAGMENTS fragments) into fragments,
+/// and to reassemble them at the receiver.
+///
+/// Fragments are not acknowledged one at a time. sendtoWaitFragmented() sends all fragments 
+/// back-to-back, and asks for an acknowledgement in the last one. The receiver replies with a single 
+/// bitmap ACK listing the fragments it is still missing, and the sender resends only those, 
+/// until the bitmap is empty or the retries are exhausted. 
+/// Retries are only counted for rounds in which no progress was made.
+///
+/// The receiver reassembles fragments in any order into one of RH_FRAGMENT_REASSEMBLY_SLOTS 
+/// buffers, so several senders can be served at the same time with bounded memory. 
+/// A partially received message that gets no new fragments within the reassembly timeout is discarded.
+/// A delivered message is remembered for the same time after its last fragment, to answer late polls,
+/// and then forgotten, so a later message from the same sender with the same ID is received afresh.
+/// If all slots are busy, the oldest one is reused.
+///
+/// Each instance needs about RH_FRAGMENT_REASSEMBLY_SLOTS * RH_FRAGMENT_MAX_MESSAGE_LEN
+/// + RH_FRAGMENT_SEND_WINDOW * RH_MAX_MESSAGE_LEN octets of SRAM, which is much less
+/// by default on small processors than on Linux. Pre-define them to suit your application.
+///
+/// recvfromAckFragmented() also accepts ordinary messages sent with RHReliableDatagram::sendtoWait()
+/// and acknowledges them in the usual way.
+///
+/// \par Streaming
+///
+/// Messages need not be in memory all at once. To send one a piece at a time, call beginFragmented()
+/// with its total length, writeFragmented() as many times as needed, and finishFragmented().
+/// Every RH_FRAGMENT_SEND_WINDOW fragments are sent as a burst, ending with a poll, and are resent
+/// until the receiver's bitmap ACK shows it has them all, before the next ones are accepted.
+/// To receive a piece at a time, call recvfromAckFragment() instead of recvfromAckFragmented().
+/// It returns each fragment once, as soon as it arrives, with its offset in the message, and says
+/// when the message is complete. Fragments can arrive in any order, and their data is not kept.
+///
+/// \par Message Format
+///
+/// Each fragment is a message with the RH_FLAGS_FRAGMENT bit set in the FLAGS header and 
+/// the ID header set to the ID of the whole message. The payload starts with a FragmentHeader:
+/// - 1 octet INDEX, the 0 based index of this fragment. The top bit (RH_FRAGMENT_POLL)
+///   is set in the last fragment of a burst.
+/// - 1 octet COUNT, the total number of fragments in the message.
+/// - 1 octet SIZE, the number of data octets in every fragment except the last one.
+/// - the fragment data.
+///
+/// A bitmap ACK is a message with RH_FLAGS_ACK and RH_FLAGS_FRAGMENT set, the ID of the message, and 
+/// a payload of 1 octet COUNT followed by (COUNT + 7) / 8 octets of bitmap, where bit i 
+/// (bit i % 8 of octet i / 8) is set if fragment i is still missing.
+///
+/// Broadcast fragmented messages are sent once and never acknowledged.
+class RHFragmentedDatagram : public RHReliableDatagram
+{
+public:
+    /// Defines the header at the start of the payload of every fragment
+    typedef struct
+    {
+	uint8_t    index;      ///< Fragment index, plus RH_FRAGMENT_POLL in the last fragment of a burst
+	uint8_t    count;      ///< Number of fragments in the message
+	uint8_t    size;       ///< Data octets in each fragment except the last
+	// Data follows, Length is implicit in the overall message length
+    } FragmentHeader;
+
+    /// Values for the possible states of a reassembly slot
+    typedef enum
+    {
+	Free = 0,              ///< Slot is unused
+	Receiving,             ///< Fragments are being collected
+	Delivered              ///< Message has been delivered, slot kept to answer late polls
+    } SlotState;
+
+    /// What receiveFrame() got
+    typedef enum
+    {
+	Nothing = 0,           ///< Nothing new
+	Message,               ///< An ordinary message not received before
+	NewFragment            ///< A fragment not received before
+    } Received;
+
+    /// Defines a reassembly slot
+    typedef struct
+    {
+	uint8_t       state;     ///< One of SlotState
+	RHAddress     from;      ///< Address of the sender
+	uint8_t       id;        ///< ID of the message
+	uint8_t       count;     ///< Number of fragments
+	uint8_t       size;      ///< Data octets in each fragment except the last
+	uint16_t      len;       ///< Total length, known once the last fragment is received
+	unsigned long lastRx;    ///< millis() when the last fragment was received
+	uint8_t       received[RH_FRAGMENT_BITMAP_LEN]; ///< Bitmap of fragments received so far
+	uint8_t       data[RH_FRAGMENT_MAX_MESSAGE_LEN]; ///< Reassembled message
+    } ReassemblySlot;
+
+    /// Constructor. 
+    /// \param[in] driver The RadioHead driver to use to transport messages.
+    /// \param[in] thisAddress The address to assign to this node. Defaults to 0
+    RHFragmentedDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
+
+    /// Sets the time a partially received message is kept without receiving any new fragments.
+    /// Defaults to RH_FRAGMENT_REASSEMBLY_TIMEOUT (5000ms).
+    /// \param[in] timeout The new timeout period in milliseconds
+    void setReassemblyTimeout(uint16_t timeout);
+
+    /// Sends a message of any length up to RH_FRAGMENT_MAX_MESSAGE_LEN, fragmented to suit the driver.
+    /// Sends all fragments back-to-back, then waits for a bitmap ACK and resends the missing fragments.
+    /// Blocks until the whole message is acknowledged or the retries are exhausted.
+    /// \param[in] buf Pointer to the binary message to send
+    /// \param[in] len Number of octets to send
+    /// \param[in] address The address to send the message to. RH_BROADCAST_ADDRESS is permitted, but
+    /// is not acknowledged.
+    /// \return true if the message was transmitted and all fragments were acknowledged.
+    bool sendtoWaitFragmented(const uint8_t* buf, uint16_t len, RHAddress address);
+
+    /// Starts sending a message of the given length a piece at a time, with writeFragmented().
+    /// \param[in] address The address to send the message to. RH_BROADCAST_ADDRESS is permitted, but
+    /// is not acknowledged.
+    /// \param[in] len The total number of octets in the message
+    /// \return true if a message of that length can be sent
+    bool beginFragmented(RHAddress address, uint16_t len);
+
+    /// Adds the next piece of a message started with beginFragmented(). Each time RH_FRAGMENT_SEND_WINDOW
+    /// fragments have been filled, sends them and blocks until they are all acknowledged or the retries 
+    /// are exhausted.
+    /// \param[in] data The next octets of the message
+    /// \param[in] len Number of octets. The total written must not exceed the length given to beginFragmented()
+    /// \return false if the message is too long, or some fragments could not be delivered
+    bool writeFragmented(const uint8_t* data, uint16_t len);
+
+    /// Sends the rest of a message started with beginFragmented(), and blocks until it is all acknowledged
+    /// or the retries are exhausted.
+    /// \return true if all of the message was written and all fragments were acknowledged.
+    bool finishFragmented();
+
+    /// Processes any received fragment or message. Fragments are stored in their reassembly slot and
+    /// polls are answered with a bitmap ACK. 
+    /// If a message is now complete, copy it to buf and return true, else return false.
+    /// Ordinary (unfragmented) messages are acknowledged and delivered like RHReliableDatagram::recvfromAck().
+    /// You should be sure to call this function frequently enough to not miss any fragments.
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a complete message was copied to buf
+    bool recvfromAckFragmented(uint8_t* buf, uint16_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Similar to recvfromAckFragmented(), this will block until either a complete message is
+    /// available for this node or the timeout expires.
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[in] timeout Maximum time to wait in milliseconds
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a complete message was copied to buf
+    bool recvfromAckFragmentedTimeout(uint8_t* buf, uint16_t* len, uint16_t timeout, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Like recvfromAckFragmented(), but delivers each fragment as soon as it arrives, instead of
+    /// reassembling the message. Each fragment is delivered once, in the order they arrive, 
+    /// which need not be the order in the message.
+    /// Ordinary (unfragmented) messages are delivered as a single complete fragment at offset 0.
+    /// \param[in] buf Location to copy the fragment data
+    /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
+    /// \param[out] offset Set to the offset of the fragment data in the message
+    /// \param[out] complete Set to true if this was the last fragment of the message still to arrive
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
+    /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
+    /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
+    /// \return true if a new fragment was copied to buf
+    bool recvfromAckFragment(uint8_t* buf, uint8_t* len, uint16_t* offset, bool* complete, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+protected:
+    /// Sends one fragment of the message being sent, without waiting for an acknowledgement
+    bool sendFragment(const uint8_t* data, uint8_t index, bool poll);
+
+    /// Sends fragments first to end - 1 of the message being sent back-to-back, asking for a bitmap ACK in
+    /// the last one, and resends the ones the receiver is missing until it has them all or the retries 
+    /// are exhausted.
+    /// \param[in] data The data of fragment first, followed by the others
+    /// \param[in] first Index of the first fragment
+    /// \param[in] end Index after the last fragment
+    /// \return true if the fragments were all acknowledged, or were broadcast
+    bool sendBurst(const uint8_t* data, uint8_t first, uint8_t end);
+
+    /// Receives the next message, acknowledging it or answering polls as needed, and records a fragment
+    /// in its reassembly slot.
+    /// \param[out] frame Set to the message, including the FragmentHeader of a fragment
+    /// \param[in,out] frameLen Available space in frame. Set to the length of the message
+    /// \param[in] reassemble true to copy fragment data into the slot
+    /// \param[out] slot Set to the reassembly slot of a fragment
+    /// \return One of Received
+    uint8_t receiveFrame(uint8_t* frame, uint8_t* frameLen, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags,
+			 bool reassemble, ReassemblySlot** slot);
+
+    /// Tells whether every fragment in the slot has been received
+    bool isComplete(ReassemblySlot* slot);
+
+    /// Sends a bitmap ACK listing the fragments still missing in the slot
+    void acknowledgeFragments(ReassemblySlot* slot);
+
+    /// Finds the slot for the message from the given sender with the given id, or allocates a new one
+    /// \return pointer to the slot
+    ReassemblySlot* getSlot(RHAddress from, uint8_t id, uint8_t count, uint8_t size);
+
+    /// Frees slots that have not received a fragment within the reassembly timeout
+    void expireSlots();
+
+private:
+    /// The last message ID used for fragmented messages
+    uint8_t         _lastFragmentedId;
+
+    /// Reassembly timeout in milliseconds
+    uint16_t        _reassemblyTimeout;
+
+    /// Reassembly slots
+    ReassemblySlot  _slots[RH_FRAGMENT_REASSEMBLY_SLOTS];
+
+    /// The message being sent
+    RHAddress       _txAddress;
+    uint16_t        _txLen;     ///< Total length
+    uint16_t        _txWritten; ///< Octets passed to writeFragmented() so far
+    uint8_t         _txId;
+    uint8_t         _txCount;   ///< Number of fragments
+    uint8_t         _txSize;    ///< Data octets in each fragment except the last
+    uint8_t         _txFirst;   ///< Index of the first fragment in _txWindow
+    bool            _txFailed;  ///< Some fragments could not be delivered
+
+    /// Fragments written with writeFragmented() and not yet sent
+    uint8_t         _txWindow[RH_FRAGMENT_SEND_WINDOW * RH_MAX_MESSAGE_LEN];
+};
+
+#endif
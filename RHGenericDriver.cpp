@@ -9,6 +9,7 @@ RHGenericDriver::RHGenericDriver()
     :
     _mode(RHModeInitialising),
     _thisAddress(RH_BROADCAST_ADDRESS),
+    _promiscuous(false),
     _txHeaderTo(RH_BROADCAST_ADDRESS),
     _txHeaderFrom(RH_BROADCAST_ADDRESS),
     _txHeaderId(0),
@@ -16,6 +17,7 @@ RHGenericDriver::RHGenericDriver()
     _rxBad(0),
     _rxGood(0),
     _txGood(0),
+    _cadBusy(0),
     _cad_timeout(0)
 {
 }
@@ -68,6 +70,52 @@ bool RHGenericDriver::waitPacketSent(uint16_t timeout)
     return false;
 }
 
+// Subclasses may override with a faster path for acknowledgements
+bool RHGenericDriver::sendAck(const uint8_t* data, uint8_t len)
+{
+    return send(data, len);
+}
+
+bool RHGenericDriver::recvLease(RxLease* lease)
+{
+    (void)lease;
+    return false;
+}
+
+void RHGenericDriver::releaseLease()
+{
+}
+
+uint8_t RHGenericDriver::numInterfaces()
+{
+    return 1;
+}
+
+void RHGenericDriver::setTransmitInterface(uint8_t interface)
+{
+    (void)interface;
+}
+
+uint8_t RHGenericDriver::lastInterface()
+{
+    return 0;
+}
+
+bool RHGenericDriver::sendv(const Segment* segments, uint8_t numSegments)
+{
+    uint8_t buf[255]; // Longest message any driver can send
+    uint16_t len = 0;
+    uint8_t i;
+    for (i = 0; i < numSegments; i++)
+    {
+	if (len + segments[i].len > sizeof(buf))
+	    return false;
+	memcpy(buf + len, segments[i].data, segments[i].len);
+	len += segments[i].len;
+    }
+    return send(buf, len);
+}
+
 // Wait until no channel activity detected or timeout
 bool RHGenericDriver::waitCAD()
 {
@@ -82,6 +130,7 @@ bool RHGenericDriver::waitCAD()
     unsigned long t = millis();
     while (isChannelActive())
     {
+         _cadBusy++;
          if (millis() - t > _cad_timeout) 
 	     return false;
          delay(random(1, 10) * 100); // Should these values be configurable? Macros?
@@ -101,6 +150,11 @@ void RHGenericDriver::setPromiscuous(bool promiscuous)
     _promiscuous = promiscuous;
 }
 
+bool RHGenericDriver::promiscuous()
+{
+    return _promiscuous;
+}
+
 void RHGenericDriver::setThisAddress(uint8_t address)
 {
     _thisAddress = address;
@@ -203,6 +257,11 @@ uint16_t RHGenericDriver::txGood()
     return _txGood;
 }
 
+uint16_t RHGenericDriver::cadBusy()
+{
+    return _cadBusy;
+}
+
 void RHGenericDriver::setCADTimeout(unsigned long cad_timeout)
 {
     _cad_timeout = cad_timeout;
@@ -17,6 +17,9 @@
 // Default timeout for waitCAD() in ms
 #define RH_CAD_DEFAULT_TIMEOUT            10000
 
+// Interface number meaning all the interfaces of a driver. See RHGenericDriver::setTransmitInterface()
+#define RH_ALL_INTERFACES                 0xff
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHGenericDriver RHGenericDriver.h <RHGenericDriver.h>
 /// \brief Abstract base class for a RadioHead driver.
@@ -55,6 +58,25 @@ public:
 	RHModeCad               ///< Transport is in the process of detecting channel activity (if supported)
     } RHMode;
 
+    /// \brief One contiguous part of a message to be sent with sendv()
+    typedef struct
+    {
+	const uint8_t* data; ///< The octets of this part of the message
+	uint8_t        len;  ///< Number of octets in this part of the message
+    } Segment;
+
+    /// \brief A received message lent by the driver, see recvLease()
+    typedef struct
+    {
+	uint8_t*       data;        ///< The message, after the driver headers, in the driver's receive buffer
+	uint8_t        len;         ///< Number of octets in the message
+	RHAddress      headerTo;    ///< The TO header of the message
+	RHAddress      headerFrom;  ///< The FROM header of the message
+	uint8_t        headerId;    ///< The ID header of the message
+	uint8_t        headerFlags; ///< The FLAGS header of the message
+	int8_t         rssi;        ///< The RSSI of the message
+    } RxLease;
+
     /// Constructor
     RHGenericDriver();
 
@@ -83,6 +105,22 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool recv(uint8_t* buf, uint8_t* len) = 0;
 
+    /// If there is a valid message available, lends it to the caller where it lies in the driver's 
+    /// receive buffer, instead of copying it like recv() does. The message stays there, and no other 
+    /// message is received, until the caller calls releaseLease(): while a message is lent, available() 
+    /// and recv() return false. So release it as soon as possible, and in particular before waiting for 
+    /// anything to be received. The message should be treated as read-only, except by manager classes 
+    /// that update headers in place before passing it on.
+    /// The default implementation returns false: the driver does not lend messages, use recv() instead. 
+    /// Drivers that transmit from their receive buffer must not lend messages.
+    /// \param[out] lease Set to describe the lent message
+    /// \return true if a message was lent, and must be released
+    virtual bool recvLease(RxLease* lease);
+
+    /// Ends the loan of a message by recvLease(). The message is discarded, as if it had been 
+    /// received with recv(), and the driver can receive the next one.
+    virtual void releaseLease();
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then optionally waits for Channel Activity Detection (CAD) 
     /// to show the channnel is clear (if the radio supports CAD) by calling waitCAD().
@@ -96,6 +134,42 @@ public:
     /// if CAD was requested and the CAD timeout timed out before clear channel was detected.
     virtual bool send(const uint8_t* data, uint8_t len) = 0;
 
+    /// Sends an acknowledgement message, as used by RHReliableDatagram.
+    /// Drivers may override this to provide a lower latency path than send(), for example
+    /// by skipping CAD and returning to receive mode as soon as the transmission is complete.
+    /// The default implementation calls send().
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message length was valid and it was correctly queued for transmit.
+    virtual bool sendAck(const uint8_t* data, uint8_t len);
+
+    /// Sends a message made up of several separate segments, exactly as if they had been 
+    /// concatenated and sent with send(). This lets callers keep headers and payload in 
+    /// separate buffers. Drivers may override this to stream the segments straight 
+    /// into the radio. The default implementation copies them into a temporary buffer and calls send().
+    /// \param[in] segments Array of segments to be sent, in order
+    /// \param[in] numSegments Number of segments
+    /// \return true if the total length was valid and the message was correctly queued for transmit.
+    virtual bool sendv(const Segment* segments, uint8_t numSegments);
+
+    /// Returns the number of separate radios or other interfaces the driver sends and receives with. 
+    /// Drivers that combine several interfaces, such as RHMultiDriver, override this. 
+    /// The default implementation returns 1.
+    /// \return The number of interfaces
+    virtual uint8_t numInterfaces();
+
+    /// Selects the interface subsequent messages are sent on, for drivers with more than one 
+    /// (see numInterfaces()). ACKs sent with sendAck() are not affected: they go out on the interface 
+    /// the last message was received on. The default implementation does nothing.
+    /// \param[in] interface The interface number, from 0 to numInterfaces() - 1, or RH_ALL_INTERFACES 
+    /// to send each message on all of them
+    virtual void setTransmitInterface(uint8_t interface);
+
+    /// Returns the interface the last received message came in on, for drivers with 
+    /// more than one (see numInterfaces()). The default implementation returns 0.
+    /// \return The interface number
+    virtual uint8_t lastInterface();
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -186,6 +260,10 @@ public:
     /// \param[in] promiscuous true if you wish to receive messages with any TO address
     virtual void           setPromiscuous(bool promiscuous);
 
+    /// Tells whether the driver is in promiscuous mode
+    /// \return true if the driver accepts messages with any TO address
+    bool                   promiscuous();
+
     /// Returns the TO header of the last received message
     /// \return The TO header
     virtual uint8_t        headerTo();
@@ -247,6 +325,11 @@ public:
     /// \return The number of packets successfully transmitted
     uint16_t       txGood();
 
+    /// Returns the count of the number of times waitCAD() found the channel active
+    /// (and therefore had to back off before transmitting).
+    /// \return The number of channel busy detections.
+    uint16_t       cadBusy();
+
 protected:
 
     /// The current transport operating mode
@@ -294,6 +377,9 @@ protected:
     /// Count of the number of bad messages (correct checksum etc) received
     volatile uint16_t   _txGood;
 
+    /// Count of the number of times waitCAD() found the channel active
+    volatile uint16_t   _cadBusy;
+
     /// Channel activity detected
     volatile bool       _cad;
     unsigned int        _cad_timeout;
@@ -0,0 +1,743 @@
+// RHIPTunnel.cpp
+//
+// Carries IPv6 packets from a Linux TUN device across an RHMesh network
+//
+// Part of the RadioHead library
+
+#include <RHIPTunnel.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#ifdef __linux__
+#include <linux/if_tun.h>
+#endif
+
+// The link local prefix fe80::/64
+static const uint8_t linkLocalPrefix[8] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0 };
+
+// Interface identifiers derived from node addresses are 0000:00ff:fe00:XXXX
+static const uint8_t shortIid[6] = { 0, 0, 0, 0xff, 0xfe, 0 };
+
+////////////////////////////////////////////////////////////////////
+// Constructors
+RHIPTunnel::RHIPTunnel(RHMesh& mesh)
+    : _mesh(mesh),
+      _fd(-1),
+      _gateway(RH_BROADCAST_ADDRESS),
+      _nextTag(0)
+{
+    memset(_name, 0, sizeof(_name));
+    memset(_prefix, 0, sizeof(_prefix));
+    _prefix[0] = 0xfd;
+    memset(&_stats, 0, sizeof(_stats));
+    uint8_t i;
+    for (i = 0; i < RH_IP_TUNNEL_REASSEMBLY_BUFFERS; i++)
+	_reassembly[i].inUse = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Public methods
+bool RHIPTunnel::open(const char* name)
+{
+#ifdef __linux__
+    int fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+	return false;
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0)
+    {
+	close(fd);
+	return false;
+    }
+    if (_fd >= 0)
+	close(_fd);
+    _fd = fd;
+    strncpy(_name, ifr.ifr_name, sizeof(_name) - 1);
+
+    // Configure the interface as best we can. Someone else may prefer to do it
+    int s = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (s < 0)
+	return true;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _name, IFNAMSIZ - 1);
+    ifr.ifr_mtu = RH_IP_TUNNEL_MTU;
+    ioctl(s, SIOCSIFMTU, &ifr);
+    if (ioctl(s, SIOCGIFINDEX, &ifr) == 0)
+    {
+	// Same layout as struct in6_ifreq in linux/ipv6.h
+	struct
+	{
+	    uint8_t  address[16];
+	    uint32_t prefixLen;
+	    int      index;
+	} req;
+	req.prefixLen = 64;
+	req.index = ifr.ifr_ifindex;
+	addressOf(_mesh.thisAddress(), req.address);
+	ioctl(s, SIOCSIFADDR, &req);
+	memcpy(req.address, linkLocalPrefix, sizeof(linkLocalPrefix));
+	ioctl(s, SIOCSIFADDR, &req);
+    }
+    if (ioctl(s, SIOCGIFFLAGS, &ifr) == 0)
+    {
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	ioctl(s, SIOCSIFFLAGS, &ifr);
+    }
+    close(s);
+    return true;
+#else
+    (void)name;
+    return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+const char* RHIPTunnel::interfaceName()
+{
+    return _name;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHIPTunnel::setPrefix(const uint8_t* prefix)
+{
+    memcpy(_prefix, prefix, sizeof(_prefix));
+}
+
+////////////////////////////////////////////////////////////////////
+void RHIPTunnel::setGateway(RHAddress gateway)
+{
+    _gateway = gateway;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHIPTunnel::addressOf(RHAddress node, uint8_t* address)
+{
+    memcpy(address, _prefix, sizeof(_prefix));
+    memcpy(address + 8, shortIid, sizeof(shortIid));
+    address[14] = (uint16_t)node >> 8;
+    address[15] = node;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::nodeOf(const uint8_t* address, RHAddress* node)
+{
+    if (   (memcmp(address, _prefix, 8) && memcmp(address, linkLocalPrefix, 8))
+	|| memcmp(address + 8, shortIid, sizeof(shortIid)))
+	return false;
+    uint16_t n = ((uint16_t)address[14] << 8) | address[15];
+    if ((RHAddress)n != n || (RHAddress)n == RH_BROADCAST_ADDRESS)
+	return false; // Not a possible node address
+    *node = n;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+const RHIPTunnel::Stats* RHIPTunnel::stats()
+{
+    return &_stats;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::poll(uint16_t timeout)
+{
+    bool busy = false;
+    if (_fd >= 0)
+    {
+	ssize_t n = read(_fd, _txPacket, sizeof(_txPacket));
+	if (n > 0)
+	{
+	    sendPacket(_txPacket, n);
+	    busy = true;
+	}
+    }
+
+    // Dont wait for the mesh if there may be more packets to send
+    uint8_t len = sizeof(_rxBuf);
+    RHAddress source, dest;
+    bool received = busy ? _mesh.recvfromAck(_rxBuf, &len, &source, &dest)
+	                 : _mesh.recvfromAckTimeout(_rxBuf, &len, timeout, &source, &dest);
+    uint8_t* packet;
+    uint16_t packetLen;
+    if (received && receiveMessage(_rxBuf, len, source, dest, &packet, &packetLen))
+    {
+	if (_fd >= 0 && write(_fd, packet, packetLen) != packetLen)
+	    _stats.dropped++;
+	busy = true;
+    }
+    return busy;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::sendPacket(const uint8_t* packet, uint16_t len)
+{
+    if (len < 40 || (packet[0] >> 4) != 6 || len > RH_IP_TUNNEL_MTU)
+    {
+	_stats.dropped++; // Not IPv6, or too long to fragment
+	return false;
+    }
+
+    // Where does it go in the mesh?
+    RHAddress dest = RH_BROADCAST_ADDRESS;
+    bool flood = false;
+    if (packet[24] == 0xff)
+    {
+	uint8_t scope = packet[25] & 0x0f;
+	if (scope < 2)
+	    return true; // Interface local, goes nowhere
+	flood = scope > 2;
+    }
+    else if (!nodeOf(packet + 24, &dest))
+	dest = _gateway;
+    if (dest == RH_BROADCAST_ADDRESS && packet[24] != 0xff)
+    {
+	_stats.dropped++; // Outside the mesh, and no gateway
+	return false;
+    }
+
+    uint8_t header[RH_IP_TUNNEL_MAX_HEADER_LEN];
+    uint8_t consumed;
+    uint8_t headerLen = compressHeader(packet, len, _mesh.thisAddress(), dest, header, &consumed);
+    uint16_t maxLen = _mesh.maxMessageLength() - sizeof(RHRouter::RoutedMessageHeader) - sizeof(RHMesh::MeshMessageHeader);
+    if (maxLen > RH_MESH_MAX_MESSAGE_LEN)
+	maxLen = RH_MESH_MAX_MESSAGE_LEN;
+
+    bool sent;
+    if (headerLen + len - consumed <= maxLen)
+    {
+	// Fits in one message
+	memcpy(_txBuf, header, headerLen);
+	memcpy(_txBuf + headerLen, packet + consumed, len - consumed);
+	sent = sendMessage(headerLen + len - consumed, dest, flood);
+    }
+    else
+    {
+	// First fragment: the compressed header, and enough of the rest that the next fragment
+	// starts at a multiple of 8 octets into the uncompressed packet
+	uint16_t tag = _nextTag++;
+	uint16_t offset = (maxLen - RH_IP_TUNNEL_FRAG1_LEN - headerLen + consumed) & ~7;
+	_txBuf[0] = RH_IP_TUNNEL_DISPATCH_FRAG1 | (len >> 8);
+	_txBuf[1] = len;
+	_txBuf[2] = tag >> 8;
+	_txBuf[3] = tag;
+	memcpy(_txBuf + RH_IP_TUNNEL_FRAG1_LEN, header, headerLen);
+	memcpy(_txBuf + RH_IP_TUNNEL_FRAG1_LEN + headerLen, packet + consumed, offset - consumed);
+	sent = sendMessage(RH_IP_TUNNEL_FRAG1_LEN + headerLen + offset - consumed, dest, flood);
+
+	// The rest, uncompressed
+	_txBuf[0] = RH_IP_TUNNEL_DISPATCH_FRAGN | (len >> 8);
+	while (sent && offset < len)
+	{
+	    uint16_t fragmentLen = (maxLen - RH_IP_TUNNEL_FRAGN_LEN) & ~7;
+	    if (fragmentLen > len - offset)
+		fragmentLen = len - offset;
+	    _txBuf[4] = offset / 8;
+	    memcpy(_txBuf + RH_IP_TUNNEL_FRAGN_LEN, packet + offset, fragmentLen);
+	    sent = sendMessage(RH_IP_TUNNEL_FRAGN_LEN + fragmentLen, dest, flood);
+	    offset += fragmentLen;
+	}
+    }
+    if (!sent)
+    {
+	_stats.dropped++;
+	return false;
+    }
+    _stats.txPackets++;
+    _stats.headerOctetsSaved += consumed - headerLen;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::receiveMessage(const uint8_t* message, uint8_t len, RHAddress source, RHAddress dest, uint8_t** packet, uint16_t* packetLen)
+{
+    _stats.rxMessages++;
+    if (!len)
+	return false;
+
+    uint8_t dispatch = message[0] & 0xf8;
+    uint8_t headerLen;
+    bool udp;
+    if (dispatch == RH_IP_TUNNEL_DISPATCH_FRAG1 || dispatch == RH_IP_TUNNEL_DISPATCH_FRAGN)
+    {
+	uint8_t fragLen = dispatch == RH_IP_TUNNEL_DISPATCH_FRAG1 ? RH_IP_TUNNEL_FRAG1_LEN : RH_IP_TUNNEL_FRAGN_LEN;
+	if (len <= fragLen)
+	    return false;
+	uint16_t size = ((uint16_t)(message[0] & 0x07) << 8) | message[1];
+	uint16_t tag = ((uint16_t)message[2] << 8) | message[3];
+	if (size < 40 || size > RH_IP_TUNNEL_MTU)
+	    return false;
+	Reassembly* r = findReassembly(source, tag, size);
+	bool complete;
+	if (dispatch == RH_IP_TUNNEL_DISPATCH_FRAG1)
+	{
+	    uint8_t compressedLen = decompressHeader(message + fragLen, len - fragLen, source, dest, r->packet, &headerLen, &r->udp);
+	    uint8_t rest = len - fragLen - compressedLen;
+	    if (!compressedLen || headerLen + rest > size)
+		return false;
+	    memcpy(r->packet + headerLen, message + fragLen + compressedLen, rest);
+	    complete = addFragment(r, 0, NULL, headerLen + rest);
+	}
+	else
+	    complete = addFragment(r, message[4] * 8, message + fragLen, len - fragLen);
+	if (!complete)
+	    return false;
+	setLengths(r->packet, size, r->udp);
+	r->inUse = false;
+	*packet = r->packet;
+	*packetLen = size;
+    }
+    else
+    {
+	uint8_t compressedLen = decompressHeader(message, len, source, dest, _rxPacket, &headerLen, &udp);
+	if (!compressedLen)
+	    return false; // Not one of ours
+	uint8_t rest = len - compressedLen;
+	setLengths(_rxPacket, headerLen + rest, udp);
+	memcpy(_rxPacket + headerLen, message + compressedLen, rest);
+	*packet = _rxPacket;
+	*packetLen = headerLen + rest;
+    }
+    _stats.rxPackets++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHIPTunnel::compressHeader(const uint8_t* packet, uint16_t len, RHAddress source, RHAddress dest, uint8_t* buf, uint8_t* consumed)
+{
+    uint8_t iphc0 = RH_IP_TUNNEL_DISPATCH_IPHC;
+    uint8_t iphc1 = 0;
+    uint8_t* p = buf + 2;
+
+    // Traffic class and flow label. RFC 6282 puts the ECN bits before the DSCP
+    uint8_t tc = (packet[0] << 4) | (packet[1] >> 4);
+    uint8_t ecnDscp = (tc << 6) | (tc >> 2);
+    uint32_t fl = ((uint32_t)(packet[1] & 0x0f) << 16) | ((uint16_t)packet[2] << 8) | packet[3];
+    if (!fl && !tc)
+	iphc0 |= 0x18; // All elided
+    else if (!fl)
+    {
+	iphc0 |= 0x10; // Flow label elided
+	*p++ = ecnDscp;
+    }
+    else if (!(tc >> 2))
+    {
+	iphc0 |= 0x08; // DSCP elided
+	*p++ = (ecnDscp & 0xc0) | (fl >> 16);
+	*p++ = fl >> 8;
+	*p++ = fl;
+    }
+    else
+    {
+	*p++ = ecnDscp;
+	*p++ = fl >> 16;
+	*p++ = fl >> 8;
+	*p++ = fl;
+    }
+
+    // Next header. UDP is compressed too
+    bool udp = packet[6] == 17 && len >= 48;
+    if (udp)
+	iphc0 |= 0x04;
+    else
+	*p++ = packet[6];
+
+    // Hop limit
+    switch (packet[7])
+    {
+    case 1:   iphc0 |= 0x01; break;
+    case 64:  iphc0 |= 0x02; break;
+    case 255: iphc0 |= 0x03; break;
+    default:  *p++ = packet[7]; break;
+    }
+
+    // Addresses
+    iphc1 |= compressAddress(packet + 8, source, &p) << 4;
+    const uint8_t* d = packet + 24;
+    if (d[0] != 0xff)
+	iphc1 |= compressAddress(d, dest, &p);
+    else
+    {
+	// Multicast, M set. Look for runs of zeros, as in ff02::1
+	static const uint8_t zeros[13] = { 0 };
+	iphc1 |= 0x08;
+	if (d[1] == 0x02 && !memcmp(d + 2, zeros, 13))
+	{
+	    iphc1 |= 0x03;
+	    *p++ = d[15];
+	}
+	else if (!memcmp(d + 2, zeros, 11))
+	{
+	    iphc1 |= 0x02;
+	    *p++ = d[1];
+	    memcpy(p, d + 13, 3);
+	    p += 3;
+	}
+	else if (!memcmp(d + 2, zeros, 9))
+	{
+	    iphc1 |= 0x01;
+	    *p++ = d[1];
+	    memcpy(p, d + 11, 5);
+	    p += 5;
+	}
+	else
+	{
+	    memcpy(p, d, 16);
+	    p += 16;
+	}
+    }
+
+    if (udp)
+    {
+	// UDP ports, short ones in fewer octets. The length is elided, the checksum never is
+	const uint8_t* u = packet + 40;
+	uint16_t sourcePort = ((uint16_t)u[0] << 8) | u[1];
+	uint16_t destPort = ((uint16_t)u[2] << 8) | u[3];
+	if ((sourcePort & 0xfff0) == 0xf0b0 && (destPort & 0xfff0) == 0xf0b0)
+	{
+	    *p++ = 0xf3;
+	    *p++ = ((sourcePort & 0x0f) << 4) | (destPort & 0x0f);
+	}
+	else if ((destPort & 0xff00) == 0xf000)
+	{
+	    *p++ = 0xf1;
+	    *p++ = u[0];
+	    *p++ = u[1];
+	    *p++ = u[3];
+	}
+	else if ((sourcePort & 0xff00) == 0xf000)
+	{
+	    *p++ = 0xf2;
+	    *p++ = u[1];
+	    *p++ = u[2];
+	    *p++ = u[3];
+	}
+	else
+	{
+	    *p++ = 0xf0;
+	    memcpy(p, u, 4);
+	    p += 4;
+	}
+	*p++ = u[6];
+	*p++ = u[7];
+    }
+
+    buf[0] = iphc0;
+    buf[1] = iphc1;
+    *consumed = udp ? 48 : 40;
+    return p - buf;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHIPTunnel::compressAddress(const uint8_t* address, RHAddress node, uint8_t** p)
+{
+    uint8_t mode;
+    if (!memcmp(address, linkLocalPrefix, 8))
+	mode = 0; // Stateless
+    else if (!memcmp(address, _prefix, 8))
+	mode = 0x04; // The mesh prefix is context 0
+    else
+    {
+	static const uint8_t unspecified[16] = { 0 };
+	if (!memcmp(address, unspecified, 16))
+	    return 0x04;
+	memcpy(*p, address, 16);
+	*p += 16;
+	return 0;
+    }
+
+    uint8_t derived[16];
+    addressOf(node, derived);
+    if (!memcmp(address + 8, derived + 8, 8))
+	return mode | 0x03; // All elided
+    if (!memcmp(address + 8, shortIid, sizeof(shortIid)))
+    {
+	memcpy(*p, address + 14, 2);
+	*p += 2;
+	return mode | 0x02;
+    }
+    memcpy(*p, address + 8, 8);
+    *p += 8;
+    return mode | 0x01;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHIPTunnel::decompressHeader(const uint8_t* buf, uint8_t len, RHAddress source, RHAddress dest, uint8_t* packet, uint8_t* headerLen, bool* udp)
+{
+    const uint8_t* p = buf + 2;
+    const uint8_t* end = buf + len;
+#define RH_IP_TUNNEL_NEED(n) if (p + (n) > end) return 0
+
+    *udp = false;
+    if (len > 40 && buf[0] == RH_IP_TUNNEL_DISPATCH_IPV6)
+    {
+	memcpy(packet, buf + 1, 40);
+	*headerLen = 40;
+	return 41;
+    }
+    if (len < 2 || (buf[0] & 0xe0) != RH_IP_TUNNEL_DISPATCH_IPHC || (buf[1] & 0x80))
+	return 0; // Not IPHC, or uses a context we dont have
+    uint8_t iphc0 = buf[0];
+    uint8_t iphc1 = buf[1];
+    memset(packet, 0, 48);
+
+    // Traffic class and flow label
+    uint8_t ecnDscp = 0;
+    uint32_t fl = 0;
+    switch ((iphc0 >> 3) & 0x03)
+    {
+    case 0:
+	RH_IP_TUNNEL_NEED(4);
+	ecnDscp = p[0];
+	fl = ((uint32_t)(p[1] & 0x0f) << 16) | ((uint16_t)p[2] << 8) | p[3];
+	p += 4;
+	break;
+    case 1:
+	RH_IP_TUNNEL_NEED(3);
+	ecnDscp = p[0] & 0xc0;
+	fl = ((uint32_t)(p[0] & 0x0f) << 16) | ((uint16_t)p[1] << 8) | p[2];
+	p += 3;
+	break;
+    case 2:
+	RH_IP_TUNNEL_NEED(1);
+	ecnDscp = *p++;
+	break;
+    }
+    uint8_t tc = (ecnDscp << 2) | (ecnDscp >> 6);
+    packet[0] = 0x60 | (tc >> 4);
+    packet[1] = (tc << 4) | (fl >> 16);
+    packet[2] = fl >> 8;
+    packet[3] = fl;
+
+    // Next header
+    if (iphc0 & 0x04)
+    {
+	packet[6] = 17;
+	*udp = true;
+    }
+    else
+    {
+	RH_IP_TUNNEL_NEED(1);
+	packet[6] = *p++;
+    }
+
+    // Hop limit
+    switch (iphc0 & 0x03)
+    {
+    case 0:
+	RH_IP_TUNNEL_NEED(1);
+	packet[7] = *p++;
+	break;
+    case 1:  packet[7] = 1; break;
+    case 2:  packet[7] = 64; break;
+    case 3:  packet[7] = 255; break;
+    }
+
+    // Addresses
+    if (!decompressAddress((iphc1 >> 4) & 0x07, source, &p, end, packet + 8))
+	return 0;
+    uint8_t* d = packet + 24;
+    if (!(iphc1 & 0x08))
+    {
+	if (!decompressAddress(iphc1 & 0x07, dest, &p, end, d))
+	    return 0;
+    }
+    else
+    {
+	d[0] = 0xff;
+	switch (iphc1 & 0x07)
+	{
+	case 0:
+	    RH_IP_TUNNEL_NEED(16);
+	    memcpy(d, p, 16);
+	    p += 16;
+	    break;
+	case 1:
+	    RH_IP_TUNNEL_NEED(6);
+	    d[1] = *p++;
+	    memcpy(d + 11, p, 5);
+	    p += 5;
+	    break;
+	case 2:
+	    RH_IP_TUNNEL_NEED(4);
+	    d[1] = *p++;
+	    memcpy(d + 13, p, 3);
+	    p += 3;
+	    break;
+	case 3:
+	    RH_IP_TUNNEL_NEED(1);
+	    d[1] = 0x02;
+	    d[15] = *p++;
+	    break;
+	default:
+	    return 0; // Stateful multicast
+	}
+    }
+
+    if (*udp)
+    {
+	RH_IP_TUNNEL_NEED(1);
+	uint8_t nhc = *p++;
+	if ((nhc & 0xfc) != 0xf0)
+	    return 0; // Not UDP, or checksum elided
+	uint8_t* u = packet + 40;
+	switch (nhc & 0x03)
+	{
+	case 0:
+	    RH_IP_TUNNEL_NEED(4);
+	    memcpy(u, p, 4);
+	    p += 4;
+	    break;
+	case 1:
+	    RH_IP_TUNNEL_NEED(3);
+	    u[0] = p[0];
+	    u[1] = p[1];
+	    u[2] = 0xf0;
+	    u[3] = p[2];
+	    p += 3;
+	    break;
+	case 2:
+	    RH_IP_TUNNEL_NEED(3);
+	    u[0] = 0xf0;
+	    u[1] = p[0];
+	    u[2] = p[1];
+	    u[3] = p[2];
+	    p += 3;
+	    break;
+	case 3:
+	    RH_IP_TUNNEL_NEED(1);
+	    u[0] = 0xf0;
+	    u[1] = 0xb0 | (p[0] >> 4);
+	    u[2] = 0xf0;
+	    u[3] = 0xb0 | (p[0] & 0x0f);
+	    p++;
+	    break;
+	}
+	RH_IP_TUNNEL_NEED(2);
+	u[6] = p[0];
+	u[7] = p[1];
+	p += 2;
+    }
+#undef RH_IP_TUNNEL_NEED
+
+    *headerLen = *udp ? 48 : 40;
+    return p - buf;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::decompressAddress(uint8_t mode, RHAddress node, const uint8_t** p, const uint8_t* end, uint8_t* address)
+{
+    uint8_t inline_len[4] = { 16, 8, 2, 0 };
+    if (mode == 0x04)
+    {
+	memset(address, 0, 16); // Unspecified
+	return true;
+    }
+    if (*p + inline_len[mode & 0x03] > end)
+	return false;
+    addressOf(node, address);
+    if (!(mode & 0x04))
+	memcpy(address, linkLocalPrefix, sizeof(linkLocalPrefix));
+    switch (mode & 0x03)
+    {
+    case 0:
+	memcpy(address, *p, 16);
+	break;
+    case 1:
+	memcpy(address + 8, *p, 8);
+	break;
+    case 2:
+	memcpy(address + 8, shortIid, sizeof(shortIid));
+	memcpy(address + 14, *p, 2);
+	break;
+    }
+    *p += inline_len[mode & 0x03];
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHIPTunnel::setLengths(uint8_t* packet, uint16_t len, bool udp)
+{
+    uint16_t payloadLen = len - 40;
+    packet[4] = payloadLen >> 8;
+    packet[5] = payloadLen;
+    if (udp)
+    {
+	packet[44] = payloadLen >> 8;
+	packet[45] = payloadLen;
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::sendMessage(uint8_t len, RHAddress dest, bool flood)
+{
+    uint8_t ret = flood ? _mesh.floodWait(_txBuf, len) : _mesh.sendtoWait(_txBuf, len, dest);
+    if (ret != RH_ROUTER_ERROR_NONE)
+	return false;
+    _stats.txMessages++;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+RHIPTunnel::Reassembly* RHIPTunnel::findReassembly(RHAddress source, uint16_t tag, uint16_t size)
+{
+    Reassembly* found = NULL;
+    Reassembly* oldest = NULL;
+    uint8_t i;
+    for (i = 0; i < RH_IP_TUNNEL_REASSEMBLY_BUFFERS; i++)
+    {
+	Reassembly* r = &_reassembly[i];
+	if (r->inUse && millis() - r->started > RH_IP_TUNNEL_REASSEMBLY_TIMEOUT)
+	{
+	    r->inUse = false; // Gave up waiting for the rest
+	    _stats.dropped++;
+	}
+	if (r->inUse && r->source == source && r->tag == tag && r->size == size)
+	    return r;
+	if (!r->inUse)
+	{
+	    if (!found)
+		found = r;
+	}
+	else if (!oldest || (long)(r->started - oldest->started) < 0)
+	    oldest = r;
+    }
+    if (!found)
+    {
+	found = oldest; // Drop the oldest one to make room
+	_stats.dropped++;
+    }
+    found->inUse = true;
+    found->udp = false;
+    found->source = source;
+    found->tag = tag;
+    found->size = size;
+    found->started = millis();
+    memset(found->received, 0, sizeof(found->received));
+    return found;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHIPTunnel::addFragment(Reassembly* r, uint16_t offset, const uint8_t* data, uint16_t len)
+{
+    if (offset + len > r->size)
+	return false; // Doesnt fit
+    if (data)
+	memcpy(r->packet + offset, data, len);
+    uint16_t block;
+    for (block = offset / 8; block < (offset + len + 7) / 8; block++)
+	r->received[block / 8] |= 1 << (block % 8);
+    for (block = 0; block < (r->size + 7) / 8; block++)
+	if (!(r->received[block / 8] & (1 << (block % 8))))
+	    return false;
+    return true;
+}
+
+#endif
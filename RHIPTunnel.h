@@ -0,0 +1,285 @@
+// RHIPTunnel.h
+//
+// Carries IPv6 packets from a Linux TUN device across an RHMesh network
+//
+// Part of the RadioHead library
+
+#ifndef RHIPTunnel_h
+#define RHIPTunnel_h
+
+#include <RHMesh.h>
+
+// This can only build on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+// Largest IPv6 packet carried, and the MTU given to the TUN device. 1280 is the IPv6 minimum
+#ifndef RH_IP_TUNNEL_MTU
+#define RH_IP_TUNNEL_MTU 1280
+#endif
+
+// Max number of fragmented packets being reassembled at once
+#ifndef RH_IP_TUNNEL_REASSEMBLY_BUFFERS
+#define RH_IP_TUNNEL_REASSEMBLY_BUFFERS 4
+#endif
+
+// Time to wait for all the fragments of a packet, in milliseconds
+#ifndef RH_IP_TUNNEL_REASSEMBLY_TIMEOUT
+#define RH_IP_TUNNEL_REASSEMBLY_TIMEOUT 10000
+#endif
+
+// Dispatch values at the start of each message, as in RFC 4944 and RFC 6282
+#define RH_IP_TUNNEL_DISPATCH_IPV6  0x41 // Uncompressed IPv6 header
+#define RH_IP_TUNNEL_DISPATCH_IPHC  0x60 // Compressed IPv6 header, top 3 bits
+#define RH_IP_TUNNEL_DISPATCH_FRAG1 0xc0 // First fragment, top 5 bits
+#define RH_IP_TUNNEL_DISPATCH_FRAGN 0xe0 // Subsequent fragment, top 5 bits
+
+// Length of the fragment headers
+#define RH_IP_TUNNEL_FRAG1_LEN 4
+#define RH_IP_TUNNEL_FRAGN_LEN 5
+
+// Longest compressed IPv6 and UDP header
+#define RH_IP_TUNNEL_MAX_HEADER_LEN 48
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHIPTunnel RHIPTunnel.h <RHIPTunnel.h>
+/// \brief Carries IPv6 packets between a Linux TUN device and an RHMesh network
+///
+/// RHIPTunnel lets ordinary Linux programs (ping6, ssh, web servers etc) talk to each other across
+/// an RHMesh network. open() creates a TUN network interface, and poll() sends the IPv6 packets
+/// written to it across the mesh, and writes the packets received from the mesh to it.
+/// Only IPv6 is carried: IPv4 packets are dropped.
+///
+/// \par Addresses
+///
+/// Each node's IPv6 addresses come from its RHMesh address, like 6LoWPAN short addresses:
+/// the interface identifier is 0000:00ff:fe00:XXXX, where XXXX is the node address,
+/// after either the link local prefix fe80::/64 or the mesh prefix (fd00::/64 by default, see setPrefix()).
+/// open() assigns both to the TUN interface, so node 5 is fd00::ff:fe00:5.
+/// Packets for other addresses are sent to the gateway node, if there is one (see setGateway()).
+/// Multicast packets are broadcast to the neighbours if their scope is link local, and
+/// flooded across the whole mesh (see RHRouter::floodWait()) otherwise.
+///
+/// \par Header Compression and Fragmentation
+///
+/// A full IPv6 and UDP header is 48 octets, most of a radio message, so headers are
+/// compressed as in RFC 6282 (IPHC), without any context except the mesh prefix.
+/// Addresses derived from the RHMesh source and destination addresses are left out entirely,
+/// as are zero traffic classes and flow labels, common hop limits, the payload length, and the UDP length.
+/// A UDP packet between two mesh nodes can have as little as 6 octets of headers instead of 48.
+///
+/// Packets that are still too long for one RHMesh message are fragmented as in RFC 4944,
+/// and reassembled by the destination, which can have up to RH_IP_TUNNEL_REASSEMBLY_BUFFERS packets
+/// in progress at once. The MTU of the TUN interface is RH_IP_TUNNEL_MTU.
+///
+/// \par Usage
+///
+/// The program running the tunnel must be the only user of the RHMesh manager, and needs
+/// the CAP_NET_ADMIN capability (or to be run as root) to create the TUN interface.
+/// \code
+/// RH_TCP driver;
+/// RHMesh manager(driver, 5);
+/// RHIPTunnel tunnel(manager);
+/// manager.init();
+/// tunnel.open();
+/// while (1)
+///     tunnel.poll(10);
+/// \endcode
+/// See examples/simulator/simulator_ip_tunnel for a complete tunnel daemon.
+class RHIPTunnel
+{
+public:
+    /// Counts of what the tunnel has done
+    typedef struct
+    {
+	uint32_t txPackets;        ///< IP packets sent across the mesh
+	uint32_t rxPackets;        ///< IP packets received from the mesh
+	uint32_t txMessages;       ///< RHMesh messages sent, including fragments
+	uint32_t rxMessages;       ///< RHMesh messages received, including fragments
+	uint32_t dropped;          ///< Packets that could not be sent, or were not completely received
+	uint32_t headerOctetsSaved; ///< Octets saved by header compression in the packets sent
+    } Stats;
+
+    /// Constructor
+    /// \param[in] mesh The RHMesh manager to send and receive packets with
+    RHIPTunnel(RHMesh& mesh);
+
+    /// Creates the TUN network interface, and gives it its MTU and addresses, and brings it up.
+    /// Call this after the manager's init(), so that its address is known.
+    /// \param[in] name Name for the interface. A %d is replaced by the first free number
+    /// \return true if the interface was created
+    bool open(const char* name = "rhmesh%d");
+
+    /// Returns the name of the TUN interface created by open()
+    /// \return The interface name
+    const char* interfaceName();
+
+    /// Sets the mesh prefix, the first 64 bits of the IPv6 address of every node in the mesh.
+    /// Call it before open(). All the nodes must use the same prefix
+    /// \param[in] prefix 8 octets. The default is fd00::/64
+    void setPrefix(const uint8_t* prefix);
+
+    /// Sets the node that packets for addresses outside the mesh are sent to
+    /// \param[in] gateway The address of the gateway node, or RH_BROADCAST_ADDRESS (the default)
+    /// to drop those packets
+    void setGateway(RHAddress gateway);
+
+    /// Works out the IPv6 address of a mesh node, with the mesh prefix
+    /// \param[in] node The RHMesh address of the node
+    /// \param[out] address 16 octets for the IPv6 address
+    void addressOf(RHAddress node, uint8_t* address);
+
+    /// Works out which mesh node an IPv6 address belongs to
+    /// \param[in] address 16 octets of IPv6 address
+    /// \param[out] node The RHMesh address of the node
+    /// \return true if the address has the link local or mesh prefix, and a node's interface identifier
+    bool nodeOf(const uint8_t* address, RHAddress* node);
+
+    /// Moves packets between the TUN interface and the mesh. Call it frequently: it
+    /// also receives and forwards the mesh's routing messages.
+    /// \param[in] timeout Max time to wait for a message from the mesh, in milliseconds
+    /// \return true if a packet was sent or received
+    bool poll(uint16_t timeout);
+
+    /// Compresses an IPv6 packet's header, fragments it if necessary, and sends it across the mesh.
+    /// Called by poll() for each packet read from the TUN interface.
+    /// \param[in] packet The IPv6 packet
+    /// \param[in] len Length of the packet in octets
+    /// \return true if all of the packet was sent
+    bool sendPacket(const uint8_t* packet, uint16_t len);
+
+    /// Handles a message received from the mesh: decompresses its header, and if it is a fragment,
+    /// adds it to the packet being reassembled. Called by poll() for each message received.
+    /// \param[in] message The message
+    /// \param[in] len Length of the message in octets
+    /// \param[in] source RHMesh SOURCE address of the message
+    /// \param[in] dest RHMesh DEST address of the message
+    /// \param[out] packet Set to the complete IPv6 packet, if there is one
+    /// \param[out] packetLen Set to the length of the complete packet
+    /// \return true if a complete packet is ready
+    bool receiveMessage(const uint8_t* message, uint8_t len, RHAddress source, RHAddress dest, uint8_t** packet, uint16_t* packetLen);
+
+    /// Returns the counts of what the tunnel has done
+    /// \return Pointer to the counts
+    const Stats* stats();
+
+protected:
+    /// Compresses an IPv6 header, and a UDP header after it, as in RFC 6282
+    /// \param[in] packet The IPv6 packet
+    /// \param[in] len Length of the packet in octets, at least 40
+    /// \param[in] source The RHMesh SOURCE address the packet will be sent with
+    /// \param[in] dest The RHMesh DEST address the packet will be sent with
+    /// \param[out] buf At least RH_IP_TUNNEL_MAX_HEADER_LEN octets for the compressed header
+    /// \param[out] consumed Set to the length of the uncompressed headers that were compressed, 40 or 48
+    /// \return The length of the compressed header
+    uint8_t compressHeader(const uint8_t* packet, uint16_t len, RHAddress source, RHAddress dest, uint8_t* buf, uint8_t* consumed);
+
+    /// Decompresses a header compressed by compressHeader(), or an uncompressed IPv6 header after 
+    /// RH_IP_TUNNEL_DISPATCH_IPV6. The payload length, and the UDP length if the UDP header was compressed, 
+    /// are not set, see setLengths()
+    /// \param[in] buf The compressed header and whatever follows it
+    /// \param[in] len Length of buf in octets
+    /// \param[in] source The RHMesh SOURCE address the message came with
+    /// \param[in] dest The RHMesh DEST address the message came with
+    /// \param[out] packet At least 48 octets for the uncompressed headers
+    /// \param[out] headerLen Set to the length of the uncompressed headers, 40 or 48
+    /// \param[out] udp Set to true if the UDP header was compressed
+    /// \return The length of the compressed header, including its dispatch, or 0 if it could not be decompressed
+    uint8_t decompressHeader(const uint8_t* buf, uint8_t len, RHAddress source, RHAddress dest, uint8_t* packet, uint8_t* headerLen, bool* udp);
+
+    /// Sets the length fields left out of a compressed header
+    /// \param[in,out] packet The complete IPv6 packet
+    /// \param[in] len Length of the packet in octets
+    /// \param[in] udp true if the UDP header was compressed
+    void setLengths(uint8_t* packet, uint16_t len, bool udp);
+
+private:
+    /// A packet being reassembled from fragments
+    typedef struct
+    {
+	bool          inUse;                      ///< true if this buffer holds part of a packet
+	bool          udp;                        ///< true if the UDP header was compressed
+	RHAddress     source;                     ///< RHMesh SOURCE address of the fragments
+	uint16_t      tag;                        ///< Datagram tag of the fragments
+	uint16_t      size;                       ///< Size of the complete packet
+	unsigned long started;                    ///< millis() when the first fragment to arrive arrived
+	uint8_t       received[(RH_IP_TUNNEL_MTU + 63) / 64]; ///< Bitmap of the 8 octet blocks received
+	uint8_t       packet[RH_IP_TUNNEL_MTU];   ///< The packet
+    } Reassembly;
+
+    /// Compresses one address
+    /// \param[in] address 16 octets of IPv6 address
+    /// \param[in] node The RHMesh address the interface identifier might be derived from
+    /// \param[in,out] p Where to put any octets of the address that are carried inline, advanced past them
+    /// \return The SAC and SAM (or DAC and DAM) bits, SAC in bit 2
+    uint8_t       compressAddress(const uint8_t* address, RHAddress node, uint8_t** p);
+
+    /// Decompresses one address
+    /// \param[in] mode The SAC and SAM (or DAC and DAM) bits, SAC in bit 2
+    /// \param[in] node The RHMesh address the interface identifier might be derived from
+    /// \param[in,out] p The octets of the address that are carried inline, advanced past them
+    /// \param[in] end The end of the compressed header
+    /// \param[out] address 16 octets for the IPv6 address
+    /// \return false if the compressed header is too short
+    bool          decompressAddress(uint8_t mode, RHAddress node, const uint8_t** p, const uint8_t* end, uint8_t* address);
+
+    /// Sends a message across the mesh
+    /// \param[in] len Length of the message in _txBuf
+    /// \param[in] dest The destination node, or RH_BROADCAST_ADDRESS
+    /// \param[in] flood true to flood a broadcast across the mesh, rather than to the neighbours
+    /// \return true if it was sent
+    bool          sendMessage(uint8_t len, RHAddress dest, bool flood);
+
+    /// Finds the reassembly buffer for a fragmented packet, or starts one, reusing the oldest if need be
+    /// \param[in] source RHMesh SOURCE address of the fragment
+    /// \param[in] tag Datagram tag of the fragment
+    /// \param[in] size Size of the complete packet
+    /// \return pointer to the buffer
+    Reassembly*   findReassembly(RHAddress source, uint16_t tag, uint16_t size);
+
+    /// Adds a fragment's data to a packet being reassembled
+    /// \param[in] r The reassembly buffer
+    /// \param[in] offset Offset of the data in the packet
+    /// \param[in] data The data, already in place if NULL
+    /// \param[in] len Length of the data
+    /// \return true if the packet is complete
+    bool          addFragment(Reassembly* r, uint16_t offset, const uint8_t* data, uint16_t len);
+
+    /// The mesh manager
+    RHMesh&       _mesh;
+
+    /// File descriptor of the TUN device, or -1
+    int           _fd;
+
+    /// Name of the TUN interface
+    char          _name[16];
+
+    /// First 64 bits of the IPv6 addresses of the mesh nodes
+    uint8_t       _prefix[8];
+
+    /// Node that packets for outside the mesh are sent to, or RH_BROADCAST_ADDRESS
+    RHAddress     _gateway;
+
+    /// Datagram tag of the next fragmented packet
+    uint16_t      _nextTag;
+
+    /// Counts of what the tunnel has done
+    Stats         _stats;
+
+    /// Packet read from the TUN device
+    uint8_t       _txPacket[RH_IP_TUNNEL_MTU];
+
+    /// Unfragmented packet received from the mesh
+    uint8_t       _rxPacket[RH_IP_TUNNEL_MTU];
+
+    /// Message being sent
+    uint8_t       _txBuf[RH_MESH_MAX_MESSAGE_LEN];
+
+    /// Message being received
+    uint8_t       _rxBuf[RH_MESH_MAX_MESSAGE_LEN];
+
+    /// Packets being reassembled
+    Reassembly    _reassembly[RH_IP_TUNNEL_REASSEMBLY_BUFFERS];
+};
+
+#endif
+#endif
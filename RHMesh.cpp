@@ -13,13 +13,70 @@
 
 #include <RHMesh.h>
 
-uint8_t RHMesh::_tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
-
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress) 
+RHMesh::RHMesh(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHRouter(driver, thisAddress)
 {
+    _routeDiscoveryTimeout = RH_MESH_ARP_TIMEOUT;
+    _routeDiscoveryRetries = RH_MESH_ARP_RETRIES;
+    _nonBlockingRouteDiscovery = false;
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    memset(_pendingDiscoveries, 0, sizeof(_pendingDiscoveries));
+#endif
+    _lastRouteDiscoveryId = 0;
+    _nextDiscoveryCacheEntry = 0;
+    _numDiscoveryCacheEntries = 0;
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+    memset(_pendingRebroadcasts, 0, sizeof(_pendingRebroadcasts));
+#endif
+    _rebroadcastJitter = RH_MESH_REBROADCAST_JITTER;
+    _rebroadcastProbability = 100;
+    _rebroadcastSuppressionThreshold = 0;
+    _expandingRingStart = 0;
+    _cachedRouteReplyMaxAge = 0;
+    _sourceRouting = false;
+    memset(_sourceRoutes, 0, sizeof(_sourceRoutes));
+    _nextSourceRoute = 0;
+    _advertisementInterval = 0;
+    _advertisementSeq = 0;
+    memset(_advertisedSeqKnown, 0, sizeof(_advertisedSeqKnown));
+    memset(_advertised, 0, sizeof(_advertised));
+    memset(_advertisedBroken, 0, sizeof(_advertisedBroken));
+#ifdef RH_ROUTING_TABLE_HASHED
+    memset(_advertisedDest, 0, sizeof(_advertisedDest));
+#endif
+    _nextAdvertisedDest = 0;
+    _advertisementBudget = 0;
+    resetRouteDiscoveryStats();
+}
+
+////////////////////////////////////////////////////////////////////
+// Bitmaps of addresses, or advertisement slots
+static bool mapTest(const uint8_t* map, uint8_t address)
+{
+    return map[address >> 3] & (1 << (address & 7));
+}
+
+static void mapSet(uint8_t* map, uint8_t address)
+{
+    map[address >> 3] |= (1 << (address & 7));
+}
+
+static void mapClear(uint8_t* map, uint8_t address)
+{
+    map[address >> 3] &= ~(1 << (address & 7));
+}
+
+////////////////////////////////////////////////////////////////////
+// Random number 0 <= n < to
+static long randomTo(long to)
+{
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    return random() % to;
+#else
+    return random(0, to);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -28,93 +85,695 @@ RHMesh::RHMesh(RHGenericDriver& driver, uint8_t thisAddress)
 ////////////////////////////////////////////////////////////////////
 // Discovers a route to the destination (if necessary), sends and 
 // waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address, uint8_t flags)
+uint8_t RHMesh::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address, uint8_t flags)
 {
     if (len > RH_MESH_MAX_MESSAGE_LEN)
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
+    // Send anything that was waiting for a route first, so messages stay in order
+    checkRouteDiscoveries();
+
     if (address != RH_BROADCAST_ADDRESS)
     {
 	RoutingTableEntry* route = getRouteTo(address);
-	if (!route && !doArp(address))
-	    return RH_ROUTER_ERROR_NO_ROUTE;
+	if (!route)
+	{
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+	    if (_nonBlockingRouteDiscovery)
+		return queueForRouteDiscovery(buf, len, address, flags);
+#endif
+	    if (!doArp(address))
+		return RH_ROUTER_ERROR_NO_ROUTE;
+	}
     }
 
     // Now have a route. Contruct an application layer message and send it via that route
+    return sendApplicationMessage(buf, len, address, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::sendtoWait(RHPacketBuffer& packet, RHAddress address, uint8_t flags)
+{
+    if (packet.length() > RH_MESH_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    // Send anything that was waiting for a route first, so messages stay in order
+    checkRouteDiscoveries();
+
+    if (address != RH_BROADCAST_ADDRESS)
+    {
+	RoutingTableEntry* route = getRouteTo(address);
+	if (!route)
+	{
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+	    if (_nonBlockingRouteDiscovery)
+		return queueForRouteDiscovery(packet.data(), packet.length(), address, flags);
+#endif
+	    if (!doArp(address))
+		return RH_ROUTER_ERROR_NO_ROUTE;
+	}
+    }
+
+    // Now have a route. Put the application layer header in front of the message
+    MeshApplicationMessage* a = (MeshApplicationMessage*)packet.push(sizeof(MeshMessageHeader));
+    if (!a)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+    uint8_t headersLen = sizeof(MeshMessageHeader);
+
+    // and the path in front of that, if we have one and there is room
+    SourceRoute* r;
+    if (   _sourceRouting
+	&& address != RH_BROADCAST_ADDRESS
+	&& (r = findSourceRoute(address)))
+    {
+	uint8_t pathLen = r->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE;
+	uint8_t sourceRouteLen = RH_MESH_SOURCE_ROUTED_HEADER_LEN + pathLen * sizeof(RHAddress);
+	MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)packet.push(sourceRouteLen);
+	if (s)
+	{
+	    s->header.msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+	    s->pathLen = r->pathLen;
+	    s->hop = 0;
+	    memcpy(s->path, r->path, pathLen * sizeof(RHAddress));
+	    headersLen += sourceRouteLen;
+	}
+    }
+
+    uint8_t ret = RHRouter::sendtoWait(packet, address, flags);
+    packet.pull(headersLen);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::floodWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
+{
+    if (len > RH_MESH_MAX_MESSAGE_LEN)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
     MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
     a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
     memcpy(a->data, buf, len);
-    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, address, flags);
+    return RHRouter::floodWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, dest, flags);
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::doArp(uint8_t address)
+uint8_t RHMesh::sendApplicationMessage(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
 {
-    // Need to discover a route
+    SourceRoute* r;
+    if (   _sourceRouting
+	&& dest != RH_BROADCAST_ADDRESS
+	&& (r = findSourceRoute(dest))
+	&& RH_MESH_SOURCE_ROUTED_HEADER_LEN + (r->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE) * sizeof(RHAddress) + sizeof(MeshMessageHeader) + len <= sizeof(_tmpMessage))
+    {
+	// Encapsulate the application message after the path
+	MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)&_tmpMessage;
+	uint8_t pathLen = r->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE;
+	s->header.msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+	s->pathLen = r->pathLen;
+	s->hop = 0;
+	memcpy(s->path, r->path, pathLen * sizeof(RHAddress));
+	MeshApplicationMessage* a = (MeshApplicationMessage*)&s->path[pathLen];
+	a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+	memcpy(a->data, buf, len);
+	return RHRouter::sendtoWait(_tmpMessage, RH_MESH_SOURCE_ROUTED_HEADER_LEN + pathLen * sizeof(RHAddress) + sizeof(MeshMessageHeader) + len, dest, flags);
+    }
+
+    MeshApplicationMessage* a = (MeshApplicationMessage*)&_tmpMessage;
+    a->header.msgType = RH_MESH_MESSAGE_TYPE_APPLICATION;
+    memcpy(a->data, buf, len);
+    return RHRouter::sendtoWait(_tmpMessage, sizeof(RHMesh::MeshMessageHeader) + len, dest, flags);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRouteDiscoveryTimeout(uint16_t timeout)
+{
+    _routeDiscoveryTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRouteDiscoveryRetries(uint8_t retries)
+{
+    _routeDiscoveryRetries = retries;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setNonBlockingRouteDiscovery(bool nonBlocking)
+{
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    _nonBlockingRouteDiscovery = nonBlocking;
+    if (!nonBlocking)
+	memset(_pendingDiscoveries, 0, sizeof(_pendingDiscoveries));
+#else
+    (void)nonBlocking; // No queue to put the messages in
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::isDiscoveringRoute(RHAddress dest)
+{
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    return findRouteDiscovery(dest) != NULL;
+#else
+    (void)dest;
+    return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastJitter(uint16_t jitter)
+{
+    _rebroadcastJitter = jitter;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastProbability(uint8_t percent)
+{
+    _rebroadcastProbability = percent;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setRebroadcastSuppressionThreshold(uint8_t copies)
+{
+    _rebroadcastSuppressionThreshold = copies;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setExpandingRingSearch(uint8_t initialHops)
+{
+    _expandingRingStart = initialHops;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setProactiveRouting(unsigned long interval)
+{
+    _advertisementInterval = interval;
+    if (interval)
+    {
+	// Advertise straight away, with a full budget
+	_nextAdvertisement = millis();
+	_advertisementTokensTime = millis();
+	_advertisementTokens = (uint32_t)_advertisementBudget * interval / 1000;
+    }
+    else
+    {
+	memset(_advertised, 0, sizeof(_advertised));
+	memset(_advertisedBroken, 0, sizeof(_advertisedBroken));
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setProactiveRoutingBudget(uint16_t octetsPerSecond)
+{
+    _advertisementBudget = octetsPerSecond;
+    _advertisementTokensTime = millis();
+    _advertisementTokens = (uint32_t)octetsPerSecond * _advertisementInterval / 1000;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::checkProactiveRouting()
+{
+    if (!_advertisementInterval || (long)(millis() - _nextAdvertisement) < 0)
+	return;
+    unsigned long now = millis();
+    _nextAdvertisement = now + _advertisementInterval - randomTo(_advertisementInterval / 4 + 1);
+
+    // Top up the budget, keeping at most one interval's worth, but always enough to 
+    // save up for a full advertisement eventually
+    if (_advertisementBudget)
+    {
+	uint32_t max = (uint32_t)_advertisementBudget * _advertisementInterval / 1000;
+	if (max < maxMessageLength())
+	    max = maxMessageLength();
+	_advertisementTokens += (uint32_t)(now - _advertisementTokensTime) * _advertisementBudget / 1000;
+	if (_advertisementTokens > max)
+	    _advertisementTokens = max;
+    }
+    _advertisementTokensTime = now;
+
+    // Expire advertised routes that have not been refreshed, or have been deleted since, 
+    // and tell our neighbours they are broken
+    uint16_t i;
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
+    {
+	if (!mapTest(_advertised, i))
+	    continue;
+	RoutingTableEntry* route = findRouteTo(advertisedDest(i));
+	if (route && routeAge(route) <= _advertisementInterval * RH_MESH_ADVERTISED_ROUTE_LIFETIME)
+	    continue;
+	if (route)
+	    deleteRouteTo(advertisedDest(i));
+	mapClear(_advertised, i);
+	mapSet(_advertisedBroken, i);
+	_advertisedSeq[i] |= 1;
+    }
+
+    // Send as many advertisements as it takes to cover the whole table, or as the budget allows
+    _advertisementSeq += 2;
+    uint8_t maxRoutes = (maxMessageLength() - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader)) / sizeof(RouteAdvertisement);
+    if (maxRoutes > RH_MESH_MAX_MESSAGE_LEN / sizeof(RouteAdvertisement))
+	maxRoutes = RH_MESH_MAX_MESSAGE_LEN / sizeof(RouteAdvertisement);
+    MeshRouteAdvertisementMessage* a = (MeshRouteAdvertisementMessage*)&_tmpMessage;
+    uint16_t remaining = RH_ROUTING_TABLE_SLOTS;
+    do
+    {
+	uint8_t numRoutes = maxRoutes;
+	if (_advertisementBudget)
+	{
+	    uint32_t overhead = sizeof(RoutedMessageHeader) + sizeof(MeshMessageHeader);
+	    if (_advertisementTokens < overhead + sizeof(RouteAdvertisement))
+		return; // Out of budget. Carry on from here next time
+	    if ((_advertisementTokens - overhead) / sizeof(RouteAdvertisement) < numRoutes)
+		numRoutes = (_advertisementTokens - overhead) / sizeof(RouteAdvertisement);
+	}
+
+	// We always come first
+	a->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT;
+	a->routes[0].dest = _thisAddress;
+	a->routes[0].seq = _advertisementSeq;
+	a->routes[0].cost = 0;
+	uint8_t n = 1;
+	while (remaining && n < numRoutes)
+	{
+	    uint8_t slot = _nextAdvertisedDest;
+	    _nextAdvertisedDest = (_nextAdvertisedDest + 1) & (RH_ROUTING_TABLE_SLOTS - 1);
+	    remaining--;
+	    RoutingTableEntry* route;
+	    if (mapTest(_advertised, slot) && (route = findRouteTo(advertisedDest(slot))))
+	    {
+		a->routes[n].dest = advertisedDest(slot);
+		a->routes[n].seq = _advertisedSeq[slot];
+		a->routes[n++].cost = route->cost;
+	    }
+	    else if (mapTest(_advertisedBroken, slot))
+	    {
+		// Only need to tell them once
+		mapClear(_advertisedBroken, slot);
+		a->routes[n].dest = advertisedDest(slot);
+		a->routes[n].seq = _advertisedSeq[slot];
+		a->routes[n++].cost = RH_ROUTER_MAX_COST;
+	    }
+	}
+
+	uint8_t len = sizeof(MeshMessageHeader) + n * sizeof(RouteAdvertisement);
+	_routeDiscoveryStats.advertisementsSent++;
+	_routeDiscoveryStats.advertisementOctetsSent += sizeof(RoutedMessageHeader) + len;
+	if (_advertisementBudget)
+	    _advertisementTokens -= sizeof(RoutedMessageHeader) + len;
+	RHRouter::sendtoWait((uint8_t*)a, len, RH_BROADCAST_ADDRESS);
+    } while (remaining);
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::handleRouteAdvertisement(MeshRouteAdvertisementMessage* a, uint8_t messageLen)
+{
+    RHAddress from = previousHop();
+    uint8_t interface = previousInterface();
+    uint8_t link = linkCost(from, interface);
+    uint8_t numRoutes = (messageLen - sizeof(MeshMessageHeader)) / sizeof(RouteAdvertisement);
+    uint8_t i;
+    for (i = 0; i < numRoutes; i++)
+    {
+	RouteAdvertisement* r = &a->routes[i];
+	RHAddress dest = r->dest;
+	uint8_t seq = r->seq;
+	uint8_t slot;
+	if (dest == _thisAddress)
+	{
+	    // Our neighbours remember our sequence number from before we restarted. Carry on from there
+	    if ((int8_t)(seq - _advertisementSeq) > 0)
+		_advertisementSeq = seq & ~1;
+	    continue;
+	}
+	if (dest == RH_BROADCAST_ADDRESS || !advertisedSlot(dest, &slot))
+	    continue;
+	int8_t diff = seq - _advertisedSeq[slot];
+	bool newer = !mapTest(_advertisedSeqKnown, slot) || diff > 0;
+	if (   !newer
+	    && dest == from
+	    && diff < 0
+	    && !(seq & 1)
+	    && r->cost != RH_ROUTER_MAX_COST)
+	{
+	    // The neighbour has restarted, and its sequence numbers with it, so everyone would ignore it
+	    // until they caught up. It is the authority on its own route: take it with the next sequence 
+	    // number after the one we know. The neighbour hears that from us and carries on from it
+	    seq = (_advertisedSeq[slot] | 1) + 1;
+	    newer = true;
+	}
+	RoutingTableEntry* route = findRouteTo(dest);
+
+	if ((seq & 1) || r->cost == RH_ROUTER_MAX_COST)
+	{
+	    // Broken. If we route that way, so are we
+	    if (!newer)
+		continue;
+	    _advertisedSeq[slot] = seq | 1;
+	    mapSet(_advertisedSeqKnown, slot);
+	    if (route && route->next_hop == from && mapTest(_advertised, slot))
+	    {
+		deleteRouteTo(dest);
+		mapClear(_advertised, slot);
+		mapSet(_advertisedBroken, slot);
+	    }
+	    continue;
+	}
+
+	uint8_t cost = addCost(r->cost, link);
+	if (newer)
+	{
+	    // Dont switch to a more expensive path just because its advertisement arrived first. 
+	    // Our current next hop's advertisement with the new sequence number is probably on its way
+	    if (   route 
+		&& mapTest(_advertised, slot)
+		&& route->next_hop != from
+		&& routeAge(route) < _advertisementInterval + _advertisementInterval / 2
+		&& addCost(route->cost, _routeHysteresis) < cost)
+		continue;
+	    addRouteTo(dest, from, Valid, cost, interface);
+	    _advertisedSeq[slot] = seq;
+	    mapSet(_advertisedSeqKnown, slot);
+	    mapSet(_advertised, slot);
+	    mapClear(_advertisedBroken, slot);
+	}
+	else if (diff == 0 && mapTest(_advertised, slot))
+	{
+	    // Same news, maybe by a cheaper path
+	    updateRouteTo(dest, from, cost, 0, interface);
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::advertisedSlot(RHAddress dest, uint8_t* slot)
+{
+#ifdef RH_ROUTING_TABLE_HASHED
+    uint8_t s = RH_ADDRESS_HASH(dest) & (RH_ROUTING_TABLE_SLOTS - 1);
+    if (_advertisedDest[s] != dest)
+    {
+	if (mapTest(_advertised, s) || mapTest(_advertisedBroken, s))
+	    return false; // Still in use
+	// Take it over
+	_advertisedDest[s] = dest;
+	mapClear(_advertisedSeqKnown, s);
+    }
+    *slot = s;
+#else
+    *slot = dest;
+#endif
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+RHAddress RHMesh::advertisedDest(uint8_t slot)
+{
+#ifdef RH_ROUTING_TABLE_HASHED
+    return _advertisedDest[slot];
+#else
+    return slot;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setSourceRouting(bool sourceRouting)
+{
+    _sourceRouting = sourceRouting;
+    if (!sourceRouting)
+	memset(_sourceRoutes, 0, sizeof(_sourceRoutes));
+}
+
+////////////////////////////////////////////////////////////////////
+RHMesh::SourceRoute* RHMesh::findSourceRoute(RHAddress dest)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_SOURCE_ROUTE_CACHE_SIZE; i++)
+	if (_sourceRoutes[i].valid && _sourceRoutes[i].dest == dest)
+	    return &_sourceRoutes[i];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::cacheSourceRoute(MeshRouteDiscoveryMessage* d, uint8_t numRoutes)
+{
+    SourceRoute* r = findSourceRoute(d->dest);
+    if (numRoutes > RH_MESH_MAX_SOURCE_ROUTE_LEN)
+    {
+	// Too long to source route. Forget any older path, and route hop by hop
+	if (r)
+	    r->valid = false;
+	return;
+    }
+    if (!r)
+    {
+	r = &_sourceRoutes[_nextSourceRoute];
+	_nextSourceRoute = (_nextSourceRoute + 1) % RH_MESH_SOURCE_ROUTE_CACHE_SIZE;
+    }
+    // The reply lists the relays from here to the destination. If it came from a cached route,
+    // it ends with the node that replied, which will have to route the rest of the way
+    r->valid = true;
+    r->dest = d->dest;
+    r->pathLen = numRoutes | (d->age ? RH_MESH_SOURCE_ROUTE_LOOSE : 0);
+    memcpy(r->path, d->route, numRoutes * sizeof(RHAddress));
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::setCachedRouteReplies(unsigned long maxAge)
+{
+    _cachedRouteReplyMaxAge = maxAge;
+}
+
+////////////////////////////////////////////////////////////////////
+const RHMesh::RouteDiscoveryStats* RHMesh::routeDiscoveryStats()
+{
+    return &_routeDiscoveryStats;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::resetRouteDiscoveryStats()
+{
+    memset(&_routeDiscoveryStats, 0, sizeof(_routeDiscoveryStats));
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::sendRouteDiscoveryRequest(RHAddress address, uint8_t attempt)
+{
+    // With expanding ring search, the hop limit doubles with each attempt, 
+    // and the last attempt searches the whole network
+    uint8_t hopLimit = _max_hops;
+    if (_expandingRingStart && attempt < _routeDiscoveryRetries)
+    {
+	uint16_t limit = _expandingRingStart;
+	while (attempt-- && limit < _max_hops)
+	    limit <<= 1;
+	if (limit < hopLimit)
+	    hopLimit = limit;
+    }
+
     // Broadcast a route discovery message with nothing in it
     MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
     p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST;
-    p->destlen = 1; 
+    p->destlen = sizeof(RHAddress);
     p->dest = address; // Who we are looking for
-    uint8_t error = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 2, RH_BROADCAST_ADDRESS);
-    if (error !=  RH_ROUTER_ERROR_NONE)
-	return false;
-    
-    // Wait for a reply, which will be unicast back to us
-    // It will contain the complete route to the destination
-    uint8_t messageLen = sizeof(_tmpMessage);
-    // FIXME: timeout should be configurable
-    unsigned long starttime = millis();
-    int32_t timeLeft;
-    while ((timeLeft = RH_MESH_ARP_TIMEOUT - (millis() - starttime)) > 0)
+    p->cost = 0;
+    p->id = ++_lastRouteDiscoveryId;
+    p->hopLimit = hopLimit;
+    p->age = 0;
+    _routeDiscoveryStats.requestsSent++;
+    _routeDiscoveryStats.octetsSent += sizeof(RoutedMessageHeader) + RH_MESH_ROUTE_DISCOVERY_HEADER_LEN;
+    return RHRouter::sendtoWait((uint8_t*)p, RH_MESH_ROUTE_DISCOVERY_HEADER_LEN, RH_BROADCAST_ADDRESS) == RH_ROUTER_ERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::doArp(RHAddress address)
+{
+    // Need to discover a route
+    uint8_t attempt;
+    for (attempt = 0; attempt <= _routeDiscoveryRetries; attempt++)
     {
-	if (waitAvailableTimeout(timeLeft))
+	if (!sendRouteDiscoveryRequest(address, attempt))
+	    return false;
+    
+	// Wait for a reply, which will be unicast back to us
+	// It will contain the complete route to the destination
+	MeshRouteDiscoveryMessage* p = (MeshRouteDiscoveryMessage*)&_tmpMessage;
+	unsigned long timeout = (unsigned long)_routeDiscoveryTimeout << attempt;
+	unsigned long starttime = millis();
+	int32_t timeLeft;
+	while ((timeLeft = timeout - (millis() - starttime)) > 0)
 	{
-	    if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
+	    if (waitAvailableTimeout(timeLeft))
 	    {
-		if (   messageLen > 1
-		       && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+		uint8_t messageLen = sizeof(_tmpMessage);
+		if (RHRouter::recvfromAck(_tmpMessage, &messageLen))
 		{
-		    // Got a reply, now add the next hop to the dest to the routing table
-		    // The first hop taken is the first octet
-		    addRouteTo(address, headerFrom());
-		    return true;
+		    if (   messageLen > 1
+			   && p->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+			   && p->dest == address)
+		    {
+			// Got a reply. peekAtMessage() has already added the next hop to the dest 
+			// to the routing table. Any later replies over cheaper paths will replace it
+			return true;
+		    }
 		}
 	    }
+	    YIELD;
 	}
-	YIELD;
     }
     return false;
 }
 
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+////////////////////////////////////////////////////////////////////
+RHMesh::PendingDiscovery* RHMesh::findRouteDiscovery(RHAddress dest)
+{
+    uint8_t i;
+    for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+	if (_pendingDiscoveries[i].attempts && _pendingDiscoveries[i].dest == dest)
+	    return &_pendingDiscoveries[i];
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::queueForRouteDiscovery(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
+{
+    PendingDiscovery* d = findRouteDiscovery(dest);
+    if (!d)
+    {
+	// Start a new route discovery, if there is room
+	uint8_t i;
+	for (i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+	    if (!_pendingDiscoveries[i].attempts)
+		break;
+	if (i >= RH_MESH_MAX_PENDING_DISCOVERIES)
+	    return RH_ROUTER_ERROR_QUEUE_FULL;
+	d = &_pendingDiscoveries[i];
+	d->dest = dest;
+	d->numMessages = 0;
+	d->attempts = 1;
+	d->deadline = millis() + _routeDiscoveryTimeout;
+	// If this fails, it will be retried when it times out
+	sendRouteDiscoveryRequest(dest, 0);
+    }
+    if (d->numMessages >= RH_MESH_MAX_PENDING_PER_DEST)
+	return RH_ROUTER_ERROR_QUEUE_FULL;
+
+    PendingMessage* m = &d->messages[d->numMessages++];
+    m->len = len;
+    m->flags = flags;
+    memcpy(m->data, buf, len);
+    return RH_ROUTER_ERROR_QUEUED;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::checkRouteDiscoveries()
+{
+    checkProactiveRouting();
+
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+    {
+	PendingRebroadcast* r = &_pendingRebroadcasts[i];
+	if (r->len && (long)(millis() - r->deadline) >= 0)
+	{
+	    uint8_t len = r->len;
+	    r->len = 0;
+	    rebroadcastRouteDiscoveryRequest(r->message, len, r->source);
+	}
+    }
+#endif
+
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+    {
+	PendingDiscovery* d = &_pendingDiscoveries[i];
+	if (!d->attempts)
+	    continue;
+
+	if (getRouteTo(d->dest))
+	{
+	    // Route has been discovered. Send everything that was waiting for it, in order.
+	    // If one fails, the route has been deleted and the rest will fail too
+	    uint8_t j;
+	    for (j = 0; j < d->numMessages; j++)
+		sendApplicationMessage(d->messages[j].data, d->messages[j].len, d->dest, d->messages[j].flags);
+	    d->attempts = 0;
+	}
+	else if ((long)(millis() - d->deadline) >= 0)
+	{
+	    if (d->attempts > _routeDiscoveryRetries)
+	    {
+		// Give up, and discard the messages
+		d->attempts = 0;
+		continue;
+	    }
+	    // Retry, waiting twice as long
+	    d->deadline = millis() + ((unsigned long)_routeDiscoveryTimeout << d->attempts);
+	    sendRouteDiscoveryRequest(d->dest, d->attempts++);
+	}
+    }
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////
 // Called by RHRouter::recvfromAck whenever a message goes past
 void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 {
     MeshMessageHeader* m = (MeshMessageHeader*)message->data;
-    if (   messageLen > 1 
+    if (message->header.flags & RH_ROUTER_FLAGS_ACK_ONLY)
+    {
+	// End-to-end ACKs for RHRouter, there is no RHMesh message
+    }
+    else if (   messageLen > 1 
 	&& m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
     {
 	// This is a unicast RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE messages 
 	// being routed back to the originator here. Want to scrape some routing data out of the response
 	// We can find the routes to all the nodes between here and the responding node
+	// The cost carried is the cost of the path from here to the responding node
+	// If the reply came from a cached route, our route inherits its age
 	MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)message->data;
-	addRouteTo(d->dest, headerFrom());
-	uint8_t numRoutes = messageLen - sizeof(RoutedMessageHeader) - sizeof(MeshMessageHeader) - 2;
+	d->cost = addCost(d->cost, linkCost(previousHop(), previousInterface()));
+	bool installed = updateRouteTo(d->dest, previousHop(), d->cost, d->age * 1000UL, previousInterface());
+	uint8_t numRoutes = (messageLen - sizeof(RoutedMessageHeader) - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN) / sizeof(RHAddress);
 	uint8_t i;
 	// Find us in the list of nodes that were traversed to get to the responding node
 	for (i = 0; i < numRoutes; i++)
 	    if (d->route[i] == _thisAddress)
 		break;
-	i++;
-	while (i++ < numRoutes)
-	    addRouteTo(d->route[i], headerFrom());
+	// Add routes to the nodes after us, or all of them if we are the originator
+	uint8_t j;
+	for (j = (i < numRoutes) ? i + 1 : 0; j < numRoutes; j++)
+	    updateRouteTo(d->route[j], previousHop(), d->cost, 0, previousInterface());
+
+	// The originator keeps the whole path for source routing, if it is the one we now route by
+	if (_sourceRouting && installed && message->header.dest == _thisAddress)
+	    cacheSourceRoute(d, numRoutes);
     }
     else if (   messageLen > 1 
 	     && m->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
     {
 	MeshRouteFailureMessage* d = (MeshRouteFailureMessage*)message->data;
 	deleteRouteTo(d->dest);
+	SourceRoute* r = findSourceRoute(d->dest);
+	if (r)
+	    r->valid = false;
+    }
+    else if (   messageLen >= sizeof(RoutedMessageHeader) + RH_MESH_SOURCE_ROUTED_HEADER_LEN
+	     && m->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+    {
+	// Look inside for route failures being returned along the reverse path
+	MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)message->data;
+	uint8_t offset = RH_MESH_SOURCE_ROUTED_HEADER_LEN + (s->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE) * sizeof(RHAddress);
+	MeshRouteFailureMessage* f = (MeshRouteFailureMessage*)&message->data[offset];
+	if (   messageLen >= sizeof(RoutedMessageHeader) + offset + sizeof(MeshRouteFailureMessage)
+	    && f->header.msgType == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE)
+	{
+	    deleteRouteTo(f->dest);
+	    SourceRoute* r = findSourceRoute(f->dest);
+	    if (r)
+		r->valid = false;
+	}
     }
 }
 
@@ -122,7 +781,14 @@ void RHMesh::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 // This is called when a message is to be delivered to the next hop
 uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 {
-    uint8_t from = headerFrom(); // Might get clobbered during call to superclass route()
+    MeshMessageHeader* m = (MeshMessageHeader*)message->data;
+    if (   messageLen >= sizeof(RoutedMessageHeader) + RH_MESH_SOURCE_ROUTED_HEADER_LEN
+	&& !(message->header.flags & RH_ROUTER_FLAGS_ACK_ONLY)
+	&& m->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+	return routeSourceRouted(message, messageLen);
+
+    RHAddress from = previousHop(); // Might change during call to superclass route()
+    uint8_t interface = previousInterface();
     uint8_t ret = RHRouter::route(message, messageLen);
     if (   ret == RH_ROUTER_ERROR_NO_ROUTE
 	|| ret == RH_ROUTER_ERROR_UNABLE_TO_DELIVER)
@@ -136,33 +802,106 @@ uint8_t RHMesh::route(RoutedMessage* message, uint8_t messageLen)
 	    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
 	    p->dest = message->header.dest; // Who you were trying to deliver to
 	    // Make sure there is a route back towards whoever sent the original message
-	    addRouteTo(message->header.source, from);
-	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(RHMesh::MeshMessageHeader) + 1, message->header.source);
+	    addRouteTo(message->header.source, from, Valid, 0, interface);
+	    ret = RHRouter::sendtoWait((uint8_t*)p, sizeof(MeshRouteFailureMessage), message->header.source);
 	}
     }
     return ret;
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHMesh::routeSourceRouted(RoutedMessage* message, uint8_t messageLen)
+{
+    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)message->data;
+    uint8_t pathLen = s->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE;
+    uint8_t hop = s->hop; // Index of the relay after us
+    if (messageLen < sizeof(RoutedMessageHeader) + RH_MESH_SOURCE_ROUTED_HEADER_LEN + pathLen * sizeof(RHAddress) || hop > pathLen)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    uint8_t ret;
+    if (hop < pathLen)
+    {
+	// Straight to the next relay in the path, no need to look it up
+	s->hop++;
+	ret = sendToNextHop(message, messageLen, s->path[hop]);
+    }
+    else if (s->pathLen & RH_MESH_SOURCE_ROUTE_LOOSE)
+    {
+	// End of a loose source route, we have to find the rest of the way ourselves
+	ret = RHRouter::route(message, messageLen);
+	if (ret != RH_ROUTER_ERROR_NONE)
+	    deleteRouteTo(message->header.dest);
+    }
+    else
+    {
+	// The destination is our neighbour
+	ret = sendToNextHop(message, messageLen, message->header.dest);
+    }
+
+    if (ret == RH_ROUTER_ERROR_NONE)
+	return ret;
+
+    if (message->header.source == _thisAddress)
+    {
+	// Our own message. Forget the path, and discover a new one next time
+	SourceRoute* r = findSourceRoute(message->header.dest);
+	if (r)
+	    r->valid = false;
+	deleteRouteTo(message->header.dest);
+	return ret;
+    }
+
+    // Tell the originator, by sending a route failure back along the path to us, reversed. 
+    // We are path[hop - 1], and the source is before path[0]
+    if (hop > 0)
+	hop--;
+    MeshSourceRoutedMessage* f = (MeshSourceRoutedMessage*)&_tmpMessage;
+    f->header.msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED;
+    f->pathLen = hop;
+    f->hop = 0;
+    uint8_t i;
+    for (i = 0; i < hop; i++)
+	f->path[i] = s->path[hop - 1 - i];
+    MeshRouteFailureMessage* p = (MeshRouteFailureMessage*)&f->path[hop];
+    p->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE;
+    p->dest = message->header.dest; // Who you were trying to deliver to
+    return RHRouter::sendtoWait((uint8_t*)f, RH_MESH_SOURCE_ROUTED_HEADER_LEN + hop * sizeof(RHAddress) + sizeof(MeshRouteFailureMessage), message->header.source);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Subclasses may want to override
 bool RHMesh::isPhysicalAddress(uint8_t* address, uint8_t addresslen)
 {
-    // Can only handle physical addresses 1 octet long, which is the physical node address
-    return addresslen == 1 && address[0] == _thisAddress;
+    // Can only handle physical addresses sizeof(RHAddress) octets long, which is the physical node address
+    return addresslen == sizeof(RHAddress) && RH_ADDRESS_GET(address) == _thisAddress;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {     
+    checkRouteDiscoveries();
+
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _source;
-    uint8_t _dest;
+    RHAddress _source;
+    RHAddress _dest;
     uint8_t _id;
     uint8_t _flags;
     if (RHRouter::recvfromAck(_tmpMessage, &tmpMessageLen, &_source, &_dest, &_id, &_flags))
     {
 	MeshMessageHeader* p = (MeshMessageHeader*)&_tmpMessage;
 
+	if (   tmpMessageLen >= RH_MESH_SOURCE_ROUTED_HEADER_LEN
+	    && p->msgType == RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED)
+	{
+	    // Source routed to us. Strip the path and handle what is inside
+	    MeshSourceRoutedMessage* s = (MeshSourceRoutedMessage*)p;
+	    uint8_t offset = RH_MESH_SOURCE_ROUTED_HEADER_LEN + (s->pathLen & ~RH_MESH_SOURCE_ROUTE_LOOSE) * sizeof(RHAddress);
+	    if (tmpMessageLen <= offset)
+		return false;
+	    p = (MeshMessageHeader*)&_tmpMessage[offset];
+	    tmpMessageLen -= offset;
+	}
+
 	if (   tmpMessageLen >= 1 
 	    && p->msgType == RH_MESH_MESSAGE_TYPE_APPLICATION)
 	{
@@ -180,62 +919,258 @@ bool RHMesh::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* d
 	    return true;
 	}
 	else if (   _dest == RH_BROADCAST_ADDRESS 
-		 && tmpMessageLen > 1 
+		 && tmpMessageLen >= RH_MESH_ROUTE_DISCOVERY_HEADER_LEN 
 		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST)
 	{
-	    MeshRouteDiscoveryMessage* d = (MeshRouteDiscoveryMessage*)p;
 	    // Handle Route discovery requests
-	    // Message is an array of node addresses the route request has already passed through
-	    // If it originally came from us, ignore it
-	    if (_source == _thisAddress)
-		return false;
+	    handleRouteDiscoveryRequest((MeshRouteDiscoveryMessage*)p, tmpMessageLen, _source);
+	}
+	else if (   _dest == RH_BROADCAST_ADDRESS
+		 && _advertisementInterval
+		 && tmpMessageLen >= sizeof(MeshMessageHeader) + sizeof(RouteAdvertisement)
+		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT)
+	{
+	    handleRouteAdvertisement((MeshRouteAdvertisementMessage*)p, tmpMessageLen);
+	}
+	else if (   _dest == _thisAddress
+		 && tmpMessageLen > 1 
+		 && p->msgType == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE)
+	{
+	    // peekAtMessage() has added the discovered route. 
+	    // Send anything that was waiting for it straight away
+	    checkRouteDiscoveries();
+	}
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::handleRouteDiscoveryRequest(MeshRouteDiscoveryMessage* d, uint8_t messageLen, RHAddress source)
+{
+    // Message is an array of node addresses the route request has already passed through
+    // If it originally came from us, ignore it
+    if (source == _thisAddress)
+	return;
 	    
-	    uint8_t numRoutes = tmpMessageLen - sizeof(MeshMessageHeader) - 2;
-	    uint8_t i;
-	    // Are we already mentioned?
-	    for (i = 0; i < numRoutes; i++)
-		if (d->route[i] == _thisAddress)
-		    return false; // Already been through us. Discard
+    uint8_t numRoutes = (messageLen - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN) / sizeof(RHAddress);
+    uint8_t i;
+    // Are we already mentioned?
+    for (i = 0; i < numRoutes; i++)
+	if (d->route[i] == _thisAddress)
+	    return; // Already been through us. Discard
 	    
-	    // Hasnt been past us yet, record routes back to the earlier nodes
-	    addRouteTo(_source, headerFrom()); // The originator
-	    for (i = 0; i < numRoutes; i++)
-		addRouteTo(d->route[i], headerFrom());
-	    if (isPhysicalAddress(&d->dest, d->destlen))
+    // Hasnt been past us yet, record routes back to the earlier nodes
+    // The cost carried is now the cost of the path from here back to the originator
+    d->cost = addCost(d->cost, linkCost(previousHop(), previousInterface()));
+    bool improved = updateRouteTo(source, previousHop(), d->cost, 0, previousInterface()); // The originator
+    for (i = 0; i < numRoutes; i++)
+	updateRouteTo(d->route[i], previousHop(), d->cost, 0, previousInterface());
+
+    // Have we seen this request before, maybe from another neighbour?
+    DiscoveryCacheEntry* c = NULL;
+    for (i = 0; i < _numDiscoveryCacheEntries; i++)
+	if (_discoveryCache[i].source == source && _discoveryCache[i].id == d->id)
+	    c = &_discoveryCache[i];
+    bool duplicate = c != NULL;
+    if (!duplicate)
+    {
+	c = &_discoveryCache[_nextDiscoveryCacheEntry];
+	_nextDiscoveryCacheEntry = (_nextDiscoveryCacheEntry + 1) % RH_MESH_DISCOVERY_CACHE_SIZE;
+	if (_numDiscoveryCacheEntries < RH_MESH_DISCOVERY_CACHE_SIZE)
+	    _numDiscoveryCacheEntries++;
+	c->source = source;
+	c->id = d->id;
+	c->bestCost = d->cost;
+	c->hops = numRoutes;
+    }
+    else if (numRoutes < c->hops && !isPhysicalAddress((uint8_t*)&d->dest, d->destlen))
+    {
+	// This copy came by a shorter path than the one we forwarded, and can travel further
+	// within its hop limit, so forward it too
+	c->hops = numRoutes;
+	duplicate = false;
+    }
+
+    if (isPhysicalAddress((uint8_t*)&d->dest, d->destlen))
+    {
+	// This route discovery is for us. Reply to the first copy, and to any later copies 
+	// that came over a cheaper path, which we now route back over
+	if (duplicate && !(improved && d->cost < c->bestCost))
+	    return;
+	c->bestCost = d->cost;
+
+	// Unicast the whole route back to the originator
+	// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+	// We are certain to have a route there, because we just got it
+	// The reply accumulates the cost of the path back from us
+	d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
+	d->cost = 0;
+	d->age = 0;
+	_routeDiscoveryStats.repliesSent++;
+	_routeDiscoveryStats.octetsSent += sizeof(RoutedMessageHeader) + messageLen;
+	RHRouter::sendtoWait((uint8_t*)d, messageLen, source);
+    }
+    else if (duplicate)
+    {
+	// Already rebroadcast, or waiting to be. Count it towards suppressing a waiting rebroadcast
+	_routeDiscoveryStats.duplicatesDropped++;
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+	for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+	{
+	    PendingRebroadcast* r = &_pendingRebroadcasts[i];
+	    if (   r->len
+		&& r->source == source 
+		&& ((MeshRouteDiscoveryMessage*)r->message)->id == d->id
+		&& ++r->copies >= _rebroadcastSuppressionThreshold
+		&& _rebroadcastSuppressionThreshold)
 	    {
-		// This route discovery is for us. Unicast the whole route back to the originator
-		// as a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
-		// We are certain to have a route there, because we just got it
-		d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
-		RHRouter::sendtoWait((uint8_t*)d, tmpMessageLen, _source);
+		r->len = 0;
+		_routeDiscoveryStats.rebroadcastsSuppressed++;
 	    }
-	    else if (i < _max_hops)
+	}
+#endif
+    }
+    else if (replyFromCachedRoute(d, messageLen, source))
+    {
+	// Answered on behalf of the destination, so no need to go any further
+    }
+    else if (   numRoutes < _max_hops 
+	     && numRoutes + 1 < d->hopLimit
+	     && messageLen + sizeof(RHAddress) <= sizeof(_tmpMessage))
+    {
+	if (_rebroadcastProbability < 100 && randomTo(100) >= _rebroadcastProbability)
+	{
+	    _routeDiscoveryStats.rebroadcastsSuppressed++;
+	    return;
+	}
+
+	// Its for someone else, rebroadcast it, after adding ourselves to the list
+	d->route[numRoutes] = _thisAddress;
+	messageLen += sizeof(RHAddress);
+
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+	if (_rebroadcastJitter)
+	{
+	    // Wait a random time first, if there is room
+	    for (i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
 	    {
-		// Its for someone else, rebroadcast it, after adding ourselves to the list
-		d->route[numRoutes] = _thisAddress;
-		tmpMessageLen++;
-		// Have to impersonate the source
-		// REVISIT: if this fails what can we do?
-		RHRouter::sendtoFromSourceWait(_tmpMessage, tmpMessageLen, RH_BROADCAST_ADDRESS, _source);
+		PendingRebroadcast* r = &_pendingRebroadcasts[i];
+		if (!r->len)
+		{
+		    r->len = messageLen;
+		    r->source = source;
+		    r->copies = 1;
+		    r->deadline = millis() + randomTo(_rebroadcastJitter + 1);
+		    memcpy(r->message, d, messageLen);
+		    return;
+		}
 	    }
 	}
+#endif
+	rebroadcastRouteDiscoveryRequest((uint8_t*)d, messageLen, source);
     }
-    return false;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHMesh::replyFromCachedRoute(MeshRouteDiscoveryMessage* d, uint8_t messageLen, RHAddress source)
+{
+    if (!_cachedRouteReplyMaxAge || d->destlen != sizeof(RHAddress) || messageLen + sizeof(RHAddress) > sizeof(_tmpMessage))
+	return false;
+
+    RoutingTableEntry* route = getRouteTo(d->dest);
+    if (!route || route->state != Valid)
+	return false;
+    unsigned long age = routeAge(route);
+    if (age > _cachedRouteReplyMaxAge)
+	return false; // Too stale to pass on
+
+    // Dont reply with a route that goes back the way the request came
+    uint8_t numRoutes = (messageLen - RH_MESH_ROUTE_DISCOVERY_HEADER_LEN) / sizeof(RHAddress);
+    uint8_t i;
+    if (route->next_hop == previousHop() || route->next_hop == source)
+	return false;
+    for (i = 0; i < numRoutes; i++)
+	if (d->route[i] == route->next_hop)
+	    return false;
+
+    // Reply with the route so far plus us. 
+    // Nodes on the way back will route to the destination via us
+    d->route[numRoutes] = _thisAddress;
+    messageLen += sizeof(RHAddress);
+    d->header.msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE;
+    d->cost = route->cost;
+    // Round the age up, and saturate. Never 0, which is reserved for replies from the destination
+    age = (age + 999) / 1000;
+    d->age = age > 255 ? 255 : (age ? age : 1);
+    _routeDiscoveryStats.cachedRepliesSent++;
+    _routeDiscoveryStats.octetsSent += sizeof(RoutedMessageHeader) + messageLen;
+    RHRouter::sendtoWait((uint8_t*)d, messageLen, source);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHMesh::rebroadcastRouteDiscoveryRequest(uint8_t* message, uint8_t messageLen, RHAddress source)
+{
+    _routeDiscoveryStats.requestsForwarded++;
+    _routeDiscoveryStats.octetsSent += sizeof(RoutedMessageHeader) + messageLen;
+    // Have to impersonate the source
+    // REVISIT: if this fails what can we do?
+    RHRouter::sendtoFromSourceWait(message, messageLen, RH_BROADCAST_ADDRESS, source);
+}
+
+////////////////////////////////////////////////////////////////////
+int32_t RHMesh::routeDiscoveryTimeLeft(int32_t timeLeft)
+{
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING_DISCOVERIES; i++)
+    {
+	if (!_pendingDiscoveries[i].attempts)
+	    continue;
+	int32_t discoveryTimeLeft = _pendingDiscoveries[i].deadline - millis();
+	if (discoveryTimeLeft < timeLeft)
+	    timeLeft = discoveryTimeLeft > 0 ? discoveryTimeLeft : 1;
+    }
+#endif
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+    for (uint8_t i = 0; i < RH_MESH_MAX_PENDING_REBROADCASTS; i++)
+    {
+	if (!_pendingRebroadcasts[i].len)
+	    continue;
+	int32_t rebroadcastTimeLeft = _pendingRebroadcasts[i].deadline - millis();
+	if (rebroadcastTimeLeft < timeLeft)
+	    timeLeft = rebroadcastTimeLeft > 0 ? rebroadcastTimeLeft : 1;
+    }
+#endif
+    if (_advertisementInterval)
+    {
+	int32_t advertisementTimeLeft = _nextAdvertisement - millis();
+	if (advertisementTimeLeft < timeLeft)
+	    timeLeft = advertisementTimeLeft > 0 ? advertisementTimeLeft : 1;
+    }
+    return timeLeft;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHMesh::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	// Wake up in time to retry or abandon any non-blocking route discoveries, 
+	// or send delayed rebroadcasts or end-to-end ACKs
+	timeLeft = endToEndAckTimeLeft(routeDiscoveryTimeLeft(timeLeft));
+	if (_numHeld || waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags))
 		return true;
 	    YIELD;
 	}
+	else
+	{
+	    checkRouteDiscoveries();
+	    checkEndToEndAcks();
+	}
     }
     return false;
 }
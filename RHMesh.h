@@ -14,9 +14,86 @@
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST        1
 #define RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE       2
 #define RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE                  3
+#define RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED                  4
+#define RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT            5
 
-// Timeout for address resolution in milliecs
+// Default timeout for address resolution in millisecs. See RHMesh::setRouteDiscoveryTimeout()
+#ifndef RH_MESH_ARP_TIMEOUT
 #define RH_MESH_ARP_TIMEOUT 4000
+#endif
+
+// Default number of times address resolution is retried. See RHMesh::setRouteDiscoveryRetries()
+#ifndef RH_MESH_ARP_RETRIES
+#define RH_MESH_ARP_RETRIES 0
+#endif
+
+// Max number of destinations that non-blocking route discovery can be in progress for at once.
+// The queue costs nearly RH_MESH_MAX_MESSAGE_LEN octets per message, so by default it is only 
+// available on Linux and compatible systems. Can be pre-defined prior to including this header
+#ifndef RH_MESH_MAX_PENDING_DISCOVERIES
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_MESH_MAX_PENDING_DISCOVERIES 4
+#else
+#define RH_MESH_MAX_PENDING_DISCOVERIES 0
+#endif
+#endif
+
+// Max number of messages that can be queued for each destination while its route is being discovered
+#ifndef RH_MESH_MAX_PENDING_PER_DEST
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_MESH_MAX_PENDING_PER_DEST 2
+#else
+#define RH_MESH_MAX_PENDING_PER_DEST 0
+#endif
+#endif
+
+// Non-blocking route discovery is compiled out unless there is room to queue messages
+#if (RH_MESH_MAX_PENDING_DISCOVERIES > 0) && (RH_MESH_MAX_PENDING_PER_DEST > 0)
+#define RH_MESH_HAVE_PENDING_DISCOVERIES
+#endif
+
+// Number of recent route discovery requests remembered, so duplicates are not rebroadcast
+#ifndef RH_MESH_DISCOVERY_CACHE_SIZE
+#define RH_MESH_DISCOVERY_CACHE_SIZE 8
+#endif
+
+// Max number of route discovery requests that can be waiting for their rebroadcast jitter delay. 
+// Each costs RH_ROUTER_MAX_MESSAGE_LEN octets, so by default they are only available on Linux and 
+// compatible systems. If 0 they are compiled out, and requests are always rebroadcast immediately.
+// Can be pre-defined prior to including this header
+#ifndef RH_MESH_MAX_PENDING_REBROADCASTS
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_MESH_MAX_PENDING_REBROADCASTS 2
+#else
+#define RH_MESH_MAX_PENDING_REBROADCASTS 0
+#endif
+#endif
+
+// Number of full paths to destinations the originator caches for source routing
+#ifndef RH_MESH_SOURCE_ROUTE_CACHE_SIZE
+#define RH_MESH_SOURCE_ROUTE_CACHE_SIZE 8
+#endif
+
+// Max number of relays in a source route
+#ifndef RH_MESH_MAX_SOURCE_ROUTE_LEN
+#define RH_MESH_MAX_SOURCE_ROUTE_LEN 8
+#endif
+
+// Set in MeshSourceRoutedMessage::pathLen if the last relay in the path must use its routing table 
+// to reach the destination
+#define RH_MESH_SOURCE_ROUTE_LOOSE 0x80
+
+// Routes learned from route advertisements expire if they are not refreshed 
+// for this many advertisement intervals
+#ifndef RH_MESH_ADVERTISED_ROUTE_LIFETIME
+#define RH_MESH_ADVERTISED_ROUTE_LIFETIME 3
+#endif
+
+// Default max random delay before rebroadcasting a route discovery request, in millisecs. 
+// 0 means rebroadcast immediately. See RHMesh::setRebroadcastJitter()
+#ifndef RH_MESH_REBROADCAST_JITTER
+#define RH_MESH_REBROADCAST_JITTER 0
+#endif
 
 /////////////////////////////////////////////////////////////////////
 /// \class RHMesh RHMesh.h <RHMesh.h>
@@ -48,7 +125,11 @@
 ///
 /// If a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST that already has itself 
 /// listed in the visited nodes, it knows it has already seen and rebroadcast this request, 
-/// and threfore ignores it. This prevents broadcast storms.
+/// and threfore ignores it. Each request also carries an ID chosen by the originator, and each node 
+/// remembers the (source, ID) of the last RH_MESH_DISCOVERY_CACHE_SIZE requests it has seen, so it 
+/// rebroadcasts each request only once, however many neighbours it hears it from (unless a later copy 
+/// has travelled fewer hops, so the request still reaches as far as its hop limit allows). 
+/// This prevents broadcast storms.
 /// When a node receives a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST it can use the list of 
 /// nodes aready visited to deduce routes back towards the originating (requesting node). 
 /// This also means that when the destination node of the request is reached, it (and all 
@@ -61,18 +142,128 @@
 /// Therefore, intermediate nodes that route the reply back towards the originating node can use the 
 /// node list in the reply to deduce routes to all the nodes between it and the destination node.
 ///
+/// If no reply is received within the route discovery timeout (RH_MESH_ARP_TIMEOUT by default, 
+/// see setRouteDiscoveryTimeout()) the request is retried up to setRouteDiscoveryRetries() times, 
+/// doubling the timeout each time.
+///
+/// \par Flood Control
+///
+/// In dense networks, many neighbours rebroadcasting the same request at the same moment 
+/// collide with each other. There are several optional ways to reduce this:
+/// - setRebroadcastJitter() delays each rebroadcast by a random time. This spreads 
+///   rebroadcasts out, and gives nodes time to hear their neighbours' rebroadcasts first. 
+///   Requests waiting for their delay are sent by recvfromAck(), so you must keep calling it. 
+///   A delay of about the airtime of one message works well. Up to RH_MESH_MAX_PENDING_REBROADCASTS 
+///   requests can wait at once, and the rest are rebroadcast immediately. 
+///   RH_MESH_MAX_PENDING_REBROADCASTS is 0 except on Linux and compatible systems, so elsewhere 
+///   define it before including RHMesh.h to use the jitter.
+/// - setRebroadcastSuppressionThreshold() (counter-based suppression) cancels a delayed rebroadcast if 
+///   the same request is heard from enough other neighbours during the delay, because 
+///   they will probably have covered the area already. This can stop a request with a small hop limit 
+///   from reaching the edge of its ring, so allow an extra retry if you combine it with expanding ring search.
+/// - setRebroadcastProbability() (probabilistic, or gossip, suppression) only rebroadcasts each request 
+///   with the given probability.
+/// - setExpandingRingSearch() limits the first attempts to discover a route to a few hops, 
+///   widening the search with each retry. Nearby destinations are then found without flooding 
+///   the whole network. Each request carries its hop limit.
+///
+/// routeDiscoveryStats() counts the route discovery messages and octets this node sends, 
+/// so you can measure how much airtime route discovery takes.
+///
 /// Therefore, RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST and 
 /// RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE together ensure the original requester and all 
 /// the intermediate nodes know how to route to the source and destination nodes and every node along the path.
 ///
-/// Note that there is a race condition here that can effect routing on multipath routes. For example, 
-/// if the route to the destination can traverse several paths, last reply from the destination 
-/// will be the one used.
+/// Route discovery messages also carry a path cost (see RHRouter Link Metrics). 
+/// As a request is flooded, each node that receives it adds the cost of the link it heard it on, so 
+/// the cost it carries is the cost of the path back to the originator. As a reply is routed back, each node 
+/// adds the cost of the link it heard it on, so the cost it carries is the cost of the path to the destination.
+/// Nodes install routes with RHRouter::updateRouteTo(), so if the destination can be reached by several paths, 
+/// the cheapest one is kept, unless it is only marginally cheaper than the route already in use.
+///
+/// \par Replies From Cached Routes
+///
+/// If you call setCachedRouteReplies() with a non-zero max age, an intermediate node that receives a 
+/// request for a destination it already has a route to, confirmed within that time, replies on behalf of the 
+/// destination instead of rebroadcasting the request. In a network that has been running for a while, 
+/// this makes most discoveries much quicker and cheaper, because they dont have to travel 
+/// all the way to the destination and back. The reply lists the nodes the request visited, followed by the 
+/// replying node, and starts with the cost of the cached route. 
+/// It also carries the age of the cached route (in seconds), and nodes that learn the route from the reply 
+/// inherit that age (see RHRouter::routeAge()), so a route cannot be passed on from cache to cache 
+/// and stay fresh forever. Nodes never reply from a route that leads back the way the request came.
+/// Note that unlike a reply from the destination, a cached reply does not give the destination a route 
+/// back to the originator.
+///
+/// \par Non-blocking Route Discovery
+///
+/// By default, sendtoWait() blocks while it discovers a route, and discards any other messages 
+/// it receives in the meantime. If you call setNonBlockingRouteDiscovery(true), sendtoWait() instead 
+/// queues a message for a destination with no route, starts route discovery and returns 
+/// RH_ROUTER_ERROR_QUEUED immediately. Up to RH_MESH_MAX_PENDING_PER_DEST messages can be queued 
+/// for each of up to RH_MESH_MAX_PENDING_DISCOVERIES destinations; beyond that sendtoWait() returns 
+/// RH_ROUTER_ERROR_QUEUE_FULL.
+/// The queue is only compiled in if RH_MESH_MAX_PENDING_DISCOVERIES and RH_MESH_MAX_PENDING_PER_DEST 
+/// are not 0, which by default is only on Linux and compatible systems. Elsewhere, define them before 
+/// including RHMesh.h if you have the memory to spare, otherwise sendtoWait() always blocks.
+/// Route discovery proceeds while you call recvfromAck() or recvfromAckTimeout() (or sendtoWait()), 
+/// which retry discovery on schedule, and send the queued messages, in order, 
+/// as soon as the route is discovered. If discovery finally fails, the queued messages are discarded.
+///
+/// \par Source Routing
+///
+/// Normally every relay looks up the next hop to the destination in its own routing table, so every 
+/// relay needs a route to every destination it relays to. If you call setSourceRouting(true), 
+/// the originator instead caches the full path (the list of relays) from the reply to its route discovery 
+/// (up to RH_MESH_SOURCE_ROUTE_CACHE_SIZE paths of up to RH_MESH_MAX_SOURCE_ROUTE_LEN relays), 
+/// and sends each message in a MeshSourceRoutedMessage (message type RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED) 
+/// that carries the path. Relays forward source routed messages to the next node in the path, without looking 
+/// up or needing a route in their own routing table, whether or not they have source routing enabled themselves.
+/// If the path came from a reply from a cached route (see above), it only goes as far as the node that replied, 
+/// which then uses its routing table for the rest of the way (loose source routing).
+/// If a relay cannot deliver a source routed message, it sends a route failure back along the reverse path, 
+/// and the originator forgets the path. 
+/// Messages that would not fit with the path added, and destinations with no cached path, 
+/// are routed hop by hop as usual.
+///
+/// \par Proactive Routing
+///
+/// On-demand route discovery means the first message to a destination after a route expires or fails 
+/// has to wait for a new route to be discovered. If you call setProactiveRouting() with a non-zero interval, 
+/// RHMesh also maintains routes in the background, with a distance vector protocol similar to DSDV:
+/// - Every interval (less a small random amount, so neighbours dont stay in step), each node broadcasts a 
+///   MeshRouteAdvertisementMessage (message type RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT) listing 
+///   itself, with a new even sequence number, and the routes it has learned from advertisements, 
+///   with their cost (see RHRouter Link Metrics) and the latest sequence number it has heard from their destination. 
+///   Advertisements also serve as hello beacons, so neighbours find each other.
+/// - A node that hears an advertisement from a neighbour installs (with RHRouter::addRouteTo()) a route via that 
+///   neighbour for each listed destination for which the advertisement has a newer sequence number, or the same 
+///   sequence number and a cheaper path (subject to hysteresis). To avoid flapping, a newer sequence number over a 
+///   more expensive path does not replace a fresh route through another neighbour until that neighbour's 
+///   advertisement has had a chance to arrive.
+/// - Routes that are not refreshed for RH_MESH_ADVERTISED_ROUTE_LIFETIME intervals, or whose next hop fails, 
+///   are deleted, and advertised once as broken (the maximum cost, with the next odd sequence number), 
+///   so that neighbours routing through this node delete them too.
+/// - A node that restarts begins its sequence numbers again, which the other nodes would take as old news. 
+///   Its neighbours accept its route to itself anyway, with the next sequence number after the one they 
+///   remember, and advertise that on. When the node hears a sequence number of its own newer than its current 
+///   one in its neighbours' advertisements, it carries on from there.
+///
+/// Advertisements of large routing tables are spread over as many messages as necessary. You can limit 
+/// the airtime used by advertisements with setProactiveRoutingBudget(): advertisements stop when 
+/// the budget is used up, and the rest of the table is advertised next interval.
+/// Advertisements are sent while you call recvfromAck(), recvfromAckTimeout() or sendtoWait(), 
+/// so a node must keep calling them. Routes for destinations that are not advertised are still 
+/// discovered on demand.
+/// Unless the routing table is indexed directly by address (see RHRouter), a node keeps advertisement 
+/// state for at most RH_ROUTING_TABLE_SLOTS destinations, indexed by RH_ADDRESS_HASH() of their address. An advertised destination whose slot is taken 
+/// by another one is ignored until the slot is free again.
 ///
 /// \par Route Failure
 ///
 /// RHRouter (and therefore RHMesh) use reliable hop-to-hop delivery of messages using 
-/// hop-to-hop acknowledgements, but not end-to-end acknowledgements. When sendtoWait() returns, 
+/// hop-to-hop acknowledgements, and only send end-to-end acknowledgements for messages sent with 
+/// RH_ROUTER_FLAGS_ACK_REQUEST (see RHRouter::deliveryReport()). When sendtoWait() returns, 
 /// you know that the message has been delivered to the next hop, but not if it is (or even if it can be) 
 /// delivered to the destination node. If during the course of hop-to-hop routing of a message, 
 /// one of the intermediate RHMesh nodes finds it cannot deliver to the next hop 
@@ -94,6 +285,9 @@
 ///   (broadcast) and replies (unicast).
 /// - MeshRouteFailureMessage (message type RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE) Informs nodes of 
 ///   route failures.
+/// RHRouter end-to-end ACKs sent on their own (RH_ROUTER_FLAGS_ACK_ONLY) carry no RHMesh message.
+///
+/// With RH_EXTENDED_ADDRESSING, each node address in these messages takes 2 octets instead of 1, low octet first.
 ///
 /// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers 
 /// (see http://www.hoperf.com)
@@ -101,7 +295,8 @@
 /// \par Memory
 ///
 /// RHMesh programs require significant amount of SRAM, often approaching 2kbytes, 
-/// which is beyond or at the limits of some Arduinos and other processors. Programs 
+/// and more with larger RH_ROUTING_TABLE_SIZE or the optional queues (see for example 
+/// RH_MESH_MAX_PENDING_DISCOVERIES), which is beyond or at the limits of some Arduinos and other processors. Programs 
 /// with additional software besides basic RHMesh programs may well require even more. If you have insufficient
 /// SRAM for your program, it may result in failure to run, or wierd crashes and other hard to trace behaviour.
 /// In this event you should consider a processor with more SRAM, such as the MotienoMEGA with 16k
@@ -120,38 +315,73 @@ public:
     #define RH_MESH_MAX_MESSAGE_LEN (RH_ROUTER_MAX_MESSAGE_LEN - sizeof(RHMesh::MeshMessageHeader))
 
     /// Structure of the basic RHMesh header.
-    typedef struct
+    typedef struct RH_PACKED
     {
 	uint8_t             msgType;  ///< Type of RHMesh message, one of RH_MESH_MESSAGE_TYPE_*
     } MeshMessageHeader;
 
     /// Signals an application layer message for the caller of RHMesh
-    typedef struct
+    typedef struct RH_PACKED
     {
 	MeshMessageHeader   header; ///< msgType = RH_MESH_MESSAGE_TYPE_APPLICATION 
 	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application layer payload data
     } MeshApplicationMessage;
 
-    /// Signals a route discovery request or reply (At present only supports physical dest addresses of length 1 octet)
-    typedef struct
+    /// Signals a route discovery request or reply (At present only supports physical dest addresses of length sizeof(RHAddress))
+    typedef struct RH_PACKED
     {
 	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_*
-	uint8_t             destlen; ///< Reserved. Must be 1.g
-	uint8_t             dest;    ///< The address of the destination node whose route is being sought
-	uint8_t             route[RH_MESH_MAX_MESSAGE_LEN - 1]; ///< List of node addresses visited so far. Length is implcit
+	uint8_t             destlen; ///< Reserved. Must be sizeof(RHAddress)
+	RHWireAddress       dest;    ///< The address of the destination node whose route is being sought
+	uint8_t             cost;    ///< Cost of the path traversed so far. See RHRouter::linkCost()
+	uint8_t             id;      ///< Request ID chosen by the originator, for detecting duplicates
+	uint8_t             hopLimit; ///< Max number of hops the request may travel from the originator
+	uint8_t             age;     ///< In replies, age in seconds of the cached route replied from. 0 from the destination
+	RHWireAddress       route[(RH_MESH_MAX_MESSAGE_LEN - 5 - sizeof(RHAddress)) / sizeof(RHAddress)]; ///< List of node addresses visited so far. Length is implcit
     } MeshRouteDiscoveryMessage;
 
+    /// Length of a MeshRouteDiscoveryMessage before the list of visited nodes
+    #define RH_MESH_ROUTE_DISCOVERY_HEADER_LEN (sizeof(RHMesh::MeshMessageHeader) + 5 + sizeof(RHAddress))
+
+    /// Carries another RHMesh message along an explicit path. The encapsulated RHMesh message 
+    /// (starting with its MeshMessageHeader) follows the path
+    typedef struct RH_PACKED
+    {
+	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_SOURCE_ROUTED
+	uint8_t             pathLen; ///< Number of relays in path, ORed with RH_MESH_SOURCE_ROUTE_LOOSE for loose source routes
+	uint8_t             hop;     ///< Index in path of the next relay to visit. pathLen when the next hop is the destination
+	RHWireAddress       path[(RH_MESH_MAX_MESSAGE_LEN - 2) / sizeof(RHAddress)]; ///< Relays between the source and destination, then the encapsulated message
+    } MeshSourceRoutedMessage;
+
+    /// Length of a MeshSourceRoutedMessage before the path
+    #define RH_MESH_SOURCE_ROUTED_HEADER_LEN (sizeof(RHMesh::MeshMessageHeader) + 2)
+
+    /// One route in a MeshRouteAdvertisementMessage
+    typedef struct RH_PACKED
+    {
+	RHWireAddress       dest;    ///< The destination
+	uint8_t             seq;     ///< The latest sequence number from the destination. Odd if the route is broken
+	uint8_t             cost;    ///< Cost of the path from the advertising node, RH_ROUTER_MAX_COST if broken
+    } RouteAdvertisement;
+
+    /// Advertises routes to neighbours for proactive routing. The first route is always the advertising node itself
+    typedef struct RH_PACKED
+    {
+	MeshMessageHeader   header;  ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT
+	RouteAdvertisement  routes[RH_MESH_MAX_MESSAGE_LEN / sizeof(RouteAdvertisement)]; ///< Routes. Number is implicit
+    } MeshRouteAdvertisementMessage;
+
     /// Signals a route failure
-    typedef struct
+    typedef struct RH_PACKED
     {
 	MeshMessageHeader   header; ///< msgType = RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
-	uint8_t             dest; ///< The address of the destination towards which the route failed
+	RHWireAddress       dest; ///< The address of the destination towards which the route failed
     } MeshRouteFailureMessage;
 
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHMesh(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHMesh(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Sends a message to the destination node. Initialises the RHRouter message header 
     /// (the SOURCE address is set to the address of this node, HOPS to 0) and calls 
@@ -172,7 +402,121 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    ///         - RH_ROUTER_ERROR_QUEUED With non-blocking route discovery, there was no route for dest, 
+    ///           so the message has been queued until route discovery for dest completes
+    ///         - RH_ROUTER_ERROR_QUEUE_FULL With non-blocking route discovery, there was no route for dest, 
+    ///           and the message could not be queued
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
+
+    /// Like sendtoWait() above, but the RHMesh and RHRouter headers (and the path, with source routing) 
+    /// are pushed into the headroom of the packet, and the message is sent from there without being copied. 
+    /// The headers are pulled off again before returning, so the packet can be reused.
+    /// Messages queued for non-blocking route discovery are still copied to the queue.
+    /// \param [in,out] packet The application message data
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer
+    /// \return The result code, as for sendtoWait() above
+    uint8_t sendtoWait(RHPacketBuffer& packet, RHAddress dest, uint8_t flags = 0);
+
+    /// Floods an application message across the whole network, without needing routes. 
+    /// Wraps the message in a MeshApplicationMessage and sends it with RHRouter::floodWait(), 
+    /// so it is received from recvfromAck() like any other application message. 
+    /// See RHRouter for details.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest RH_BROADCAST_ADDRESS or a multicast group address
+    /// \param [in] flags Optional flags for use by subclasses or application layer
+    /// \return The result code, as for RHRouter::floodWait()
+    uint8_t floodWait(uint8_t* buf, uint8_t len, RHAddress dest = RH_BROADCAST_ADDRESS, uint8_t flags = 0);
+
+    /// Sets how long to wait for a reply to the first route discovery request for a destination. 
+    /// Each retry waits twice as long as the previous attempt.
+    /// \param [in] timeout Timeout in milliseconds. Defaults to RH_MESH_ARP_TIMEOUT
+    void setRouteDiscoveryTimeout(uint16_t timeout);
+
+    /// Sets how many times a route discovery request is retried if no reply is received.
+    /// \param [in] retries Number of retries. Defaults to RH_MESH_ARP_RETRIES
+    void setRouteDiscoveryRetries(uint8_t retries);
+
+    /// Enables or disables non-blocking route discovery. 
+    /// See the Non-blocking Route Discovery section above.
+    /// Disabling it discards any messages waiting for route discovery.
+    /// Has no effect unless RH_MESH_HAVE_PENDING_DISCOVERIES is defined (see RH_MESH_MAX_PENDING_DISCOVERIES)
+    /// \param [in] nonBlocking true to queue messages while their route is discovered in the background, 
+    /// false (the default) to block in sendtoWait() until the route is discovered
+    void setNonBlockingRouteDiscovery(bool nonBlocking);
+
+    /// Tests whether non-blocking route discovery is in progress for a destination
+    /// \param [in] dest The destination node address
+    /// \return true if messages for dest are waiting for its route to be discovered
+    bool isDiscoveringRoute(RHAddress dest);
+
+    /// Counts the route discovery traffic sent by this node
+    typedef struct
+    {
+	uint32_t            requestsSent;        ///< Route discovery requests originated by this node
+	uint32_t            requestsForwarded;   ///< Route discovery requests rebroadcast by this node
+	uint32_t            repliesSent;         ///< Route discovery replies sent by this node as destination
+	uint32_t            cachedRepliesSent;   ///< Route discovery replies sent by this node from its routing table
+	uint32_t            duplicatesDropped;   ///< Duplicate requests that were not rebroadcast
+	uint32_t            rebroadcastsSuppressed; ///< Rebroadcasts cancelled by counter-based or probabilistic suppression
+	uint32_t            octetsSent;          ///< Total octets in the above requests and replies, including the RHRouter header
+	uint32_t            advertisementsSent;  ///< Proactive route advertisements sent by this node
+	uint32_t            advertisementOctetsSent; ///< Total octets in route advertisements, including the RHRouter header
+    } RouteDiscoveryStats;
+
+    /// Sets the maximum random delay before this node rebroadcasts a route discovery request.
+    /// See the Flood Control section above.
+    /// \param [in] jitter Max delay in milliseconds. 0 means rebroadcast immediately. 
+    /// Defaults to RH_MESH_REBROADCAST_JITTER
+    void setRebroadcastJitter(uint16_t jitter);
+
+    /// Sets the probability that this node rebroadcasts a route discovery request it has not seen before.
+    /// \param [in] percent Probability in percent. Defaults to 100
+    void setRebroadcastProbability(uint8_t percent);
+
+    /// Sets how many copies of a route discovery request this node must hear while waiting 
+    /// for its rebroadcast jitter delay before it cancels the rebroadcast. 
+    /// Only has an effect if setRebroadcastJitter() is not 0.
+    /// \param [in] copies Number of copies, including the first. 0 (the default) disables counter-based suppression
+    void setRebroadcastSuppressionThreshold(uint8_t copies);
+
+    /// Enables expanding ring search for route discovery. The first request for a destination 
+    /// travels at most initialHops hops, and each retry doubles the limit. 
+    /// The last retry (see setRouteDiscoveryRetries()) always searches the whole network, up to 
+    /// the max hops (see RHRouter::setMaxHops()), so you should allow enough retries for the ring to grow.
+    /// \param [in] initialHops Hop limit of the first request. 0 (the default) disables expanding ring search
+    void setExpandingRingSearch(uint8_t initialHops);
+
+    /// Enables or disables proactive routing. See the Proactive Routing section above.
+    /// All nodes in the network should use the same interval.
+    /// \param [in] interval Interval between route advertisements in milliseconds. 
+    /// 0 (the default) disables proactive routing
+    void setProactiveRouting(unsigned long interval);
+
+    /// Sets the airtime budget for proactive route advertisements, as a sustained rate. 
+    /// Unused budget accumulates for up to one advertisement interval.
+    /// \param [in] octetsPerSecond Max average number of octets per second in advertisements, including the 
+    /// RHRouter header. 0 (the default) means no limit
+    void setProactiveRoutingBudget(uint16_t octetsPerSecond);
+
+    /// Enables or disables source routing of messages originated by this node.
+    /// See the Source Routing section above. Disabling it forgets all cached paths.
+    /// \param [in] sourceRouting true to send messages along cached paths. Defaults to false
+    void setSourceRouting(bool sourceRouting);
+
+    /// Enables intermediate nodes to reply to route discovery requests from their routing table.
+    /// See the Replies From Cached Routes section above.
+    /// \param [in] maxAge Max age in milliseconds of a route this node will reply from 
+    /// (see RHRouter::routeAge()). 0 (the default) disables replies from cached routes
+    void setCachedRouteReplies(unsigned long maxAge);
+
+    /// Returns the counts of route discovery traffic sent by this node
+    /// \return pointer to the RouteDiscoveryStats
+    const RouteDiscoveryStats* routeDiscoveryStats();
+
+    /// Resets the counts of route discovery traffic to 0
+    void resetRouteDiscoveryStats();
 
     /// Starts the receiver if it is not running already, processes and possibly routes any received messages
     /// addressed to other nodes
@@ -190,13 +534,13 @@ public:
     /// If the message is not a broadcast, acknowledge to the sender before returning.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was received for this node and copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid application layer 
@@ -205,16 +549,66 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
 protected:
 
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    /// Defines a message waiting for non-blocking route discovery
+    typedef struct
+    {
+	uint8_t             len;   ///< Length of the application payload data
+	uint8_t             flags; ///< End-to-end flags to send with it
+	uint8_t             data[RH_MESH_MAX_MESSAGE_LEN]; ///< Application payload data
+    } PendingMessage;
+
+    /// Defines the state of a non-blocking route discovery
+    typedef struct
+    {
+	RHAddress           dest;        ///< The destination whose route is being discovered
+	uint8_t             attempts;    ///< Number of requests sent so far. 0 if this slot is free
+	unsigned long       deadline;    ///< millis() when the current request times out
+	uint8_t             numMessages; ///< Number of messages in messages
+	PendingMessage      messages[RH_MESH_MAX_PENDING_PER_DEST]; ///< Messages waiting for the route, oldest first
+    } PendingDiscovery;
+#endif
+
+    /// Defines a route discovery request that has been seen recently
+    typedef struct
+    {
+	RHAddress           source;   ///< Originator of the request
+	uint8_t             id;       ///< Request ID
+	uint8_t             bestCost; ///< Cheapest path cost this request has arrived with
+	uint8_t             hops;     ///< Fewest hops this request has arrived with
+    } DiscoveryCacheEntry;
+
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+    /// Defines a route discovery request waiting for its rebroadcast jitter delay
+    typedef struct
+    {
+	uint8_t             len;      ///< Length of the message, 0 if this slot is free
+	RHAddress           source;   ///< Originator of the request
+	uint8_t             copies;   ///< Number of copies of the request heard so far
+	unsigned long       deadline; ///< millis() when the request is to be rebroadcast
+	uint8_t             message[RH_ROUTER_MAX_MESSAGE_LEN]; ///< The MeshRouteDiscoveryMessage to rebroadcast
+    } PendingRebroadcast;
+#endif
+
+    /// Defines a full path to a destination cached for source routing
+    typedef struct
+    {
+	bool                valid;   ///< true if this entry is in use
+	RHWireAddress       dest;    ///< The destination
+	uint8_t             pathLen; ///< Number of relays in path, ORed with RH_MESH_SOURCE_ROUTE_LOOSE for loose source routes
+	RHAddress           path[RH_MESH_MAX_SOURCE_ROUTE_LEN]; ///< Relays between here and dest, nearest first
+    } SourceRoute;
+
     /// Internal function that inspects messages being received and adjusts the routing table if necessary.
     /// Called by recvfromAck() immediately after it gets the message from RHReliableDatagram
     /// \param [in] message Pointer to the RHRouter message that was received.
@@ -229,16 +623,16 @@ protected:
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
     /// Try to resolve a route for the given address. Blocks while discovering the route
-    /// which may take up to 4000 msec.
+    /// which may take up to the route discovery timeout, doubled for each retry.
     /// Virtual so subclasses can override.
     /// \param [in] address The physical address to resolve
     /// \return true if the address was resolved and added to the local routing table
-    virtual bool doArp(uint8_t address);
+    virtual bool doArp(RHAddress address);
 
     /// Tests if the given address of length addresslen is indentical to the
     /// physical address of this node.
     /// RHMesh always implements physical addresses as the 1 octet address of the node
-    /// given by _thisAddress
+    /// given by _thisAddress (2 octets, low octet first, with RH_EXTENDED_ADDRESSING)
     /// Called by recvfromAck() to test whether a RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
     /// is for this node.
     /// Subclasses may want to override to implement more complicated or longer physical addresses
@@ -247,9 +641,197 @@ protected:
     /// \return true if the physical address of this node is identical to address
     virtual bool isPhysicalAddress(uint8_t* address, uint8_t addresslen);
 
+    /// Broadcasts a route discovery request for the given address
+    /// \param [in] address The physical address to resolve
+    /// \param [in] attempt 0 based number of the attempt to resolve address, which sets the hop limit 
+    /// for expanding ring search
+    /// \return true if the request was sent
+    bool sendRouteDiscoveryRequest(RHAddress address, uint8_t attempt);
+
+    /// Handles a route discovery request received from a neighbour
+    /// \param [in] d The request, in _tmpMessage
+    /// \param [in] messageLen Length of the request in octets
+    /// \param [in] source The originator of the request
+    void handleRouteDiscoveryRequest(MeshRouteDiscoveryMessage* d, uint8_t messageLen, RHAddress source);
+
+    /// Replies to a route discovery request on behalf of its destination, if this node has a fresh enough 
+    /// route to the destination that does not lead back the way the request came
+    /// \param [in] d The request, in _tmpMessage. Converted to the reply
+    /// \param [in] messageLen Length of the request in octets
+    /// \param [in] source The originator of the request
+    /// \return true if a reply was sent
+    bool replyFromCachedRoute(MeshRouteDiscoveryMessage* d, uint8_t messageLen, RHAddress source);
+
+    /// Handles a route advertisement received from a neighbour
+    /// \param [in] a The advertisement
+    /// \param [in] messageLen Length of the advertisement in octets
+    void handleRouteAdvertisement(MeshRouteAdvertisementMessage* a, uint8_t messageLen);
+
+    /// Expires stale advertised routes and sends route advertisements when they are due.
+    /// Called by checkRouteDiscoveries()
+    void checkProactiveRouting();
+
+    /// Finds the slot in the advertisement state (_advertisedSeq etc) for a destination
+    /// \param [in] dest The destination
+    /// \param [out] slot Set to the index of the slot, which is dest itself unless RH_ROUTING_TABLE_HASHED 
+    /// is defined
+    /// \return false if the slot is in use for another destination
+    bool advertisedSlot(RHAddress dest, uint8_t* slot);
+
+    /// Returns the destination a slot in the advertisement state is for
+    /// \param [in] slot The index of the slot
+    /// \return The destination address
+    RHAddress advertisedDest(uint8_t slot);
+
+    /// Finds the cached source route to dest
+    /// \return pointer to the SourceRoute, or NULL if there is none
+    SourceRoute* findSourceRoute(RHAddress dest);
+
+    /// Caches the path to a destination from a route discovery reply
+    /// \param [in] d The reply
+    /// \param [in] numRoutes The number of nodes listed in the reply
+    void cacheSourceRoute(MeshRouteDiscoveryMessage* d, uint8_t numRoutes);
+
+    /// Forwards a MeshSourceRoutedMessage to the next node in its path, 
+    /// and reports failure back to the source along the reverse path.
+    /// Called by route()
+    /// \return The result code, as for RHRouter::route()
+    uint8_t routeSourceRouted(RoutedMessage* message, uint8_t messageLen);
+
+    /// Rebroadcasts a route discovery request, impersonating its originator
+    /// \param [in] message The MeshRouteDiscoveryMessage to rebroadcast
+    /// \param [in] messageLen Length of the message in octets
+    /// \param [in] source The originator of the request
+    void rebroadcastRouteDiscoveryRequest(uint8_t* message, uint8_t messageLen, RHAddress source);
+
+    /// Returns the time until the next route discovery or rebroadcast needs attention, 
+    /// or timeLeft if that is sooner
+    /// \param [in] timeLeft The longest time to return
+    /// \return Time in milliseconds
+    int32_t routeDiscoveryTimeLeft(int32_t timeLeft);
+
+    /// Wraps the application payload data in a MeshApplicationMessage and sends it with RHRouter::sendtoWait()
+    /// \return The result code from RHRouter::sendtoWait()
+    uint8_t sendApplicationMessage(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags);
+
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    /// Queues a message until non-blocking route discovery for dest completes, 
+    /// starting route discovery if it is not already in progress
+    /// \return RH_ROUTER_ERROR_QUEUED or RH_ROUTER_ERROR_QUEUE_FULL
+    uint8_t queueForRouteDiscovery(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags);
+#endif
+
+    /// Sends any queued messages whose route has been discovered, retries or 
+    /// abandons route discoveries that have timed out, and sends rebroadcasts whose jitter delay has expired.
+    /// Called by recvfromAck() and sendtoWait()
+    void checkRouteDiscoveries();
+
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    /// Finds the non-blocking route discovery in progress for dest
+    /// \return pointer to the PendingDiscovery, or NULL if there is none
+    PendingDiscovery* findRouteDiscovery(RHAddress dest);
+#endif
+
+    /// Timeout for the first route discovery request in milliseconds
+    uint16_t          _routeDiscoveryTimeout;
+
+    /// Number of times to retry route discovery
+    uint8_t           _routeDiscoveryRetries;
+
+    /// true if route discovery is non-blocking
+    bool              _nonBlockingRouteDiscovery;
+
+#ifdef RH_MESH_HAVE_PENDING_DISCOVERIES
+    /// Non-blocking route discoveries in progress, with the messages waiting for them
+    PendingDiscovery  _pendingDiscoveries[RH_MESH_MAX_PENDING_DISCOVERIES];
+#endif
+
+    /// The last route discovery request ID we sent
+    uint8_t           _lastRouteDiscoveryId;
+
+    /// Recently seen route discovery requests
+    DiscoveryCacheEntry _discoveryCache[RH_MESH_DISCOVERY_CACHE_SIZE];
+
+    /// Next entry in _discoveryCache to replace
+    uint8_t           _nextDiscoveryCacheEntry;
+
+    /// Number of valid entries in _discoveryCache
+    uint8_t           _numDiscoveryCacheEntries;
+
+#if RH_MESH_MAX_PENDING_REBROADCASTS > 0
+    /// Route discovery requests waiting for their rebroadcast jitter delay
+    PendingRebroadcast _pendingRebroadcasts[RH_MESH_MAX_PENDING_REBROADCASTS];
+#endif
+
+    /// Max rebroadcast jitter in milliseconds
+    uint16_t          _rebroadcastJitter;
+
+    /// Rebroadcast probability in percent
+    uint8_t           _rebroadcastProbability;
+
+    /// Number of copies that suppress a rebroadcast, 0 if disabled
+    uint8_t           _rebroadcastSuppressionThreshold;
+
+    /// Hop limit of the first route discovery request, 0 if expanding ring search is disabled
+    uint8_t           _expandingRingStart;
+
+    /// Max age in milliseconds of cached routes to reply from, 0 if disabled
+    unsigned long     _cachedRouteReplyMaxAge;
+
+    /// true if messages originated here are source routed
+    bool              _sourceRouting;
+
+    /// Cached paths for source routing
+    SourceRoute       _sourceRoutes[RH_MESH_SOURCE_ROUTE_CACHE_SIZE];
+
+    /// Next entry in _sourceRoutes to replace
+    uint8_t           _nextSourceRoute;
+
+    /// Interval between route advertisements in milliseconds, 0 if proactive routing is disabled
+    unsigned long     _advertisementInterval;
+
+    /// millis() when the next route advertisement is due
+    unsigned long     _nextAdvertisement;
+
+    /// Our own sequence number for route advertisements. Always even
+    uint8_t           _advertisementSeq;
+
+    /// Latest sequence number heard from each destination in route advertisements, indexed by 
+    /// advertisedSlot(), as are the bitmaps below
+    uint8_t           _advertisedSeq[RH_ROUTING_TABLE_SLOTS];
+
+#ifdef RH_ROUTING_TABLE_HASHED
+    /// The destination each slot is for
+    RHAddress         _advertisedDest[RH_ROUTING_TABLE_SLOTS];
+#endif
+
+    /// Bitmap of destinations whose sequence number is in _advertisedSeq
+    uint8_t           _advertisedSeqKnown[RH_ROUTING_TABLE_SLOTS / 8];
+
+    /// Bitmap of destinations with a route learned from route advertisements
+    uint8_t           _advertised[RH_ROUTING_TABLE_SLOTS / 8];
+
+    /// Bitmap of destinations whose route is to be advertised as broken
+    uint8_t           _advertisedBroken[RH_ROUTING_TABLE_SLOTS / 8];
+
+    /// Slot of the next destination to advertise, if the last advertisement did not cover the whole table
+    uint8_t           _nextAdvertisedDest;
+
+    /// Advertisement budget in octets per second, 0 if unlimited
+    uint16_t          _advertisementBudget;
+
+    /// Advertisement octets that can be sent now
+    uint32_t          _advertisementTokens;
+
+    /// millis() when _advertisementTokens was last topped up
+    unsigned long     _advertisementTokensTime;
+
+    /// Route discovery traffic counts
+    RouteDiscoveryStats _routeDiscoveryStats;
+
 private:
-    /// Temporary message buffer
-    static uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
+    /// Temporary message buffer, one per instance
+    uint8_t _tmpMessage[RH_ROUTER_MAX_MESSAGE_LEN];
 
 };
 
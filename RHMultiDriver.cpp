@@ -0,0 +1,247 @@
+// RHMultiDriver.cpp
+//
+// Driver that sends and receives through several other drivers
+//
+// Part of the RadioHead library
+
+#include <RHMultiDriver.h>
+
+RHMultiDriver::RHMultiDriver()
+    :
+    _numInterfaces(0),
+    _txInterface(RH_ALL_INTERFACES),
+    _rxInterface(0),
+    _rxPending(false),
+    _leased(false)
+{
+}
+
+uint8_t RHMultiDriver::addInterface(RHGenericDriver& driver)
+{
+    if (_numInterfaces >= RH_MULTI_DRIVER_MAX_INTERFACES)
+	return RH_ALL_INTERFACES;
+    _interfaces[_numInterfaces] = &driver;
+    return _numInterfaces++;
+}
+
+bool RHMultiDriver::init()
+{
+    if (!RHGenericDriver::init() || !_numInterfaces)
+	return false;
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	if (!_interfaces[i]->init())
+	    return false;
+    return true;
+}
+
+bool RHMultiDriver::available()
+{
+    if (_leased)
+	return false;
+    if (_rxPending)
+	return true; // Not collected yet
+
+    // Start with the interface after the last one we received from, so a busy one cant starve the others
+    uint8_t i;
+    for (i = 1; i <= _numInterfaces; i++)
+    {
+	uint8_t interface = (_rxInterface + i) % _numInterfaces;
+	if (_interfaces[interface]->available())
+	{
+	    _rxInterface = interface;
+	    _rxPending = true;
+	    _lastRssi = _interfaces[interface]->lastRssi();
+	    return true;
+	}
+    }
+    return false;
+}
+
+bool RHMultiDriver::recv(uint8_t* buf, uint8_t* len)
+{
+    if (!available())
+	return false;
+    _rxPending = false;
+    if (!_interfaces[_rxInterface]->recv(buf, len))
+	return false;
+    _rxGood++;
+    return true;
+}
+
+bool RHMultiDriver::recvLease(RxLease* lease)
+{
+    if (!available() || !_interfaces[_rxInterface]->recvLease(lease))
+	return false;
+    _leased = true;
+    _rxGood++;
+    return true;
+}
+
+void RHMultiDriver::releaseLease()
+{
+    if (!_leased)
+	return;
+    _interfaces[_rxInterface]->releaseLease();
+    _leased = false;
+    _rxPending = false;
+}
+
+bool RHMultiDriver::send(const uint8_t* data, uint8_t len)
+{
+    Segment segment = { data, len };
+    return sendOn(_txInterface, &segment, 1, false);
+}
+
+bool RHMultiDriver::sendAck(const uint8_t* data, uint8_t len)
+{
+    Segment segment = { data, len };
+    return sendOn(_txHeaderTo == RH_BROADCAST_ADDRESS ? RH_ALL_INTERFACES : _rxInterface, &segment, 1, true);
+}
+
+bool RHMultiDriver::sendv(const Segment* segments, uint8_t numSegments)
+{
+    return sendOn(_txInterface, segments, numSegments, false);
+}
+
+bool RHMultiDriver::sendOn(uint8_t interface, const Segment* segments, uint8_t numSegments, bool ack)
+{
+    bool sent = false;
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+    {
+	if (interface != RH_ALL_INTERFACES && interface != i)
+	    continue;
+	// Each radio transmits on its own, so they can all be sending at once
+	if (ack ? _interfaces[i]->sendAck(segments[0].data, segments[0].len)
+	        : _interfaces[i]->sendv(segments, numSegments))
+	    sent = true;
+    }
+    if (sent)
+	_txGood++;
+    return sent;
+}
+
+uint8_t RHMultiDriver::maxMessageLength()
+{
+    uint8_t len = 255;
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	if (_interfaces[i]->maxMessageLength() < len)
+	    len = _interfaces[i]->maxMessageLength();
+    return len;
+}
+
+bool RHMultiDriver::waitPacketSent()
+{
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->waitPacketSent();
+    return true;
+}
+
+bool RHMultiDriver::waitPacketSent(uint16_t timeout)
+{
+    unsigned long starttime = millis();
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+    {
+	unsigned long elapsed = millis() - starttime;
+	if (elapsed >= timeout || !_interfaces[i]->waitPacketSent(timeout - elapsed))
+	    return false;
+    }
+    return true;
+}
+
+void RHMultiDriver::setThisAddress(uint8_t thisAddress)
+{
+    RHGenericDriver::setThisAddress(thisAddress);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setThisAddress(thisAddress);
+}
+
+void RHMultiDriver::setHeaderTo(uint8_t to)
+{
+    RHGenericDriver::setHeaderTo(to);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setHeaderTo(to);
+}
+
+void RHMultiDriver::setHeaderFrom(uint8_t from)
+{
+    RHGenericDriver::setHeaderFrom(from);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setHeaderFrom(from);
+}
+
+void RHMultiDriver::setHeaderId(uint8_t id)
+{
+    RHGenericDriver::setHeaderId(id);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setHeaderId(id);
+}
+
+void RHMultiDriver::setHeaderFlags(uint8_t set, uint8_t clear)
+{
+    RHGenericDriver::setHeaderFlags(set, clear);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setHeaderFlags(set, clear);
+}
+
+void RHMultiDriver::setPromiscuous(bool promiscuous)
+{
+    RHGenericDriver::setPromiscuous(promiscuous);
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	_interfaces[i]->setPromiscuous(promiscuous);
+}
+
+uint8_t RHMultiDriver::headerTo()
+{
+    return _numInterfaces ? _interfaces[_rxInterface]->headerTo() : RHGenericDriver::headerTo();
+}
+
+uint8_t RHMultiDriver::headerFrom()
+{
+    return _numInterfaces ? _interfaces[_rxInterface]->headerFrom() : RHGenericDriver::headerFrom();
+}
+
+uint8_t RHMultiDriver::headerId()
+{
+    return _numInterfaces ? _interfaces[_rxInterface]->headerId() : RHGenericDriver::headerId();
+}
+
+uint8_t RHMultiDriver::headerFlags()
+{
+    return _numInterfaces ? _interfaces[_rxInterface]->headerFlags() : RHGenericDriver::headerFlags();
+}
+
+bool RHMultiDriver::sleep()
+{
+    bool ret = _numInterfaces > 0;
+    uint8_t i;
+    for (i = 0; i < _numInterfaces; i++)
+	if (!_interfaces[i]->sleep())
+	    ret = false;
+    return ret;
+}
+
+uint8_t RHMultiDriver::numInterfaces()
+{
+    return _numInterfaces;
+}
+
+void RHMultiDriver::setTransmitInterface(uint8_t interface)
+{
+    _txInterface = interface;
+}
+
+uint8_t RHMultiDriver::lastInterface()
+{
+    return _rxInterface;
+}
@@ -0,0 +1,198 @@
+// RHMultiDriver.h
+//
+// Driver that sends and receives through several other drivers, such as radios on different bands
+//
+// Part of the RadioHead library
+
+#ifndef RHMultiDriver_h
+#define RHMultiDriver_h
+
+#include <RHGenericDriver.h>
+
+// Max number of drivers that can be combined
+#ifndef RH_MULTI_DRIVER_MAX_INTERFACES
+#define RH_MULTI_DRIVER_MAX_INTERFACES 4
+#endif
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHMultiDriver RHMultiDriver.h <RHMultiDriver.h>
+/// \brief Driver that combines several other drivers into one, with one interface for each
+///
+/// A node with several radios, for example a Pi-Gate with both a 433 MHz and an 868 MHz radio,
+/// can use RHMultiDriver to join them into a single RadioHead driver, and give it to a manager class.
+/// Each of the combined drivers is an interface, numbered from 0 in the order they were added
+/// with addInterface().
+///
+/// Received messages are collected from all the interfaces, taking each interface in turn when
+/// several have messages waiting, and lastInterface() tells which one a message came in on.
+/// Messages are sent on the interface selected with setTransmitInterface(), or by default on all of them.
+/// ACKs sent with sendAck() go back out on the interface the last message came in on,
+/// or on all interfaces if they are broadcast.
+///
+/// RHRouter and RHMesh know about interfaces: each route records the interface as well as
+/// the next hop, so a single mesh can span all the radios, and messages are forwarded from one band
+/// to another where the route takes them. With the plain RHDatagram and RHReliableDatagram
+/// managers, every message goes out on all the interfaces.
+///
+/// All the interfaces get the same node address and headers. init() initialises all of them, so
+/// configure each driver as usual, but do not call their init() yourself.
+/// maxMessageLength() is the least of the interfaces' maximum message lengths.
+/// \code
+/// RH_RF95 radio433(8, 3);
+/// RH_RF95 radio868(7, 2);
+/// RHMultiDriver driver;
+/// RHMesh manager(driver, MY_ADDRESS);
+///
+/// driver.addInterface(radio433); // Interface 0
+/// driver.addInterface(radio868); // Interface 1
+/// manager.init();
+/// radio433.setFrequency(433.0);
+/// radio868.setFrequency(868.0);
+/// \endcode
+class RHMultiDriver : public RHGenericDriver
+{
+public:
+    /// Constructor. There are no interfaces until they are added with addInterface()
+    RHMultiDriver();
+
+    /// Adds a driver as the next interface
+    /// \param[in] driver The driver
+    /// \return The interface number of the driver, or RH_ALL_INTERFACES if there are already
+    /// RH_MULTI_DRIVER_MAX_INTERFACES
+    uint8_t addInterface(RHGenericDriver& driver);
+
+    /// Initialises all the interfaces
+    /// \return true if they all initialised
+    virtual bool init();
+
+    /// Tests whether a new message is available from any interface
+    /// \return true if a message is available to be retrieved by recv()
+    virtual bool available();
+
+    /// Copies the message found by available() to buf
+    /// \param[in] buf Location to copy the received message
+    /// \param[in,out] len Pointer to available space in buf. Set to the actual number of octets copied.
+    /// \return true if a valid message was copied to buf
+    virtual bool recv(uint8_t* buf, uint8_t* len);
+
+    /// Lends the message found by available(), if its interface lends messages
+    /// \param[out] lease Set to describe the lent message
+    /// \return true if a message was lent, and must be released
+    virtual bool recvLease(RxLease* lease);
+
+    /// Ends the loan of a message by recvLease()
+    virtual void releaseLease();
+
+    /// Sends a message on the transmit interface, or on all interfaces
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message was queued for transmit on at least one interface
+    virtual bool send(const uint8_t* data, uint8_t len);
+
+    /// Sends an acknowledgement on the interface the last message came in on,
+    /// or if it is broadcast, on all interfaces
+    /// \param[in] data Array of data to be sent
+    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \return true if the message was queued for transmit on at least one interface
+    virtual bool sendAck(const uint8_t* data, uint8_t len);
+
+    /// Sends a message made up of several segments on the transmit interface, or on all interfaces
+    /// \param[in] segments Array of segments to be sent, in order
+    /// \param[in] numSegments Number of segments
+    /// \return true if the message was queued for transmit on at least one interface
+    virtual bool sendv(const Segment* segments, uint8_t numSegments);
+
+    /// Returns the least of the maximum message lengths of the interfaces
+    /// \return The maximum legal message length
+    virtual uint8_t maxMessageLength();
+
+    /// Blocks until none of the interfaces is transmitting
+    virtual bool waitPacketSent();
+
+    /// Blocks until none of the interfaces is transmitting, or until the timeout
+    /// \param[in] timeout Maximum time to wait in milliseconds.
+    /// \return true if they all finished within the timeout
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// Sets the address of this node on all the interfaces
+    /// \param[in] thisAddress The address of this node.
+    virtual void setThisAddress(uint8_t thisAddress);
+
+    /// Sets the TO header on all the interfaces
+    /// \param[in] to The new TO header value
+    virtual void setHeaderTo(uint8_t to);
+
+    /// Sets the FROM header on all the interfaces
+    /// \param[in] from The new FROM header value
+    virtual void setHeaderFrom(uint8_t from);
+
+    /// Sets the ID header on all the interfaces
+    /// \param[in] id The new ID header value
+    virtual void setHeaderId(uint8_t id);
+
+    /// Sets and clears bits in the FLAGS header on all the interfaces
+    /// \param[in] set bitmask of bits to be set
+    /// \param[in] clear bitmask of flags to clear
+    virtual void setHeaderFlags(uint8_t set, uint8_t clear = RH_FLAGS_APPLICATION_SPECIFIC);
+
+    /// Sets promiscuous mode on all the interfaces
+    /// \param[in] promiscuous true if you wish to receive messages with any TO address
+    virtual void setPromiscuous(bool promiscuous);
+
+    /// Returns the TO header of the last received message
+    virtual uint8_t headerTo();
+
+    /// Returns the FROM header of the last received message
+    virtual uint8_t headerFrom();
+
+    /// Returns the ID header of the last received message
+    virtual uint8_t headerId();
+
+    /// Returns the FLAGS header of the last received message
+    virtual uint8_t headerFlags();
+
+    /// Puts all the interfaces into low power sleep mode
+    /// \return true if they all support sleep mode
+    virtual bool sleep();
+
+    /// Returns the number of interfaces added with addInterface()
+    /// \return The number of interfaces
+    virtual uint8_t numInterfaces();
+
+    /// Selects the interface subsequent messages are sent on
+    /// \param[in] interface The interface number, or RH_ALL_INTERFACES (the default) for all of them
+    virtual void setTransmitInterface(uint8_t interface);
+
+    /// Returns the interface the last received message came in on
+    /// \return The interface number
+    virtual uint8_t lastInterface();
+
+private:
+    /// Sends a message on one interface, or on all of them
+    /// \param[in] interface The interface number, or RH_ALL_INTERFACES
+    /// \param[in] segments Array of segments to be sent, in order
+    /// \param[in] numSegments Number of segments
+    /// \param[in] ack true to send it with sendAck()
+    /// \return true if the message was queued for transmit on at least one interface
+    bool                sendOn(uint8_t interface, const Segment* segments, uint8_t numSegments, bool ack);
+
+    /// The combined drivers
+    RHGenericDriver*    _interfaces[RH_MULTI_DRIVER_MAX_INTERFACES];
+
+    /// Number of entries in _interfaces
+    uint8_t             _numInterfaces;
+
+    /// Interface to send on, or RH_ALL_INTERFACES
+    uint8_t             _txInterface;
+
+    /// Interface of the last message found by available()
+    uint8_t             _rxInterface;
+
+    /// true if the message found by available() has not yet been collected
+    bool                _rxPending;
+
+    /// true if the message found by available() is lent by recvLease()
+    bool                _leased;
+};
+
+#endif
@@ -0,0 +1,103 @@
+// RHPacketBuffer.h
+//
+// Message buffer with headroom for headers added by the manager classes
+//
+// Part of the RadioHead library
+
+#ifndef RHPacketBuffer_h
+#define RHPacketBuffer_h
+
+#include <RHDatagram.h>
+
+// Space reserved in front of the message for headers. Enough for RHRouter and RHMesh headers,
+// including a source route of RH_MESH_MAX_SOURCE_ROUTE_LEN hops
+#ifndef RH_PACKET_BUFFER_HEADROOM
+#ifdef RH_EXTENDED_ADDRESSING
+#define RH_PACKET_BUFFER_HEADROOM 32
+#else
+#define RH_PACKET_BUFFER_HEADROOM 24
+#endif
+#endif
+
+/////////////////////////////////////////////////////////////////////
+/// \class RHPacketBuffer RHPacketBuffer.h <RHPacketBuffer.h>
+/// \brief Message buffer with headroom, so manager classes can add their headers without copying
+///
+/// Normally each manager class copies the message into its own buffer, after its header,
+/// before passing it down to the next class: a message sent with RHMesh::sendtoWait() is copied
+/// twice before it even reaches the driver.
+/// An RHPacketBuffer holds the message with RH_PACKET_BUFFER_HEADROOM octets of free space
+/// in front of it. The manager classes' sendtoWait(RHPacketBuffer&, ...) functions push()
+/// their headers into that space, in place, and the driver sends the whole thing from where it is.
+/// When sendtoWait() returns, the headers have been pull()ed off again, and the buffer holds
+/// just the application message, ready to be changed and sent again.
+/// \code
+/// RHPacketBuffer packet;
+/// uint8_t len = sprintf((char*)packet.data(), "Hello %d", count);
+/// packet.setLength(len);
+/// manager.sendtoWait(packet, SERVER_ADDRESS);
+/// \endcode
+class RHPacketBuffer
+{
+public:
+    /// Constructor. The buffer is empty, with RH_PACKET_BUFFER_HEADROOM octets of headroom
+    RHPacketBuffer() : _start(RH_PACKET_BUFFER_HEADROOM), _len(0) {}
+
+    /// Returns the start of the message. Write your message here, then call setLength()
+    /// \return Pointer to the first octet of the message
+    uint8_t* data() { return _buf + _start; }
+
+    /// Returns the length of the message, including any headers pushed in front of it
+    /// \return The length in octets
+    uint8_t  length() { return _len; }
+
+    /// Sets the length of the message at data()
+    /// \param[in] len The new length in octets
+    /// \return false if len is more than fits after data()
+    bool     setLength(uint8_t len)
+    {
+	if (len > sizeof(_buf) - _start)
+	    return false;
+	_len = len;
+	return true;
+    }
+
+    /// Returns the space available in front of the message for more headers
+    /// \return The headroom in octets
+    uint8_t  headroom() { return _start; }
+
+    /// Adds space for a header in front of the message.
+    /// \param[in] len Length of the header in octets
+    /// \return Pointer to the header, which is the new start of the message, or NULL if there is not
+    /// enough headroom
+    uint8_t* push(uint8_t len)
+    {
+	if (len > _start)
+	    return NULL;
+	_start -= len;
+	_len += len;
+	return data();
+    }
+
+    /// Removes a header from the front of the message
+    /// \param[in] len Length of the header in octets
+    void     pull(uint8_t len)
+    {
+	if (len > _len)
+	    len = _len;
+	_start += len;
+	_len -= len;
+    }
+
+private:
+    /// The headroom followed by the message
+    uint8_t _buf[RH_MAX_MESSAGE_LEN];
+
+    /// Index of the first octet of the message in _buf
+    uint8_t _start;
+
+    /// Length of the message
+    uint8_t _len;
+};
+
+#endif
@@ -15,7 +15,7 @@
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress) 
+RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHDatagram(driver, thisAddress)
 {
     _retransmissions = 0;
@@ -23,6 +23,14 @@ RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddr
     _timeout = RH_DEFAULT_TIMEOUT;
     _retries = RH_DEFAULT_RETRIES;
     memset(_seenIds, 0, sizeof(_seenIds));
+#ifdef RH_EXTENDED_ADDRESSING
+    memset(_seenFrom, 0, sizeof(_seenFrom));
+#endif
+    _lastSendTime = 0;
+    _acceptAggregateAcks = false;
+    _ackAggregationWindow = 0;
+    _numPendingAcks = 0;
+    setCongestionControl(false);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -30,6 +38,8 @@ RHReliableDatagram::RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddr
 void RHReliableDatagram::setTimeout(uint16_t timeout)
 {
     _timeout = timeout;
+    if (!_congestionControl || _congestion.backoffWindow < _timeout)
+	_congestion.backoffWindow = _timeout;
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -45,17 +55,24 @@ uint8_t RHReliableDatagram::retries()
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
+bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, RHAddress address)
 {
     // Assemble the message
     uint8_t thisSequenceNumber = ++_lastSequenceNumber;
     uint8_t retries = 0;
+    flushAcks(); // Dont hold up ACKs to others while we wait for ours
     while (retries++ <= _retries)
     {
+	waitSendInterval();
 	setHeaderId(thisSequenceNumber);
-	setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_ACK); // Clear the ACK flag
+	// Clear the ACK flag, and tell the receiver whether we can take an aggregated ACK
+	setHeaderFlags(_acceptAggregateAcks ? RH_FLAGS_AGGREGATE : RH_FLAGS_NONE, RH_FLAGS_ACK | RH_FLAGS_AGGREGATE);
+	uint16_t cadBusy = _driver.cadBusy();
 	sendto(buf, len, address);
 	waitPacketSent();
+	_lastSendTime = millis();
+	if (_driver.cadBusy() != cadBusy)
+	    congestionDetected(); // Had to back off for a busy channel
 
 	// Never wait for ACKS to broadcasts:
 	if (address == RH_BROADCAST_ADDRESS)
@@ -65,21 +82,27 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 	    _retransmissions++;
 	unsigned long thisSendTime = millis(); // Timeout does not include original transmit time
 
-	// Compute a new timeout, random between _timeout and _timeout*2
+	// Compute a new timeout, random between _timeout and _timeout plus the backoff window
 	// This is to prevent collisions on every retransmit
 	// if 2 nodes try to transmit at the same time
-#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
-	uint16_t timeout = _timeout + (_timeout * (random() & 0xFF) / 256);
-#else
-	uint16_t timeout = _timeout + (_timeout * random(0, 256) / 256);
-#endif
+	uint16_t timeout = retransmitTimeout();
 	int32_t timeLeft;
         while ((timeLeft = timeout - (millis() - thisSendTime)) > 0)
 	{
 	    if (waitAvailableTimeout(timeLeft))
 	    {
-		uint8_t from, to, id, flags;
-		if (recvfrom(0, 0, &from, &to, &id, &flags)) // Discards the message
+		RHAddress from, to;
+		uint8_t id, flags;
+		uint8_t ack[RH_AGGREGATE_ACK_MAX * RH_AGGREGATE_ACK_ENTRY_LEN];
+		uint8_t ackLen = sizeof(ack);
+		// A subclass may want to keep new messages that arrive while we wait
+		uint8_t* rxBuf = holdBuffer(&ackLen);
+		if (!rxBuf)
+		{
+		    rxBuf = ack;
+		    ackLen = sizeof(ack);
+		}
+		if (recvfrom(rxBuf, &ackLen, &from, &to, &id, &flags)) // Discards the message unless held
 		{
 		    // Now have a message: is it our ACK?
 		    if (   from == address 
@@ -88,14 +111,48 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 			   && (id == thisSequenceNumber))
 		    {
 			// Its the ACK we are waiting for
+			congestionRelieved();
 			return true;
 		    }
+		    else if (   _acceptAggregateAcks
+			     && from == address
+			     && to == RH_BROADCAST_ADDRESS
+			     && (flags & RH_FLAGS_ACK)
+			     && (flags & RH_FLAGS_AGGREGATE))
+		    {
+			// An aggregated ACK: look for our entry
+			uint8_t i;
+			for (i = 0; i + RH_AGGREGATE_ACK_ENTRY_LEN <= ackLen; i += RH_AGGREGATE_ACK_ENTRY_LEN)
+			{
+			    if (   RH_ADDRESS_GET(rxBuf + i) == _thisAddress
+				&& rxBuf[i + sizeof(RHAddress)] == thisSequenceNumber)
+			    {
+				congestionRelieved();
+				return true;
+			    }
+			}
+		    }
 		    else if (   !(flags & RH_FLAGS_ACK)
-				&& (id == _seenIds[from]))
+				&& isDuplicate(from, id))
 		    {
 			// This is a request we have already received. ACK it again
 			acknowledge(id, from);
 		    }
+		    else if (   !(flags & RH_FLAGS_ACK)
+			     && rxBuf != ack)
+		    {
+			// A new message, and there was room to keep it. ACK it now so the sender 
+			// does not have to wait for us
+			if (to != RH_BROADCAST_ADDRESS)
+			{
+			    if (_ackAggregationWindow && (flags & RH_FLAGS_AGGREGATE))
+				acknowledgeAggregated(id, from);
+			    else
+				acknowledge(id, from);
+			}
+			setSeenId(from, id);
+			holdMessage(ackLen, from, to, id, flags);
+		    }
 		    // Else discard it
 		}
 	    }
@@ -103,6 +160,7 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 	    YIELD;
 	}
 	// Timeout exhausted, maybe retry
+	congestionDetected();
 	YIELD;
     }
     // Retries exhausted
@@ -110,12 +168,13 @@ bool RHReliableDatagram::sendtoWait(uint8_t* buf, uint8_t len, uint8_t address)
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {  
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
+    checkAckAggregation();
     // Get the message before its clobbered by the ACK (shared rx and tx buffer in some drivers
     if (available() && recvfrom(buf, len, &_from, &_to, &_id, &_flags))
     {
@@ -127,16 +186,19 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
 	    {
 		// Its not a broadcast, so ACK it
 		// Acknowledge message with ACK set in flags and ID set to received ID
-		acknowledge(_id, _from);
+		if (_ackAggregationWindow && (_flags & RH_FLAGS_AGGREGATE))
+		    acknowledgeAggregated(_id, _from);
+		else
+		    acknowledge(_id, _from);
 	    }
 	    // If we have not seen this message before, then we are interested in it
-	    if (_id != _seenIds[_from])
+	    if (!isDuplicate(_from, _id))
 	    {
 		if (from)  *from =  _from;
 		if (to)    *to =    _to;
 		if (id)    *id =    _id;
 		if (flags) *flags = _flags;
-		_seenIds[_from] = _id;
+		setSeenId(_from, _id);
 		return true;
 	    }
 	    // Else just re-ack it and wait for a new one
@@ -146,17 +208,55 @@ bool RHReliableDatagram::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from,
     return false;
 }
 
-bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* from, uint8_t* to, uint8_t* id, uint8_t* flags)
+bool RHReliableDatagram::recvfromAckLease(RHGenericDriver::RxLease* lease)
+{
+    checkAckAggregation();
+    if (!recvfromLease(lease))
+	return false;
+
+    // Never ACK an ACK
+    if (!(lease->headerFlags & RH_FLAGS_ACK))
+    {
+	// The driver only lends messages if its transmit buffer is separate, so it is safe to ACK 
+	// without copying the message first
+	if (lease->headerTo != RH_BROADCAST_ADDRESS)
+	{
+	    if (_ackAggregationWindow && (lease->headerFlags & RH_FLAGS_AGGREGATE))
+		acknowledgeAggregated(lease->headerId, lease->headerFrom);
+	    else
+		acknowledge(lease->headerId, lease->headerFrom);
+	}
+	// If we have not seen this message before, then we are interested in it
+	if (!isDuplicate(lease->headerFrom, lease->headerId))
+	{
+	    setSeenId(lease->headerFrom, lease->headerId);
+	    return true;
+	}
+    }
+    releaseLease();
+    return false;
+}
+
+bool RHReliableDatagram::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* from, RHAddress* to, uint8_t* id, uint8_t* flags)
 {
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
+	// Wake up in time to send any pending aggregated ACKs
+	if (_numPendingAcks)
+	{
+	    int32_t ackTimeLeft = _ackAggregationWindow - (millis() - _pendingAcksSince);
+	    if (ackTimeLeft < timeLeft)
+		timeLeft = ackTimeLeft > 0 ? ackTimeLeft : 1;
+	}
 	if (waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, from, to, id, flags))
 		return true;
 	}
+	else
+	    checkAckAggregation();
 	YIELD;
     }
     return false;
@@ -171,18 +271,165 @@ void RHReliableDatagram::resetRetransmissions()
 {
     _retransmissions = 0;
 }
+
+void RHReliableDatagram::setAcceptAggregateAcks(bool accept)
+{
+    _acceptAggregateAcks = accept;
+}
+
+void RHReliableDatagram::setAckAggregationWindow(uint16_t window)
+{
+    flushAcks();
+    _ackAggregationWindow = window;
+}
+
+void RHReliableDatagram::acknowledgeAggregated(uint8_t id, RHAddress from)
+{
+    uint8_t i;
+    uint8_t* entry;
+    // A retransmission we have not yet acknowledged is already in the list
+    for (i = 0; i < _numPendingAcks; i++)
+    {
+	entry = _pendingAcks + i * RH_AGGREGATE_ACK_ENTRY_LEN;
+	if (RH_ADDRESS_GET(entry) == from && entry[sizeof(RHAddress)] == id)
+	    return;
+    }
+
+    if (!_numPendingAcks)
+	_pendingAcksSince = millis();
+    entry = _pendingAcks + _numPendingAcks * RH_AGGREGATE_ACK_ENTRY_LEN;
+    RH_ADDRESS_PUT(entry, from);
+    entry[sizeof(RHAddress)] = id;
+    _numPendingAcks++;
+    if (   _numPendingAcks >= RH_AGGREGATE_ACK_MAX 
+	|| (_numPendingAcks + 1) * RH_AGGREGATE_ACK_ENTRY_LEN > maxMessageLength())
+	flushAcks();
+}
+
+void RHReliableDatagram::checkAckAggregation()
+{
+    if (_numPendingAcks && millis() - _pendingAcksSince >= _ackAggregationWindow)
+	flushAcks();
+}
+
+void RHReliableDatagram::flushAcks()
+{
+    if (!_numPendingAcks)
+	return;
+    setHeaderId(0);
+    setHeaderFlags(RH_FLAGS_ACK | RH_FLAGS_AGGREGATE);
+    setHeaderTo(RH_BROADCAST_ADDRESS);
+    sendAck(_pendingAcks, _numPendingAcks * RH_AGGREGATE_ACK_ENTRY_LEN);
+    waitPacketSent();
+    _numPendingAcks = 0;
+}
+
+void RHReliableDatagram::setCongestionControl(bool enable)
+{
+    _congestionControl = enable;
+    _congestion.backoffWindow = _timeout;
+    _congestion.sendInterval = 0;
+    _congestion.congestionEvents = 0;
+    _congestion.acks = 0;
+}
+
+const RHReliableDatagram::CongestionState* RHReliableDatagram::congestionState()
+{
+    return &_congestion;
+}
+
+void RHReliableDatagram::waitSendInterval()
+{
+    if (!_congestionControl)
+	return;
+    unsigned long elapsed = millis() - _lastSendTime;
+    if (elapsed < _congestion.sendInterval)
+	delay(_congestion.sendInterval - elapsed);
+}
+
+void RHReliableDatagram::congestionDetected()
+{
+    if (!_congestionControl)
+	return;
+    _congestion.congestionEvents++;
+    // Multiplicative increase of the backoff window and send interval, ie multiplicative decrease of the rate
+    uint32_t window = (uint32_t)_congestion.backoffWindow * 2;
+    _congestion.backoffWindow = window > RH_CONGESTION_MAX_BACKOFF ? RH_CONGESTION_MAX_BACKOFF : window;
+    uint32_t interval = _congestion.sendInterval ? (uint32_t)_congestion.sendInterval * 2 : RH_CONGESTION_DECREASE_STEP;
+    _congestion.sendInterval = interval > RH_CONGESTION_MAX_SEND_INTERVAL ? RH_CONGESTION_MAX_SEND_INTERVAL : interval;
+}
+
+void RHReliableDatagram::congestionRelieved()
+{
+    if (!_congestionControl)
+	return;
+    _congestion.acks++;
+    // Additive decrease of the backoff window and send interval, ie additive increase of the rate
+    if (_congestion.backoffWindow > _timeout + RH_CONGESTION_DECREASE_STEP)
+	_congestion.backoffWindow -= RH_CONGESTION_DECREASE_STEP;
+    else
+	_congestion.backoffWindow = _timeout;
+    if (_congestion.sendInterval > RH_CONGESTION_DECREASE_STEP)
+	_congestion.sendInterval -= RH_CONGESTION_DECREASE_STEP;
+    else
+	_congestion.sendInterval = 0;
+}
+
+uint8_t* RHReliableDatagram::holdBuffer(uint8_t* len)
+{
+    (void)len;
+    return NULL;
+}
+
+void RHReliableDatagram::holdMessage(uint8_t len, RHAddress from, RHAddress to, uint8_t id, uint8_t flags)
+{
+    (void)len; (void)from; (void)to; (void)id; (void)flags;
+}
+
+uint16_t RHReliableDatagram::retransmitTimeout()
+{
+    uint16_t window = _congestionControl ? _congestion.backoffWindow : _timeout;
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) // use standard library random(), bugs in random(min, max)
+    return _timeout + ((uint32_t)window * (random() & 0xFF) / 256);
+#else
+    return _timeout + ((uint32_t)window * random(0, 256) / 256);
+#endif
+}
  
-void RHReliableDatagram::acknowledge(uint8_t id, uint8_t from)
+bool RHReliableDatagram::isDuplicate(RHAddress from, uint8_t id)
+{
+#ifdef RH_EXTENDED_ADDRESSING
+    uint8_t slot = RH_ADDRESS_HASH(from);
+    return _seenFrom[slot] == from && _seenIds[slot] == id;
+#else
+    return _seenIds[from] == id;
+#endif
+}
+
+void RHReliableDatagram::setSeenId(RHAddress from, uint8_t id)
+{
+#ifdef RH_EXTENDED_ADDRESSING
+    uint8_t slot = RH_ADDRESS_HASH(from);
+    _seenFrom[slot] = from;
+    _seenIds[slot] = id;
+#else
+    _seenIds[from] = id;
+#endif
+}
+
+void RHReliableDatagram::acknowledge(uint8_t id, RHAddress from)
 {
+    setHeaderFlags(RH_FLAGS_ACK, RH_FLAGS_AGGREGATE | RH_FLAGS_APPLICATION_SPECIFIC);
     setHeaderId(id);
-    setHeaderFlags(RH_FLAGS_ACK);
     // We would prefer to send a zero length ACK,
     // but if an RH_RF22 receives a 0 length message with a CRC error, it will never receive
     // a 0 length message again, until its reset, which makes everything hang :-(
     // So we send an ACK of 1 octet
     // REVISIT: should we send the RSSI for the information of the sender?
     uint8_t ack = '!';
-    sendto(&ack, sizeof(ack), from); 
+    setHeaderTo(from);
+    // The driver may have a faster path for ACKs than sendto()
+    sendAck(&ack, sizeof(ack));
     waitPacketSent();
 }
 
@@ -14,12 +14,31 @@
 // for application layer use.
 #define RH_FLAGS_ACK 0x80
 
+// The aggregated acknowledgement bit in the FLAGS
+// In a message: the sender can accept aggregated ACKs. With RH_FLAGS_ACK: this is an aggregated ACK
+#define RH_FLAGS_AGGREGATE 0x20
+
+/// The maximum number of (source, id) pairs carried in one aggregated ACK
+#define RH_AGGREGATE_ACK_MAX 32
+
+/// The length of each (source, id) pair in an aggregated ACK
+#define RH_AGGREGATE_ACK_ENTRY_LEN (sizeof(RHAddress) + 1)
+
 /// the default retry timeout in milliseconds
 #define RH_DEFAULT_TIMEOUT 200
 
 /// The default number of retries
 #define RH_DEFAULT_RETRIES 3
 
+/// The largest retransmit backoff window the congestion controller will use, in milliseconds
+#define RH_CONGESTION_MAX_BACKOFF 5000
+
+/// The largest interval between transmissions the congestion controller will impose, in milliseconds
+#define RH_CONGESTION_MAX_SEND_INTERVAL 2000
+
+/// The additive step in milliseconds by which the backoff window and send interval shrink after each ACK
+#define RH_CONGESTION_DECREASE_STEP 100
+
 /////////////////////////////////////////////////////////////////////
 /// \class RHReliableDatagram RHReliableDatagram.h <RHReliableDatagram.h>
 /// \brief RHDatagram subclass for sending addressed, acknowledged, retransmitted datagrams.
@@ -69,6 +88,35 @@
 /// retransmit strategy and configuration lest they hang for a long time
 /// trying to reply to clients that are unreachable.
 ///
+/// \par Aggregated Acknowledgements
+///
+/// A gateway receiving from many nodes can spend most of its transmit time on individual ACKs.
+/// With setAckAggregationWindow(), a receiver collects the (source, id) pairs of messages it has
+/// accepted within the window and broadcasts them all in one aggregated ACK:
+/// - TO set to RH_BROADCAST_ADDRESS
+/// - FROM set to this node address
+/// - FLAGS with RH_FLAGS_ACK and RH_FLAGS_AGGREGATE set
+/// - a payload of up to RH_AGGREGATE_ACK_MAX pairs of source address (1 octet, or 2 with RH_EXTENDED_ADDRESSING) and 1 octet ID
+///
+/// This is negotiated per peer: only messages whose sender has set RH_FLAGS_AGGREGATE
+/// (see setAcceptAggregateAcks()) are acknowledged this way. Messages from other nodes, and 
+/// broadcasts, get the usual per-message ACK. Pending ACKs are sent when the window expires, when 
+/// the list is full, or before this node sends a message of its own. recvfromAck() must be 
+/// called frequently for the window to be honoured. The window must be well below the 
+/// senders' timeout (see setTimeout()).
+///
+/// \par Congestion Control
+///
+/// When many nodes retry at the same time, fixed retries and timeouts can cause retransmission storms.
+/// setCongestionControl(true) enables an AIMD congestion controller shared by all messages sent by 
+/// this instance, whatever their destination. Missing ACKs, and CAD detections of a busy 
+/// channel (see RHGenericDriver::cadBusy()) are treated as congestion. On congestion the retransmit backoff 
+/// window and the minimum interval between transmissions are doubled (up to RH_CONGESTION_MAX_BACKOFF and 
+/// RH_CONGESTION_MAX_SEND_INTERVAL). Each ACK received shrinks both by RH_CONGESTION_DECREASE_STEP,
+/// back towards the timeout set by setTimeout() and no pacing.
+/// The current state can be read with congestionState().
+/// Congestion control is disabled by default.
+///
 /// Caution: if you have a radio network with a mixture of slow and fast
 /// processors and ReliableDatagrams, you may be affected by race conditions
 /// where the fast processor acknowledges a message before the sender is ready
@@ -78,10 +126,19 @@
 class RHReliableDatagram : public RHDatagram
 {
 public:
+    /// Defines the state of the congestion controller, see congestionState()
+    typedef struct
+    {
+	uint16_t    backoffWindow;    ///< Retransmit timeouts are random between timeout and timeout + backoffWindow (ms)
+	uint16_t    sendInterval;     ///< Minimum time between the start of transmissions (ms)
+	uint32_t    congestionEvents; ///< Number of ACK timeouts and CAD busy detections seen
+	uint32_t    acks;             ///< Number of ACKs received
+    } CongestionState;
+
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHReliableDatagram(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHReliableDatagram(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Sets the minimum retransmit timeout. If sendtoWait is waiting for an ack 
     /// longer than this time (in milliseconds), 
@@ -108,7 +165,8 @@ public:
     uint8_t retries();
 
     /// Send the message (with retries) and waits for an ack. Returns true if an acknowledgement is received.
-    /// Synchronous: any message other than the desired ACK received while waiting is discarded.
+    /// Synchronous: any message other than the desired ACK received while waiting is discarded, unless
+    /// a subclass keeps it (see holdBuffer()).
     /// Blocks until an ACK is received or all retries are exhausted (ie up to retries*timeout milliseconds).
     /// If the destination address is the broadcast address RH_BROADCAST_ADDRESS (255), the message will 
     /// be sent as a broadcast, but receiving nodes do not acknowledge, and sendtoWait() returns true immediately
@@ -117,7 +175,7 @@ public:
     /// \param[in] buf Pointer to the binary message to send
     /// \param[in] len Number of octets to send
     /// \return true if the message was transmitted and an acknowledgement was received.
-    bool sendtoWait(uint8_t* buf, uint8_t len, uint8_t address);
+    bool sendtoWait(uint8_t* buf, uint8_t len, RHAddress address);
 
     /// If there is a valid message available for this node, send an acknowledgement to the SRC
     /// address (blocking until this is complete), then copy the message to buf and return true
@@ -131,13 +189,21 @@ public:
     /// It is recommended that you call it in your main loop.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+
+    /// Like recvfromAck(), but if the driver supports it, lends the new message where it lies in the 
+    /// driver instead of copying it (see RHGenericDriver::recvLease()). ACKs and duplicates are 
+    /// released without being lent.
+    /// \param[out] lease Set to describe the lent message and its headers
+    /// \return true if a new message was lent. Call releaseLease() as soon as you are finished with it, 
+    /// and before sending anything that needs an ACK
+    bool recvfromAckLease(RHGenericDriver::RxLease* lease);
 
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
     /// or the timeout expires. Starts the receiver automatically.
@@ -146,13 +212,13 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] from If present and not NULL, the referenced uint8_t will be set to the SRC address
-    /// \param[in] to If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] from If present and not NULL, the referenced RHAddress will be set to the SRC address
+    /// \param[in] to If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* from = NULL, uint8_t* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* from = NULL, RHAddress* to = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Returns the number of retransmissions 
     /// we have had to send since starting or since the last call to resetRetransmissions().
@@ -163,17 +229,92 @@ public:
     /// to 0. 
     void resetRetransmissions(); 
 
+    /// Tells peers that this node can accept aggregated ACKs, by setting RH_FLAGS_AGGREGATE
+    /// in messages sent by sendtoWait(). Also makes sendtoWait() recognise its own entry in aggregated ACKs.
+    /// Defaults to false.
+    /// \param[in] accept true to accept aggregated ACKs
+    void setAcceptAggregateAcks(bool accept);
+
+    /// Sets the time to collect ACKs for peers that accept aggregated ACKs before broadcasting 
+    /// them in one aggregated ACK. 0 (the default) disables aggregation and every message is acknowledged 
+    /// individually.
+    /// \param[in] window The aggregation window in milliseconds
+    void setAckAggregationWindow(uint16_t window);
+
+    /// Broadcasts any pending aggregated ACKs now.
+    void flushAcks();
+
+    /// Enables or disables the congestion controller. See the Congestion Control section above.
+    /// Enabling it resets its state. Defaults to false.
+    /// \param[in] enable true to enable congestion control
+    void setCongestionControl(bool enable);
+
+    /// Returns the current state of the congestion controller.
+    /// \return Pointer to the current congestion state
+    const CongestionState* congestionState();
+
 protected:
     /// Send an ACK for the message id to the given from address
-    /// Blocks until the ACK has been sent
-    void acknowledge(uint8_t id, uint8_t from);
+    /// Blocks until the ACK has been sent. Uses the driver's sendAck() fast path where available
+    void acknowledge(uint8_t id, RHAddress from);
+
+    /// Adds an ACK to the list of pending aggregated ACKs, flushing the list if it is full
+    void acknowledgeAggregated(uint8_t id, RHAddress from);
+
+    /// Broadcasts pending aggregated ACKs if the aggregation window has expired
+    void checkAckAggregation();
 
     /// Checks whether the message currently in the Rx buffer is a new message, not previously received
     /// based on the from address and the sequence.  If it is new, it is acknowledged and returns true
     /// \return true if there is a message received and it is a new message
     bool haveNewMessage();
 
-private:
+    /// Tells whether id is the last sequence number seen from a node
+    /// \param[in] from The node the message came from
+    /// \param[in] id The ID of the message
+    /// \return true if the message is a duplicate
+    bool isDuplicate(RHAddress from, uint8_t id);
+
+    /// Records the last sequence number seen from a node, for isDuplicate()
+    /// \param[in] from The node the message came from
+    /// \param[in] id The ID of the message
+    void setSeenId(RHAddress from, uint8_t id);
+
+    /// If congestion control is enabled, blocks until the current send interval
+    /// has passed since the last transmission
+    void waitSendInterval();
+
+    /// Tells the congestion controller about a congestion signal (ACK loss or busy channel).
+    /// Multiplicatively increases the backoff window and send interval
+    void congestionDetected();
+
+    /// Tells the congestion controller an ACK was received.
+    /// Additively decreases the backoff window and send interval
+    void congestionRelieved();
+
+    /// Computes a retransmit timeout, random between the timeout and the timeout plus the backoff window
+    /// \return The timeout in milliseconds
+    uint16_t retransmitTimeout();
+
+    /// Called by sendtoWait() when a message arrives while it is waiting for an ACK, to ask 
+    /// where to keep the message if it turns out to be new. Subclasses override this, together 
+    /// with holdMessage(), to keep messages that would otherwise be discarded. 
+    /// The default returns NULL, which discards them.
+    /// \param[out] len Set to the available space in the returned buffer
+    /// \return Pointer to a buffer for the message, or NULL to discard it
+    virtual uint8_t* holdBuffer(uint8_t* len);
+
+    /// Called by sendtoWait() when a new message (not an ACK or a duplicate) was received into 
+    /// the buffer returned by holdBuffer(). The message has already been acknowledged, 
+    /// and will not be returned by recvfromAck(), so the subclass must deliver it itself.
+    /// \param[in] len Length of the message in the buffer
+    /// \param[in] from The FROM header of the message
+    /// \param[in] to The TO header of the message
+    /// \param[in] id The ID header of the message
+    /// \param[in] flags The FLAGS header of the message
+    virtual void holdMessage(uint8_t len, RHAddress from, RHAddress to, uint8_t id, uint8_t flags);
+
+protected:
     /// Count of retransmissions we have had to send
     uint32_t _retransmissions;
 
@@ -193,7 +334,38 @@ private:
     /// It is used for duplicate detection. Duplicated messages are re-acknowledged when received 
     /// (this is generally due to lost ACKs, causing the sender to retransmit, even though we have already
     /// received that message)
+    /// With RH_EXTENDED_ADDRESSING it is indexed by RH_ADDRESS_HASH() of the address, and a node whose 
+    /// address shares a slot with another can occasionally have a duplicate accepted.
     uint8_t _seenIds[256];
+
+#ifdef RH_EXTENDED_ADDRESSING
+    /// The node address that each entry in _seenIds was seen from
+    RHAddress _seenFrom[256];
+#endif
+
+    /// Whether we set RH_FLAGS_AGGREGATE in our messages
+    bool            _acceptAggregateAcks;
+
+    /// ACK aggregation window in milliseconds, 0 if disabled
+    uint16_t        _ackAggregationWindow;
+
+    /// Pending aggregated ACKs, as pairs of source address and ID
+    uint8_t         _pendingAcks[RH_AGGREGATE_ACK_MAX * RH_AGGREGATE_ACK_ENTRY_LEN];
+
+    /// Number of pending aggregated ACKs
+    uint8_t         _numPendingAcks;
+
+    /// millis() when the first pending aggregated ACK was added
+    unsigned long   _pendingAcksSince;
+
+    /// Whether congestion control is enabled
+    bool            _congestionControl;
+
+    /// Congestion controller state
+    CongestionState _congestion;
+
+    /// millis() at the end of the last transmission, for pacing
+    unsigned long   _lastSendTime;
 };
 
 /// @example rf22_reliable_datagram_client.pde
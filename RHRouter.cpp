@@ -12,15 +12,49 @@
 // $Id: RHRouter.cpp,v 1.7 2015/08/13 02:45:47 mikem Exp $
 
 #include <RHRouter.h>
-
-RHRouter::RoutedMessage RHRouter::_tmpMessage;
+#ifdef RH_ROUTER_HAVE_STATE_FILE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////
 // Constructors
-RHRouter::RHRouter(RHGenericDriver& driver, uint8_t thisAddress) 
+RHRouter::RHRouter(RHGenericDriver& driver, RHAddress thisAddress) 
     : RHReliableDatagram(driver, thisAddress)
 {
     _max_hops = RH_DEFAULT_MAX_HOPS;
+    _routeTimeout = 0;
+    _routeHysteresis = RH_ROUTER_DEFAULT_ROUTE_HYSTERESIS;
+    _storeAndForward = false;
+    _heldHead = 0;
+    _numHeld = 0;
+    _previousHop = RH_BROADCAST_ADDRESS;
+    _previousInterface = 0;
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_FLOOD_CACHE_SIZE; i++)
+	_floods[i].source = RH_BROADCAST_ADDRESS;
+    _nextFlood = 0;
+    _numGroups = 0;
+    for (i = 0; i < RH_ROUTER_MAX_DELIVERY_REPORTS; i++)
+	_deliveries[i].dest = RH_BROADCAST_ADDRESS;
+    _e2eAckTimeout = RH_ROUTER_DEFAULT_E2E_ACK_TIMEOUT;
+    _numE2EAcks = 0;
+    _e2eAckDelay = 0;
+    _lastE2ESequenceNumber = 0;
+    _routes = _localState.routes;
+    _lruPrev = _localState.lruPrev;
+    _lruNext = _localState.lruNext;
+    _links = _localState.links;
+#ifdef RH_ROUTING_TABLE_HASHED
+    _linkNeighbour = _localState.linkNeighbour;
+    memset(&_noLink, 0, sizeof(_noLink));
+#endif
+#ifdef RH_ROUTER_HAVE_STATE_FILE
+    _stateFile = NULL;
+#endif
+    memset(&_localState, 0, sizeof(_localState));
     clearRoutingTable();
 }
 
@@ -41,155 +75,947 @@ void RHRouter::setMaxHops(uint8_t max_hops)
 }
 
 ////////////////////////////////////////////////////////////////////
-void RHRouter::addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state)
+void RHRouter::setRouteTimeout(unsigned long timeout)
 {
-    uint8_t i;
+    _routeTimeout = timeout;
+}
 
-    // First look for an existing entry we can update
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+void RHRouter::addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state, uint8_t cost, uint8_t interface)
+{
+    if (state == Invalid)
     {
-	if (_routes[i].dest == dest)
-	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
-	}
+	deleteRouteTo(dest);
+	return;
     }
 
-    // Look for an invalid entry we can use
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    // Need to make room for a new one?
+    uint8_t index = routeIndex(dest);
+    if (_routes[index].state == Invalid && _numRoutes >= RH_ROUTING_TABLE_SIZE)
     {
-	if (_routes[i].state == Invalid)
+	retireOldestRoute();
+	index = routeIndex(dest); // Other routes may have moved
+    }
+
+    touchRoute(index);
+    _routes[index].dest = dest;
+    _routes[index].next_hop = next_hop;
+    _routes[index].interface = interface;
+    _routes[index].state = state;
+    _routes[index].cost = cost;
+    _routes[index].confirmed = _routes[index].lastUsed;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::updateRouteTo(RHAddress dest, RHAddress next_hop, uint8_t cost, unsigned long age, uint8_t interface)
+{
+    RoutingTableEntry* route = getRouteTo(dest);
+    if (route && route->next_hop == next_hop && interface == RH_ALL_INTERFACES)
+	interface = route->interface;
+    bool samePath = route && route->next_hop == next_hop && route->interface == interface;
+    if (   route
+	&& route->cost != 0
+	&& !samePath
+	&& addCost(cost, _routeHysteresis) >= route->cost)
+	return false; // Not enough better than what we have
+
+    unsigned long confirmed = millis() - age;
+    if (samePath && (long)(route->confirmed - confirmed) > 0)
+	confirmed = route->confirmed; // Already have more recent news of this path
+    addRouteTo(dest, next_hop, Valid, cost, interface);
+    _routes[routeIndex(dest)].confirmed = confirmed;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+unsigned long RHRouter::routeAge(const RoutingTableEntry* route)
+{
+    if (route->state == Restored)
+	return (unsigned long)-1;
+    return millis() - route->confirmed;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setRouteHysteresis(uint8_t hysteresis)
+{
+    _routeHysteresis = hysteresis;
+}
+
+////////////////////////////////////////////////////////////////////
+const RHRouter::LinkMetrics* RHRouter::linkMetrics(RHAddress neighbour, uint8_t interface)
+{
+    if (interface == RH_ALL_INTERFACES)
+	interface = bestInterface(neighbour);
+    return findLink(neighbour, interface == RH_ALL_INTERFACES ? 0 : interface, false);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::linkCost(RHAddress neighbour, uint8_t interface)
+{
+    if (interface == RH_ALL_INTERFACES)
+	interface = bestInterface(neighbour);
+    LinkMetrics* link = findLink(neighbour, interface == RH_ALL_INTERFACES ? 0 : interface, false);
+    uint8_t cost = link->etx ? link->etx : RH_ROUTER_LINK_COST_SCALE;
+    if (link->rssiValid && link->rssi < RH_ROUTER_RSSI_WEAK)
+    {
+	uint16_t penalty = (RH_ROUTER_RSSI_WEAK - link->rssi) / RH_ROUTER_RSSI_PENALTY_STEP + 1;
+	cost = addCost(cost, penalty > RH_ROUTER_MAX_COST ? RH_ROUTER_MAX_COST : penalty);
+    }
+    return cost;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::bestInterface(RHAddress neighbour)
+{
+    uint8_t numInterfaces = _driver.numInterfaces();
+    if (numInterfaces <= 1)
+	return 0;
+    if (numInterfaces > RH_ROUTER_MAX_INTERFACES)
+	return RH_ALL_INTERFACES; // Cant tell the links apart
+
+    uint8_t best = RH_ALL_INTERFACES;
+    uint8_t bestCost = RH_ROUTER_MAX_COST;
+    uint8_t i;
+    for (i = 0; i < numInterfaces; i++)
+    {
+	LinkMetrics* link = findLink(neighbour, i, false);
+	if (!link->etx && !link->rssiValid)
+	    continue; // Never heard it on this one
+	uint8_t cost = linkCost(neighbour, i);
+	if (best == RH_ALL_INTERFACES || cost < bestCost)
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
-	    return;
+	    best = i;
+	    bestCost = cost;
 	}
     }
+    return best;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::addCost(uint8_t a, uint8_t b)
+{
+    uint16_t sum = a + b;
+    return sum > RH_ROUTER_MAX_COST ? RH_ROUTER_MAX_COST : sum;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::updateLinkEtx(RHAddress neighbour, uint8_t interface, bool delivered, uint8_t transmissions)
+{
+    // A failed delivery counts as twice the transmissions that were wasted on it
+    uint16_t sample = (uint16_t)transmissions * RH_ROUTER_LINK_COST_SCALE;
+    if (!delivered)
+	sample *= 2;
+    if (sample > RH_ROUTER_MAX_COST)
+	sample = RH_ROUTER_MAX_COST;
+
+    // Exponentially weighted moving average, new samples weighted 1/4
+    LinkMetrics* link = findLink(neighbour, interface, true);
+    if (link->etx == 0)
+	link->etx = sample;
+    else
+	link->etx = ((uint16_t)link->etx * 3 + sample + 2) / 4;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::updateLinkRssi(RHAddress neighbour, uint8_t interface, int8_t rssi)
+{
+    LinkMetrics* link = findLink(neighbour, interface, true);
+    if (!link->rssiValid)
+    {
+	link->rssi = rssi;
+	link->rssiValid = true;
+    }
+    else
+	link->rssi = ((int16_t)link->rssi * 3 + rssi) / 4;
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::LinkMetrics* RHRouter::findLink(RHAddress neighbour, uint8_t interface, bool create)
+{
+    uint16_t base = (uint16_t)(interface < RH_ROUTER_MAX_INTERFACES ? interface : RH_ROUTER_MAX_INTERFACES - 1) * RH_ROUTING_TABLE_SLOTS;
+#ifdef RH_ROUTING_TABLE_HASHED
+    uint16_t slot = base + (RH_ADDRESS_HASH(neighbour) & (RH_ROUTING_TABLE_SLOTS - 1));
+    if (_linkNeighbour[slot] != neighbour)
+    {
+	if (!create)
+	    return &_noLink;
+	// Take over the slot
+	_linkNeighbour[slot] = neighbour;
+	memset(&_links[slot], 0, sizeof(_links[slot]));
+    }
+    return &_links[slot];
+#else
+    (void)create;
+    return &_links[base + neighbour];
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::getRouteTo(RHAddress dest)
+{
+    uint8_t index = routeIndex(dest);
+    if (_routes[index].state == Invalid)
+	return NULL;
+    if (_routeTimeout && (millis() - _routes[index].lastUsed) > _routeTimeout)
+    {
+	// Expired
+	deleteRoute(index);
+	return NULL;
+    }
+    touchRoute(index);
+    return &_routes[index];
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setStoreAndForward(bool storeAndForward)
+{
+    _storeAndForward = storeAndForward;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::numHeldMessages()
+{
+    return _numHeld;
+}
+
+////////////////////////////////////////////////////////////////////
+RHAddress RHRouter::previousHop()
+{
+    return _previousHop;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::previousInterface()
+{
+    return _previousInterface;
+}
+
+#if RH_ROUTER_FORWARDING_QUEUE_LEN > 0
+////////////////////////////////////////////////////////////////////
+uint8_t* RHRouter::holdBuffer(uint8_t* len)
+{
+    if (!_storeAndForward || _numHeld >= RH_ROUTER_FORWARDING_QUEUE_LEN)
+	return NULL;
+    *len = sizeof(RoutedMessage);
+    return (uint8_t*)&_held[(_heldHead + _numHeld) % RH_ROUTER_FORWARDING_QUEUE_LEN].message;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::holdMessage(uint8_t len, RHAddress from, RHAddress to, uint8_t id, uint8_t flags)
+{
+    if (len < sizeof(RoutedMessageHeader))
+	return; // Not one of ours
+    HeldMessage* h = &_held[(_heldHead + _numHeld) % RH_ROUTER_FORWARDING_QUEUE_LEN];
+    h->len = len;
+    h->from = from;
+    h->to = to;
+    h->id = id;
+    h->flags = flags;
+    h->rssi = _driver.lastRssi();
+    h->interface = _driver.lastInterface();
+    _numHeld++;
+}
+#endif
 
-    // Need to make room for a new one
-    retireOldestRoute();
-    // Should be an invalid slot now
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+////////////////////////////////////////////////////////////////////
+RHRouter::RoutingTableEntry* RHRouter::findRouteTo(RHAddress dest)
+{
+    uint8_t index = routeIndex(dest);
+    return _routes[index].state == Invalid ? NULL : &_routes[index];
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::routeIndex(RHAddress dest)
+{
+#ifdef RH_ROUTING_TABLE_HASHED
+    // Linear probing. The table is never full, so there is always an Invalid entry to stop at
+    uint8_t index = RH_ADDRESS_HASH(dest) & (RH_ROUTING_TABLE_SLOTS - 1);
+    while (_routes[index].state != Invalid && _routes[index].dest != dest)
+	index = (index + 1) & (RH_ROUTING_TABLE_SLOTS - 1);
+    return index;
+#else
+    return dest;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::touchRoute(uint8_t index)
+{
+    _routes[index].lastUsed = millis();
+    if (_routes[index].state != Invalid)
     {
-	if (_routes[i].state == Invalid)
+	if (index == _lruHead)
+	    return; // Already the most recently used
+	// Unlink it from where it is now
+	if (index == _lruTail)
+	{
+	    _lruTail = _lruPrev[index];
+	    _lruNext[_lruTail] = _lruTail;
+	}
+	else
 	{
-	    _routes[i].dest = dest;
-	    _routes[i].next_hop = next_hop;
-	    _routes[i].state = state;
+	    _lruNext[_lruPrev[index]] = _lruNext[index];
+	    _lruPrev[_lruNext[index]] = _lruPrev[index];
 	}
     }
+    else if (_numRoutes++ == 0)
+    {
+	// First route in the table
+	_lruHead = _lruTail = _lruPrev[index] = _lruNext[index] = index;
+	return;
+    }
+    // Put it at the head
+    _lruPrev[index] = index;
+    _lruNext[index] = _lruHead;
+    _lruPrev[_lruHead] = index;
+    _lruHead = index;
 }
 
 ////////////////////////////////////////////////////////////////////
-RHRouter::RoutingTableEntry* RHRouter::getRouteTo(uint8_t dest)
+void RHRouter::deleteRoute(uint8_t index)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-	if (_routes[i].dest == dest && _routes[i].state != Invalid)
-	    return &_routes[i];
-    return NULL;
+    if (_routes[index].state == Invalid)
+	return;
+    _routes[index].state = Invalid;
+    if (--_numRoutes == 0)
+	return;
+    // Unlink it from the LRU list
+    if (index == _lruHead)
+    {
+	_lruHead = _lruNext[index];
+	_lruPrev[_lruHead] = _lruHead;
+    }
+    else if (index == _lruTail)
+    {
+	_lruTail = _lruPrev[index];
+	_lruNext[_lruTail] = _lruTail;
+    }
+    else
+    {
+	_lruNext[_lruPrev[index]] = _lruNext[index];
+	_lruPrev[_lruNext[index]] = _lruPrev[index];
+    }
+#ifdef RH_ROUTING_TABLE_HASHED
+    // Close the gap in the probe sequence, so that routeIndex() finds the routes after it:
+    // move back each following route that may be stored in the now empty entry
+    uint8_t empty = index;
+    uint8_t i = (index + 1) & (RH_ROUTING_TABLE_SLOTS - 1);
+    while (_routes[i].state != Invalid)
+    {
+	uint8_t home = RH_ADDRESS_HASH(_routes[i].dest) & (RH_ROUTING_TABLE_SLOTS - 1);
+	if (((i - home) & (RH_ROUTING_TABLE_SLOTS - 1)) >= ((i - empty) & (RH_ROUTING_TABLE_SLOTS - 1)))
+	{
+	    moveRoute(i, empty);
+	    empty = i;
+	}
+	i = (i + 1) & (RH_ROUTING_TABLE_SLOTS - 1);
+    }
+#endif
 }
 
+#ifdef RH_ROUTING_TABLE_HASHED
 ////////////////////////////////////////////////////////////////////
-void RHRouter::deleteRoute(uint8_t index)
+void RHRouter::moveRoute(uint8_t from, uint8_t to)
 {
-    // Delete a route by copying following routes on top of it
-    memcpy(&_routes[index], &_routes[index+1], 
-	   sizeof(RoutingTableEntry) * (RH_ROUTING_TABLE_SIZE - index - 1));
-    _routes[RH_ROUTING_TABLE_SIZE - 1].state = Invalid;
+    _routes[to] = _routes[from];
+    _routes[from].state = Invalid;
+    // Relink its neighbours in the LRU list
+    if (from == _lruHead)
+    {
+	_lruHead = to;
+	_lruPrev[to] = to;
+    }
+    else
+    {
+	_lruPrev[to] = _lruPrev[from];
+	_lruNext[_lruPrev[to]] = to;
+    }
+    if (from == _lruTail)
+    {
+	_lruTail = to;
+	_lruNext[to] = to;
+    }
+    else
+    {
+	_lruNext[to] = _lruNext[from];
+	_lruPrev[_lruNext[to]] = to;
+    }
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::printRoutingTable()
 {
 #ifdef RH_HAVE_SERIAL
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    // Most recently used first
+    uint8_t i = _lruHead;
+    uint16_t n;
+    for (n = 0; n < _numRoutes; n++, i = _lruNext[i])
     {
-	Serial.print(i, DEC);
+	Serial.print((unsigned int)n, DEC);
 	Serial.print(" Dest: ");
-	Serial.print(_routes[i].dest, DEC);
+	Serial.print((unsigned int)_routes[i].dest, DEC);
 	Serial.print(" Next Hop: ");
-	Serial.print(_routes[i].next_hop, DEC);
+	Serial.print((unsigned int)_routes[i].next_hop, DEC);
 	Serial.print(" State: ");
-	Serial.println(_routes[i].state, DEC);
+	Serial.print(_routes[i].state, DEC);
+	if (_driver.numInterfaces() > 1)
+	{
+	    Serial.print(" Interface: ");
+	    Serial.print((unsigned int)_routes[i].interface, DEC);
+	}
+	Serial.print(" Cost: ");
+	Serial.println(_routes[i].cost, DEC);
     }
 #endif
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::deleteRouteTo(uint8_t dest)
+bool RHRouter::deleteRouteTo(RHAddress dest)
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
-    {
-	if (_routes[i].dest == dest)
-	{
-	    deleteRoute(i);
-	    return true;
-	}
-    }
-    return false;
+    uint8_t index = routeIndex(dest);
+    if (_routes[index].state == Invalid)
+	return false;
+    deleteRoute(index);
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::retireOldestRoute()
 {
-    // We just obliterate the first in the table and clear the last
-    deleteRoute(0);
+    // The tail of the LRU list is the least recently used
+    if (_numRoutes)
+	deleteRoute(_lruTail);
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::numRoutes()
+{
+    return _numRoutes;
 }
 
 ////////////////////////////////////////////////////////////////////
 void RHRouter::clearRoutingTable()
 {
-    uint8_t i;
-    for (i = 0; i < RH_ROUTING_TABLE_SIZE; i++)
+    uint16_t i;
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
 	_routes[i].state = Invalid;
+    _numRoutes = 0;
+    _lruHead = _lruTail = 0;
 }
 
 
-uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags)
+uint8_t RHRouter::sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
 {
     return sendtoFromSourceWait(buf, len, dest, _thisAddress, flags);
 }
 
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendtoWait(RHPacketBuffer& packet, RHAddress dest, uint8_t flags)
+{
+    // Put our header in front of the message, in place
+    RoutedMessage* message = (RoutedMessage*)packet.push(sizeof(RoutedMessageHeader));
+    if (!message)
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    uint8_t ret = RH_ROUTER_ERROR_INVALID_LENGTH;
+    PendingDelivery* report = NULL;
+    if (packet.length() > maxMessageLength())
+	ret = RH_ROUTER_ERROR_INVALID_LENGTH;
+    else if (   (flags & RH_ROUTER_FLAGS_ACK_REQUEST)
+	     && dest != RH_BROADCAST_ADDRESS
+	     && !(report = startDeliveryReport(dest, _lastE2ESequenceNumber)))
+	ret = RH_ROUTER_ERROR_QUEUE_FULL;
+    else
+    {
+	message->header.source = _thisAddress;
+	message->header.dest = dest;
+	message->header.hops = 0;
+	message->header.id = _lastE2ESequenceNumber++;
+	message->header.flags = flags & ~(RH_ROUTER_FLAGS_ACKS | RH_ROUTER_FLAGS_ACK_ONLY);
+	ret = route(message, packet.length());
+	if (report && ret != RH_ROUTER_ERROR_NONE)
+	    report->dest = RH_BROADCAST_ADDRESS; // Failed already, no need for a report
+    }
+    packet.pull(sizeof(RoutedMessageHeader));
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::floodWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags)
+{
+    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > maxMessageLength())
+	return RH_ROUTER_ERROR_INVALID_LENGTH;
+
+    _tmpMessage.header.source = _thisAddress;
+    _tmpMessage.header.dest = dest;
+    _tmpMessage.header.hops = 0;
+    _tmpMessage.header.id = _lastE2ESequenceNumber++;
+    _tmpMessage.header.flags = flags & ~(RH_ROUTER_FLAGS_ACKS | RH_ROUTER_FLAGS_ACK_ONLY);
+    memcpy(_tmpMessage.data, buf, len);
+
+    return sendFlood(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendFlood(RoutedMessage* message, uint8_t messageLen)
+{
+    setHeaderFlags(RH_FLAGS_FLOOD, RH_FLAGS_NONE);
+    uint8_t ret = sendToNextHop(message, messageLen, RH_BROADCAST_ADDRESS);
+    setHeaderFlags(RH_FLAGS_NONE, RH_FLAGS_FLOOD);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::floodSeen(RHAddress source, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_FLOOD_CACHE_SIZE; i++)
+	if (_floods[i].source == source && _floods[i].id == id)
+	    return true;
+    // Replace the oldest one
+    _floods[_nextFlood].source = source;
+    _floods[_nextFlood].id = id;
+    _nextFlood = (_nextFlood + 1) % RH_ROUTER_FLOOD_CACHE_SIZE;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::joinGroup(RHAddress group)
+{
+    if (isGroupMember(group))
+	return true;
+    if (_numGroups >= RH_ROUTER_MAX_GROUPS)
+	return false;
+    _groups[_numGroups++] = group;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::leaveGroup(RHAddress group)
+{
+    uint8_t i;
+    for (i = 0; i < _numGroups; i++)
+    {
+	if (_groups[i] == group)
+	{
+	    _groups[i] = _groups[--_numGroups];
+	    return;
+	}
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::isGroupMember(RHAddress group)
+{
+    uint8_t i;
+    for (i = 0; i < _numGroups; i++)
+	if (_groups[i] == group)
+	    return true;
+    return false;
+}
+
 ////////////////////////////////////////////////////////////////////
 // Waits for delivery to the next hop (but not for delivery to the final destination)
-uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags)
+uint8_t RHRouter::sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags)
 {
-    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > _driver.maxMessageLength())
+    if (((uint16_t)len + sizeof(RoutedMessageHeader)) > maxMessageLength())
 	return RH_ROUTER_ERROR_INVALID_LENGTH;
 
+    // Keep a delivery report if we want an end-to-end ACK for our own message
+    PendingDelivery* report = NULL;
+    if (   (flags & RH_ROUTER_FLAGS_ACK_REQUEST)
+	&& source == _thisAddress
+	&& dest != RH_BROADCAST_ADDRESS
+	&& !(report = startDeliveryReport(dest, _lastE2ESequenceNumber)))
+	return RH_ROUTER_ERROR_QUEUE_FULL;
+
     // Construct a RH RouterMessage message
     _tmpMessage.header.source = source;
     _tmpMessage.header.dest = dest;
     _tmpMessage.header.hops = 0;
     _tmpMessage.header.id = _lastE2ESequenceNumber++;
-    _tmpMessage.header.flags = flags;
+    // These are ours, and would make the receiver take the end of the data for ACKs
+    _tmpMessage.header.flags = flags & ~(RH_ROUTER_FLAGS_ACKS | RH_ROUTER_FLAGS_ACK_ONLY);
     memcpy(_tmpMessage.data, buf, len);
 
-    return route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    uint8_t ret = route(&_tmpMessage, sizeof(RoutedMessageHeader)+len);
+    if (report && ret != RH_ROUTER_ERROR_NONE)
+	report->dest = RH_BROADCAST_ADDRESS; // Failed already, no need for a report
+    return ret;
+}
+
+#ifdef RH_ROUTER_HAVE_STATE_FILE
+////////////////////////////////////////////////////////////////////
+bool RHRouter::setStateFile(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    bool restore = fstat(fd, &st) == 0 && st.st_size == sizeof(StateFile);
+    if (!restore && ftruncate(fd, sizeof(StateFile)) != 0)
+    {
+	close(fd);
+	return false;
+    }
+    StateFile* file = (StateFile*)mmap(NULL, sizeof(StateFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+	return false;
+    restore = restore
+	&& file->magic == RH_ROUTER_STATE_FILE_MAGIC
+	&& file->size == sizeof(RoutingState)
+	&& file->thisAddress == _thisAddress;
+
+    // The state we have now, or the saved routes to restore, oldest first
+    RoutingState* current = _stateFile ? &_stateFile->state : &_localState;
+    RoutingState* from = restore ? &file->state : current;
+    RoutingTableEntry saved[RH_ROUTING_TABLE_SLOTS];
+    uint8_t order[RH_ROUTING_TABLE_SLOTS];
+    uint16_t numSaved = lruOrder(from, order);
+    memcpy(saved, from->routes, sizeof(saved));
+    if (!restore)
+    {
+	// Start a new file. It is only valid once it is complete
+	file->magic = 0;
+	memcpy(&file->state, current, sizeof(RoutingState));
+	file->size = sizeof(RoutingState);
+	file->thisAddress = _thisAddress;
+	file->magic = RH_ROUTER_STATE_FILE_MAGIC;
+    }
+    if (_stateFile)
+	munmap(_stateFile, sizeof(StateFile));
+    _stateFile = file;
+    _routes = file->state.routes;
+    _lruPrev = file->state.lruPrev;
+    _lruNext = file->state.lruNext;
+    _links = file->state.links;
+#ifdef RH_ROUTING_TABLE_HASHED
+    _linkNeighbour = file->state.linkNeighbour;
+#endif
+
+    // Rebuild the routing table, in case it was saved part way through a change, 
+    // adding routes oldest first so they keep their order in the LRU list
+    clearRoutingTable();
+    uint16_t i;
+    for (i = 0; i < numSaved; i++)
+    {
+	RoutingTableEntry* route = &saved[order[i]];
+	addRouteTo(route->dest, route->next_hop, restore ? (uint8_t)Restored : route->state, route->cost, route->interface);
+	if (!restore)
+	    _routes[routeIndex(route->dest)].confirmed = route->confirmed;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+uint16_t RHRouter::lruOrder(RoutingState* state, uint8_t* order)
+{
+    uint16_t numRoutes = 0;
+    uint16_t tail = RH_ROUTING_TABLE_SLOTS;
+    uint16_t i;
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
+    {
+	if (state->routes[i].state == Invalid)
+	    continue;
+	numRoutes++;
+	if (state->lruNext[i] == i)
+	    tail = (tail == RH_ROUTING_TABLE_SLOTS) ? i : RH_ROUTING_TABLE_SLOTS + 1; // More than one tail is a broken list
+    }
+
+    // Follow the LRU list back from the tail, if it is intact
+    uint16_t n = 0;
+    if (tail < RH_ROUTING_TABLE_SLOTS)
+    {
+	uint8_t index = tail;
+	while (n < numRoutes && state->routes[index].state != Invalid)
+	{
+	    order[n++] = index;
+	    if (state->lruPrev[index] == index)
+		break; // The head
+	    index = state->lruPrev[index];
+	}
+    }
+    if (n == numRoutes && (n == 0 || state->lruPrev[order[n - 1]] == order[n - 1]))
+	return numRoutes;
+
+    // Broken: order them by when they were last used instead
+    n = 0;
+    for (i = 0; i < RH_ROUTING_TABLE_SLOTS; i++)
+	if (state->routes[i].state != Invalid)
+	    order[n++] = i;
+    uint16_t j;
+    for (i = 1; i < n; i++)
+	for (j = i; j > 0 && (long)(state->routes[order[j]].lastUsed - state->routes[order[j - 1]].lastUsed) < 0; j--)
+	{
+	    uint8_t t = order[j];
+	    order[j] = order[j - 1];
+	    order[j - 1] = t;
+	}
+    return n;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::lastSentId()
+{
+    return _lastE2ESequenceNumber - 1;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setEndToEndAckTimeout(uint16_t timeout)
+{
+    _e2eAckTimeout = timeout;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::setEndToEndAckDelay(uint16_t delay)
+{
+    _e2eAckDelay = delay;
+}
+
+////////////////////////////////////////////////////////////////////
+RHRouter::PendingDelivery* RHRouter::startDeliveryReport(RHAddress dest, uint8_t id)
+{
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_MAX_DELIVERY_REPORTS; i++)
+    {
+	PendingDelivery* p = &_deliveries[i];
+	if (p->dest == RH_BROADCAST_ADDRESS)
+	{
+	    p->dest = dest;
+	    p->id = id;
+	    p->hops = 0;
+	    p->sent = millis();
+	    return p;
+	}
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+bool RHRouter::deliveryReport(DeliveryReport* report)
+{
+    // Oldest first. Messages that have been waiting too long are reported as not delivered
+    PendingDelivery* oldest = NULL;
+    uint8_t i;
+    for (i = 0; i < RH_ROUTER_MAX_DELIVERY_REPORTS; i++)
+    {
+	PendingDelivery* p = &_deliveries[i];
+	if (   p->dest != RH_BROADCAST_ADDRESS
+	    && (p->hops || millis() - p->sent > _e2eAckTimeout)
+	    && (!oldest || (long)(p->sent - oldest->sent) < 0))
+	    oldest = p;
+    }
+    if (!oldest)
+	return false;
+
+    report->dest = oldest->dest;
+    report->id = oldest->id;
+    report->hops = oldest->hops;
+    report->status = oldest->hops ? RH_ROUTER_ERROR_NONE : RH_ROUTER_ERROR_TIMEOUT;
+    report->latency = oldest->hops ? oldest->latency : 0;
+    oldest->dest = RH_BROADCAST_ADDRESS;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::acknowledgeEndToEnd(RoutedMessage* message)
+{
+    if (_numE2EAcks >= RH_ROUTER_MAX_E2E_ACKS)
+	removeEndToEndAcks(_e2eAcks[0].to, 1); // Make room by dropping the oldest
+    EndToEndAck* a = &_e2eAcks[_numE2EAcks++];
+    a->to = message->header.source;
+    a->id = message->header.id;
+    a->hops = message->header.hops + 1;
+    a->since = millis();
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::checkEndToEndAcks()
+{
+    while (_numE2EAcks && millis() - _e2eAcks[0].since >= _e2eAckDelay)
+    {
+	// Nothing came along for the oldest one to ride on, so send it on its own.
+	// sendToNextHop() adds all the other ACKs for the same originator that fit
+	RHAddress to = _e2eAcks[0].to;
+	_tmpMessage.header.source = _thisAddress;
+	_tmpMessage.header.dest = to;
+	_tmpMessage.header.hops = 0;
+	_tmpMessage.header.id = _lastE2ESequenceNumber++;
+	_tmpMessage.header.flags = RH_ROUTER_FLAGS_ACK_ONLY;
+	if (route(&_tmpMessage, sizeof(RoutedMessageHeader)) != RH_ROUTER_ERROR_NONE)
+	    removeEndToEndAcks(to, RH_ROUTER_MAX_E2E_ACKS); // Drop them and let the originator time out
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+int32_t RHRouter::endToEndAckTimeLeft(int32_t timeLeft)
+{
+    if (_numE2EAcks)
+    {
+	int32_t ackTimeLeft = _e2eAckDelay - (millis() - _e2eAcks[0].since);
+	if (ackTimeLeft < timeLeft)
+	    timeLeft = ackTimeLeft > 0 ? ackTimeLeft : 1;
+    }
+    return timeLeft;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::addEndToEndAcks(RoutedMessage* message, uint8_t* messageLen)
+{
+    // Append after any ACKs the message already carries, keeping the count at the end
+    uint8_t len = *messageLen;
+    uint8_t count = 0;
+    if (message->header.flags & RH_ROUTER_FLAGS_ACKS)
+    {
+	if (!endToEndAcksLen(message, len))
+	    return 0; // Cant make sense of them
+	count = ((uint8_t*)message)[--len];
+    }
+    uint8_t maxLen = maxMessageLength() < sizeof(RoutedMessage) ? maxMessageLength() : sizeof(RoutedMessage);
+    uint8_t added = 0;
+    uint8_t i;
+    for (i = 0; i < _numE2EAcks && count < 255; i++)
+    {
+	EndToEndAck* a = &_e2eAcks[i];
+	if (a->to != message->header.dest)
+	    continue;
+	if ((uint16_t)len + RH_ROUTER_E2E_ACK_LEN + 1 > maxLen)
+	    break;
+	uint8_t* entry = (uint8_t*)message + len;
+	RH_ADDRESS_PUT(entry, _thisAddress);
+	entry[sizeof(RHAddress)] = a->id;
+	entry[sizeof(RHAddress) + 1] = a->hops;
+	len += RH_ROUTER_E2E_ACK_LEN;
+	count++;
+	added++;
+    }
+    if (!count)
+	return 0;
+    ((uint8_t*)message)[len++] = count;
+    message->header.flags |= RH_ROUTER_FLAGS_ACKS;
+    *messageLen = len;
+    return added;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::removeEndToEndAcks(RHAddress to, uint8_t count)
+{
+    uint8_t i, j;
+    for (i = 0, j = 0; i < _numE2EAcks; i++)
+    {
+	if (count && _e2eAcks[i].to == to)
+	    count--;
+	else
+	    _e2eAcks[j++] = _e2eAcks[i];
+    }
+    _numE2EAcks = j;
+}
+
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::endToEndAcksLen(RoutedMessage* message, uint8_t messageLen)
+{
+    if (   !(message->header.flags & RH_ROUTER_FLAGS_ACKS)
+	|| messageLen <= sizeof(RoutedMessageHeader))
+	return 0;
+    uint16_t len = ((uint8_t*)message)[messageLen - 1] * RH_ROUTER_E2E_ACK_LEN + 1;
+    return len <= messageLen - sizeof(RoutedMessageHeader) ? len : 0;
+}
+
+////////////////////////////////////////////////////////////////////
+void RHRouter::handleEndToEndAcks(RoutedMessage* message, uint8_t messageLen)
+{
+    uint8_t acksLen = endToEndAcksLen(message, messageLen);
+    uint8_t* entry;
+    for (entry = (uint8_t*)message + messageLen - acksLen; acksLen > 1; entry += RH_ROUTER_E2E_ACK_LEN, acksLen -= RH_ROUTER_E2E_ACK_LEN)
+    {
+	RHAddress from = RH_ADDRESS_GET(entry);
+	uint8_t i;
+	for (i = 0; i < RH_ROUTER_MAX_DELIVERY_REPORTS; i++)
+	{
+	    PendingDelivery* p = &_deliveries[i];
+	    if (p->dest == from && p->id == entry[sizeof(RHAddress)] && !p->hops)
+	    {
+		p->hops = entry[sizeof(RHAddress) + 1] ? entry[sizeof(RHAddress) + 1] : 1;
+		p->latency = millis() - p->sent;
+		break;
+	    }
+	}
+    }
 }
 
 ////////////////////////////////////////////////////////////////////
 uint8_t RHRouter::route(RoutedMessage* message, uint8_t messageLen)
 {
     // Reliably deliver it if possible. See if we have a route:
-    uint8_t next_hop = RH_BROADCAST_ADDRESS;
+    RHAddress next_hop = RH_BROADCAST_ADDRESS;
+    uint8_t interface = RH_ALL_INTERFACES;
+    bool restored = false;
     if (message->header.dest != RH_BROADCAST_ADDRESS)
     {
 	RoutingTableEntry* route = getRouteTo(message->header.dest);
 	if (!route)
 	    return RH_ROUTER_ERROR_NO_ROUTE;
 	next_hop = route->next_hop;
+	interface = route->interface;
+	restored = route->state == Restored;
+    }
+    RHAddress dest = message->header.dest;
+    uint8_t ret = sendToNextHop(message, messageLen, next_hop, interface);
+    if (restored)
+    {
+	// First use since it was restored. Keep it only if it still works
+	RoutingTableEntry* route = findRouteTo(dest);
+	if (route && route->state == Restored)
+	{
+	    if (ret == RH_ROUTER_ERROR_NONE)
+		route->state = Valid;
+	    else
+		deleteRouteTo(dest);
+	}
     }
+    return ret;
+}
 
-    if (!RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop))
+////////////////////////////////////////////////////////////////////
+uint8_t RHRouter::sendToNextHop(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop, uint8_t interface)
+{
+    // Piggyback any end-to-end ACKs for the destination. There is always room after _tmpMessage,
+    // but an RHPacketBuffer has no tailroom, so messages sent from one carry no ACKs
+    uint8_t acks = 0;
+    if (_numE2EAcks && message == &_tmpMessage && next_hop != RH_BROADCAST_ADDRESS)
+	acks = addEndToEndAcks(message, &messageLen);
+
+    if (next_hop == RH_BROADCAST_ADDRESS)
+	interface = RH_ALL_INTERFACES;
+    else if (interface == RH_ALL_INTERFACES)
+	interface = bestInterface(next_hop);
+    uint32_t retransmissions = _retransmissions;
+    _driver.setTransmitInterface(interface);
+    bool delivered = RHReliableDatagram::sendtoWait((uint8_t*)message, messageLen, next_hop);
+    _driver.setTransmitInterface(RH_ALL_INTERFACES);
+    if (next_hop != RH_BROADCAST_ADDRESS)
+    {
+	uint8_t transmissions = delivered ? (_retransmissions - retransmissions + 1) : (_retries + 1);
+	if (interface != RH_ALL_INTERFACES)
+	    updateLinkEtx(next_hop, interface, delivered, transmissions);
+	else if (delivered)
+	    updateLinkEtx(next_hop, _driver.lastInterface(), delivered, transmissions); // Where the ACK came from
+	else
+	{
+	    uint8_t i;
+	    for (i = 0; i < _driver.numInterfaces(); i++)
+		updateLinkEtx(next_hop, i, delivered, transmissions);
+	}
+    }
+    if (!delivered)
 	return RH_ROUTER_ERROR_UNABLE_TO_DELIVER;
 
+    if (acks)
+	removeEndToEndAcks(message->header.dest, acks);
+
     return RH_ROUTER_ERROR_NONE;
 }
 
@@ -201,104 +1027,172 @@ void RHRouter::peekAtMessage(RoutedMessage* message, uint8_t messageLen)
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHRouter::recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {  
     uint8_t tmpMessageLen = sizeof(_tmpMessage);
-    uint8_t _from;
-    uint8_t _to;
+    RHAddress _from;
+    RHAddress _to;
     uint8_t _id;
     uint8_t _flags;
-    if (RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags))
-    {
-	// Here we simulate networks with limited visibility between nodes
-	// so we can test routing
-#ifdef RH_TEST_NETWORK
-	if (
-#if RH_TEST_NETWORK==1
-	    // This network looks like 1-2-3-4
-	       (_thisAddress == 1 && _from == 2)
-	    || (_thisAddress == 2 && (_from == 1 || _from == 3))
-	    || (_thisAddress == 3 && (_from == 2 || _from == 4))
-	    || (_thisAddress == 4 && _from == 3)
-	    
-#elif RH_TEST_NETWORK==2
-	       // This network looks like 1-2-4
-	       //                         | | |
-	       //                         --3--
-	       (_thisAddress == 1 && (_from == 2 || _from == 3))
-	    ||  _thisAddress == 2
-	    ||  _thisAddress == 3
-	    || (_thisAddress == 4 && (_from == 2 || _from == 3))
-
-#elif RH_TEST_NETWORK==3
-	       // This network looks like 1-2-4
-	       //                         |   |
-	       //                         --3--
-	       (_thisAddress == 1 && (_from == 2 || _from == 3))
-	    || (_thisAddress == 2 && (_from == 1 || _from == 4))
-	    || (_thisAddress == 3 && (_from == 1 || _from == 4))
-	    || (_thisAddress == 4 && (_from == 2 || _from == 3))
-
-#elif RH_TEST_NETWORK==4
-	       // This network looks like 1-2-3
-	       //                           |
-	       //                           4
-	       (_thisAddress == 1 && _from == 2)
-	    ||  _thisAddress == 2
-	    || (_thisAddress == 3 && _from == 2)
-	    || (_thisAddress == 4 && _from == 2)
-
+    int8_t  rssi;
+    uint8_t interface;
+    bool    received;
+    bool    leased = false;
+    RHGenericDriver::RxLease lease;
+    RoutedMessage* message = &_tmpMessage;
+    checkEndToEndAcks();
+#if RH_ROUTER_FORWARDING_QUEUE_LEN > 0
+    if (_numHeld)
+    {
+	// Deal with messages that arrived while we were busy first
+	HeldMessage* h = &_held[_heldHead];
+	tmpMessageLen = h->len;
+	memcpy(&_tmpMessage, &h->message, tmpMessageLen);
+	_from = h->from;
+	_to = h->to;
+	_id = h->id;
+	_flags = h->flags;
+	rssi = h->rssi;
+	interface = h->interface;
+	_heldHead = (_heldHead + 1) % RH_ROUTER_FORWARDING_QUEUE_LEN;
+	_numHeld--;
+	received = true;
+    }
+    else
 #endif
-)
+    if (RHReliableDatagram::recvfromAckLease(&lease))
+    {
+	// Look at the message where it is in the driver, and only copy what we need
+	message = (RoutedMessage*)lease.data;
+	tmpMessageLen = lease.len;
+	_from = lease.headerFrom;
+	_to = lease.headerTo;
+	_id = lease.headerId;
+	_flags = lease.headerFlags;
+	rssi = lease.rssi;
+	interface = _driver.lastInterface();
+	received = leased = true;
+    }
+    else
+    {
+	received = RHReliableDatagram::recvfromAck((uint8_t*)&_tmpMessage, &tmpMessageLen, &_from, &_to, &_id, &_flags);
+	rssi = _driver.lastRssi();
+	interface = _driver.lastInterface();
+    }
+    if (received)
+    {
+	if (tmpMessageLen < sizeof(RoutedMessageHeader))
 	{
-	    // OK
+	    // Too short to be one of ours: dont look at the header
+	    if (leased)
+		releaseLease();
+	    return false;
 	}
-	else
+	_previousHop = _from;
+	_previousInterface = interface;
+	updateLinkRssi(_from, interface, rssi);
+	// Subclasses dont need to know about piggybacked end-to-end ACKs
+	uint8_t acksLen = endToEndAcksLen(message, tmpMessageLen);
+	peekAtMessage(message, tmpMessageLen - acksLen);
+	bool flood = _flags & RH_FLAGS_FLOOD;
+	if (flood)
 	{
-	    return false; // Pretend we got nothing
+	    // Relay each flood once, however many neighbours we hear it from, and never our own
+	    if (   message->header.source == _thisAddress
+		|| floodSeen(message->header.source, message->header.id))
+	    {
+		if (leased)
+		    releaseLease();
+		return false;
+	    }
+	    if (   message->header.dest != _thisAddress
+		&& message->header.hops++ < _max_hops)
+	    {
+		if (leased)
+		{
+		    // Must give it back to the driver before we can send
+		    memcpy(&_tmpMessage, message, tmpMessageLen);
+		    releaseLease();
+		    leased = false;
+		    message = &_tmpMessage;
+		}
+		sendFlood(message, tmpMessageLen);
+	    }
 	}
-#endif
-
-	peekAtMessage(&_tmpMessage, tmpMessageLen);
 	// See if its for us or has to be routed
-	if (_tmpMessage.header.dest == _thisAddress || _tmpMessage.header.dest == RH_BROADCAST_ADDRESS)
+	if (   message->header.dest == _thisAddress 
+	    || message->header.dest == RH_BROADCAST_ADDRESS
+	    || (flood && isGroupMember(message->header.dest)))
 	{
+	    if (message->header.dest == _thisAddress && acksLen)
+	    {
+		handleEndToEndAcks(message, tmpMessageLen);
+		tmpMessageLen -= acksLen;
+	    }
+	    if (message->header.flags & RH_ROUTER_FLAGS_ACK_ONLY)
+	    {
+		// Nothing else in it
+		if (leased)
+		    releaseLease();
+		return false;
+	    }
 	    // Deliver it here
-	    if (source) *source  = _tmpMessage.header.source;
-	    if (dest)   *dest    = _tmpMessage.header.dest;
-	    if (id)     *id      = _tmpMessage.header.id;
-	    if (flags)  *flags   = _tmpMessage.header.flags;
+	    if (source) *source  = message->header.source;
+	    if (dest)   *dest    = message->header.dest;
+	    if (id)     *id      = message->header.id;
+	    if (flags)  *flags   = message->header.flags & ~(RH_ROUTER_FLAGS_ACKS | RH_ROUTER_FLAGS_ACK_ONLY);
 	    uint8_t msgLen = tmpMessageLen - sizeof(RoutedMessageHeader);
 	    if (*len > msgLen)
 		*len = msgLen;
-	    memcpy(buf, _tmpMessage.data, *len);
+	    memcpy(buf, message->data, *len);
+	    if (   message->header.dest == _thisAddress
+		&& (message->header.flags & RH_ROUTER_FLAGS_ACK_REQUEST))
+		acknowledgeEndToEnd(message);
+	    if (leased)
+		releaseLease();
+	    // Now the driver is free, send the ACK, unless it can wait for something to ride on
+	    checkEndToEndAcks();
 	    return true; // Its for you!
 	}
-	else if (   _tmpMessage.header.dest != RH_BROADCAST_ADDRESS
-		 && _tmpMessage.header.hops++ < _max_hops)
+	else if (   !flood
+		 && message->header.dest != RH_BROADCAST_ADDRESS
+		 && message->header.hops++ < _max_hops)
 	{
 	    // Maybe it has to be routed to the next hop
 	    // REVISIT: if it fails due to no route or unable to deliver to the next hop, 
 	    // tell the originator. BUT HOW?
+	    if (leased)
+	    {
+		// Must give it back to the driver before we can receive the next hop's ACK
+		memcpy(&_tmpMessage, message, tmpMessageLen);
+		releaseLease();
+		leased = false;
+	    }
 	    route(&_tmpMessage, tmpMessageLen);
 	}
 	// Discard it and maybe wait for another
+	if (leased)
+	    releaseLease();
     }
     return false;
 }
 
 ////////////////////////////////////////////////////////////////////
-bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, uint8_t* source, uint8_t* dest, uint8_t* id, uint8_t* flags)
+bool RHRouter::recvfromAckTimeout(uint8_t* buf, uint8_t* len, uint16_t timeout, RHAddress* source, RHAddress* dest, uint8_t* id, uint8_t* flags)
 {  
     unsigned long starttime = millis();
     int32_t timeLeft;
     while ((timeLeft = timeout - (millis() - starttime)) > 0)
     {
-	if (waitAvailableTimeout(timeLeft))
+	// Wake up in time to send any delayed end-to-end ACKs
+	timeLeft = endToEndAckTimeLeft(timeLeft);
+	if (_numHeld || waitAvailableTimeout(timeLeft))
 	{
 	    if (recvfromAck(buf, len, source, dest, id, flags))
 		return true;
 	}
+	else
+	    checkEndToEndAcks();
 	YIELD;
     }
     return false;
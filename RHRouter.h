@@ -8,12 +8,137 @@
 #define RHRouter_h
 
 #include <RHReliableDatagram.h>
+#include <RHPacketBuffer.h>
 
 // Default max number of hops we will route
 #define RH_DEFAULT_MAX_HOPS 30
 
-// The default size of the routing table we keep
+// The maximum number of valid routes we keep. If more routes than this are added,
+// the least recently used one is retired.
+// On Linux and compatible systems with 8 bit addresses, the table has 256 entries and is indexed 
+// directly by destination address. Otherwise, or if this is pre-defined to less than 256 prior to 
+// including this header, it is an open addressing hash table of RH_ROUTING_TABLE_SLOTS entries, 
+// the smallest power of 2 larger than this, so small targets keep a small table.
+#ifndef RH_ROUTING_TABLE_SIZE
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#ifdef RH_EXTENDED_ADDRESSING
+#define RH_ROUTING_TABLE_SIZE 128
+#else
+#define RH_ROUTING_TABLE_SIZE 256
+#endif
+#else
 #define RH_ROUTING_TABLE_SIZE 10
+#endif
+#endif
+#if defined(RH_EXTENDED_ADDRESSING) && RH_ROUTING_TABLE_SIZE > 255
+#error RH_ROUTING_TABLE_SIZE must be less than 256 with RH_EXTENDED_ADDRESSING
+#endif
+
+// Number of entries in the routing table, and in the link metrics for each interface
+#if !defined(RH_EXTENDED_ADDRESSING) && RH_ROUTING_TABLE_SIZE > 255
+#define RH_ROUTING_TABLE_SLOTS 256
+#else
+#define RH_ROUTING_TABLE_HASHED
+#if RH_ROUTING_TABLE_SIZE < 8
+#define RH_ROUTING_TABLE_SLOTS 8
+#elif RH_ROUTING_TABLE_SIZE < 16
+#define RH_ROUTING_TABLE_SLOTS 16
+#elif RH_ROUTING_TABLE_SIZE < 32
+#define RH_ROUTING_TABLE_SLOTS 32
+#elif RH_ROUTING_TABLE_SIZE < 64
+#define RH_ROUTING_TABLE_SLOTS 64
+#elif RH_ROUTING_TABLE_SIZE < 128
+#define RH_ROUTING_TABLE_SLOTS 128
+#else
+#define RH_ROUTING_TABLE_SLOTS 256
+#endif
+#endif
+
+// Link and path costs are measured in units of 1/RH_ROUTER_LINK_COST_SCALE of a transmission,
+// so a perfect link (every message acknowledged first time) costs RH_ROUTER_LINK_COST_SCALE.
+#define RH_ROUTER_LINK_COST_SCALE 4
+
+// Maximum link or path cost. Costs saturate at this value
+#define RH_ROUTER_MAX_COST 255
+
+// Links received weaker than this RSSI (in dBm) cost one extra unit 
+// for every RH_ROUTER_RSSI_PENALTY_STEP dB below it
+#ifndef RH_ROUTER_RSSI_WEAK
+#define RH_ROUTER_RSSI_WEAK -100
+#endif
+#define RH_ROUTER_RSSI_PENALTY_STEP 3
+
+// Default amount by which a new route must be cheaper than the current one before it replaces it
+#define RH_ROUTER_DEFAULT_ROUTE_HYSTERESIS 2
+
+// Max number of messages held for later delivery or forwarding with store and forward. 
+// Each costs a full message buffer, so by default the queue is only available on Linux and 
+// compatible systems. If 0 it is compiled out. Can be pre-defined prior to including this header
+#ifndef RH_ROUTER_FORWARDING_QUEUE_LEN
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_ROUTER_FORWARDING_QUEUE_LEN 4
+#else
+#define RH_ROUTER_FORWARDING_QUEUE_LEN 0
+#endif
+#endif
+
+// The routing table and link metrics can be kept in a file on Linux and compatible systems
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_ROUTER_HAVE_STATE_FILE
+#endif
+
+// Identifies an RHRouter state file. See RHRouter::setStateFile()
+#define RH_ROUTER_STATE_FILE_MAGIC 0x53524852
+
+// Max number of driver interfaces that link metrics are kept for separately. See RHMultiDriver
+// Can be pre-defined prior to including this header
+#ifndef RH_ROUTER_MAX_INTERFACES
+#if (RH_PLATFORM == RH_PLATFORM_RASPI) || (RH_PLATFORM == RH_PLATFORM_UNIX)
+#define RH_ROUTER_MAX_INTERFACES 4
+#else
+#define RH_ROUTER_MAX_INTERFACES 1
+#endif
+#endif
+
+// Hop-to-hop FLAGS bit marking a network wide flood. See RHRouter::floodWait()
+#define RH_FLAGS_FLOOD 0x10
+
+// Number of recent floods remembered, to relay each one only once
+#ifndef RH_ROUTER_FLOOD_CACHE_SIZE
+#define RH_ROUTER_FLOOD_CACHE_SIZE 16
+#endif
+
+// Max number of multicast groups a node can join
+#ifndef RH_ROUTER_MAX_GROUPS
+#define RH_ROUTER_MAX_GROUPS 4
+#endif
+
+// End-to-end FLAGS bits used by RHRouter. The rest are for subclasses and the application layer.
+// RH_ROUTER_FLAGS_ACK_REQUEST asks the destination for an end-to-end ACK. See RHRouter::deliveryReport()
+#define RH_ROUTER_FLAGS_ACK_REQUEST 0x80
+// The message carries end-to-end ACKs after its data
+#define RH_ROUTER_FLAGS_ACKS        0x40
+// The message is only end-to-end ACKs, and has no data
+#define RH_ROUTER_FLAGS_ACK_ONLY    0x20
+#define RH_ROUTER_FLAGS_RESERVED    (RH_ROUTER_FLAGS_ACK_REQUEST | RH_ROUTER_FLAGS_ACKS | RH_ROUTER_FLAGS_ACK_ONLY)
+
+// Length of each end-to-end ACK carried by a message: the acknowledging node address, ID and hops
+#define RH_ROUTER_E2E_ACK_LEN (sizeof(RHAddress) + 2)
+
+// Max number of messages waiting for end-to-end ACKs, or with delivery reports not yet collected
+#ifndef RH_ROUTER_MAX_DELIVERY_REPORTS
+#define RH_ROUTER_MAX_DELIVERY_REPORTS 4
+#endif
+
+// Max number of end-to-end ACKs waiting to be sent
+#ifndef RH_ROUTER_MAX_E2E_ACKS
+#define RH_ROUTER_MAX_E2E_ACKS 8
+#endif
+
+// Default time to wait for an end-to-end ACK, in milliseconds
+#ifndef RH_ROUTER_DEFAULT_E2E_ACK_TIMEOUT
+#define RH_ROUTER_DEFAULT_E2E_ACK_TIMEOUT 5000
+#endif
 
 // Error codes
 #define RH_ROUTER_ERROR_NONE              0
@@ -22,19 +147,18 @@
 #define RH_ROUTER_ERROR_TIMEOUT           3
 #define RH_ROUTER_ERROR_NO_REPLY          4
 #define RH_ROUTER_ERROR_UNABLE_TO_DELIVER 5
+#define RH_ROUTER_ERROR_QUEUED            6
+#define RH_ROUTER_ERROR_QUEUE_FULL        7
 
 // This size of RH_ROUTER_MAX_MESSAGE_LEN is OK for Arduino Mega, but too big for
 // Duemilanova. Size of 50 works with the sample router programs on Duemilanova.
+// Each RHRouter (and RHMesh) instance has its own message buffers of this size, so if all your drivers 
+// have a smaller maxMessageLength() you can save memory by defining it to match.
+#ifndef RH_ROUTER_MAX_MESSAGE_LEN
 #define RH_ROUTER_MAX_MESSAGE_LEN (RH_MAX_MESSAGE_LEN - sizeof(RHRouter::RoutedMessageHeader))
+#endif
 //#define RH_ROUTER_MAX_MESSAGE_LEN 50
 
-// These allow us to define a simulated network topology for testing purposes
-// See RHRouter.cpp for details
-//#define RH_TEST_NETWORK 1
-//#define RH_TEST_NETWORK 2
-//#define RH_TEST_NETWORK 3
-//#define RH_TEST_NETWORK 4
-
 /////////////////////////////////////////////////////////////////////
 /// \class RHRouter RHRouter.h <RHRouter.h>
 /// \brief RHReliableDatagram subclass for sending addressed, optionally acknowledged datagrams
@@ -62,7 +186,8 @@
 /// This helps prevent infinite routing loops.
 ///
 /// RHRouter supports messages with a dest of RH_BROADCAST_ADDRESS. Such messages are not routed, 
-/// and are broadcast (once) to all nodes within range.
+/// and are broadcast (once) to all nodes within range. To reach every node in the network, 
+/// use floodWait() instead (see Flooding and Multicast below).
 ///
 /// The recvfromAck() function is responsible not just for receiving and delivering 
 /// messages addressed to this node (or RH_BROADCAST_ADDRESS), but 
@@ -72,7 +197,8 @@
 ///
 /// RHRouter does not provide reliable end-to-end delivery, but uses reliable hop-to-hop delivery. 
 /// If a message is unable to be delivered to an end node during to a delivery failure between 2 hops, 
-/// the source node will not be told about it.
+/// the source node will not be told about it, unless it asked for an end-to-end acknowledgement 
+/// (see End-to-end Acknowledgements below).
 ///
 /// Note: This class is most useful for networks of nodes that are essentially static 
 /// (i.e. the nodes dont move around), and for which the 
@@ -90,9 +216,104 @@
 /// You can also use addRouteTo() to change a route and 
 /// deleteRouteTo() to delete a route at run time. Youcan also clear the entire routing table
 ///
-/// The Routing Table has limited capacity for entries (defined by RH_ROUTING_TABLE_SIZE, which is 10)
-/// if more than RH_ROUTING_TABLE_SIZE are added, the oldest (first) one will be removed by calling 
-/// retireOldestRoute()
+/// On Linux and compatible systems with 8 bit addresses, the Routing Table is indexed directly by 
+/// destination address, so looking up, adding, updating and deleting a route take constant time, 
+/// for all 256 possible addresses.
+/// Otherwise it is an open addressing hash table, indexed by RH_ADDRESS_HASH() of the destination address, 
+/// with RH_ROUTING_TABLE_SLOTS entries, the smallest power of 2 larger than RH_ROUTING_TABLE_SIZE, 
+/// so that it is never full, and lookups stay close to constant time. RH_ROUTING_TABLE_SIZE defaults 
+/// to 10, or to 128 on Linux with RH_EXTENDED_ADDRESSING, and can be defined to another value to 
+/// trade memory for routes.
+/// Each entry records when it was last used. Routes are kept in least recently used order, 
+/// and if more than RH_ROUTING_TABLE_SIZE valid routes are added, the least recently used 
+/// one will be removed by calling retireOldestRoute().
+/// With setRouteTimeout(), routes that have not been used or updated for the given time expire, 
+/// and are deleted the next time they are looked up.
+///
+/// \par Persistent Routing State
+///
+/// On Linux and compatible systems (where RH_ROUTER_HAVE_STATE_FILE is defined), setStateFile() keeps 
+/// the routing table and link metrics in a memory mapped file instead of in memory. Every change is 
+/// written straight into the file, so there is nothing to save, and when the program restarts and calls 
+/// setStateFile() again, it carries on with the routes and link metrics it had. Without this, 
+/// a restarted RHMesh node has to discover every route again.
+/// Restored routes are in the Restored state: they are used straight away, but are not passed on 
+/// to other nodes (for example in cached route replies), because they may be out of date. The first time 
+/// each one is used, it becomes Valid if the next hop acknowledges the message, and is deleted if not.
+///
+/// \par Link Metrics
+///
+/// RHRouter measures the quality of the link to each neighbour it exchanges messages with:
+/// - ETX, the expected number of transmissions needed to deliver a message to the neighbour, 
+///   from the number of retransmissions RHReliableDatagram needed (or a penalty if delivery failed), 
+///   as a moving average.
+/// - RSSI of messages received from the neighbour, as a moving average.
+///
+/// linkCost() combines them into a single cost, in units of 1/RH_ROUTER_LINK_COST_SCALE 
+/// of a transmission, with an extra penalty for links weaker than RH_ROUTER_RSSI_WEAK. 
+/// Each route records the cost of the path to its destination, and updateRouteTo() only 
+/// replaces a route with one through a different next hop if it is cheaper by more than the 
+/// route hysteresis (see setRouteHysteresis()), so that routes dont flap between 
+/// paths of similar quality. RHMesh uses this to choose among the paths found by route discovery.
+///
+/// \par Multiple Interfaces
+///
+/// A node with several radios, for example on different bands, can combine them into one driver 
+/// with RHMultiDriver, and route across all of them. Each route records the driver interface to send on 
+/// as well as the next hop, and link metrics are kept for each neighbour on each interface 
+/// (for the first RH_ROUTER_MAX_INTERFACES interfaces). Broadcasts, and so RHMesh route discovery, 
+/// go out on all interfaces. A message received on one interface is forwarded on whichever 
+/// interface the route to its destination uses, so nodes with several radios bridge between the bands.
+/// RHMesh learns the interface of each route from the interface the route discovery replies came in on. 
+/// Routes added with addRouteTo() without an interface, and source routed hops, use the interface 
+/// with the cheapest link to the next hop, or all interfaces if no link to it has been measured yet.
+///
+/// \par Store and Forward
+///
+/// Normally, while a node is forwarding a message it waits for the next hop's acknowledgement 
+/// in RHReliableDatagram::sendtoWait(), and discards any other messages that arrive in the meantime. 
+/// A busy relay therefore loses many of the messages sent to it, and their senders have to retransmit. 
+/// With setStoreAndForward(), messages that arrive while the node is waiting for an acknowledgement 
+/// are acknowledged straight away and held in a queue of up to RH_ROUTER_FORWARDING_QUEUE_LEN messages. 
+/// Subsequent calls to recvfromAck() deliver or forward the held messages, in the order they arrived, 
+/// before receiving any more. When the queue is full, new messages are discarded unacknowledged as before, 
+/// so their senders retransmit them later.
+/// RH_ROUTER_FORWARDING_QUEUE_LEN defaults to 0 except on Linux and compatible systems. When it is 0, 
+/// setStoreAndForward() has no effect. Define it before including RHRouter.h if you have the memory to spare.
+///
+/// \par End-to-end Acknowledgements
+///
+/// If a message is sent with RH_ROUTER_FLAGS_ACK_REQUEST in its flags, the destination node sends an 
+/// end-to-end ACK back to the originator when it receives it. sendtoWait() still returns as soon as 
+/// the next hop has the message. Later, deliveryReport() tells the originator whether the message 
+/// got there, how many hops it took, and how long the ACK took to come back. If no ACK arrives within 
+/// the end-to-end ACK timeout (see setEndToEndAckTimeout()) the report says so instead.
+/// The originator can have up to RH_ROUTER_MAX_DELIVERY_REPORTS messages waiting for ACKs or with 
+/// reports not yet collected.
+///
+/// End-to-end ACKs are small (RH_ROUTER_E2E_ACK_LEN octets each), and are piggybacked on other traffic: 
+/// a node that sends or forwards a message to the node an ACK is for adds the ACK to the end of it, 
+/// if there is room. Messages sent with sendtoWait(RHPacketBuffer&) carry no ACKs, because the packet 
+/// buffer has no room after the data. With setEndToEndAckDelay(), a destination waits a while before sending its ACKs 
+/// on their own, in case there is some traffic for them to ride on, for example the application's reply.
+/// ACKs that are sent on their own are combined into one message per originator.
+///
+/// \par Flooding and Multicast
+///
+/// floodWait() sends a message to every node in the network, however many hops away, without 
+/// needing any routes. Every node that receives it broadcasts it again, once: each node remembers the 
+/// SOURCE and ID of the last RH_ROUTER_FLOOD_CACHE_SIZE floods it has seen, and ignores any more copies 
+/// it hears from its other neighbours. Floods are not acknowledged, and go no further than the 
+/// max hops of each relay (see setMaxHops()). Sending a message to all the nodes in the network 
+/// therefore costs about one transmission per node, rather than one end-to-end unicast per node.
+///
+/// The dest of a flood can be RH_BROADCAST_ADDRESS, for every node, or a multicast group address. 
+/// Group addresses are ordinary addresses that are not used by any node. Nodes that have joined the 
+/// group with joinGroup() receive floods sent to it, and all nodes relay them, members or not.
+/// A flood sent to a node address only reaches that node, by whatever paths it finds.
+///
+/// Flooded messages are marked with RH_FLAGS_FLOOD in the hop-to-hop FLAGS header, so RHRouter 
+/// networks that use them must all be running a version of RHRouter that knows about them.
 ///
 /// \par Message Format
 ///
@@ -105,12 +326,19 @@
 ///   destination node for this message)
 /// - 1 octet SOURCE, the source node address (ie the address of the originating node that first sent 
 ///   the message).
+/// (DEST and SOURCE are 2 octets each, low octet first, with RH_EXTENDED_ADDRESSING)
 /// - 1 octet HOPS, the number of hops this message has traversed so far.
 /// - 1 octet ID, an incrementing message ID for end-to-end message tracking for use by subclasses. 
 ///   Not used by RHRouter.
-/// - 1 octet FLAGS, a bitmask for use by subclasses. Not used by RHRouter.
+/// - 1 octet FLAGS, a bitmask for use by subclasses, except for the RH_ROUTER_FLAGS_RESERVED bits.
+///   The send functions clear RH_ROUTER_FLAGS_ACKS and RH_ROUTER_FLAGS_ACK_ONLY in the flags they are given, 
+///   so applications written for older versions of RHRouter that used those bits for their own purposes 
+///   will not see them at the receiver, and must be changed to use other bits.
 /// - 0 or more octets DATA, the application payload data. The length of this data is implicit 
 ///   in the length of the entire message.
+/// - If FLAGS includes RH_ROUTER_FLAGS_ACKS, end-to-end ACKs follow the data: 
+///   RH_ROUTER_E2E_ACK_LEN octets each (the address of the acknowledging node, 
+///   the ID of the message it received and the HOPS it took to get there), then 1 octet, the number of ACKs.
 ///
 /// You should be careful to note that there are ID and FLAGS fields in the low level per-hop 
 /// message header too. These are used only for hop-to-hop, and in general will be different to 
@@ -121,11 +349,12 @@
 /// Bench testing of such networks is notoriously difficult, especially simulating limited radio 
 /// connectivity between some nodes.
 /// To assist testing (both during RH development and for your own networks) 
-/// RHRouter.cpp has the ability to 
-/// simulate a number of different small network topologies. Each simulated network supports 4 nodes with 
-/// addresses 1 to 4. It operates by pretending to not hear RH messages from certain other nodes.
-/// You can enable testing with a \#define TEST_NETWORK in RHRouter.h
-/// The sample programs rf22_mesh_* rely on this feature.
+/// tools/meshSimulator runs any number of RHMesh nodes in a single Linux process, over a simulated 
+/// medium whose topology, including the loss and latency of each link, is read from a file. 
+/// It runs in simulated time, much faster than real time, and reports the delivery ratio, 
+/// how long route discovery took to converge, the airtime spent on routing and the CPU time used. 
+/// See tools/meshSimulator.cpp for details. tools/topologies has some example topologies, including the 
+/// 4 node networks that RHRouter formerly simulated with RH_TEST_NETWORK.
 ///
 /// Part of the Arduino RH library for operating with HopeRF RH compatible transceivers 
 /// (see http://www.hoperf.com)
@@ -134,10 +363,10 @@ class RHRouter : public RHReliableDatagram
 public:
 
     /// Defines the structure of the RHRouter message header, used to keep track of end-to-end delivery parameters
-    typedef struct
+    typedef struct RH_PACKED
     {
-	uint8_t    dest;       ///< Destination node address
-	uint8_t    source;     ///< Originator node address
+	RHWireAddress dest;    ///< Destination node address
+	RHWireAddress source;  ///< Originator node address
 	uint8_t    hops;       ///< Hops traversed so far
 	uint8_t    id;         ///< Originator sequence number
 	uint8_t    flags;      ///< Originator flags
@@ -145,7 +374,7 @@ public:
     } RoutedMessageHeader;
 
     /// Defines the structure of a RHRouter message
-    typedef struct
+    typedef struct RH_PACKED
     {
 	RoutedMessageHeader header;    ///< end-to-end delivery header
 	uint8_t             data[RH_ROUTER_MAX_MESSAGE_LEN]; ///< Application payload data
@@ -156,21 +385,44 @@ public:
     {
 	Invalid = 0,           ///< No valid route is known
 	Discovering,           ///< Discovering a route (not currently used)
-	Valid                  ///< Route is valid
+	Valid,                 ///< Route is valid
+	Restored               ///< Route was restored from the state file, and has not been used since
     } RouteState;
 
     /// Defines an entry in the routing table
     typedef struct
     {
-	uint8_t      dest;      ///< Destination node address
-	uint8_t      next_hop;  ///< Send via this next hop address
-	uint8_t      state;     ///< State of this route, one of RouteState
+	RHAddress     dest;      ///< Destination node address
+	RHAddress     next_hop;  ///< Send via this next hop address
+	uint8_t       interface; ///< Send via this driver interface, or RH_ALL_INTERFACES for the cheapest link
+	uint8_t       state;     ///< State of this route, one of RouteState
+	uint8_t       cost;      ///< Cost of the path to dest, 0 if unknown. See linkCost()
+	unsigned long lastUsed;  ///< millis() when this route was last added, updated or looked up
+	unsigned long confirmed; ///< millis() when dest was last known to be reachable by this route. See routeAge()
     } RoutingTableEntry;
 
+    /// Defines the link quality measurements kept for each neighbour
+    typedef struct
+    {
+	uint8_t       etx;       ///< Expected transmission count * RH_ROUTER_LINK_COST_SCALE, 0 if not measured yet
+	int8_t        rssi;      ///< Average RSSI of messages received from the neighbour
+	bool          rssiValid; ///< true if rssi has been measured
+    } LinkMetrics;
+
+    /// Defines a delivery report for a message sent with RH_ROUTER_FLAGS_ACK_REQUEST. See deliveryReport()
+    typedef struct
+    {
+	RHAddress     dest;      ///< Destination node address
+	uint8_t       id;        ///< End-to-end ID of the message, see lastSentId()
+	uint8_t       status;    ///< RH_ROUTER_ERROR_NONE if delivered, RH_ROUTER_ERROR_TIMEOUT if no ACK came back
+	uint8_t       hops;      ///< Number of hops the message took to reach dest, 1 for a neighbour
+	unsigned long latency;   ///< Milliseconds from sending the message to receiving the ACK
+    } DeliveryReport;
+
     /// Constructor. 
     /// \param[in] driver The RadioHead driver to use to transport messages.
     /// \param[in] thisAddress The address to assign to this node. Defaults to 0
-    RHRouter(RHGenericDriver& driver, uint8_t thisAddress = 0);
+    RHRouter(RHGenericDriver& driver, RHAddress thisAddress = 0);
 
     /// Initialises this instance and the radio module connected to it.
     /// Overrides the init() function in RH.
@@ -184,27 +436,104 @@ public:
     /// \param [in] max_hops The new value for max_hops
     void setMaxHops(uint8_t max_hops);
 
+    /// Sets the time after which a route that has not been used or updated expires.
+    /// Expired routes are deleted when they are next looked up.
+    /// \param [in] timeout The route timeout in milliseconds. 0 (the default) means routes never expire.
+    void setRouteTimeout(unsigned long timeout);
+
     /// Adds a route to the local routing table, or updates it if already present.
-    /// If there is not enough room the oldest (first) route will be deleted by calling retireOldestRoute().
+    /// If there is not enough room the least recently used route will be deleted by calling retireOldestRoute().
     /// \param [in] dest The destination node address. RH_BROADCAST_ADDRESS is permitted.
     /// \param [in] next_hop The address of the next hop to send messages destined for dest
     /// \param [in] state The satte of the route. Defaults to Valid
-    void addRouteTo(uint8_t dest, uint8_t next_hop, uint8_t state = Valid);
-
-    /// Finds and returns a RoutingTableEntry for the given destination node
+    /// \param [in] cost The cost of the path to dest. Defaults to 0, unknown
+    /// \param [in] interface The driver interface to send on, for drivers with more than one. 
+    /// Defaults to RH_ALL_INTERFACES, which sends on the interface with the cheapest link to next_hop
+    void addRouteTo(RHAddress dest, RHAddress next_hop, uint8_t state = Valid, uint8_t cost = 0, uint8_t interface = RH_ALL_INTERFACES);
+
+    /// Adds or updates a route to dest with a known cost, subject to hysteresis.
+    /// The route is installed if there is no route to dest yet, if its current cost is unknown, 
+    /// if it is already via next_hop and interface (in which case its cost is updated), or if cost plus 
+    /// the route hysteresis is less than the cost of the current route.
+    /// \param [in] dest The destination node address
+    /// \param [in] next_hop The address of the next hop to send messages destined for dest
+    /// \param [in] cost The cost of the path to dest via next_hop
+    /// \param [in] age How long ago, in milliseconds, dest was known to be reachable by this path. 
+    /// Defaults to 0, just now. If the route is already via next_hop, a more recent confirmation is kept.
+    /// \param [in] interface The driver interface to send on. Defaults to RH_ALL_INTERFACES, which keeps 
+    /// the interface of a route that is already via next_hop
+    /// \return true if the route was installed or updated
+    bool updateRouteTo(RHAddress dest, RHAddress next_hop, uint8_t cost, unsigned long age = 0, uint8_t interface = RH_ALL_INTERFACES);
+
+    /// Returns the age of a route: how long since its destination was last known 
+    /// to be reachable by it. Routes added with addRouteTo() are new. Routes 
+    /// learned second hand with updateRouteTo() inherit the age of the information they came from.
+    /// Routes restored from the state file are as old as can be until they have been used.
+    /// \param [in] route The route, as returned by getRouteTo()
+    /// \return The age of the route in milliseconds
+    unsigned long routeAge(const RoutingTableEntry* route);
+
+    /// Sets the amount by which a new route must be cheaper than the current route 
+    /// to the same destination before updateRouteTo() replaces it.
+    /// \param [in] hysteresis The new hysteresis in cost units. 
+    /// Defaults to RH_ROUTER_DEFAULT_ROUTE_HYSTERESIS
+    void setRouteHysteresis(uint8_t hysteresis);
+
+    /// Enables or disables holding messages received while waiting for acknowledgements, 
+    /// for later delivery or forwarding. See the Store and Forward section above.
+    /// Messages already held are still delivered after it is disabled.
+    /// \param [in] storeAndForward true to hold messages. Defaults to false
+    void setStoreAndForward(bool storeAndForward);
+
+    /// Returns the number of messages held for later delivery or forwarding
+    /// \return The number of held messages
+    uint8_t numHeldMessages();
+
+    /// Returns the link quality measurements for a neighbour
+    /// \param [in] neighbour The address of the neighbour
+    /// \param [in] interface The driver interface of the link. Defaults to RH_ALL_INTERFACES, the cheapest link
+    /// \return pointer to the LinkMetrics for the neighbour
+    const LinkMetrics* linkMetrics(RHAddress neighbour, uint8_t interface = RH_ALL_INTERFACES);
+
+    /// Returns the cost of the link to a neighbour, from its ETX and RSSI. A link that has 
+    /// not been measured is assumed to be perfect.
+    /// \param [in] neighbour The address of the neighbour
+    /// \param [in] interface The driver interface of the link. Defaults to RH_ALL_INTERFACES, the cheapest link
+    /// \return The link cost, from RH_ROUTER_LINK_COST_SCALE to RH_ROUTER_MAX_COST
+    uint8_t linkCost(RHAddress neighbour, uint8_t interface = RH_ALL_INTERFACES);
+
+    /// Finds the driver interface with the cheapest link to a neighbour
+    /// \param [in] neighbour The address of the neighbour
+    /// \return The interface number, or RH_ALL_INTERFACES if no link to the neighbour has been measured 
+    /// on any of the first RH_ROUTER_MAX_INTERFACES interfaces
+    uint8_t bestInterface(RHAddress neighbour);
+
+    /// Adds two costs, saturating at RH_ROUTER_MAX_COST
+    /// \param [in] a First cost
+    /// \param [in] b Second cost
+    /// \return The sum of a and b, or RH_ROUTER_MAX_COST
+    static uint8_t addCost(uint8_t a, uint8_t b);
+
+    /// Finds and returns a RoutingTableEntry for the given destination node, 
+    /// and marks it as the most recently used route.
+    /// If the route has expired, it is deleted.
     /// \param [in] dest The desired destination node address.
-    /// \return pointer to a RoutingTableEntry for dest
-    RoutingTableEntry* getRouteTo(uint8_t dest);
+    /// \return pointer to a RoutingTableEntry for dest, or NULL if there is no valid route
+    RoutingTableEntry* getRouteTo(RHAddress dest);
 
     /// Deletes from the local routing table any route for the destination node.
     /// \param [in] dest The destination node address
     /// \return true if the route was present
-    bool deleteRouteTo(uint8_t dest);
+    bool deleteRouteTo(RHAddress dest);
 
-    /// Deletes the oldest (first) route from the 
+    /// Deletes the least recently used route from the 
     /// local routing table
     void retireOldestRoute();
 
+    /// Returns the number of valid routes in the local routing table
+    /// \return The number of routes
+    uint16_t numRoutes();
+
     /// Clears all entries from the 
     /// local routing table
     void clearRoutingTable();
@@ -223,13 +552,88 @@ public:
     /// \param [in] dest The destination node address
     /// \param [in] flags Optional flags for use by subclasses or application layer, 
     ///             delivered end-to-end to the dest address. The receiver can recover the flags with recvFromAck().
+    ///             Include RH_ROUTER_FLAGS_ACK_REQUEST to get a deliveryReport() for the message.
+    ///             RH_ROUTER_FLAGS_ACKS and RH_ROUTER_FLAGS_ACK_ONLY are reserved and are cleared.
     /// \return The result code:
     ///         - RH_ROUTER_ERROR_NONE Message was routed and delivered to the next hop 
     ///           (not necessarily to the final dest address)
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Not able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t flags = 0);
+    ///         - RH_ROUTER_ERROR_QUEUE_FULL RH_ROUTER_FLAGS_ACK_REQUEST was given, but there are already 
+    ///           RH_ROUTER_MAX_DELIVERY_REPORTS messages waiting for ACKs or with reports not yet collected
+    uint8_t sendtoWait(uint8_t* buf, uint8_t len, RHAddress dest, uint8_t flags = 0);
+
+    /// Like sendtoWait() above, but the RHRouter header is pushed into the headroom of the 
+    /// packet, and the message is sent from there without being copied. 
+    /// The header is pulled off again before returning, so the packet can be reused.
+    /// End-to-end ACKs are not piggybacked on messages sent this way, since there is no room for them.
+    /// \param [in,out] packet The application message data
+    /// \param [in] dest The destination node address
+    /// \param [in] flags Optional flags for use by subclasses or application layer, as for sendtoWait() above
+    /// \return The result code, as for sendtoWait() above, or RH_ROUTER_ERROR_INVALID_LENGTH if there 
+    /// was not enough headroom
+    uint8_t sendtoWait(RHPacketBuffer& packet, RHAddress dest, uint8_t flags = 0);
+
+    /// Floods a message across the whole network. It is broadcast to all the nodes in range, 
+    /// and each node that receives it broadcasts it once more, until it has been relayed max hops times.
+    /// Nothing is acknowledged, so delivery is not guaranteed, even to nodes in range. 
+    /// Nodes receive the message from recvfromAck() if dest is RH_BROADCAST_ADDRESS, 
+    /// their own address, or a multicast group they have joined.
+    /// \param [in] buf The application message data
+    /// \param [in] len Number of octets in the application message data. 0 is permitted
+    /// \param [in] dest RH_BROADCAST_ADDRESS or a multicast group address
+    /// \param [in] flags Optional flags for use by subclasses or application layer, 
+    ///             delivered end-to-end to the receivers, except the reserved RH_ROUTER_FLAGS_ACKS and RH_ROUTER_FLAGS_ACK_ONLY
+    /// \return The result code:
+    ///         - RH_ROUTER_ERROR_NONE Message was sent
+    ///         - RH_ROUTER_ERROR_INVALID_LENGTH The message is too long
+    uint8_t floodWait(uint8_t* buf, uint8_t len, RHAddress dest = RH_BROADCAST_ADDRESS, uint8_t flags = 0);
+
+    /// Joins a multicast group, so that floods sent to the group address are received by recvfromAck()
+    /// \param [in] group The group address
+    /// \return false if this node is already in RH_ROUTER_MAX_GROUPS groups
+    bool joinGroup(RHAddress group);
+
+    /// Leaves a multicast group joined with joinGroup()
+    /// \param [in] group The group address
+    void leaveGroup(RHAddress group);
+
+    /// Tells whether this node has joined a multicast group
+    /// \param [in] group The group address
+    /// \return true if the node is in the group
+    bool isGroupMember(RHAddress group);
+
+#ifdef RH_ROUTER_HAVE_STATE_FILE
+    /// Keeps the routing table and link metrics in a memory mapped file, so they survive restarts.
+    /// If the file holds the state saved by an earlier run with the same node address and 
+    /// the same build options, the routes and link metrics in it replace the current ones, 
+    /// with the routes in the Restored state. Otherwise the file is created or overwritten with the 
+    /// current routes and link metrics. Call this after init(), and before adding any routes.
+    /// \param [in] path Path of the state file
+    /// \return true if the file could be used, false (and the state stays in memory) if not
+    bool setStateFile(const char* path);
+#endif
+
+    /// Returns the end-to-end ID of the last message this node sent with sendtoWait() or floodWait()
+    /// \return The ID, as given in its DeliveryReport
+    uint8_t lastSentId();
+
+    /// Gets the result of sending a message with RH_ROUTER_FLAGS_ACK_REQUEST. 
+    /// Does not wait: ACKs are received by recvfromAck(), which you must keep calling.
+    /// Each report is returned once, oldest message first.
+    /// \param [out] report The delivery report
+    /// \return true if a report was available
+    bool deliveryReport(DeliveryReport* report);
+
+    /// Sets how long to wait for end-to-end ACKs before reporting that the message was not delivered.
+    /// \param [in] timeout Timeout in milliseconds. Defaults to RH_ROUTER_DEFAULT_E2E_ACK_TIMEOUT
+    void setEndToEndAckTimeout(uint16_t timeout);
+
+    /// Sets how long a destination may hold on to end-to-end ACKs, in the hope of piggybacking them 
+    /// on a message going the same way, before sending them on their own.
+    /// \param [in] delay Delay in milliseconds. 0 (the default) sends them immediately
+    void setEndToEndAckDelay(uint16_t delay);
 
     /// Similar to sendtoWait() above, but spoofs the source address.
     /// For internal use only during routing
@@ -245,7 +649,7 @@ public:
     ///         - RH_ROUTER_ERROR_NO_ROUTE There was no route for dest in the local routing table
     ///         - RH_ROUTER_ERROR_UNABLE_TO_DELIVER Noyt able to deliver to the next hop 
     ///           (usually because it dod not acknowledge due to being off the air or out of range
-    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, uint8_t dest, uint8_t source, uint8_t flags = 0);
+    uint8_t sendtoFromSourceWait(uint8_t* buf, uint8_t len, RHAddress dest, RHAddress source, uint8_t flags = 0);
 
     /// Starts the receiver if it is not running already.
     /// If there is a valid message available for this node (or RH_BROADCAST_ADDRESS), 
@@ -261,13 +665,13 @@ public:
     /// If the message is not a broadcast, acknowledge to the sender before returning.
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was recvived for this node copied to buf
-    bool recvfromAck(uint8_t* buf, uint8_t* len, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAck(uint8_t* buf, uint8_t* len, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
     /// Starts the receiver if it is not running already.
     /// Similar to recvfromAck(), this will block until either a valid message available for this node
@@ -275,13 +679,13 @@ public:
     /// \param[in] buf Location to copy the received message
     /// \param[in,out] len Available space in buf. Set to the actual number of octets copied.
     /// \param[in] timeout Maximum time to wait in milliseconds
-    /// \param[in] source If present and not NULL, the referenced uint8_t will be set to the SOURCE address
-    /// \param[in] dest If present and not NULL, the referenced uint8_t will be set to the DEST address
+    /// \param[in] source If present and not NULL, the referenced RHAddress will be set to the SOURCE address
+    /// \param[in] dest If present and not NULL, the referenced RHAddress will be set to the DEST address
     /// \param[in] id If present and not NULL, the referenced uint8_t will be set to the ID
     /// \param[in] flags If present and not NULL, the referenced uint8_t will be set to the FLAGS
     /// (not just those addressed to this node).
     /// \return true if a valid message was copied to buf
-    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, uint8_t* source = NULL, uint8_t* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
+    bool recvfromAckTimeout(uint8_t* buf, uint8_t* len,  uint16_t timeout, RHAddress* source = NULL, RHAddress* dest = NULL, uint8_t* id = NULL, uint8_t* flags = NULL);
 
 protected:
 
@@ -299,11 +703,102 @@ protected:
     /// \param [in] messageLen Length of message in octets
     virtual uint8_t route(RoutedMessage* message, uint8_t messageLen);
 
-    /// Deletes a specific rout entry from therouting table
-    /// \param [in] index The 0 based index of the routing table entry to delete
+    /// Finds the RoutingTableEntry for the given destination node, without marking it as 
+    /// recently used or checking whether it has expired.
+    /// \param [in] dest The desired destination node address.
+    /// \return pointer to a RoutingTableEntry for dest, or NULL if there is no valid route
+    RoutingTableEntry* findRouteTo(RHAddress dest);
+
+    /// Reliably sends a message to a next hop, updating the ETX of the link to it.
+    /// Called by route() once it has chosen the next hop.
+    /// \param [in] message Pointer to the RHRouter message to be sent.
+    /// \param [in] messageLen Length of message in octets
+    /// \param [in] next_hop The address of the next hop, or RH_BROADCAST_ADDRESS
+    /// \param [in] interface The driver interface to send on. Defaults to RH_ALL_INTERFACES, 
+    /// which sends on bestInterface(). Broadcasts are always sent on all interfaces
+    /// \return RH_ROUTER_ERROR_NONE or RH_ROUTER_ERROR_UNABLE_TO_DELIVER
+    uint8_t sendToNextHop(RoutedMessage* message, uint8_t messageLen, RHAddress next_hop, uint8_t interface = RH_ALL_INTERFACES);
+
+    /// Broadcasts a message marked as a flood, for floodWait() or to relay a flood
+    /// \param [in] message Pointer to the RHRouter message to be sent.
+    /// \param [in] messageLen Length of message in octets
+    /// \return RH_ROUTER_ERROR_NONE
+    uint8_t sendFlood(RoutedMessage* message, uint8_t messageLen);
+
+    /// Tells whether a flood has been seen before, and remembers it if not
+    /// \param [in] source The SOURCE address of the flood
+    /// \param [in] id The end-to-end ID of the flood
+    /// \return true if the flood is in the cache of recent floods
+    bool floodSeen(RHAddress source, uint8_t id);
+
+    /// Sends any end-to-end ACKs that have waited for the end-to-end ACK delay
+    void checkEndToEndAcks();
+
+    /// Works out how long recvfromAckTimeout() can wait before checkEndToEndAcks() has to send ACKs
+    /// \param [in] timeLeft The time left before the timeout, in milliseconds
+    /// \return timeLeft, or less if ACKs are due before then
+    int32_t endToEndAckTimeLeft(int32_t timeLeft);
+
+    /// Deletes a specific route entry from the routing table
+    /// \param [in] index The index of the routing table entry to delete, see routeIndex()
     void deleteRoute(uint8_t index);
 
-    /// The last end-to-end sequence number to be used
+    /// Marks a route as the most recently used one, adding it to the LRU list if necessary
+    /// \param [in] index The index of the routing table entry, see routeIndex()
+    void touchRoute(uint8_t index);
+
+    /// Finds where the route to a destination is, or would be, in the routing table
+    /// \param [in] dest The destination node address
+    /// \return The index of the routing table entry for dest, which is dest itself unless 
+    /// RH_ROUTING_TABLE_HASHED is defined. If there is no route to dest, the entry is Invalid
+    uint8_t routeIndex(RHAddress dest);
+
+    /// Updates the ETX of the link to a neighbour after trying to send a message to it
+    /// \param [in] neighbour The address of the neighbour
+    /// \param [in] interface The driver interface the message was sent on
+    /// \param [in] delivered true if the message was acknowledged
+    /// \param [in] transmissions Number of times the message was transmitted
+    void updateLinkEtx(RHAddress neighbour, uint8_t interface, bool delivered, uint8_t transmissions);
+
+    /// Updates the RSSI of the link to a neighbour after receiving a message from it
+    /// \param [in] neighbour The address of the neighbour
+    /// \param [in] interface The driver interface the message was received on
+    /// \param [in] rssi The RSSI of the received message
+    void updateLinkRssi(RHAddress neighbour, uint8_t interface, int8_t rssi);
+
+    /// Returns the node the message currently being handled by recvfromAck() was received from. 
+    /// Use this rather than headerFrom(), which may describe a message that has since been held.
+    /// \return The address of the previous hop
+    RHAddress previousHop();
+
+    /// Returns the driver interface the message currently being handled by recvfromAck() was received on
+    /// \return The interface number
+    uint8_t previousInterface();
+
+#if RH_ROUTER_FORWARDING_QUEUE_LEN > 0
+    /// Returns the next free slot in the store and forward queue, if store and forward is enabled.
+    /// Overrides RHReliableDatagram::holdBuffer()
+    virtual uint8_t* holdBuffer(uint8_t* len);
+
+    /// Adds the message in the slot returned by holdBuffer() to the store and forward queue.
+    /// Overrides RHReliableDatagram::holdMessage()
+    virtual void holdMessage(uint8_t len, RHAddress from, RHAddress to, uint8_t id, uint8_t flags);
+#endif
+
+    /// A message held for later delivery or forwarding
+    typedef struct
+    {
+	RoutedMessage message; ///< The message
+	uint8_t       len;     ///< Length of the message
+	RHAddress     from;    ///< Hop-to-hop FROM header
+	RHAddress     to;      ///< Hop-to-hop TO header
+	uint8_t       id;      ///< Hop-to-hop ID header
+	uint8_t       flags;   ///< Hop-to-hop FLAGS header
+	int8_t        rssi;    ///< RSSI the message was received with
+	uint8_t       interface; ///< Driver interface the message was received on
+    } HeldMessage;
+
+    /// The next end-to-end sequence number to be used
     /// Defaults to 0
     uint8_t _lastE2ESequenceNumber;
 
@@ -311,13 +806,202 @@ protected:
     /// If a routed message would exceed this number of hops it is dropped and ignored.
     uint8_t              _max_hops;
 
+    /// Route hysteresis in cost units
+    uint8_t              _routeHysteresis;
+
+    /// Whether messages received while waiting for acknowledgements are held
+    bool                 _storeAndForward;
+
+    /// The store and forward queue, a ring buffer
+#if RH_ROUTER_FORWARDING_QUEUE_LEN > 0
+    HeldMessage          _held[RH_ROUTER_FORWARDING_QUEUE_LEN];
+#endif
+
+    /// Index of the oldest held message
+    uint8_t              _heldHead;
+
+    /// Number of held messages
+    uint8_t              _numHeld;
+
+    /// Node the message being handled by recvfromAck() was received from
+    RHAddress            _previousHop;
+
+    /// Driver interface the message being handled by recvfromAck() was received on
+    uint8_t              _previousInterface;
+
+    /// Identifies a flood, for the cache of recent floods
+    typedef struct
+    {
+	RHAddress     source;  ///< SOURCE address of the flood
+	uint8_t       id;      ///< End-to-end ID of the flood
+    } FloodId;
+
+    /// Recent floods, a ring buffer. Unused entries have a source of RH_BROADCAST_ADDRESS
+    FloodId              _floods[RH_ROUTER_FLOOD_CACHE_SIZE];
+
+    /// Index of the next entry in _floods to be replaced
+    uint8_t              _nextFlood;
+
+    /// Multicast groups this node has joined
+    RHAddress            _groups[RH_ROUTER_MAX_GROUPS];
+
+    /// Number of entries in _groups
+    uint8_t              _numGroups;
+
+    /// A message waiting for an end-to-end ACK, or its delivery report
+    typedef struct
+    {
+	RHAddress     dest;      ///< Destination node address, RH_BROADCAST_ADDRESS if the entry is free
+	uint8_t       id;        ///< End-to-end ID of the message
+	uint8_t       hops;      ///< Hops reported by the ACK, 0 while waiting for it
+	unsigned long sent;      ///< millis() when the message was sent
+	unsigned long latency;   ///< Milliseconds until the ACK was received
+    } PendingDelivery;
+
+    /// Messages waiting for end-to-end ACKs, and delivery reports not yet collected
+    PendingDelivery      _deliveries[RH_ROUTER_MAX_DELIVERY_REPORTS];
+
+    /// Time to wait for an end-to-end ACK, in milliseconds
+    uint16_t             _e2eAckTimeout;
+
+    /// An end-to-end ACK waiting to be sent
+    typedef struct
+    {
+	RHAddress     to;        ///< Originator of the acknowledged message
+	uint8_t       id;        ///< End-to-end ID of the acknowledged message
+	uint8_t       hops;      ///< Number of hops the acknowledged message took
+	unsigned long since;     ///< millis() when the acknowledged message was received
+    } EndToEndAck;
+
+    /// End-to-end ACKs waiting to be sent, oldest first
+    EndToEndAck          _e2eAcks[RH_ROUTER_MAX_E2E_ACKS];
+
+    /// Number of entries in _e2eAcks
+    uint8_t              _numE2EAcks;
+
+    /// How long to hold end-to-end ACKs in the hope of piggybacking them, in milliseconds
+    uint16_t             _e2eAckDelay;
+
 private:
 
-    /// Temporary mesage buffer
-    static RoutedMessage _tmpMessage;
+    /// Temporary message buffer. Not shared with other instances, so that several routers, each 
+    /// with its own driver, can be used in one program
+    RoutedMessage        _tmpMessage;
 
-    /// Local routing table
-    RoutingTableEntry    _routes[RH_ROUTING_TABLE_SIZE];
+    /// The routing table and link metrics, kept together so they can be mapped from the state file
+    typedef struct
+    {
+	RoutingTableEntry routes[RH_ROUTING_TABLE_SLOTS];  ///< Routing table
+	uint8_t           lruPrev[RH_ROUTING_TABLE_SLOTS]; ///< Least recently used list of routes
+	uint8_t           lruNext[RH_ROUTING_TABLE_SLOTS]; ///< Least recently used list of routes
+	LinkMetrics       links[RH_ROUTING_TABLE_SLOTS * RH_ROUTER_MAX_INTERFACES];         ///< Link quality measurements
+#ifdef RH_ROUTING_TABLE_HASHED
+	RHAddress         linkNeighbour[RH_ROUTING_TABLE_SLOTS * RH_ROUTER_MAX_INTERFACES]; ///< The neighbour each entry in links is for
+#endif
+    } RoutingState;
+
+    /// The routing state when it is not in a state file
+    RoutingState         _localState;
+
+    /// Local routing table, indexed by routeIndex(). Points into _localState or the state file
+    RoutingTableEntry*   _routes;
+
+    /// Least recently used list of valid routes, linked by routing table index.
+    /// The head and tail of the list link to themselves. Point into _localState or the state file
+    uint8_t*             _lruPrev;
+    uint8_t*             _lruNext;
+
+    /// Most recently used route
+    uint8_t              _lruHead;
+
+    /// Least recently used route
+    uint8_t              _lruTail;
+
+    /// Number of valid routes
+    uint16_t             _numRoutes;
+
+    /// Route timeout in milliseconds, 0 if routes never expire
+    unsigned long        _routeTimeout;
+
+    /// Starts keeping a delivery report for a message about to be sent with RH_ROUTER_FLAGS_ACK_REQUEST
+    /// \param [in] dest The destination of the message
+    /// \param [in] id The end-to-end ID of the message
+    /// \return pointer to the PendingDelivery, or NULL if there are no free ones
+    PendingDelivery*     startDeliveryReport(RHAddress dest, uint8_t id);
+
+    /// Queues an end-to-end ACK to be sent by checkEndToEndAcks() after the end-to-end ACK delay
+    /// \param [in] message The message to acknowledge, which was addressed to this node
+    void                 acknowledgeEndToEnd(RoutedMessage* message);
+
+    /// Adds end-to-end ACKs for the destination of a message to the end of it, if there is room
+    /// \param [in] message The message, in _tmpMessage
+    /// \param [in,out] messageLen Length of the message, updated to include the ACKs
+    /// \return The number of ACKs added
+    uint8_t              addEndToEndAcks(RoutedMessage* message, uint8_t* messageLen);
+
+    /// Removes the oldest end-to-end ACKs to a node from the queue, once they have been sent
+    /// \param [in] to The node the ACKs were sent to
+    /// \param [in] count The number of ACKs to remove
+    void                 removeEndToEndAcks(RHAddress to, uint8_t count);
+
+    /// Works out the length of the end-to-end ACKs at the end of a received message
+    /// \param [in] message The message
+    /// \param [in] messageLen Length of the message
+    /// \return The length of the ACKs, including their count, or 0 if there are none
+    uint8_t              endToEndAcksLen(RoutedMessage* message, uint8_t messageLen);
+
+    /// Completes the delivery reports for the end-to-end ACKs at the end of a message
+    /// \param [in] message The message, addressed to this node
+    /// \param [in] messageLen Length of the message
+    void                 handleEndToEndAcks(RoutedMessage* message, uint8_t messageLen);
+
+    /// Finds the link quality measurements for a neighbour
+    /// \param [in] neighbour The address of the neighbour
+    /// \param [in] interface The driver interface of the link. Interfaces from RH_ROUTER_MAX_INTERFACES on 
+    /// share the measurements of the last one
+    /// \param [in] create true to start new measurements if there are none
+    /// \return pointer to the LinkMetrics for the neighbour, or to an unmeasured LinkMetrics if there 
+    /// are none and create is false
+    LinkMetrics*         findLink(RHAddress neighbour, uint8_t interface, bool create);
+
+#ifdef RH_ROUTING_TABLE_HASHED
+    /// Moves a route to another, empty, entry of the routing table, keeping its place in the LRU list
+    /// \param [in] from The index of the route
+    /// \param [in] to The index of the empty entry
+    void                 moveRoute(uint8_t from, uint8_t to);
+
+    /// The neighbour each entry in _links is for
+    RHAddress*           _linkNeighbour;
+
+    /// Returned by findLink() for neighbours without measurements
+    LinkMetrics          _noLink;
+#endif
+
+    /// Link quality measurements, RH_ROUTING_TABLE_SLOTS for each interface, indexed by neighbour address, 
+    /// or with RH_ROUTING_TABLE_HASHED by RH_ADDRESS_HASH() of the address. A neighbour whose address shares 
+    /// a slot with another one then replaces its measurements
+    LinkMetrics*         _links;
+
+#ifdef RH_ROUTER_HAVE_STATE_FILE
+    /// Layout of the state file
+    typedef struct
+    {
+	uint32_t          magic;               ///< RH_ROUTER_STATE_FILE_MAGIC
+	uint32_t          size;                ///< sizeof(RoutingState)
+	RHAddress         thisAddress;         ///< Address of the node that saved it
+	RoutingState      state;               ///< The state
+    } StateFile;
+
+    /// The mapped state file, or NULL
+    StateFile*           _stateFile;
+
+    /// Lists the routes in a routing state from least to most recently used, following its LRU list, 
+    /// or if that is broken, by when they were last used
+    /// \param [in] state The routing state
+    /// \param [out] order The routing table indexes of the routes
+    /// \return The number of routes
+    uint16_t             lruOrder(RoutingState* state, uint8_t* order);
+#endif
 };
 
 /// @example rf22_router_client.pde
@@ -81,6 +81,28 @@ uint8_t RHSPIDriver::spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t len)
     return status;
 }
 
+uint8_t RHSPIDriver::spiBurstWritev(uint8_t reg, const uint8_t* src, uint8_t len, const Segment* segments, uint8_t numSegments)
+{
+    uint8_t status = 0;
+    RPI_CE0_CE1_FIX;
+    ATOMIC_BLOCK_START;
+    digitalWrite(_slaveSelectPin, LOW);
+    status = _spi.transfer(reg | RH_SPI_WRITE_MASK); // Send the start address with the write mask on
+    while (len--)
+	_spi.transfer(*src++);
+    while (numSegments--)
+    {
+	const uint8_t* data = segments->data;
+	uint8_t segmentLen = segments->len;
+	while (segmentLen--)
+	    _spi.transfer(*data++);
+	segments++;
+    }
+    digitalWrite(_slaveSelectPin, HIGH);
+    ATOMIC_BLOCK_END;
+    return status;
+}
+
 void RHSPIDriver::setSlaveSelectPin(uint8_t slaveSelectPin)
 {
     _slaveSelectPin = slaveSelectPin;
@@ -93,6 +93,17 @@ public:
     ///  it may or may not be meaningfule depending on the the type of device being accessed.
     uint8_t           spiBurstWrite(uint8_t reg, const uint8_t* src, uint8_t len);
 
+    /// Write a number of consecutive registers using burst write mode, taking the new values 
+    /// from a first buffer, then from several separate buffers in turn, all in one SPI transaction
+    /// \param[in] reg Register number of the first register
+    /// \param[in] src Array of the first new register values, such as a header. May be NULL if len is 0
+    /// \param[in] len Number of bytes in src
+    /// \param[in] segments Array of buffers of the following new register values, in order
+    /// \param[in] numSegments Number of segments
+    /// \return Some devices return a status byte during the first data transfer. This byte is returned.
+    ///  it may or may not be meaningfule depending on the the type of device being accessed.
+    uint8_t           spiBurstWritev(uint8_t reg, const uint8_t* src, uint8_t len, const Segment* segments, uint8_t numSegments);
+
     /// Set or change the pin to be used for SPI slave select.
     /// This can be called at any time to change the
     /// pin that will be used for slave select in subsquent SPI operations.
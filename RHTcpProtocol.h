@@ -12,6 +12,7 @@
 #define RH_TCP_MESSAGE_TYPE_NOP               0
 #define RH_TCP_MESSAGE_TYPE_THISADDRESS       1
 #define RH_TCP_MESSAGE_TYPE_PACKET            2
+#define RH_TCP_MESSAGE_TYPE_MODEMCONFIG       3
 
 // Maximum message length (including the headers) we are willing to support
 #define RH_TCP_MAX_PAYLOAD_LEN 255
@@ -61,6 +62,40 @@ typedef struct
     uint8_t         payload[RH_TCP_MAX_MESSAGE_LEN]; ///< 0 or more, length deduced from length above
 }   RHTcpPacket;
 
+/// \brief RH_TCP message Notifies the server of the LoRa modem parameters this client transmits and receives with,
+/// so it can work out how long each packet is on the air, how far it carries and what it collides with
+typedef struct
+{
+    uint32_t        length;          ///< Number of octets following, in network byte order
+    uint8_t         type;            ///< == RH_TCP_MESSAGE_TYPE_MODEMCONFIG
+    uint32_t        frequency;       ///< Centre frequency in Hz, in network byte order
+    uint32_t        bandwidth;       ///< Signal bandwidth in Hz, in network byte order
+    uint8_t         spreadingFactor; ///< 6 to 12
+    uint8_t         codingRate;      ///< Denominator of the coding rate, 5 to 8 for 4/5 to 4/8
+    uint16_t        preambleLength;  ///< Preamble length in symbols, in network byte order
+    int8_t          txPower;         ///< Transmitter power in dBm
+}   RHTcpModemConfig;
+
 #pragma pack(pop)
 
+/// Time on air in microseconds of a LoRa packet, with explicit header and CRC, as given by the Semtech
+/// SX1276 datasheet. Low data rate optimisation is on when a symbol is longer than 16ms, as the SX1276 requires.
+/// \param[in] len Number of octets in the packet, including the RH_TCP_HEADER_LEN headers
+/// \param[in] spreadingFactor 6 to 12
+/// \param[in] bandwidth Signal bandwidth in Hz
+/// \param[in] codingRate Denominator of the coding rate, 5 to 8
+/// \param[in] preambleLength Preamble length in symbols
+/// \return The time on air in microseconds
+inline uint32_t RHTcpTimeOnAir(uint16_t len, uint8_t spreadingFactor, uint32_t bandwidth, uint8_t codingRate, uint16_t preambleLength)
+{
+    uint64_t symbolTime = ((uint64_t)1000000 << spreadingFactor) / bandwidth; // microseconds
+    int32_t  lowDataRate = symbolTime > 16000 ? 2 : 0;
+    int32_t  bits = 8 * (int32_t)len - 4 * spreadingFactor + 28 + 16; // CRC, no implicit header
+    int32_t  bitsPerBlock = 4 * (spreadingFactor - lowDataRate);
+    int32_t  blocks = bits > 0 ? (bits + bitsPerBlock - 1) / bitsPerBlock : 0;
+    // Preamble of preambleLength + 4.25 symbols, then 8 symbols plus one codeword per block, in quarter symbols
+    uint64_t quarterSymbols = 4 * (uint64_t)preambleLength + 17 + 4 * (8 + (uint64_t)blocks * codingRate);
+    return (uint32_t)((quarterSymbols * ((uint64_t)1000000 << spreadingFactor)) / (4 * (uint64_t)bandwidth));
+}
+
 #endif
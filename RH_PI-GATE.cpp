@@ -24,7 +24,7 @@ PROGMEM static const RH_SX1276::ModemConfig MODEM_CONFIG_TABLE[] = {
 		};
 
 RH_SX1276::RH_SX1276(uint8_t slaveSelectPin, uint8_t interruptPin, uint8_t rstPin, uint8_t txePin, RHGenericSPI& spi) :
-		RHSPIDriver(slaveSelectPin, spi), _rxBufValid(0) {
+		RHSPIDriver(slaveSelectPin, spi), _rxBufValid(0), _leased(false) {
 	_slaveSelectPin = slaveSelectPin;
 	_interruptPin = interruptPin;
 	_resetPin = rstPin;
@@ -134,6 +134,9 @@ void RH_SX1276::validateRxBuf() {
 }
 
 bool RH_SX1276::available() {
+	if (_leased)
+		return false; // Dont touch the buffer or the radio until the lent message is released
+
 #ifdef RH_SX1276_IRQLESS
 	// Read the interrupt register
 	uint8_t irq_flags = spiRead(RH_SX1276_REG_12_IRQ_FLAGS);
@@ -193,7 +196,37 @@ bool RH_SX1276::recv(uint8_t* buf, uint8_t* len) {
 	return true;
 }
 
+bool RH_SX1276::recvLease(RxLease* lease) {
+	if (!available())
+		return false;
+	lease->data = _buf + RH_SX1276_HEADER_LEN;
+	lease->len = _bufLen - RH_SX1276_HEADER_LEN;
+	lease->headerTo = _rxHeaderTo;
+	lease->headerFrom = _rxHeaderFrom;
+	lease->headerId = _rxHeaderId;
+	lease->headerFlags = _rxHeaderFlags;
+	lease->rssi = _lastRssi;
+	_leased = true;
+	return true;
+}
+
+void RH_SX1276::releaseLease() {
+	if (!_leased)
+		return;
+	_leased = false;
+	clearRxBuf(); // This message accepted and cleared
+}
+
 bool RH_SX1276::send(const uint8_t* data, uint8_t len) {
+	Segment segment = { data, len };
+	return sendv(&segment, 1);
+}
+
+bool RH_SX1276::sendv(const Segment* segments, uint8_t numSegments) {
+	uint16_t len = 0;
+	uint8_t i;
+	for (i = 0; i < numSegments; i++)
+		len += segments[i].len;
 	if (len > RH_SX1276_MAX_MESSAGE_LEN)
 		return false;
 
@@ -203,22 +236,61 @@ bool RH_SX1276::send(const uint8_t* data, uint8_t len) {
 	if (!waitCAD())
 		return false;  // Check channel activity
 
-	// Position at the beginning of the FIFO
-	spiWrite(RH_SX1276_REG_0D_FIFO_ADDR_PTR, 0);
-	// The headers
-	spiWrite(RH_SX1276_REG_00_FIFO, _txHeaderTo);
-	spiWrite(RH_SX1276_REG_00_FIFO, _txHeaderFrom);
-	spiWrite(RH_SX1276_REG_00_FIFO, _txHeaderId);
-	spiWrite(RH_SX1276_REG_00_FIFO, _txHeaderFlags);
-	// The message data
-	spiBurstWrite(RH_SX1276_REG_00_FIFO, data, len);
-	spiWrite(RH_SX1276_REG_22_PAYLOAD_LENGTH, len + RH_SX1276_HEADER_LEN);
+	loadFifo(segments, numSegments, len);
 
 	setModeTx(); // Start the transmitter
 	// when Tx is done, interruptHandler will fire and radio mode will return to STANDBY
 	return true;
 }
 
+bool RH_SX1276::sendAck(const uint8_t* data, uint8_t len) {
+	if (len > RH_SX1276_MAX_MESSAGE_LEN)
+		return false;
+
+	waitPacketSent(); // Make sure we dont interrupt an outgoing message
+
+	// No CAD here: the channel was busy with the very exchange we are acknowledging,
+	// and the sender is waiting for us. Going through CAD only adds latency.
+	// The FIFO can only be written in STDBY
+	setModeIdle();
+	Segment segment = { data, len };
+	loadFifo(&segment, 1, len);
+	setModeTx();
+
+	unsigned long start = millis();
+	while (!(spiRead(RH_SX1276_REG_12_IRQ_FLAGS) & RH_SX1276_TX_DONE)) {
+		if (millis() - start > RH_SX1276_ACK_TX_TIMEOUT) {
+			// TxDone never came: give up on this ACK, and get the radio listening again
+			setModeIdle();
+			spiWrite(RH_SX1276_REG_12_IRQ_FLAGS, 0xff);
+			setModeRx();
+			return false;
+		}
+		YIELD;
+	}
+	spiWrite(RH_SX1276_REG_12_IRQ_FLAGS, 0xff); // Clear all IRQ flags
+	_txGood++;
+
+	// The radio drops to STANDBY after TxDone. Go straight back to RX so we
+	// dont miss the next frame of the exchange
+	setModeRx();
+	return true;
+}
+
+void RH_SX1276::loadFifo(const Segment* segments, uint8_t numSegments, uint8_t len) {
+	uint8_t headers[RH_SX1276_HEADER_LEN];
+	headers[0] = _txHeaderTo;
+	headers[1] = _txHeaderFrom;
+	headers[2] = _txHeaderId;
+	headers[3] = _txHeaderFlags;
+
+	// Position at the beginning of the FIFO. The FIFO pointer advances with each octet written, 
+	// so the headers and then the message data, straight from the callers buffers, go in one burst
+	spiWrite(RH_SX1276_REG_0D_FIFO_ADDR_PTR, 0);
+	spiBurstWritev(RH_SX1276_REG_00_FIFO, headers, RH_SX1276_HEADER_LEN, segments, numSegments);
+	spiWrite(RH_SX1276_REG_22_PAYLOAD_LENGTH, len + RH_SX1276_HEADER_LEN);
+}
+
 #ifdef RH_SX1276_IRQLESS
 // Since we have no interrupts, we need to implement our own 
 // waitPacketSent for the driver by reading RF69 internal register
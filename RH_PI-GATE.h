@@ -47,6 +47,12 @@
 #define RH_SX1276_MAX_MESSAGE_LEN (RH_SX1276_MAX_PAYLOAD_LEN - RH_SX1276_HEADER_LEN)
 #endif
 
+// Milliseconds sendAck() waits for TxDone before giving up. Long enough for an ACK
+// with the slowest of the canned modem configs
+#ifndef RH_SX1276_ACK_TX_TIMEOUT
+#define RH_SX1276_ACK_TX_TIMEOUT 5000
+#endif
+
 // The crystal oscillator frequency of the module
 #define RH_SX1276_FXOSC 32000000.0
 
@@ -668,6 +674,15 @@ public:
 	/// \return true if a valid message was copied to buf
 	virtual bool recv(uint8_t* buf, uint8_t* len);
 
+	/// If there is a valid message available, lends it where it lies in the receive buffer, 
+	/// instead of copying it. The radio stays idle until the message is released with releaseLease().
+	/// \param[out] lease Set to describe the lent message
+	/// \return true if a message was lent
+	virtual bool recvLease(RxLease* lease);
+
+	/// Discards the message lent by recvLease(), so the next one can be received
+	virtual void releaseLease();
+
 	/// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
 	/// Then optionally waits for Channel Activity Detection (CAD)
 	/// to show the channnel is clear (if the radio supports CAD) by calling waitCAD().
@@ -680,6 +695,25 @@ public:
 	/// if CAD was requested and the CAD timeout timed out before clear channel was detected.
 	virtual bool send(const uint8_t* data, uint8_t len);
 
+	/// Like send(), but the message is made up of several separate segments. The segments are
+	/// written to the FIFO directly from where they are, without assembling them first.
+	/// \param[in] segments Array of segments to be sent, in order
+	/// \param[in] numSegments Number of segments
+	/// \return true if the total length was valid and it was correctly queued for transmit.
+	virtual bool sendv(const Segment* segments, uint8_t numSegments);
+
+	/// Fast path for sending acknowledgements, used by RHReliableDatagram::acknowledge().
+	/// Unlike send(), does not wait for CAD: the channel was just heard busy with the exchange
+	/// being acknowledged. Headers and payload are written to the FIFO in one SPI burst.
+	/// Blocks until TxDone, then puts the radio directly back into RX mode, ready for the next frame.
+	/// The synthesizer is not pre-warmed in FSTX mode: the FIFO can only be written in STDBY, and
+	/// LoRa mode has no PLL lock flag to wait for, so FSTX could not be entered any earlier than TX is.
+	/// Gives up and returns to RX if TxDone does not come within RH_SX1276_ACK_TX_TIMEOUT milliseconds.
+	/// \param[in] data Array of data to be sent
+	/// \param[in] len Number of bytes of data to send
+	/// \return true if the message length was valid and it was transmitted.
+	virtual bool sendAck(const uint8_t* data, uint8_t len);
+
 	/// Blocks until the current message (if any)
 	/// has been transmitted
 	/// \return true on success, false if the chip is not in transmit mode or other transmit failure
@@ -772,6 +806,13 @@ protected:
 	/// Clear our local receive buffer
 	void clearRxBuf();
 
+	/// Writes the 4 headers and the message segments to the FIFO in one SPI burst, without copying them,
+	/// and sets the payload length
+	/// \param[in] segments Array of segments to be sent, in order
+	/// \param[in] numSegments Number of segments
+	/// \param[in] len Total number of bytes in the segments
+	void loadFifo(const Segment* segments, uint8_t numSegments, uint8_t len);
+
 private:
 
 	/// The configured txe pin connected to this instance
@@ -789,6 +830,9 @@ private:
 
 	/// True when there is a valid message in the buffer
 	volatile bool _rxBufValid;
+
+	/// True while the message in the buffer is lent by recvLease()
+	bool _leased;
 };
 
 #endif
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -21,9 +22,22 @@
 
 RH_TCP::RH_TCP(const char* server)
     : _server(server),
+      _socket(-1),
+      _reconnectAt(0),
+      _socketBufStart(0),
+      _socketBufLen(0),
+      _rxBuf(NULL),
       _rxBufLen(0),
       _rxBufValid(false),
-      _socket(-1)
+      _leased(false),
+      _txBufLen(0),
+      _frequency(434000000),
+      _bandwidth(125000),
+      _spreadingFactor(7),
+      _codingRate(5),
+      _preambleLength(8),
+      _txPower(13),
+      _txEnd(0)
 {
 }
     
@@ -31,7 +45,7 @@ bool RH_TCP::init()
 {   
     if (!connectToServer())
 	return false;
-    return sendThisAddress(_thisAddress);
+    return sendThisAddress(_thisAddress) && sendModemConfig() && flushTxBuf();
 }
     
 bool RH_TCP::connectToServer()
@@ -82,16 +96,17 @@ bool RH_TCP::connectToServer()
 	    break;                  /* Success */
 
 	close(_socket);
+	_socket = -1;
     }
 
+    freeaddrinfo(result);           /* No longer needed */
+
     if (rp == NULL) 
     {               /* No address succeeded */
 	fprintf(stderr, "RH_TCP::connect could not connect to %s\n", _server);
 	return false;
     }
 
-    freeaddrinfo(result);           /* No longer needed */
-
     // Now make the socket non-blocking
     int on = 1;
     int rc = ioctl(_socket, FIONBIO, (char *)&on);
@@ -102,79 +117,120 @@ bool RH_TCP::connectToServer()
 	_socket = -1;
 	return false;
     }
+    // Each message is written whole, so dont wait to fill a segment with it
+    setsockopt(_socket, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
     return true;
 }
 
+bool RH_TCP::connected()
+{
+    if (_socket >= 0)
+	return true;
+    if (!_reconnectAt || (long)(millis() - _reconnectAt) < 0)
+	return false; // Never connected, or too soon to try again
+    _reconnectAt = millis() + RH_TCP_RECONNECT_INTERVAL;
+    if (!connectToServer())
+	return false;
+    fprintf(stderr, "RH_TCP reconnected to %s\n", _server);
+    if (!sendThisAddress(_thisAddress) || !sendModemConfig())
+	return false;
+    return flushTxBuf();
+}
+
+void RH_TCP::disconnect(const char* reason)
+{
+    if (_socket < 0)
+	return;
+    fprintf(stderr, "RH_TCP lost connection to %s: %s. Reconnecting\n", _server, reason);
+    close(_socket);
+    _socket = -1;
+    _reconnectAt = millis() + RH_TCP_RECONNECT_INTERVAL;
+    // Whatever was buffered is lost. A lent message stays where it is until it is released
+    _rxBufValid = false;
+    _socketBufStart = 0;
+    _socketBufLen = 0;
+    _txBufLen = 0;
+}
+
 void RH_TCP::clearRxBuf()
 {
+    if (_rxBufValid)
+    {
+	// Done with the packet message, so its space can be read into again
+	uint16_t messageLen = sizeof(uint32_t) + 5 + _rxBufLen;
+	_socketBufStart = (_socketBufStart + messageLen) & (RH_TCP_SOCKETBUF_LEN - 1);
+	_socketBufLen -= messageLen;
+    }
     _rxBufValid = false;
     _rxBufLen = 0;
 }
 
 void RH_TCP::checkForEvents()
 {
-    #define RH_TCP_SOCKETBUF_LEN 500
-    static uint8_t socketBuf[RH_TCP_SOCKETBUF_LEN]; // Room for several messages
-    static uint16_t socketBufLen = 0;
-
-    // Read at most the amount of space we have left in the buffer
-    ssize_t count = read(_socket, socketBuf + socketBufLen, sizeof(socketBuf) - socketBufLen);
-    if (count < 0)
+    // Read into the free part of the ring, which may be in two pieces
+    while (_socket >= 0 && _socketBufLen < RH_TCP_SOCKETBUF_LEN)
     {
-	if (errno != EAGAIN)
+	uint16_t end = (_socketBufStart + _socketBufLen) & (RH_TCP_SOCKETBUF_LEN - 1);
+	uint16_t space = RH_TCP_SOCKETBUF_LEN - _socketBufLen;
+	struct iovec iov[2];
+	iov[0].iov_base = _socketBuf + end;
+	iov[0].iov_len = end + space > RH_TCP_SOCKETBUF_LEN ? RH_TCP_SOCKETBUF_LEN - end : space;
+	iov[1].iov_base = _socketBuf;
+	iov[1].iov_len = space - iov[0].iov_len;
+	ssize_t count = readv(_socket, iov, iov[1].iov_len ? 2 : 1);
+	if (count < 0)
 	{
-	    fprintf(stderr,"RH_TCP::checkForEvents read error: %s\n", strerror(errno));
-	    exit(1);
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		disconnect(strerror(errno));
+	    break;
 	}
+	if (count == 0)
+	{
+	    disconnect("end of file");
+	    break;
+	}
+	_socketBufLen += count;
     }
-    else if (count == 0)
-    {
-	// End of file
-	fprintf(stderr,"RH_TCP::checkForEvents unexpected end of file on read\n");
-	exit(1);
-    }
-    else
+
+    // Handle each complete message where it is, until there is a packet for us
+    while (!_rxBufValid && _socketBufLen >= sizeof(uint32_t))
     {
-	socketBufLen += count;
-	while (socketBufLen >= 5)
+	// Continue a message that wraps past the end of the ring, so it is all in one piece
+	uint16_t held = _socketBufLen < sizeof(RHTcpMessage) ? _socketBufLen : sizeof(RHTcpMessage);
+	if (_socketBufStart + held > RH_TCP_SOCKETBUF_LEN)
+	    memcpy(_socketBuf + RH_TCP_SOCKETBUF_LEN, _socketBuf, _socketBufStart + held - RH_TCP_SOCKETBUF_LEN);
+
+	RHTcpTypeMessage* message = (RHTcpTypeMessage*)(_socketBuf + _socketBufStart);
+	uint32_t len = ntohl(message->length);
+	uint32_t messageLen = len + sizeof(message->length);
+	if (len > RH_TCP_MAX_PAYLOAD_LEN + 1)
 	{
-	    RHTcpTypeMessage* message = ((RHTcpTypeMessage*)socketBuf);
-	    uint32_t len = ntohl(message->length);
-	    uint32_t messageLen = len + sizeof(message->length);
-	    if (len > sizeof(socketBuf) - sizeof(message->length))
-	    {
-		// Bogus length
-		fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream? Aborting\n", len);
-		exit(1);
-	    }
-	    if (socketBufLen >= len + sizeof(message->length))
-	    {
-		// Got at least all of this message
-		if (message->type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
-		{
-		    // REVISIT: need to check if we are actually receiving?
-		    // Its a new packet, extract the headers and payload
-		    RHTcpPacket* packet = ((RHTcpPacket*)socketBuf);
-		    _rxHeaderTo    = packet->to;
-		    _rxHeaderFrom  = packet->from;
-		    _rxHeaderId    = packet->id;
-		    _rxHeaderFlags = packet->flags;
-		    uint32_t payloadLen = len - 5;
-		    if (payloadLen <= sizeof(_rxBuf))
-		    {
-			// Enough room in our receiver buffer
-			memcpy(_rxBuf, packet->payload, payloadLen);
-			_rxBufLen = payloadLen;
-			_rxBufFull = true;
-		    }
-		}
-		// check for other message types here
-		// Now remove the used message by copying the trailing bytes (maybe start of a new message?)
-		// to the top of the buffer
-		memcpy(socketBuf, socketBuf + messageLen, sizeof(socketBuf) - messageLen);
-		socketBufLen -= messageLen;
-	    }
+	    // Bogus length
+	    fprintf(stderr, "RH_TCP::checkForEvents read ridiculous length: %d. Corrupt message stream?\n", len);
+	    disconnect("corrupt message stream");
+	    return;
+	}
+	if (_socketBufLen < messageLen)
+	    break; // The rest of it is still to come
+	if (message->type == RH_TCP_MESSAGE_TYPE_PACKET && len >= 5)
+	{
+	    // Its a new packet, extract the headers, and leave the payload where it is
+	    RHTcpPacket* packet = (RHTcpPacket*)message;
+	    _rxHeaderTo    = packet->to;
+	    _rxHeaderFrom  = packet->from;
+	    _rxHeaderId    = packet->id;
+	    _rxHeaderFlags = packet->flags;
+	    _rxBuf = packet->payload;
+	    _rxBufLen = len - 5;
+	    validateRxBuf();
+	    if (_rxBufValid)
+		break; // Keep it until it has been received
 	}
+	// check for other message types here
+	_socketBufStart = (_socketBufStart + messageLen) & (RH_TCP_SOCKETBUF_LEN - 1);
+	_socketBufLen -= messageLen;
     }
 }
 
@@ -192,14 +248,17 @@ void RH_TCP::validateRxBuf()
 
 bool RH_TCP::available()
 {
-    if (_socket < 0)
+    if (_leased)
 	return false;
-    checkForEvents();
-    if (_rxBufFull)
+    if (_mode == RHModeTx)
     {
-	validateRxBuf();
-	_rxBufFull= false;
+	// Half duplex: nothing can be received until the transmission is over
+	if ((long)(millis() - _txEnd) < 0)
+	    return false;
+	_mode = RHModeIdle;
     }
+    if (!_rxBufValid && connected() && flushTxBuf())
+	checkForEvents();
     return _rxBufValid;
 }
 
@@ -212,29 +271,43 @@ void RH_TCP::waitAvailable()
 // Block until something is available or timeout expires
 bool RH_TCP::waitAvailableTimeout(uint16_t timeout)
 {
-    int            max_fd;
-    fd_set         input;
-    int            result;
-
-    FD_ZERO(&input);
-    FD_SET(_socket, &input);
-    max_fd = _socket + 1;
-
-    if (timeout)
+    unsigned long starttime = millis();
+    while (!available())
     {
+	// Wait for more from the server, the end of our transmission, or the next attempt to reconnect
+	long wait = -1; // Forever
+	if (_mode == RHModeTx)
+	    wait = (long)(_txEnd - millis());
+	else if (_socket < 0)
+	    wait = RH_TCP_RECONNECT_INTERVAL;
+	if (timeout)
+	{
+	    long left = timeout - (long)(millis() - starttime);
+	    if (left <= 0)
+		return false;
+	    if (wait < 0 || left < wait)
+		wait = left;
+	}
+	if (_socket < 0 || _mode == RHModeTx)
+	{
+	    if (wait > 0)
+		delay(wait);
+	    continue;
+	}
+
+	fd_set input;
+	FD_ZERO(&input);
+	FD_SET(_socket, &input);
 	struct timeval timer;
-	// Timeout is in milliseconds
-	timer.tv_sec  = timeout / 1000;
-	timer.tv_usec = (timeout % 1000) * 1000;
-	result = select(max_fd, &input, NULL, NULL, &timer);
-    }
-    else
-    {
-	result = select(max_fd, &input, NULL, NULL, NULL);
+	timer.tv_sec  = wait / 1000;
+	timer.tv_usec = (wait % 1000) * 1000;
+	if (select(_socket + 1, &input, NULL, NULL, wait < 0 ? NULL : &timer) < 0 && errno != EINTR)
+	{
+	    fprintf(stderr, "RH_TCP::waitAvailableTimeout: select failed %s\n", strerror(errno));
+	    return false;
+	}
     }
-    if (result < 0)
-	fprintf(stderr, "RH_TCP::waitAvailableTimeout: select failed %s\n", strerror(errno));
-    return result > 0;
+    return true;
 }
 
 bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
@@ -252,14 +325,76 @@ bool RH_TCP::recv(uint8_t* buf, uint8_t* len)
     return true;
 }
 
+bool RH_TCP::recvLease(RxLease* lease)
+{
+    if (!available())
+	return false;
+    lease->data = _rxBuf;
+    lease->len = _rxBufLen;
+    lease->headerTo = _rxHeaderTo;
+    lease->headerFrom = _rxHeaderFrom;
+    lease->headerId = _rxHeaderId;
+    lease->headerFlags = _rxHeaderFlags;
+    lease->rssi = _lastRssi;
+    _leased = true;
+    return true;
+}
+
+void RH_TCP::releaseLease()
+{
+    if (!_leased)
+	return;
+    _leased = false;
+    clearRxBuf();
+}
+
 bool RH_TCP::send(const uint8_t* data, uint8_t len)
 {
+    Segment segment = { data, len };
+    return sendv(&segment, 1);
+}
+
+bool RH_TCP::sendv(const Segment* segments, uint8_t numSegments)
+{
+    uint16_t len = 0;
+    uint8_t i;
+    for (i = 0; i < numSegments; i++)
+	len += segments[i].len;
+    if (len > RH_TCP_MAX_MESSAGE_LEN)
+	return false;
+
     if (!waitCAD()) 
 	return false;  // Check channel activity (prob not possible for this driver?)
 
-    bool ret = sendPacket(data, len);
-    delay(10); // Wait for transmit to succeed. REVISIT: depends on length and speed
-    return ret;
+    waitPacketSent(); // Make sure we dont interrupt an outgoing message
+    if (!sendPacket(segments, numSegments, len))
+	return false;
+    // The packet is on the air for as long as it would be on the radio
+    _mode = RHModeTx;
+    _txEnd = millis() + (timeOnAir(len) + 999) / 1000;
+    return true;
+}
+
+bool RH_TCP::waitPacketSent()
+{
+    if (_mode == RHModeTx)
+    {
+	long left = (long)(_txEnd - millis());
+	if (left > 0)
+	    delay(left);
+	_mode = RHModeIdle;
+    }
+    return true;
+}
+
+bool RH_TCP::waitPacketSent(uint16_t timeout)
+{
+    if (_mode == RHModeTx && (long)(_txEnd - millis()) > (long)timeout)
+    {
+	delay(timeout);
+	return false;
+    }
+    return waitPacketSent();
 }
 
 uint8_t RH_TCP::maxMessageLength()
@@ -273,6 +408,41 @@ void RH_TCP::setThisAddress(uint8_t address)
     sendThisAddress(_thisAddress);
 }
 
+bool RH_TCP::setFrequency(float centre)
+{
+    _frequency = (uint32_t)(centre * 1000000.0 + 0.5);
+    sendModemConfig();
+    return true;
+}
+
+bool RH_TCP::setModemParameters(uint32_t bandwidth, uint8_t spreadingFactor, uint8_t codingRate)
+{
+    if (!bandwidth || spreadingFactor < 6 || spreadingFactor > 12 || codingRate < 5 || codingRate > 8)
+	return false;
+    _bandwidth = bandwidth;
+    _spreadingFactor = spreadingFactor;
+    _codingRate = codingRate;
+    sendModemConfig();
+    return true;
+}
+
+void RH_TCP::setPreambleLength(uint16_t symbols)
+{
+    _preambleLength = symbols;
+    sendModemConfig();
+}
+
+void RH_TCP::setTxPower(int8_t power)
+{
+    _txPower = power;
+    sendModemConfig();
+}
+
+uint32_t RH_TCP::timeOnAir(uint8_t len)
+{
+    return RHTcpTimeOnAir(len + RH_TCP_HEADER_LEN, _spreadingFactor, _bandwidth, _codingRate, _preambleLength);
+}
+
 bool RH_TCP::sendThisAddress(uint8_t thisAddress)
 {
     if (_socket < 0)
@@ -281,24 +451,126 @@ bool RH_TCP::sendThisAddress(uint8_t thisAddress)
     m.length = htonl(2);
     m.type = RH_TCP_MESSAGE_TYPE_THISADDRESS;
     m.thisAddress = thisAddress;
-    ssize_t sent = write(_socket, &m, sizeof(m));
-    return sent > 0;
+    struct iovec iov = { &m, sizeof(m) };
+    return writeMessage(&iov, 1, false); // Goes with the next message
 }
 
-bool RH_TCP::sendPacket(const uint8_t* data, uint8_t len)
+bool RH_TCP::sendPacket(const Segment* segments, uint8_t numSegments, uint8_t len)
 {
-    if (_socket < 0)
+    if (!connected())
 	return false;
     RHTcpPacket m;
-    m.length = htonl(len + 4);
+    m.length = htonl(len + 5); // type, to, from, id, flags and the data
     m.type  = RH_TCP_MESSAGE_TYPE_PACKET;
     m.to    = _txHeaderTo;
     m.from  = _txHeaderFrom;
     m.id    = _txHeaderId;
     m.flags = _txHeaderFlags;
-    memcpy(m.payload, data, len);
-    ssize_t sent = write(_socket, &m, len + 8);
-    return sent > 0;
+    // The headers, then the data straight from the segments
+    struct iovec iov[256];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = &m;
+    iov[iovcnt++].iov_len = sizeof(m) - sizeof(m.payload);
+    uint8_t i;
+    for (i = 0; i < numSegments; i++)
+    {
+	if (!segments[i].len)
+	    continue;
+	iov[iovcnt].iov_base = (void*)segments[i].data;
+	iov[iovcnt++].iov_len = segments[i].len;
+    }
+    return writeMessage(iov, iovcnt, true);
+}
+
+bool RH_TCP::sendModemConfig()
+{
+    if (_socket < 0)
+	return false;
+    RHTcpModemConfig m;
+    m.length = htonl(sizeof(m) - sizeof(m.length));
+    m.type = RH_TCP_MESSAGE_TYPE_MODEMCONFIG;
+    m.frequency = htonl(_frequency);
+    m.bandwidth = htonl(_bandwidth);
+    m.spreadingFactor = _spreadingFactor;
+    m.codingRate = _codingRate;
+    m.preambleLength = htons(_preambleLength);
+    m.txPower = _txPower;
+    struct iovec iov = { &m, sizeof(m) };
+    return writeMessage(&iov, 1, false); // Goes with the next message
+}
+
+bool RH_TCP::writeMessage(const struct iovec* iov, int iovcnt, bool flush)
+{
+    size_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    if (_txBufLen + len > sizeof(_txBuf))
+	return false; // Server is not keeping up, so this one is lost, as it might be on the air
+
+    size_t written = 0;
+    if (flush)
+    {
+	// Whatever is waiting, then this message, in one go
+	struct iovec all[257];
+	int n = 0;
+	if (_txBufLen)
+	{
+	    all[n].iov_base = _txBuf;
+	    all[n++].iov_len = _txBufLen;
+	}
+	for (i = 0; i < iovcnt; i++)
+	    all[n++] = iov[i];
+	ssize_t count;
+	do
+	    count = writev(_socket, all, n);
+	while (count < 0 && errno == EINTR);
+	if (count < 0)
+	{
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+		disconnect(strerror(errno));
+		return false;
+	    }
+	    count = 0;
+	}
+	// Retire what was written of the waiting messages
+	written = count;
+	size_t fromTxBuf = written < _txBufLen ? written : _txBufLen;
+	memmove(_txBuf, _txBuf + fromTxBuf, _txBufLen - fromTxBuf);
+	_txBufLen -= fromTxBuf;
+	written -= fromTxBuf;
+    }
+
+    // Keep whatever of this message was not written, to go next time
+    for (i = 0; i < iovcnt; i++)
+    {
+	size_t skip = written < iov[i].iov_len ? written : iov[i].iov_len;
+	written -= skip;
+	memcpy(_txBuf + _txBufLen, (uint8_t*)iov[i].iov_base + skip, iov[i].iov_len - skip);
+	_txBufLen += iov[i].iov_len - skip;
+    }
+    return true;
+}
+
+bool RH_TCP::flushTxBuf()
+{
+    while (_socket >= 0 && _txBufLen)
+    {
+	ssize_t written = write(_socket, _txBuf, _txBufLen);
+	if (written < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return true;
+	    disconnect(strerror(errno));
+	    return false;
+	}
+	memmove(_txBuf, _txBuf + written, _txBufLen - written);
+	_txBufLen -= written;
+    }
+    return _socket >= 0;
 }
 
 #endif
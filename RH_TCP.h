@@ -7,6 +7,25 @@
 
 #include <RHGenericDriver.h>
 #include <RHTcpProtocol.h>
+#include <sys/uio.h>
+
+// Octets of RHTcpProtocol messages from the server that can be buffered. Must be a power of 2
+#ifndef RH_TCP_SOCKETBUF_LEN
+ #define RH_TCP_SOCKETBUF_LEN 1024
+#endif
+#if (RH_TCP_SOCKETBUF_LEN & (RH_TCP_SOCKETBUF_LEN - 1)) != 0
+ #error RH_TCP_SOCKETBUF_LEN must be a power of 2
+#endif
+
+// Octets of RHTcpProtocol messages to the server that can wait for the socket to have room
+#ifndef RH_TCP_TXBUF_LEN
+ #define RH_TCP_TXBUF_LEN 1024
+#endif
+
+// Milliseconds between attempts to reconnect to the server after losing it
+#ifndef RH_TCP_RECONNECT_INTERVAL
+ #define RH_TCP_RECONNECT_INTERVAL 1000
+#endif
 
 /////////////////////////////////////////////////////////////////////
 /// \class RH_TCP RH_TCP.h <RH_TCP.h>
@@ -50,6 +69,39 @@
 /// You can change the listen port and the simulated baud rate with 
 /// command line arguments passed to etherSimulator.pl
 ///
+/// tools/etherSimulator.cpp is the same server in C++, taking the same arguments and config file.
+/// It needs no Perl modules, and serves thousands of simulated sketches on one host:
+/// \code
+/// g++ -O2 -I . tools/etherSimulator.cpp -o etherSimulator
+/// ./etherSimulator
+/// \endcode
+///
+/// Each RH_TCP instance has its own connection and buffers, so one process can run many simulated nodes,
+/// each with its own RH_TCP, as well as many processes with one each.
+/// Messages from the server are parsed where they land in the receive buffer, and received packets are
+/// copied only into the caller's buffer by recv(), or not at all with recvLease().
+/// Each packet goes to the server in a single writev(), with any other messages waiting to go, straight from
+/// the caller's buffers. If the server goes away, RH_TCP keeps trying to connect to it again every
+/// RH_TCP_RECONNECT_INTERVAL milliseconds, instead of exiting: packets sent meanwhile are lost, as they
+/// would be on the air.
+///
+/// \par Simulated LoRa medium
+///
+/// RH_TCP tells the server the LoRa modem parameters it is using: by default those of an RH_RF95
+/// after init() (434.0MHz, 125kHz bandwidth, spreading factor 7, coding rate 4/5, 8 symbol preamble, 13dBm).
+/// Change them with setFrequency(), setModemParameters(), setPreambleLength() and setTxPower().
+/// send() starts a transmission that lasts for the packet's time on air with those parameters,
+/// as it would on the radio: waitPacketSent() waits for it to finish, and nothing is received meanwhile.
+///
+/// etherSimulator.cpp uses the same parameters to work out when each packet reaches the other clients
+/// and whether they receive it. Given the node positions in its config file, it works out the path loss
+/// between each pair of nodes and drops packets that arrive below the receiver's sensitivity.
+/// Packets that overlap at a receiver collide, unless one is enough stronger than the other to be captured,
+/// and a node that is transmitting hears nothing, so MAC, retry and routing
+/// changes can be tried under realistic contention before trying them on radios.
+/// Clients on different frequencies, bandwidths or spreading factors do not hear each other at all.
+/// etherSimulator.pl ignores the modem parameters, and passes packets on as it always has.
+///
 /// \par Implementation
 ///
 /// etherServer.pl is a conventional server written in Perl.
@@ -109,6 +161,15 @@ public:
     /// \return true if a valid message was copied to buf
     virtual bool recv(uint8_t* buf, uint8_t* len);
 
+    /// Lends the next received message, still in the receive buffer, instead of copying it
+    /// as recv() does. No more messages are received until releaseLease() is called.
+    /// \param[out] lease Set to describe the lent message
+    /// \return true if a message was lent, and must be released
+    virtual bool recvLease(RxLease* lease);
+
+    /// Ends the loan of a message by recvLease(), and discards the message
+    virtual void releaseLease();
+
     /// Waits until any previous transmit packet is finished being transmitted with waitPacketSent().
     /// Then loads a message into the transmitter and starts the transmitter. Note that a message length
     /// of 0 is NOT permitted. If the message is too long for the underlying radio technology, send() will
@@ -118,6 +179,13 @@ public:
     /// \return true if the message length was valid and it was correctly queued for transmit
     virtual bool send(const uint8_t* data, uint8_t len);
 
+    /// Sends a message made of several segments, written to the server straight from the segments
+    /// with a single writev()
+    /// \param[in] segments Array of segments to be sent, in order
+    /// \param[in] numSegments Number of segments
+    /// \return true if the total length was valid and the message was sent to the server
+    virtual bool sendv(const Segment* segments, uint8_t numSegments);
+
     /// Returns the maximum message length 
     /// available in this Driver.
     /// \return The maximum legal message length
@@ -134,6 +202,44 @@ public:
     /// \param[in] address The address of this node.
     void setThisAddress(uint8_t address);
 
+    /// Waits until any previous transmit packet has been on the air for its whole time on air
+    /// \return true
+    virtual bool waitPacketSent();
+
+    /// Waits until any previous transmit packet has been on the air for its whole time on air,
+    /// or the timeout expires
+    /// \param[in] timeout The maximum time to wait in milliseconds
+    /// \return true if the packet was sent before the timeout
+    virtual bool waitPacketSent(uint16_t timeout);
+
+    /// Sets the simulated transmitter and receiver frequency.
+    /// Only clients on the same frequency hear each other.
+    /// \param[in] centre Frequency in MHz. Defaults to 434.0
+    /// \return true
+    bool setFrequency(float centre);
+
+    /// Sets the simulated LoRa modem parameters, which set the time on air of each packet, and the receiver
+    /// sensitivity. Only clients with the same bandwidth and spreading factor hear each other.
+    /// \param[in] bandwidth Signal bandwidth in Hz. Defaults to 125000
+    /// \param[in] spreadingFactor 6 to 12. Defaults to 7
+    /// \param[in] codingRate Denominator of the coding rate, 5 to 8 for 4/5 to 4/8. Defaults to 5
+    /// \return true if the parameters are valid
+    bool setModemParameters(uint32_t bandwidth, uint8_t spreadingFactor, uint8_t codingRate);
+
+    /// Sets the length of the simulated preamble
+    /// \param[in] symbols Preamble length in symbols. Defaults to 8
+    void setPreambleLength(uint16_t symbols);
+
+    /// Sets the simulated transmitter power, which sets how far packets carry
+    /// given the node positions in the ether simulator config file.
+    /// \param[in] power Transmitter power in dBm. Defaults to 13
+    void setTxPower(int8_t power);
+
+    /// Returns the time on air of a packet with the current modem parameters
+    /// \param[in] len Number of octets of data in the packet, not including the headers
+    /// \return The time on air in microseconds
+    uint32_t timeOnAir(uint8_t len);
+
 protected:
 
 private:
@@ -141,6 +247,15 @@ private:
     /// Prepares the socket for use.
     bool connectToServer();
 
+    /// Makes sure there is a connection to the server, connecting again if it was lost
+    /// and it is time to try again, and telling the server our address and modem parameters
+    /// \return true if connected
+    bool connected();
+
+    /// Closes the connection to the server after an error, and discards what was buffered
+    /// \param[in] reason Why, for the message printed
+    void disconnect(const char* reason);
+
     /// Check for new messages from the ether simulator server
     void checkForEvents();
 
@@ -155,10 +270,28 @@ private:
 
     /// Sends a message to the ether simulator server for delivery to
     /// other nodes
-    /// \param[in] data Array of data to be sent
-    /// \param[in] len Number of bytes of data to send (> 0)
+    /// \param[in] segments Array of segments making up the data to be sent
+    /// \param[in] numSegments Number of segments
+    /// \param[in] len Total number of bytes of data to send (> 0)
     /// \return true if successful
-    bool sendPacket(const uint8_t* data, uint8_t len);
+    bool sendPacket(const Segment* segments, uint8_t numSegments, uint8_t len);
+
+    /// Sends the modem parameters to the ether simulator server
+    /// in a RHTcpModemConfig message.
+    /// \return true if successful
+    bool sendModemConfig();
+
+    /// Writes a message to the server, after any others still waiting to go.
+    /// Whatever the socket will not take yet waits in _txBuf.
+    /// \param[in] iov The parts of the message
+    /// \param[in] iovcnt Number of parts
+    /// \param[in] flush false to leave the message in _txBuf to go with the next one
+    /// \return true if the message was written or is waiting to be written
+    bool writeMessage(const struct iovec* iov, int iovcnt, bool flush);
+
+    /// Writes as much of _txBuf as the socket will take
+    /// \return false if the connection failed
+    bool flushTxBuf();
 
     /// Address and port of the server to which messages are sent
     /// and received using the protocol RHTcpPRotocol
@@ -167,17 +300,38 @@ private:
     /// The TCP socket used to communicate with the message server
     int         _socket;
 
-    /// Buffer to receive RHTcpProtocol messages
-    uint8_t     _rxBuf[RH_TCP_MAX_PAYLOAD_LEN + 5];
+    /// millis() when to next try to connect to the server
+    unsigned long _reconnectAt;
+
+    /// Ring buffer of RHTcpProtocol messages from the server. A message that wraps around the end
+    /// is continued past the end, so it can always be parsed where it is
+    uint8_t     _socketBuf[RH_TCP_SOCKETBUF_LEN + sizeof(RHTcpMessage)];
+    uint16_t    _socketBufStart; ///< Index of the first message not yet handled
+    uint16_t    _socketBufLen;   ///< Octets from _socketBufStart
+
+    /// The payload of the received packet, in _socketBuf
+    uint8_t*    _rxBuf;
     uint16_t    _rxBufLen;
     bool        _rxBufValid;
+    bool        _leased;
 
-    /// Check whether the latest received message is complete and uncorrupted
-    void            validateRxBuf();
+    /// RHTcpProtocol messages waiting for room in the socket
+    uint8_t     _txBuf[RH_TCP_TXBUF_LEN];
+    uint16_t    _txBufLen;
+
+    /// Simulated modem parameters
+    uint32_t    _frequency;
+    uint32_t    _bandwidth;
+    uint8_t     _spreadingFactor;
+    uint8_t     _codingRate;
+    uint16_t    _preambleLength;
+    int8_t      _txPower;
 
-    // Used in the interrupt handlers
-    /// Buf is filled but not validated
-    volatile bool   _rxBufFull;
+    /// millis() when the packet being transmitted is all on the air
+    unsigned long _txEnd;
+
+    /// Check whether the latest received message is addressed to us
+    void            validateRxBuf();
 
 };
 
@@ -120,6 +120,10 @@
 /// Works with tools/etherSimulator.pl to pass messages between simulated sketches, allowing
 /// testing of Manager classes on Linux and without need for real radios or other transport hardware.
 ///
+/// - RHMultiDriver
+/// Combines several other drivers, such as radios on different bands, into a single driver with 
+/// one interface for each. RHRouter and RHMesh route across all the interfaces.
+///
 /// Drivers can be used on their own to provide unaddressed, unreliable datagrams. 
 /// All drivers have the same identical API.
 /// Or you can use any Driver with any of the Managers described below.
@@ -1006,4 +1010,35 @@
 // This is the address that indicates a broadcast
 #define RH_BROADCAST_ADDRESS 0xff
 
+// Node addresses used by the manager classes. Normally 8 bits, the same as the TO and FROM headers.
+// Define RH_EXTENDED_ADDRESSING (on every node in the network) for 16 bit addresses. The radio 
+// headers still carry the low 8 bits, and RHDatagram sends the high 8 bits at the start of the message.
+// Addresses in manager class headers and ACKs are then sent low octet first, whatever the byte order 
+// of the host. RH_BROADCAST_ADDRESS is still the broadcast address.
+#ifdef RH_EXTENDED_ADDRESSING
+typedef uint16_t RHAddress;
+#define RH_PACKED __attribute__((packed))
+// Read and write an address in a message, low octet first
+#define RH_ADDRESS_GET(p) ((RHAddress)((p)[0] | ((p)[1] << 8)))
+#define RH_ADDRESS_PUT(p, a) do { (p)[0] = (uint8_t)(a); (p)[1] = (uint8_t)((a) >> 8); } while (0)
+
+// An address in a message header, such as RHRouter::RoutedMessageHeader. It is stored low octet first, 
+// and converts to and from RHAddress, so it can be used like one
+struct RHWireAddress
+{
+    uint8_t octets[2];
+    operator RHAddress() const { return RH_ADDRESS_GET(octets); }
+    RHWireAddress& operator=(RHAddress address) { RH_ADDRESS_PUT(octets, address); return *this; }
+};
+#else
+typedef uint8_t RHAddress;
+typedef uint8_t RHWireAddress;
+#define RH_PACKED
+#define RH_ADDRESS_GET(p) ((RHAddress)(p)[0])
+#define RH_ADDRESS_PUT(p, a) ((p)[0] = (a))
+#endif
+
+// Index into tables of 256 entries looked up by node address. The identity for 8 bit addresses
+#define RH_ADDRESS_HASH(a) ((uint8_t)((a) ^ ((a) >> 8)))
+
 #endif
@@ -0,0 +1,69 @@
+// simulator_fragmented_client.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to send messages larger than the driver's maximum message length
+// with the RHFragmentedDatagram class, using the RH_SIMULATOR driver to control a SIMULATOR radio.
+// It is designed to work with the other example simulator_fragmented_server
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_fragmented_client/simulator_fragmented_client.pde
+// Run with ./simulator_fragmented_client
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running
+
+#include <RHFragmentedDatagram.h>
+#include <RH_TCP.h>
+
+#define CLIENT_ADDRESS 1
+#define SERVER_ADDRESS 2
+
+// Singleton instance of the radio driver
+RH_TCP driver;
+
+// Class to manage message fragmentation, delivery and receipt, using the driver declared above
+RHFragmentedDatagram manager(driver, CLIENT_ADDRESS);
+
+// Dont put these on the stack:
+// A message several times larger than the driver can send in one go
+uint8_t data[1000];
+uint8_t buf[RH_FRAGMENT_MAX_MESSAGE_LEN];
+
+void setup() 
+{
+  Serial.begin(9600);
+  if (!manager.init())
+    Serial.println("init failed");
+
+  // Maybe set this address from the command line
+  if (_simulator_argc >= 2)
+     manager.setThisAddress(atoi(_simulator_argv[1]));
+
+  for (uint16_t i = 0; i < sizeof(data); i++)
+    data[i] = i & 0xff;
+}
+
+void loop()
+{
+  Serial.println("Sending to simulator_fragmented_server");
+    
+  // Send the whole message. It is split into fragments and reassembled by the server
+  if (manager.sendtoWaitFragmented(data, sizeof(data), SERVER_ADDRESS))
+  {
+    // Now wait for a reply from the server
+    uint16_t len = sizeof(buf);
+    RHAddress from;   
+    if (manager.recvfromAckFragmentedTimeout(buf, &len, 2000, &from))
+    {
+      Serial.print("got reply from : 0x");
+      Serial.print(from, HEX);
+      Serial.print(": ");
+      Serial.println((char*)buf);
+    }
+    else
+    {
+      Serial.println("No reply, is simulator_fragmented_server running?");
+    }
+  }
+  else
+    Serial.println("sendtoWaitFragmented failed");
+  delay(500);
+}
@@ -0,0 +1,66 @@
+// simulator_ip_tunnel.pde
+// -*- mode: C++ -*-
+// Example sketch showing how to carry IPv6 traffic across an RHMesh network
+// with the RHIPTunnel class, using the RH_TCP driver to control a SIMULATOR radio.
+// Each process is one mesh node, with a TUN network interface for its share of the mesh.
+// Ordinary programs such as ping6, ssh and nc can then talk to the other nodes.
+// Tested on Linux
+// Build with
+// cd whatever/RadioHead 
+// tools/simBuild examples/simulator/simulator_ip_tunnel/simulator_ip_tunnel.pde
+// Run as root (or with CAP_NET_ADMIN) with the node address, and optionally the etherSimulator
+// server address, as the arguments:
+// ./simulator_ip_tunnel 1 localhost:4000
+// Make sure you also have the 'Luminiferous Ether' simulator tools/etherSimulator.pl running
+//
+// To try it on one machine, run each node in its own network namespace, so the
+// kernel sends the traffic through the mesh instead of delivering it locally:
+// ip netns add node1
+// ip netns add node2
+// ip netns exec node1 ./simulator_ip_tunnel 1 10.0.0.254:4000 &
+// ip netns exec node2 ./simulator_ip_tunnel 2 10.0.0.254:4000 &
+// ip netns exec node1 ping6 fd00::ff:fe00:2
+// Each namespace has its own loopback interface, so it needs a route to the etherSimulator,
+// such as a veth pair to 10.0.0.254 in the main namespace.
+
+#include <RHIPTunnel.h>
+#include <RH_TCP.h>
+
+// Singleton instance of the radio driver
+RH_TCP* driver;
+
+// Class to manage message delivery and receipt, using the driver declared above
+RHMesh* manager;
+
+// Carries the IPv6 packets
+RHIPTunnel* tunnel;
+
+void setup() 
+{
+  Serial.begin(9600);
+  RHAddress address = _simulator_argc > 1 ? atoi(_simulator_argv[1]) : 1;
+  driver = _simulator_argc > 2 ? new RH_TCP(_simulator_argv[2]) : new RH_TCP();
+  manager = new RHMesh(*driver, address);
+  tunnel = new RHIPTunnel(*manager);
+  if (!manager->init())
+    Serial.println("init failed");
+  if (!tunnel->open())
+    Serial.println("could not open the TUN interface");
+
+  uint8_t ip[16];
+  tunnel->addressOf(address, ip);
+  Serial.print(tunnel->interfaceName());
+  Serial.print(" has address ");
+  for (uint8_t i = 0; i < 16; i += 2)
+  {
+    if (i)
+      Serial.print(":");
+    Serial.print((unsigned int)((ip[i] << 8) | ip[i + 1]), HEX);
+  }
+  Serial.println("/64");
+}
+
+void loop()
+{
+  tunnel->poll(10);
+}
@@ -0,0 +1,820 @@
+// etherSimulator.cpp
+//
+// Simulates the luminiferous ether for RH_TCP, like tools/etherSimulator.pl, but in C++ with epoll,
+// so it can serve thousands of simulated sketches on one Linux host and needs no Perl modules.
+//
+// Each RH_TCP client connects, says which node address it has (RH_TCP_MESSAGE_TYPE_THISADDRESS) and
+// which LoRa modem parameters it uses (RH_TCP_MESSAGE_TYPE_MODEMCONFIG), then sends the packets it
+// transmits (RH_TCP_MESSAGE_TYPE_PACKET). Each packet is passed on to every other client on the same
+// frequency, bandwidth and spreading factor, as a radio transmission would be, at the end of its time on air.
+// See RHTcpProtocol.h for the messages.
+//
+// Whether a client receives a packet is modelled on the SX127x:
+//  - The received power is the transmitter power less the path loss between the two nodes' positions, using
+//    the log-distance model. Packets below the receiver's sensitivity for its bandwidth and spreading factor
+//    are not received, though they still interfere with others.
+//  - The receiver locks on to the first packet it can receive. A packet that overlaps it at the receiver
+//    destroys it, unless the locked packet is at least the capture threshold stronger.
+//    A later packet is never received while the receiver is locked, except that one arriving during the
+//    locked packet's preamble that is the capture threshold stronger takes the receiver over.
+//  - A node cannot receive while it is transmitting, and starting to transmit loses anything it was receiving.
+// Packets are also lost at random, with the probabilities given in the config file.
+// Clients that have not sent their modem parameters (including those written for etherSimulator.pl)
+// have a packet time of the packet octets at the -b bit rate, and hear and are heard by every client at
+// the same strength, so that any packets that overlap collide and both are lost, as in etherSimulator.pl.
+//
+// Every packet is kept in one buffer, exactly as it will be sent, and shared by all the clients it is
+// passed to, so passing on a broadcast to many clients copies nothing. Each client has its own queue of
+// packets waiting to be written. The queue is written with one writev() once all the packets due have
+// been queued, and otherwise when the client's socket has room, so a slow client does not hold up
+// the rest. If a client stops reading altogether, packets for it are dropped once its queue is full.
+//
+// Build with
+// cd whatever/RadioHead
+// g++ -O2 -I . tools/etherSimulator.cpp -o etherSimulator
+//
+// Usage:
+// ./etherSimulator [-h] [-c configfile] [-b bitspersec] [-p portnumber] [-s statsinterval]
+//  -c  Config file giving the probability of successful delivery between nodes, the same as for
+//      etherSimulator.pl, and the node positions and propagation model. See tools/chain.conf and tools/lora.conf
+//  -b  Simulated bits per second, which sets the transmission time of each packet from clients that
+//      have not sent their modem parameters. Default 10000.
+//      0 passes all packets on at once, with no collisions, for load testing
+//  -p  TCP port to listen on. Default 4000
+//  -s  Seconds between printing throughput and latency counters. Default 10. 0 for never
+//
+// The counters printed are, for the interval since the last ones:
+//  - clients connected
+//  - packets and octets received from clients, and passed on to them, per second
+//  - the percentage of the time the medium was in use, summing the time on air of every packet
+//  - packets lost to collisions, packets received despite overlapping weaker ones (captured),
+//    packets that arrived while the receiver was transmitting (deaf), packets too weak to receive,
+//    and packets lost to the config file's delivery probabilities and to full client queues
+//  - the mean and maximum time from when a packet is due to be received to when it is written to
+//    the client's socket, which is the delay added by the simulator itself
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <RHTcpProtocol.h>
+
+// Packets waiting to be written to one client before more are dropped
+#define ETHER_MAX_QUEUED_PACKETS 1024
+
+// Packets written to a client in one writev()
+#define ETHER_MAX_IOV 64
+
+// Socket events handled for each epoll_wait()
+#define ETHER_MAX_EVENTS 256
+
+// Default dB by which a packet must be stronger than one it overlaps to survive
+#define ETHER_CAPTURE_THRESHOLD 6.0
+
+// Default path loss exponent
+#define ETHER_PATH_LOSS_EXPONENT 2.7
+
+// Noise figure of the receivers, dB
+#define ETHER_NOISE_FIGURE 6.0
+
+// A message from a client, kept as it will be written to the other clients
+typedef struct
+{
+    int       refs;
+    uint16_t  len; // Including the length field
+    uint8_t   data[sizeof(RHTcpMessage)];
+} SharedMessage;
+
+// A packet queued for writing to a client
+typedef struct
+{
+    SharedMessage* message;
+    uint64_t       due; // When it should have been received, microseconds
+} Queued;
+
+// A transmission reaching a client
+typedef struct
+{
+    uint64_t  end;
+    double    power; // dBm
+} Signal;
+
+// A connected RH_TCP client
+typedef struct
+{
+    int                 fd;
+    uint64_t            id;         // Unique, unlike the fd
+    size_t              index;      // In clients
+    int                 address;    // Node address, or -1 if not yet known
+    uint8_t             rxBuf[sizeof(RHTcpMessage)];
+    uint16_t            rxLen;
+    std::deque<Queued>  txQueue;
+    uint16_t            txOffset;   // Octets of the first queued message already written
+    bool                txBlocked;  // Waiting for EPOLLOUT
+    bool                txDirty;    // In dirty, to be written this time round
+    bool                lora;       // Has sent its modem parameters
+    RHTcpModemConfig    modem;      // In host byte order
+    double              sensitivity; // dBm
+    uint64_t            txUntil;    // Cannot receive until this time
+    SharedMessage*      incoming;   // Packet this client's receiver is locked on, if any
+    uint64_t            incomingDue;
+    uint64_t            incomingPreambleEnd;
+    double              incomingPower;
+    bool                incomingOverlapped;
+    bool                incomingCorrupt;
+    std::vector<Signal> signals;    // Transmissions reaching this client, some of which may have ended
+} Client;
+
+// A packet that finishes its transmission to a client at a given time
+typedef struct
+{
+    uint64_t  due;
+    uint64_t  clientId;
+    int       fd;
+} Delivery;
+
+// A client that may be gone by the time it is looked at
+typedef struct
+{
+    uint64_t  clientId;
+    int       fd;
+} ClientRef;
+
+struct DeliveryLater
+{
+    bool operator()(const Delivery& a, const Delivery& b) const
+    {
+	return a.due > b.due;
+    }
+};
+
+// Counters, reset each time they are printed
+typedef struct
+{
+    uint64_t  packetsIn;
+    uint64_t  octetsIn;
+    uint64_t  packetsOut;
+    uint64_t  octetsOut;
+    uint64_t  airtime;
+    uint64_t  collisions;
+    uint64_t  captures;
+    uint64_t  deaf;
+    uint64_t  weak;
+    uint64_t  lost;
+    uint64_t  dropped;
+    uint64_t  latencySum;
+    uint64_t  latencyMax;
+} Stats;
+
+static std::vector<Client*> clients;      // Connected clients, in no order
+static std::vector<Client*> clientsByFd;
+static std::vector<ClientRef> dirty;      // Clients with newly queued packets
+static std::priority_queue<Delivery, std::vector<Delivery>, DeliveryLater> deliveries;
+static uint64_t             nextClientId = 1;
+static int                  epollFd;
+static Stats                stats;
+static unsigned long        bitsPerSecond = 10000;
+static float                deliveryProbability[256][256];
+static bool                 positioned[256];
+static double               positionX[256], positionY[256]; // Metres
+static double               pathLossExponent = ETHER_PATH_LOSS_EXPONENT;
+static double               referenceLoss = NAN; // dB at 1 metre. Free space loss if not configured
+static double               captureThreshold = ETHER_CAPTURE_THRESHOLD;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void releaseMessage(SharedMessage* message)
+{
+    if (--message->refs == 0)
+	delete message;
+}
+
+static void watch(Client* c, bool writable)
+{
+    struct epoll_event ev;
+    ev.events = writable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->txBlocked = writable;
+}
+
+static void closeClient(Client* c)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    while (!c->txQueue.empty())
+    {
+	releaseMessage(c->txQueue.front().message);
+	c->txQueue.pop_front();
+    }
+    if (c->incoming)
+	releaseMessage(c->incoming);
+    // Swap the last client into its place
+    clients[c->index] = clients.back();
+    clients[c->index]->index = c->index;
+    clients.pop_back();
+    clientsByFd[c->fd] = NULL;
+    delete c;
+}
+
+// Writes as much of the client's queue as its socket will take
+// Returns false if the client has gone
+static bool flush(Client* c)
+{
+    uint64_t t = now();
+    while (!c->txQueue.empty())
+    {
+	struct iovec iov[ETHER_MAX_IOV];
+	int n = 0;
+	std::deque<Queued>::iterator q;
+	for (q = c->txQueue.begin(); q != c->txQueue.end() && n < ETHER_MAX_IOV; q++, n++)
+	{
+	    uint16_t offset = n ? 0 : c->txOffset;
+	    iov[n].iov_base = q->message->data + offset;
+	    iov[n].iov_len = q->message->len - offset;
+	}
+	ssize_t written = writev(c->fd, iov, n);
+	if (written < 0)
+	{
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	// Retire the messages that are now completely written
+	while (written > 0)
+	{
+	    Queued& first = c->txQueue.front();
+	    size_t left = first.message->len - c->txOffset;
+	    if ((size_t)written < left)
+	    {
+		c->txOffset += written;
+		break;
+	    }
+	    written -= left;
+	    c->txOffset = 0;
+	    uint64_t latency = t > first.due ? t - first.due : 0;
+	    stats.latencySum += latency;
+	    if (latency > stats.latencyMax)
+		stats.latencyMax = latency;
+	    stats.packetsOut++;
+	    stats.octetsOut += first.message->len;
+	    releaseMessage(first.message);
+	    c->txQueue.pop_front();
+	}
+    }
+    bool blocked = !c->txQueue.empty();
+    if (blocked != c->txBlocked)
+	watch(c, blocked);
+    return true;
+}
+
+// Queues a message for writing to the client
+static void queue(Client* c, SharedMessage* message, uint64_t due)
+{
+    if (c->txQueue.size() >= ETHER_MAX_QUEUED_PACKETS)
+    {
+	stats.dropped++; // Not reading fast enough
+	releaseMessage(message);
+	return;
+    }
+    Queued q = { message, due };
+    c->txQueue.push_back(q);
+    if (!c->txBlocked && !c->txDirty)
+    {
+	// Write it once everything else due now has been queued too
+	ClientRef ref = { c->id, c->fd };
+	dirty.push_back(ref);
+	c->txDirty = true;
+    }
+}
+
+static Client* findClient(uint64_t id, int fd)
+{
+    Client* c = (size_t)fd < clientsByFd.size() ? clientsByFd[fd] : NULL;
+    return c && c->id == id ? c : NULL;
+}
+
+// Writes the packets queued since last time
+static void flushDirty()
+{
+    size_t i;
+    for (i = 0; i < dirty.size(); i++)
+    {
+	Client* c = findClient(dirty[i].clientId, dirty[i].fd);
+	if (!c)
+	    continue; // Gone
+	c->txDirty = false;
+	if (!c->txBlocked && !flush(c))
+	    closeClient(c);
+    }
+    dirty.clear();
+}
+
+// Signal strength at one client of a packet from another, in dBm
+static double receivedPower(Client* from, Client* to)
+{
+    if (!from->lora)
+	return 0.0; // Everyone hears everyone equally
+    double loss = referenceLoss;
+    if (isnan(loss))
+	loss = 20 * log10((double)from->modem.frequency) - 147.55; // Free space, 1 metre
+    if (   from->address >= 0 && to->address >= 0
+	&& positioned[from->address] && positioned[to->address])
+    {
+	double dx = positionX[from->address] - positionX[to->address];
+	double dy = positionY[from->address] - positionY[to->address];
+	double distance = sqrt(dx * dx + dy * dy);
+	if (distance > 1.0)
+	    loss += 10 * pathLossExponent * log10(distance);
+    }
+    return from->modem.txPower - loss;
+}
+
+// Whether a client can hear another's transmissions at all
+static bool sameChannel(Client* from, Client* to)
+{
+    if (!from->lora || !to->lora)
+	return true;
+    return    from->modem.frequency == to->modem.frequency
+	   && from->modem.bandwidth == to->modem.bandwidth
+	   && from->modem.spreadingFactor == to->modem.spreadingFactor;
+}
+
+// A packet from one client starts to reach another
+static void transmit(Client* from, Client* to, SharedMessage* message, uint64_t t, uint64_t airtime, uint64_t preamble)
+{
+    if (   from->address >= 0 && to->address >= 0
+	&& (double)random() / RAND_MAX >= deliveryProbability[from->address][to->address])
+    {
+	stats.lost++;
+	return;
+    }
+    if (!bitsPerSecond)
+    {
+	message->refs++;
+	queue(to, message, t);
+	return;
+    }
+    if (!sameChannel(from, to))
+	return;
+
+    // Check it against everything else reaching this client, forgetting what has finished
+    double power = receivedPower(from, to);
+    bool overlapped = false, corrupt = false;
+    size_t i = 0;
+    while (i < to->signals.size())
+    {
+	if (to->signals[i].end <= t)
+	{
+	    to->signals[i] = to->signals.back();
+	    to->signals.pop_back();
+	    continue;
+	}
+	overlapped = true;
+	if (power - to->signals[i].power < captureThreshold)
+	    corrupt = true;
+	i++;
+    }
+    Signal signal = { t + airtime, power };
+    to->signals.push_back(signal);
+
+    bool receivable = power >= to->sensitivity && to->txUntil <= t;
+    if (to->incoming)
+    {
+	if (   receivable && t < to->incomingPreambleEnd
+	    && power - to->incomingPower >= captureThreshold)
+	{
+	    // Much stronger, and in time to be locked on to instead
+	    stats.collisions++;
+	    releaseMessage(to->incoming);
+	    to->incoming = NULL;
+	}
+	else
+	{
+	    to->incomingOverlapped = true;
+	    if (to->incomingPower - power < captureThreshold)
+		to->incomingCorrupt = true;
+	    if (receivable)
+		stats.collisions++; // Receiver is busy with the other one
+	    receivable = false;
+	}
+    }
+    if (power < to->sensitivity)
+    {
+	stats.weak++;
+	return;
+    }
+    if (to->txUntil > t)
+    {
+	stats.deaf++;
+	return;
+    }
+    if (!receivable)
+	return;
+    if (corrupt)
+    {
+	stats.collisions++;
+	return;
+    }
+    message->refs++;
+    to->incoming = message;
+    to->incomingDue = t + airtime;
+    to->incomingPreambleEnd = t + preamble;
+    to->incomingPower = power;
+    to->incomingOverlapped = overlapped;
+    to->incomingCorrupt = false;
+    Delivery d = { to->incomingDue, to->id, to->fd };
+    deliveries.push(d);
+}
+
+// Handles a complete message from a client
+static void handleMessage(Client* c, const uint8_t* data, uint16_t len)
+{
+    const RHTcpTypeMessage* m = (const RHTcpTypeMessage*)data;
+    if (len < sizeof(uint32_t) + 1)
+	return; // No type
+    if (m->type == RH_TCP_MESSAGE_TYPE_THISADDRESS && len >= sizeof(RHTcpThisAddress))
+	c->address = ((const RHTcpThisAddress*)data)->thisAddress;
+    else if (m->type == RH_TCP_MESSAGE_TYPE_MODEMCONFIG && len >= sizeof(RHTcpModemConfig))
+    {
+	const RHTcpModemConfig* config = (const RHTcpModemConfig*)data;
+	if (   !config->bandwidth || config->spreadingFactor < 6 || config->spreadingFactor > 12
+	    || config->codingRate < 5 || config->codingRate > 8)
+	    return;
+	c->lora = true;
+	c->modem = *config;
+	c->modem.frequency = ntohl(config->frequency);
+	c->modem.bandwidth = ntohl(config->bandwidth);
+	c->modem.preambleLength = ntohs(config->preambleLength);
+	// Thermal noise in the bandwidth, plus the noise figure, less the SNR the spreading factor can demodulate
+	c->sensitivity = -174 + 10 * log10((double)c->modem.bandwidth) + ETHER_NOISE_FIGURE
+	    - 2.5 * (c->modem.spreadingFactor - 4);
+    }
+    else if (m->type == RH_TCP_MESSAGE_TYPE_PACKET)
+    {
+	uint64_t t = now();
+	uint64_t airtime = 0, preamble = 0;
+	uint16_t packetLen = len - sizeof(uint32_t) - 1; // Headers and payload
+	if (c->lora)
+	{
+	    airtime = RHTcpTimeOnAir(packetLen, c->modem.spreadingFactor, c->modem.bandwidth,
+				     c->modem.codingRate, c->modem.preambleLength);
+	    // preambleLength + 4.25 symbols
+	    preamble = ((4 * (uint64_t)c->modem.preambleLength + 17) * ((uint64_t)1000000 << c->modem.spreadingFactor))
+		/ (4 * (uint64_t)c->modem.bandwidth);
+	}
+	else if (bitsPerSecond)
+	    airtime = (uint64_t)packetLen * 8 * 1000000 / bitsPerSecond;
+	// Half duplex: transmitting loses whatever it was receiving
+	if (bitsPerSecond)
+	{
+	    if (c->incoming)
+	    {
+		stats.deaf++;
+		releaseMessage(c->incoming);
+		c->incoming = NULL;
+	    }
+	    c->txUntil = t + airtime;
+	}
+	stats.packetsIn++;
+	stats.octetsIn += len;
+	stats.airtime += airtime;
+	// One copy, shared by all the clients it reaches
+	SharedMessage* message = new SharedMessage;
+	message->refs = 1;
+	message->len = len;
+	memcpy(message->data, data, len);
+	size_t i;
+	for (i = 0; i < clients.size(); i++)
+	    if (clients[i] != c)
+		transmit(c, clients[i], message, t, airtime, preamble);
+	releaseMessage(message);
+    }
+}
+
+// Reads and handles everything the client has sent
+// Returns false if the client has gone
+static bool readClient(Client* c)
+{
+    for (;;)
+    {
+	ssize_t n = read(c->fd, c->rxBuf + c->rxLen, sizeof(c->rxBuf) - c->rxLen);
+	if (n == 0)
+	    return false;
+	if (n < 0)
+	{
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return true;
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	c->rxLen += n;
+
+	// Handle each complete message where it is in the buffer
+	uint16_t start = 0;
+	while (c->rxLen - start >= (int)sizeof(uint32_t))
+	{
+	    uint32_t length;
+	    memcpy(&length, c->rxBuf + start, sizeof(length));
+	    length = ntohl(length);
+	    if (length > RH_TCP_MAX_PAYLOAD_LEN + 1)
+	    {
+		fprintf(stderr, "Client %d sent a message too long for RH_TCP, closing it\n", c->fd);
+		return false;
+	    }
+	    if ((uint32_t)(c->rxLen - start) < sizeof(uint32_t) + length)
+		break;
+	    handleMessage(c, c->rxBuf + start, sizeof(uint32_t) + length);
+	    start += sizeof(uint32_t) + length;
+	}
+	// Keep any partial message for next time
+	if (start)
+	{
+	    memmove(c->rxBuf, c->rxBuf + start, c->rxLen - start);
+	    c->rxLen -= start;
+	}
+    }
+}
+
+static void acceptClients(int listenFd)
+{
+    for (;;)
+    {
+	int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+	{
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		fprintf(stderr, "accept failed: %s\n", strerror(errno));
+	    if (errno != EINTR)
+		return;
+	    continue;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	Client* c = new Client;
+	c->fd = fd;
+	c->id = nextClientId++;
+	c->index = clients.size();
+	c->address = -1;
+	c->rxLen = 0;
+	c->txOffset = 0;
+	c->txBlocked = false;
+	c->txDirty = false;
+	c->lora = false;
+	memset(&c->modem, 0, sizeof(c->modem));
+	c->sensitivity = -INFINITY;
+	c->txUntil = 0;
+	c->incoming = NULL;
+	c->incomingDue = 0;
+	clients.push_back(c);
+	if ((size_t)fd >= clientsByFd.size())
+	    clientsByFd.resize(fd + 1);
+	clientsByFd[fd] = c;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Hands over each packet whose transmission time is up
+static void deliver(uint64_t t)
+{
+    while (!deliveries.empty() && deliveries.top().due <= t)
+    {
+	Delivery d = deliveries.top();
+	deliveries.pop();
+	Client* c = findClient(d.clientId, d.fd);
+	if (!c || !c->incoming || c->incomingDue != d.due)
+	    continue; // Client has gone, or the packet was lost
+	if (c->incomingCorrupt)
+	{
+	    stats.collisions++;
+	    releaseMessage(c->incoming);
+	}
+	else
+	{
+	    if (c->incomingOverlapped)
+		stats.captures++;
+	    queue(c, c->incoming, d.due);
+	}
+	c->incoming = NULL;
+    }
+}
+
+static void printStats(double seconds)
+{
+    uint64_t packets = stats.packetsOut;
+    printf("clients %lu, in %.0f packets/s %.0f octets/s, out %.0f packets/s %.0f octets/s, airtime %.1f%%, "
+	   "collisions %lu, captures %lu, deaf %lu, weak %lu, lost %lu, dropped %lu, "
+	   "latency mean %.0f us max %lu us\n",
+	   (unsigned long)clients.size(),
+	   stats.packetsIn / seconds, stats.octetsIn / seconds,
+	   packets / seconds, stats.octetsOut / seconds, stats.airtime / seconds / 1e4,
+	   (unsigned long)stats.collisions, (unsigned long)stats.captures, (unsigned long)stats.deaf,
+	   (unsigned long)stats.weak, (unsigned long)stats.lost, (unsigned long)stats.dropped,
+	   packets ? (double)stats.latencySum / packets : 0.0, (unsigned long)stats.latencyMax);
+    fflush(stdout);
+    memset(&stats, 0, sizeof(stats));
+}
+
+// Same format as etherSimulator.pl:
+// probability:nodea:nodeb:probability
+// and also
+// position:node:x:y                     Node position in metres
+// pathloss:exponent[:lossat1metre]      Log-distance path loss model. Default exponent 2.7, and free space loss at 1m
+// capture:db                            Capture threshold. Default 6dB
+static bool readConfig(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+	fprintf(stderr, "Could not open config file %s: %s\n", path, strerror(errno));
+	return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+	unsigned int a, b;
+	float p;
+	double x, y;
+	int n;
+	if (sscanf(line, "probability:%u:%u:%f", &a, &b, &p) == 3 && a < 256 && b < 256)
+	    deliveryProbability[a][b] = deliveryProbability[b][a] = p; // Bidirectional
+	else if (sscanf(line, "position:%u:%lf:%lf", &a, &x, &y) == 3 && a < 256)
+	{
+	    positioned[a] = true;
+	    positionX[a] = x;
+	    positionY[a] = y;
+	}
+	else if ((n = sscanf(line, "pathloss:%lf:%lf", &x, &y)) >= 1)
+	{
+	    pathLossExponent = x;
+	    if (n == 2)
+		referenceLoss = y;
+	}
+	else if (sscanf(line, "capture:%lf", &x) == 1)
+	    captureThreshold = x;
+    }
+    fclose(f);
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: etherSimulator [-h] [-c configfile] [-b bitspersec] [-p portnumber] [-s statsinterval]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    int port = 4000;
+    unsigned long statsInterval = 10;
+    int a, b;
+    for (a = 0; a < 256; a++)
+	for (b = 0; b < 256; b++)
+	    deliveryProbability[a][b] = 1.0;
+
+    int c;
+    while ((c = getopt(argc, argv, "hc:b:p:s:")) != -1)
+    {
+	switch (c)
+	{
+	case 'c':
+	    if (!readConfig(optarg))
+		return 1;
+	    break;
+	case 'b': bitsPerSecond = strtoul(optarg, NULL, 0); break;
+	case 'p': port = atoi(optarg); break;
+	case 's': statsInterval = strtoul(optarg, NULL, 0); break;
+	default: usage();
+	}
+    }
+    if (optind < argc)
+	usage();
+
+    signal(SIGPIPE, SIG_IGN);
+    // One descriptor for each client
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1, zero = 0;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)); // IPv4 clients too
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+    {
+	fprintf(stderr, "Could not listen on port %d: %s\n", port, strerror(errno));
+	return 1;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    uint64_t timerWake = 0;
+    ev.events = EPOLLIN;
+    ev.data.fd = timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+
+    uint64_t lastStats = now();
+    for (;;)
+    {
+	// Wake up for the next delivery or the next counters, whichever is first. The timer has
+	// microsecond resolution, where the epoll_wait() timeout only has milliseconds
+	uint64_t t = now();
+	uint64_t wake = statsInterval ? lastStats + statsInterval * 1000000 : t + 1000000;
+	if (!deliveries.empty() && deliveries.top().due < wake)
+	    wake = deliveries.top().due;
+	if (wake != timerWake)
+	{
+	    struct itimerspec its;
+	    memset(&its, 0, sizeof(its));
+	    its.it_value.tv_sec = wake / 1000000;
+	    its.it_value.tv_nsec = (wake % 1000000) * 1000 + 1; // Zero would disarm it
+	    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+	    timerWake = wake;
+	}
+
+	struct epoll_event events[ETHER_MAX_EVENTS];
+	int n = epoll_wait(epollFd, events, ETHER_MAX_EVENTS, -1);
+	if (n < 0 && errno != EINTR)
+	{
+	    fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+	    return 1;
+	}
+	int i;
+	for (i = 0; i < n; i++)
+	{
+	    int fd = events[i].data.fd;
+	    if (fd == listenFd)
+	    {
+		acceptClients(listenFd);
+		continue;
+	    }
+	    if (fd == timerFd)
+	    {
+		uint64_t expirations;
+		if (read(timerFd, &expirations, sizeof(expirations)) > 0)
+		    timerWake = 0; // Expired, so set it again
+		continue;
+	    }
+	    Client* client = (size_t)fd < clientsByFd.size() ? clientsByFd[fd] : NULL;
+	    if (!client)
+		continue; // Closed while handling an earlier event
+	    bool ok = true;
+	    if (events[i].events & EPOLLOUT)
+		ok = flush(client);
+	    if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		ok = readClient(client);
+	    if (!ok)
+		closeClient(client);
+	}
+
+	t = now();
+	deliver(t);
+	flushDirty();
+	if (statsInterval && t - lastStats >= statsInterval * 1000000)
+	{
+	    printStats((t - lastStats) / 1e6);
+	    lastStats = t;
+	}
+    }
+}
@@ -0,0 +1,835 @@
+// meshSimulator.cpp
+//
+// Runs many RHMesh nodes in one Linux process, over a simulated medium with a topology read from
+// a file, and reports how well routing performed. Lets routing changes be tested and benchmarked
+// on networks of hundreds or thousands of nodes, without radios and without a process per node.
+//
+// Each node is an RHMesh with its own SimulatedDriver, running in its own coroutine. Time is simulated:
+// millis() returns the simulated time, and whenever a node would wait (for a message, for its
+// transmission to finish, or in delay()) it is suspended and the simulator moves on to the next event.
+// So the run is repeatable for a given seed, and takes only as much CPU as the nodes actually use.
+//
+// The medium: a frame sent by a node is received by each node it has a link to, after its time on air
+// (its length at the simulated bit rate) plus the latency of the link, unless it is lost, at random,
+// with the loss probability of the link. Frames do not collide. Each node can hold only a few received
+// frames it has not yet read, and further ones are dropped.
+//
+// Build with
+// cd whatever/RadioHead
+// tools/meshSimBuild
+// For more than 254 nodes, build with 16 bit addresses:
+// tools/meshSimBuild -DRH_EXTENDED_ADDRESSING
+//
+// Usage:
+// ./meshSimulator [-t topologyfile] [-g WIDTHxHEIGHT] [-l loss] [-L latency] [-f flows] [-i interval]
+//                 [-m length] [-d duration] [-b bitspersec] [-a advertisementinterval] [-q queuelen]
+//                 [-s seed] [-r] [-v]
+//  -t  Read nodes, links and traffic flows from a topology file (see below)
+//  -g  Add a grid of WIDTH by HEIGHT nodes, addressed from 1 along each row (skipping the
+//      broadcast address), each linked to the nodes above, below, left and right of it
+//  -l  Loss probability (0.0 to 1.0) of links added by -g. Default 0
+//  -L  Latency in milliseconds of links added by -g. Default 0
+//  -f  Add this many flows between randomly chosen pairs of nodes
+//  -i  Milliseconds between messages of flows added by -f. Default 10000
+//  -m  Length of each message in octets. Default 20
+//  -d  Seconds of simulated time to run for. Default 300
+//  -b  Simulated bits per second, which sets each frame's time on air. Default 10000
+//  -a  Turns on RHMesh proactive routing, with this advertisement interval in milliseconds
+//  -q  Number of received frames each node can hold before it reads them. Default 4
+//  -s  Random number seed. Default 1
+//  -r  Print every node's routing table at the end
+//  -v  Print each message as it is delivered
+//
+// The topology file has one item per line. Blank lines and everything after # are ignored:
+//  node ADDRESS                          A node, needed only if it has no links
+//  link A B [LOSS [LATENCY]]             A link in both directions between nodes A and B
+//  oneway A B [LOSS [LATENCY]]           A link that carries frames from A to B only
+//  flow A B [INTERVAL [START]]           A flow of messages from A to B, one every INTERVAL
+//                                        milliseconds, from START milliseconds into the run
+// Nodes are created when they are first mentioned. See tools/topologies for some examples, including the
+// small networks that RHRouter used to simulate with RH_TEST_NETWORK.
+//
+// At the end it reports:
+//  - Delivery ratio: the proportion of messages sent that reached their destination
+//  - Convergence time: how long until every flow had delivered its first message, ie until
+//    route discovery had found routes for all the traffic
+//  - Airtime used by route discovery, failure and advertisement messages, compared to data and ACKs
+//  - CPU time used per frame transmitted, which is the figure to watch when making the code faster
+
+#include <RadioHead.h>
+#if (RH_PLATFORM == RH_PLATFORM_UNIX)
+
+#include <RHMesh.h>
+#include <RHFragmentedDatagram.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <vector>
+#include <queue>
+#include <map>
+#include <deque>
+
+// Number of received frames each node can hold, unless changed with -q
+#ifndef RH_MESH_SIMULATOR_RX_QUEUE_LEN
+#define RH_MESH_SIMULATOR_RX_QUEUE_LEN 4
+#endif
+
+// Largest frame the simulated radios can send, like a LoRa radio with its 4 octet header
+#define RH_MESH_SIMULATOR_MAX_MESSAGE_LEN 251
+
+// Octets sent with each frame in addition to its payload: TO, FROM, ID and FLAGS
+#define RH_MESH_SIMULATOR_FRAME_OVERHEAD 4
+
+// Stack size of each node's coroutine
+#define RH_MESH_SIMULATOR_STACK_SIZE (64 * 1024)
+
+// Longest a node waits for a message before checking whether it has anything to send
+#define RH_MESH_SIMULATOR_MAX_WAIT 1000
+
+#define RH_MESH_SIMULATOR_FOREVER ((unsigned long)-1)
+
+SerialSimulator Serial;
+int    _simulator_argc;
+char** _simulator_argv;
+
+// A frame in flight, shared by all the nodes that receive it
+typedef struct
+{
+    int       refs;
+    uint8_t   to;
+    uint8_t   from;
+    uint8_t   id;
+    uint8_t   flags;
+    uint8_t   len;
+    uint8_t   data[RH_MESH_SIMULATOR_MAX_MESSAGE_LEN];
+} Frame;
+
+// One direction of a link between nodes
+typedef struct
+{
+    uint32_t  to;      // Index of the receiving node
+    float     loss;    // Probability a frame is lost
+    uint16_t  latency; // Milliseconds, in addition to the time on air
+} Link;
+
+// A stream of messages from one node to another
+typedef struct
+{
+    uint32_t      source;        // Index of the sending node
+    uint32_t      dest;          // Index of the receiving node
+    unsigned long interval;
+    unsigned long start;
+    unsigned long nextSend;
+    uint32_t      sent;
+    uint32_t      delivered;
+    uint32_t      duplicates;
+    unsigned long firstDelivered; // Simulated time of the first delivery, if delivered
+    std::vector<bool> received;   // Sequence numbers delivered so far
+} Flow;
+
+// What is sent in each message
+typedef struct
+{
+    uint32_t  flow;
+    uint32_t  seq;
+    uint32_t  sent;
+} Payload;
+
+// Things that happen at a given simulated time
+typedef struct
+{
+    unsigned long time;
+    uint64_t      seq;    // Keeps events at the same time in the order they were scheduled
+    uint32_t      node;
+    uint32_t      waitId; // For wake ups: the wait they are for. Zero for frame arrivals
+    Frame*        frame;  // For frame arrivals: the frame
+} Event;
+
+struct EventLater
+{
+    bool operator()(const Event& a, const Event& b) const
+    {
+	return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+    }
+};
+
+class SimulatedDriver;
+
+// A simulated node
+typedef struct
+{
+    uint32_t           index;
+    RHAddress          address;
+    SimulatedDriver*   driver;
+    RHMesh*            mesh;
+    ucontext_t         context;
+    void*              stack;
+    uint32_t           waitId;      // Increments each time the node starts to wait
+    bool               waitFrame;   // true if a frame arrival ends the wait
+    std::vector<Link>  links;
+    std::vector<uint32_t> flows;     // Indexes of the flows this node sends
+} Node;
+
+// Counters for the whole run
+typedef struct
+{
+    unsigned long frames;          // Transmitted
+    unsigned long arrivals;        // Frames received by a node
+    unsigned long lost;            // Frames lost on a link
+    unsigned long overflowed;      // Frames dropped because the receiver's queue was full
+    uint64_t      airtime;         // All frames, microseconds
+    uint64_t      routingAirtime;  // Route discovery, failure and advertisement messages
+    uint64_t      ackAirtime;      // Hop to hop ACKs
+    uint64_t      latency;         // Sum of message latencies, milliseconds
+    unsigned long sendFailures;    // Messages sendtoWait() could not send
+} Stats;
+
+static std::vector<Node*>   nodes;
+static std::map<RHAddress, uint32_t> nodeIndex;
+static std::vector<Flow>    flows;
+static std::priority_queue<Event, std::vector<Event>, EventLater> events;
+static uint64_t             eventSeq;
+static unsigned long        simTime;
+static ucontext_t           schedulerContext;
+static Node*                current;
+static Stats                stats;
+
+// Options
+static unsigned long        bitsPerSecond = 10000;
+static uint8_t              rxQueueLen = RH_MESH_SIMULATOR_RX_QUEUE_LEN;
+static uint8_t              messageLen = 20;
+static unsigned long        advertisementInterval = 0;
+static bool                 verbose = false;
+
+////////////////////////////////////////////////////////////////////
+// Simulated time, in place of the ones in simMain.cpp
+unsigned long millis()
+{
+    return simTime;
+}
+
+static void schedule(unsigned long time, uint32_t node, uint32_t waitId, Frame* frame)
+{
+    Event e = { time, eventSeq++, node, waitId, frame };
+    events.push(e);
+}
+
+// Suspends the running node until the given time, or if frame is true, until a frame arrives
+static void block(unsigned long until, bool frame)
+{
+    Node* n = current;
+    n->waitId++;
+    n->waitFrame = frame;
+    if (until != RH_MESH_SIMULATOR_FOREVER)
+	schedule(until, n->index, n->waitId, NULL);
+    swapcontext(&n->context, &schedulerContext);
+    n->waitFrame = false;
+}
+
+void delay(unsigned long ms)
+{
+    if (current)
+	block(simTime + ms, false);
+}
+
+long random(long from, long to)
+{
+    return from + (random() % (to - from));
+}
+
+long random(long to)
+{
+    return random(0, to);
+}
+
+static void releaseFrame(Frame* frame)
+{
+    if (--frame->refs == 0)
+	delete frame;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Driver for one node's simulated radio
+class SimulatedDriver : public RHGenericDriver
+{
+public:
+    SimulatedDriver(uint32_t node) : _node(node), _txEnd(0), _leased(false) {}
+
+    bool init()
+    {
+	return true;
+    }
+
+    // Drops received frames that are not for us, as a radio would
+    bool available()
+    {
+	if (_leased)
+	    return false;
+	while (!_rxQueue.empty())
+	{
+	    Frame* f = _rxQueue.front();
+	    if (_promiscuous || f->to == _thisAddress || f->to == RH_BROADCAST_ADDRESS)
+	    {
+		_rxHeaderTo = f->to;
+		_rxHeaderFrom = f->from;
+		_rxHeaderId = f->id;
+		_rxHeaderFlags = f->flags;
+		return true;
+	    }
+	    _rxQueue.pop_front();
+	    releaseFrame(f);
+	}
+	return false;
+    }
+
+    bool recv(uint8_t* buf, uint8_t* len)
+    {
+	if (!available())
+	    return false;
+	Frame* f = _rxQueue.front();
+	_rxQueue.pop_front();
+	if (buf && len)
+	{
+	    if (*len > f->len)
+		*len = f->len;
+	    memcpy(buf, f->data, *len);
+	}
+	releaseFrame(f);
+	_rxGood++;
+	return true;
+    }
+
+    bool recvLease(RxLease* lease)
+    {
+	if (!available())
+	    return false;
+	Frame* f = _rxQueue.front();
+	lease->data = f->data;
+	lease->len = f->len;
+	lease->headerTo = f->to;
+	lease->headerFrom = f->from;
+	lease->headerId = f->id;
+	lease->headerFlags = f->flags;
+	lease->rssi = _lastRssi;
+	_leased = true;
+	_rxGood++;
+	return true;
+    }
+
+    void releaseLease()
+    {
+	if (!_leased)
+	    return;
+	_leased = false;
+	releaseFrame(_rxQueue.front());
+	_rxQueue.pop_front();
+    }
+
+    bool waitAvailableTimeout(uint16_t timeout)
+    {
+	unsigned long end = simTime + timeout;
+	while (!available())
+	{
+	    if (simTime >= end)
+		return false;
+	    block(end, true); // Woken by any arrival, even if it is not for us
+	}
+	return true;
+    }
+
+    void waitAvailable()
+    {
+	while (!available())
+	    block(RH_MESH_SIMULATOR_FOREVER, true);
+    }
+
+    bool send(const uint8_t* data, uint8_t len)
+    {
+	if (len > RH_MESH_SIMULATOR_MAX_MESSAGE_LEN)
+	    return false;
+	waitPacketSent();
+
+	Frame* f = new Frame;
+	f->refs = 1;
+	f->to = _txHeaderTo;
+	f->from = _txHeaderFrom;
+	f->id = _txHeaderId;
+	f->flags = _txHeaderFlags;
+	f->len = len;
+	memcpy(f->data, data, len);
+
+	// Time on air, rounded up to whole milliseconds for delivery
+	uint64_t airtime = (uint64_t)(len + RH_MESH_SIMULATOR_FRAME_OVERHEAD) * 8 * 1000000 / bitsPerSecond;
+	unsigned long airtimeMs = (airtime + 999) / 1000;
+	countFrame(f, airtime);
+	_txEnd = simTime + airtimeMs;
+	_mode = RHModeTx;
+
+	Node* n = nodes[_node];
+	for (size_t i = 0; i < n->links.size(); i++)
+	{
+	    const Link& link = n->links[i];
+	    if (link.loss > 0 && (random() % 1000000) < link.loss * 1000000)
+	    {
+		stats.lost++;
+		continue;
+	    }
+	    f->refs++;
+	    schedule(_txEnd + link.latency, link.to, 0, f);
+	}
+	releaseFrame(f);
+	_txGood++;
+	return true;
+    }
+
+    bool waitPacketSent()
+    {
+	if (simTime < _txEnd)
+	    block(_txEnd, false);
+	_mode = RHModeIdle;
+	return true;
+    }
+
+    bool waitPacketSent(uint16_t timeout)
+    {
+	if (simTime < _txEnd)
+	    block(_txEnd < simTime + timeout ? _txEnd : simTime + timeout, false);
+	if (simTime < _txEnd)
+	    return false;
+	_mode = RHModeIdle;
+	return true;
+    }
+
+    uint8_t maxMessageLength()
+    {
+	return RH_MESH_SIMULATOR_MAX_MESSAGE_LEN;
+    }
+
+    // Called when a frame reaches this node
+    void arrive(Frame* f)
+    {
+	stats.arrivals++;
+	if (_rxQueue.size() >= rxQueueLen)
+	{
+	    stats.overflowed++;
+	    releaseFrame(f);
+	    return;
+	}
+	_rxQueue.push_back(f);
+    }
+
+private:
+    // Adds a transmitted frame to the airtime counters
+    void countFrame(const Frame* f, uint64_t airtime)
+    {
+	stats.frames++;
+	stats.airtime += airtime;
+	if (f->flags & RH_FLAGS_ACK)
+	{
+	    stats.ackAirtime += airtime;
+	    return;
+	}
+	// Look past the datagram and router headers for the mesh message type
+	uint8_t offset = RH_DATAGRAM_HEADER_LEN + sizeof(RHRouter::RoutedMessageHeader);
+	if (!(f->flags & RH_FLAGS_FRAGMENT) && f->len > offset)
+	{
+	    uint8_t type = f->data[offset];
+	    if (   type == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_REQUEST
+		|| type == RH_MESH_MESSAGE_TYPE_ROUTE_DISCOVERY_RESPONSE
+		|| type == RH_MESH_MESSAGE_TYPE_ROUTE_FAILURE
+		|| type == RH_MESH_MESSAGE_TYPE_ROUTE_ADVERTISEMENT)
+		stats.routingAirtime += airtime;
+	}
+    }
+
+    uint32_t           _node;
+    unsigned long      _txEnd;
+    bool               _leased;
+    std::deque<Frame*> _rxQueue;
+};
+
+////////////////////////////////////////////////////////////////////
+// The nodes
+static bool validAddress(unsigned long address)
+{
+    return address && address != RH_BROADCAST_ADDRESS && (RHAddress)address == address;
+}
+
+// Address of the node at a position in the grid, counting along each row
+static unsigned long gridAddress(unsigned long position)
+{
+    return position + 1 + (position + 1 >= RH_BROADCAST_ADDRESS); // Skips the broadcast address
+}
+
+// Returns the index of the node with the address, creating it if need be
+static uint32_t addNode(RHAddress address)
+{
+    std::map<RHAddress, uint32_t>::iterator i = nodeIndex.find(address);
+    if (i != nodeIndex.end())
+	return i->second;
+    Node* n = new Node;
+    n->index = nodes.size();
+    n->address = address;
+    n->driver = new SimulatedDriver(n->index);
+    n->mesh = new RHMesh(*n->driver, address);
+    n->stack = NULL;
+    n->waitId = 0;
+    n->waitFrame = false;
+    nodes.push_back(n);
+    nodeIndex[address] = n->index;
+    return n->index;
+}
+
+static void addLink(uint32_t from, uint32_t to, float loss, unsigned long latency)
+{
+    Link link = { to, loss, (uint16_t)latency };
+    nodes[from]->links.push_back(link);
+}
+
+static void addFlow(uint32_t source, uint32_t dest, unsigned long interval, unsigned long start)
+{
+    Flow f;
+    f.source = source;
+    f.dest = dest;
+    f.interval = interval ? interval : 1;
+    f.start = f.nextSend = start;
+    f.sent = f.delivered = f.duplicates = 0;
+    f.firstDelivered = 0;
+    nodes[source]->flows.push_back(flows.size());
+    flows.push_back(f);
+}
+
+static void sendMessage(Node* n, uint32_t flow)
+{
+    Flow& f = flows[flow];
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+    Payload p = { flow, f.sent++, (uint32_t)simTime };
+    memset(buf, 0, messageLen);
+    memcpy(buf, &p, sizeof(p));
+    if (n->mesh->sendtoWait(buf, messageLen, nodes[f.dest]->address) != RH_ROUTER_ERROR_NONE)
+	stats.sendFailures++;
+}
+
+static void receiveMessage(Node* n, const uint8_t* buf, uint8_t len, RHAddress source)
+{
+    Payload p;
+    if (len < sizeof(p))
+	return;
+    memcpy(&p, buf, sizeof(p));
+    if (p.flow >= flows.size() || flows[p.flow].dest != n->index)
+	return; // Not one of ours
+    Flow& f = flows[p.flow];
+    if (p.seq >= f.received.size())
+	f.received.resize(p.seq + 1);
+    if (f.received[p.seq])
+    {
+	f.duplicates++;
+	return;
+    }
+    f.received[p.seq] = true;
+    if (!f.delivered++)
+	f.firstDelivered = simTime;
+    stats.latency += simTime - p.sent;
+    if (verbose)
+	printf("%lu: %u received message %u from %u after %lu ms\n",
+	       simTime, (unsigned int)n->address, (unsigned int)p.seq, (unsigned int)source, simTime - p.sent);
+}
+
+// What each node runs: send messages as they fall due, and receive in between
+static void runNode(int index)
+{
+    Node* n = nodes[index];
+    uint8_t buf[RH_MESH_MAX_MESSAGE_LEN];
+    for (;;)
+    {
+	unsigned long next = simTime + RH_MESH_SIMULATOR_MAX_WAIT;
+	size_t i;
+	for (i = 0; i < n->flows.size(); i++)
+	{
+	    Flow& f = flows[n->flows[i]];
+	    if (f.nextSend <= simTime)
+	    {
+		f.nextSend += f.interval;
+		sendMessage(n, n->flows[i]);
+	    }
+	    if (f.nextSend < next)
+		next = f.nextSend;
+	}
+	if (next <= simTime)
+	    continue; // Sending took long enough for more to fall due
+
+	uint8_t len = sizeof(buf);
+	RHAddress source;
+	if (n->mesh->recvfromAckTimeout(buf, &len, next - simTime, &source))
+	    receiveMessage(n, buf, len, source);
+    }
+}
+
+////////////////////////////////////////////////////////////////////
+// The scheduler
+static void resume(Node* n)
+{
+    current = n;
+    swapcontext(&schedulerContext, &n->context);
+    current = NULL;
+}
+
+static void startNode(Node* n)
+{
+    n->mesh->init();
+    if (advertisementInterval)
+	n->mesh->setProactiveRouting(advertisementInterval);
+    n->stack = malloc(RH_MESH_SIMULATOR_STACK_SIZE);
+    getcontext(&n->context);
+    n->context.uc_stack.ss_sp = n->stack;
+    n->context.uc_stack.ss_size = RH_MESH_SIMULATOR_STACK_SIZE;
+    n->context.uc_link = &schedulerContext;
+    makecontext(&n->context, (void (*)())runNode, 1, (int)n->index);
+    // Switch the nodes on at random during the first second, as they would be in real life
+    n->waitId = 1;
+    schedule(random(1000), n->index, n->waitId, NULL);
+}
+
+// Runs all the nodes until the end time
+static void run(unsigned long end)
+{
+    while (!events.empty() && events.top().time <= end)
+    {
+	Event e = events.top();
+	events.pop();
+	simTime = e.time;
+	Node* n = nodes[e.node];
+	if (e.frame)
+	{
+	    n->driver->arrive(e.frame);
+	    if (n->waitFrame)
+		resume(n);
+	}
+	else if (e.waitId == n->waitId)
+	    resume(n);
+    }
+    simTime = end;
+}
+
+////////////////////////////////////////////////////////////////////
+// Setting up
+static bool readTopology(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+	fprintf(stderr, "Could not open topology file %s\n", path);
+	return false;
+    }
+    char line[256];
+    unsigned int lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+	lineNumber++;
+	char* comment = strchr(line, '#');
+	if (comment)
+	    *comment = 0;
+	char keyword[16];
+	unsigned long a, b, n3 = 0, n4 = 0;
+	float loss = 0;
+	if (sscanf(line, "%15s", keyword) != 1)
+	    continue; // Blank
+	if (!strcmp(keyword, "node"))
+	{
+	    ok = sscanf(line, "%*s %lu", &a) == 1 && validAddress(a);
+	    if (ok)
+		addNode(a);
+	}
+	else if (!strcmp(keyword, "link") || !strcmp(keyword, "oneway"))
+	{
+	    ok = sscanf(line, "%*s %lu %lu %f %lu", &a, &b, &loss, &n4) >= 2
+		&& validAddress(a) && validAddress(b) && a != b && loss >= 0 && loss <= 1;
+	    if (ok)
+	    {
+		addLink(addNode(a), addNode(b), loss, n4);
+		if (keyword[0] == 'l')
+		    addLink(addNode(b), addNode(a), loss, n4);
+	    }
+	}
+	else if (!strcmp(keyword, "flow"))
+	{
+	    n3 = 10000;
+	    ok = sscanf(line, "%*s %lu %lu %lu %lu", &a, &b, &n3, &n4) >= 2
+		&& validAddress(a) && validAddress(b) && a != b;
+	    if (ok)
+		addFlow(addNode(a), addNode(b), n3, n4);
+	}
+	else
+	    ok = false;
+    }
+    fclose(f);
+    if (!ok)
+	fprintf(stderr, "%s line %u: not understood, or address out of range\n", path, lineNumber);
+    return ok;
+}
+
+static bool addGrid(const char* size, float loss, unsigned long latency)
+{
+    unsigned long width, height;
+    if (   sscanf(size, "%lux%lu", &width, &height) != 2 || !width || !height
+	|| !validAddress(gridAddress(width * height - 1)))
+    {
+	fprintf(stderr, "Grid %s is not WIDTHxHEIGHT, or has too many nodes\n", size);
+	return false;
+    }
+    unsigned long x, y;
+    for (y = 0; y < height; y++)
+	for (x = 0; x < width; x++)
+	{
+	    uint32_t n = addNode(gridAddress(y * width + x));
+	    if (x)
+	    {
+		uint32_t left = addNode(gridAddress(y * width + x - 1));
+		addLink(n, left, loss, latency);
+		addLink(left, n, loss, latency);
+	    }
+	    if (y)
+	    {
+		uint32_t above = addNode(gridAddress((y - 1) * width + x));
+		addLink(n, above, loss, latency);
+		addLink(above, n, loss, latency);
+	    }
+	}
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: meshSimulator [-t topologyfile] [-g WIDTHxHEIGHT] [-l loss] [-L latency] [-f flows] [-i interval]\n"
+	    "                     [-m length] [-d duration] [-b bitspersec] [-a advertisementinterval] [-q queuelen]\n"
+	    "                     [-s seed] [-r] [-v]\n"
+	    "See tools/meshSimulator.cpp for details\n");
+    exit(1);
+}
+
+static double cpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double percent(double part, double whole)
+{
+    return whole ? part * 100 / whole : 0;
+}
+
+static void report(unsigned long duration, double cpu)
+{
+    unsigned long links = 0, sent = 0, delivered = 0, duplicates = 0, silent = 0, active = 0, convergence = 0;
+    size_t i;
+    for (i = 0; i < nodes.size(); i++)
+	links += nodes[i]->links.size();
+    for (i = 0; i < flows.size(); i++)
+    {
+	const Flow& f = flows[i];
+	sent += f.sent;
+	delivered += f.delivered;
+	duplicates += f.duplicates;
+	if (!f.sent)
+	    continue;
+	active++;
+	if (!f.delivered)
+	    silent++;
+	else if (f.firstDelivered - f.start > convergence)
+	    convergence = f.firstDelivered - f.start;
+    }
+
+    printf("Nodes %lu, one way links %lu, flows %lu, %.1f s simulated\n",
+	   (unsigned long)nodes.size(), links, (unsigned long)flows.size(), duration / 1000.0);
+    printf("Messages: %lu sent, %lu delivered (%.1f%%), %lu duplicates, %lu not sent, mean latency %.0f ms\n",
+	   sent, delivered, percent(delivered, sent), duplicates, stats.sendFailures,
+	   delivered ? (double)stats.latency / delivered : 0.0);
+    if (silent)
+	printf("Convergence: not reached, %lu of %lu flows delivered nothing\n", silent, active);
+    else
+	printf("Convergence: %.3f s until every flow had delivered a message\n", convergence / 1000.0);
+    printf("Frames: %lu sent, %lu received, %lu lost on links, %lu dropped by full receive queues\n",
+	   stats.frames, stats.arrivals, stats.lost, stats.overflowed);
+    printf("Airtime: %.1f s in total, %.1f s (%.1f%%) route discovery and maintenance, %.1f s (%.1f%%) ACKs\n",
+	   stats.airtime / 1e6, stats.routingAirtime / 1e6, percent(stats.routingAirtime, stats.airtime),
+	   stats.ackAirtime / 1e6, percent(stats.ackAirtime, stats.airtime));
+    printf("CPU: %.2f s, %.1f us per frame sent, %.1f times faster than real time\n",
+	   cpu, stats.frames ? cpu * 1e6 / stats.frames : 0.0, cpu ? duration / 1000.0 / cpu : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    _simulator_argc = argc;
+    _simulator_argv = argv;
+
+    const char* topology = NULL;
+    const char* grid = NULL;
+    float loss = 0;
+    unsigned long latency = 0, randomFlows = 0, interval = 10000, duration = 300, seed = 1;
+    bool routingTables = false;
+    int c;
+    while ((c = getopt(argc, argv, "t:g:l:L:f:i:m:d:b:a:q:s:rv")) != -1)
+    {
+	switch (c)
+	{
+	case 't': topology = optarg; break;
+	case 'g': grid = optarg; break;
+	case 'l': loss = atof(optarg); break;
+	case 'L': latency = strtoul(optarg, NULL, 0); break;
+	case 'f': randomFlows = strtoul(optarg, NULL, 0); break;
+	case 'i': interval = strtoul(optarg, NULL, 0); break;
+	case 'm': messageLen = strtoul(optarg, NULL, 0); break;
+	case 'd': duration = strtoul(optarg, NULL, 0); break;
+	case 'b': bitsPerSecond = strtoul(optarg, NULL, 0); break;
+	case 'a': advertisementInterval = strtoul(optarg, NULL, 0); break;
+	case 'q': rxQueueLen = strtoul(optarg, NULL, 0); break;
+	case 's': seed = strtoul(optarg, NULL, 0); break;
+	case 'r': routingTables = true; break;
+	case 'v': verbose = true; break;
+	default: usage();
+	}
+    }
+    if (   optind < argc || !bitsPerSecond || !rxQueueLen || messageLen < sizeof(Payload)
+	|| messageLen > RH_MESH_SIMULATOR_MAX_MESSAGE_LEN - RH_DATAGRAM_HEADER_LEN
+	                - sizeof(RHRouter::RoutedMessageHeader) - sizeof(RHMesh::MeshMessageHeader))
+	usage();
+    srandom(seed);
+
+    if (topology && !readTopology(topology))
+	return 1;
+    if (grid && !addGrid(grid, loss, latency))
+	return 1;
+    if (nodes.size() < 2)
+	usage();
+    unsigned long i;
+    for (i = 0; i < randomFlows; i++)
+    {
+	uint32_t source = random(nodes.size());
+	uint32_t dest = random(nodes.size() - 1);
+	if (dest >= source)
+	    dest++;
+	addFlow(source, dest, interval, random(interval));
+    }
+
+    for (i = 0; i < nodes.size(); i++)
+	startNode(nodes[i]);
+    double cpu = cpuSeconds();
+    run(duration * 1000);
+    cpu = cpuSeconds() - cpu;
+
+    if (routingTables)
+    {
+	for (i = 0; i < nodes.size(); i++)
+	{
+	    printf("Node %u:\n", (unsigned int)nodes[i]->address);
+	    nodes[i]->mesh->printRoutingTable();
+	}
+    }
+    report(duration * 1000, cpu);
+    return 0;
+}
+
+#endif